@@ -1,2 +1,2 @@
 #!/bin/sh
-LD_LIBRARY_PATH=. ./WaveEdit
\ No newline at end of file
+LD_LIBRARY_PATH=. ./WaveEdit "$@"
@@ -9,13 +9,29 @@
 
 #include <string.h>
 #include <thread>
+#include <atomic>
 #include <vector>
 #include <complex>
+#include <memory>
+#include <functional>
 
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
+// Everything below is compiled once per wavetable format into a namespace of its own, so one binary holds every geometry. main() in launcher.cpp picks one at startup.
+#if WAVETABLE_FORMAT_WAVEEDIT
+#define WAVETABLE_NAMESPACE waveedit
+#elif WAVETABLE_FORMAT_PHMK2
+#define WAVETABLE_NAMESPACE phmk2
+#elif WAVETABLE_FORMAT_BLOFELD
+#define WAVETABLE_NAMESPACE blofeld
+#elif WAVETABLE_FORMAT_LARGE
+#define WAVETABLE_NAMESPACE large
+#endif
+
+namespace WAVETABLE_NAMESPACE {
+
 
 ////////////////////
 // math.cpp
@@ -148,10 +164,36 @@ inline void cmultf(float *cr, float *ci, float ar, float ai, float br, float bi)
 
 void RFFT(const float *in, float *out, int len);
 void IRFFT(const float *in, float *out, int len);
+/** RFFT() of `count` consecutive arrays of `len` samples, sharing one FFT setup and work buffer */
+void RFFTBatch(const float *in, float *out, int len, int count);
+void IRFFTBatch(const float *in, float *out, int len, int count);
 
 int resample(const float *in, int inLen, float *out, int outLen, double ratio);
 void cyclicOversample(const float *in, float *out, int len, int oversample);
 void cyclicUndersample(const float *in, float *out, int len, int undersample);
+/** Resamples `count` consecutive cycles to another length by truncating or zero-padding their spectra */
+void cyclicResample(const float *in, int inLen, float *out, int outLen, int count = 1);
+
+/** Mip levels of a cycle are oversampled this many times beyond their highest harmonic, so reads between samples can be interpolated */
+#define MIP_OVERSAMPLE 8
+#define MIP_MIN_LEN 128
+
+/** Number of mip levels of a cycle of `len` samples. Level k keeps the harmonics up to len / 2^(k+1), the last one is a sine. */
+constexpr int mipLevels(int len) {
+	return len <= 2 ? 1 : 1 + mipLevels(len / 2);
+}
+constexpr int mipLength(int len, int level) {
+	return 2 * MIP_OVERSAMPLE * (len / 2 >> level) > MIP_MIN_LEN ? 2 * MIP_OVERSAMPLE * (len / 2 >> level) : MIP_MIN_LEN;
+}
+constexpr int mipOffset(int len, int level) {
+	return level <= 0 ? 0 : mipOffset(len, level - 1) + mipLength(len, level - 1);
+}
+/** Length of all mip levels of a cycle, one after another */
+constexpr int mipsLength(int len) {
+	return mipOffset(len, mipLevels(len));
+}
+/** Computes every mip level of a cycle of `len` samples by truncating its spectrum. `mips` must be mipsLength(len) long. */
+void computeMips(const float *in, int len, float *mips);
 void i16_to_f32(const int16_t *in, float *out, int length);
 void f32_to_i16(const float *in, int16_t *out, int length);
 
@@ -168,6 +210,116 @@ float *loadAudio(const char *filename, int *length);
 std::string stringf(const char *format, ...);
 /** Truncates a string if needed, inserting ellipses (...), to be no greater than `maxLen` characters */
 void ellipsize(char *str, int maxLen);
+/** 64-bit FNV-1a hash, for detecting changed content rather than security */
+uint64_t hashBytes(const void *data, size_t len);
+/** Moves `from` over `to`, replacing it in one step so readers never see a partial file. Returns false if unsuccessful */
+bool replaceFile(const char *from, const char *to);
+/** Flushes a written file, or a directory entry on POSIX, to disk. Returns false if unsuccessful */
+bool syncFile(const char *filename);
+/** Maps a whole file read-only into memory. Returns NULL if unsuccessful. Release with unmapFile() */
+const uint8_t *mapFile(const char *filename, size_t *size);
+void unmapFile(const uint8_t *data, size_t size);
+/** Files smaller than this are read in one go instead of mapped */
+#define MAPPED_WAV_MIN_SIZE (1 << 20)
+/** Files with more channels than this fail to open, like in libsndfile */
+#define MAPPED_WAV_MAX_CHANNELS 1024
+
+/** A 16-bit PCM or 32-bit float WAV file converted straight from a memory map, or from a single read for small files.
+Anything else fails to open, so callers can fall back to libsndfile.
+*/
+struct MappedWAV {
+	const uint8_t *map = NULL;
+	size_t mapSize = 0;
+	/** Owns `map` when the file was read rather than mapped */
+	uint8_t *buffer = NULL;
+	const uint8_t *data = NULL;
+	size_t frames = 0;
+	int channels = 0;
+	bool isFloat = false;
+
+	bool open(const char *filename);
+	void close();
+	/** Converts `len` interleaved samples starting at sample `offset`, scaled like libsndfile's sf_read_float() */
+	void read(float *out, size_t offset, size_t len) const;
+	/** Converts `len` frames starting at `frame`, averaging the channels */
+	void readMono(float *out, size_t frame, size_t len) const;
+};
+/** libsndfile format for saving 16-bit audio, FLAC for .flac file names and WAV otherwise */
+int soundFileFormat(const char *filename);
+/** Appends a mono 16-bit PCM WAV file with `frames` samples to `out` */
+void wavEncode(std::vector<uint8_t> &out, const int16_t *samples, size_t frames, int sampleRate = 44100);
+/** Appends a mono 16-bit FLAC file to `out` using libsndfile. Returns false if libsndfile has no FLAC support */
+bool flacEncode(std::vector<uint8_t> &out, const int16_t *samples, size_t frames, int sampleRate = 44100);
+/** Scratch arrays for per-wave processing, which would not fit on the stack at large wave lengths.
+Arrays come from an arena owned by the calling thread and are all released when the Workspace goes out of scope, so nested Workspaces behave like stack frames and no allocation happens once the arena has grown.
+*/
+struct Workspace {
+	int block;
+	size_t used;
+
+	Workspace();
+	~Workspace();
+	/** Uninitialized array of `len` floats */
+	float *alloc(size_t len);
+	/** Zeroed array of `len` floats */
+	float *calloc(size_t len);
+};
+/** Calls `f(i)` for every 0 <= i < n, spread over `threads` threads or one per core if 0, and waits for all of them.
+The calling thread takes part, and the others come from a pool of threads which are started on first use and kept.
+*/
+void parallelFor(int n, const std::function<void(int)> &f, int threads = 0);
+/** Most threads the parallelFor() pool starts */
+#define PARALLEL_MAX_WORKERS 32
+/** Fixed capacity queue which one thread pushes to and another pops from, without locks or allocation.
+`N` must be a power of two.
+*/
+template <typename T, int N>
+struct SpscQueue {
+	T items[N];
+	/** Counts of items pushed and popped, each written by one side only and kept on separate cache lines */
+	alignas(64) std::atomic<uint32_t> pushed;
+	alignas(64) std::atomic<uint32_t> popped;
+
+	SpscQueue() : pushed(0), popped(0) {}
+	/** Producer side. Returns false if the queue is full. */
+	bool push(const T &item) {
+		uint32_t p = pushed.load(std::memory_order_relaxed);
+		if (p - popped.load(std::memory_order_acquire) >= (uint32_t) N)
+			return false;
+		items[p & (N - 1)] = item;
+		pushed.store(p + 1, std::memory_order_release);
+		return true;
+	}
+	/** Consumer side. Returns the oldest item without removing it, or NULL if the queue is empty. */
+	T *front() {
+		uint32_t p = popped.load(std::memory_order_relaxed);
+		if (pushed.load(std::memory_order_acquire) == p)
+			return NULL;
+		return &items[p & (N - 1)];
+	}
+	/** Consumer side. Removes the item returned by front(). */
+	void pop() {
+		popped.store(popped.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	/** Consumer side. Moves the oldest item to `item`, returning false if the queue is empty. */
+	bool pop(T &item) {
+		T *f = front();
+		if (!f)
+			return false;
+		item = *f;
+		pop();
+		return true;
+	}
+};
+/** Appends `len` bytes as Intel HEX data records of up to `recordLen` bytes to `out`, followed by an end of file record */
+void ihexEncode(std::vector<uint8_t> &out, const uint8_t *data, size_t len, int recordLen = 16);
+/** Writes the output of ihexEncode() to a file. Returns false on write error */
+bool ihexWrite(FILE *f, const uint8_t *data, size_t len, int recordLen = 16);
+/** Reads Intel HEX records into `image` of `size` bytes.
+Returns false on a malformed line, bad checksum, data outside the image, or a missing end of file record.
+`written` receives the number of data bytes read.
+*/
+bool ihexRead(FILE *f, uint8_t *image, size_t size, size_t *written);
 unsigned char *base64_encode(const unsigned char *src, size_t len, size_t *out_len);
 unsigned char *base64_decode(const unsigned char *src, size_t len, size_t *out_len);
 
@@ -178,6 +330,8 @@ unsigned char *base64_decode(const unsigned char *src, size_t len, size_t *out_l
 
 #ifdef WAVETABLE_FORMAT_BLOFELD
 #define WAVE_LEN 128
+#elif defined(WAVETABLE_FORMAT_LARGE)
+#define WAVE_LEN 2048
 #else
 #define WAVE_LEN 256
 #endif
@@ -210,41 +364,105 @@ enum EffectID {
 
 extern const char *effectNames[EFFECTS_LEN];
 
-struct Wave {
-	float samples[WAVE_LEN];
+/** Groups of derived arrays in Wave which are computed on demand */
+enum WaveDerived {
+	/** spectrum and harmonics */
+	WAVE_SPECTRUM = 1 << 0,
+	/** postSamples, postSpectrum and postHarmonics */
+	WAVE_POST = 1 << 1,
+	/** mips, which need postSamples */
+	WAVE_MIPS = 1 << 2,
+	WAVE_DERIVED_ALL = WAVE_SPECTRUM | WAVE_POST | WAVE_MIPS,
+};
+
+/** A single cycle of N samples with its effects
+Instantiated in wave.cpp for the wave length of every wavetable format, so banks of any format can be read by one build.
+*/
+template <int N>
+struct WaveT {
+	float samples[N];
 	/** FFT of wave, interleaved complex numbers */
-	float spectrum[WAVE_LEN];
+	mutable float spectrum[N];
 	/** Norm of spectrum */
-	float harmonics[WAVE_LEN / 2];
+	mutable float harmonics[N / 2];
 	/** Wave after effects have been applied */
-	float postSamples[WAVE_LEN];
-	float postSpectrum[WAVE_LEN];
-	float postHarmonics[WAVE_LEN / 2];
+	mutable float postSamples[N];
+	mutable float postSpectrum[N];
+	mutable float postHarmonics[N / 2];
+	/** Band-limited versions of postSamples for playback, see computeMips() */
+	mutable float mips[mipsLength(N)];
 
 	float effects[EFFECTS_LEN];
 	bool cycle;
 	bool normalize = true;
+	/** WaveDerived bits which are out of date in the low bits, and a count of invalidations above them */
+	mutable uint32_t stale = WAVE_DERIVED_ALL;
 
+	WaveT() = default;
+	/** Copies under the validation lock of `other`, since another thread may be computing its derived arrays meanwhile */
+	WaveT(const WaveT &other);
+	WaveT &operator=(const WaveT &other);
 	void clear();
-	/** Generates post arrays from the sample array, by applying effects */
+	/** Marks post arrays as out of date after the effects have changed */
 	void updatePost();
+	/** Marks all derived arrays as out of date after the samples have changed */
 	void commitSamples();
+	/** Regenerates samples from the edited harmonics. Call validate() before editing them. */
 	void commitHarmonics();
+	void invalidate(int derived);
+	/** Computes the given WaveDerived arrays if they are out of date. Safe to call from any thread. */
+	void validate(int derived = WAVE_DERIVED_ALL) const;
+	bool isValid(int derived = WAVE_DERIVED_ALL) const;
+	const float *getSpectrum() const {
+		validate(WAVE_SPECTRUM);
+		return spectrum;
+	}
+	const float *getHarmonics() const {
+		validate(WAVE_SPECTRUM);
+		return harmonics;
+	}
+	const float *getPostSamples() const {
+		validate(WAVE_POST);
+		return postSamples;
+	}
+	const float *getPostHarmonics() const {
+		validate(WAVE_POST);
+		return postHarmonics;
+	}
+	const float *getMips() const {
+		validate(WAVE_MIPS);
+		return mips;
+	}
+	/** Returns the mips if they are up to date, otherwise NULL, without computing or waiting for anything. For playback, which must not block. */
+	const float *getValidMips() const {
+		return isValid(WAVE_MIPS) ? mips : NULL;
+	}
+	/** Returns post samples if they are up to date, otherwise the samples, without computing anything. For overviews which should not stall. */
+	const float *getPreviewSamples() const {
+		return isValid(WAVE_POST) ? postSamples : samples;
+	}
 	void clearEffects();
-	void morphEffect(Wave *from_wave, Wave *to_wave, EffectID effect, float fade);
-	void morphAllEffects(Wave *from_wave, Wave *to_wave, float fade);
+	void morphEffect(const WaveT *from_wave, const WaveT *to_wave, EffectID effect, float fade);
+	void morphAllEffects(const WaveT *from_wave, const WaveT *to_wave, float fade);
 
 	/** Applies effects to the sample array and resets the effect parameters */
 	void bakeEffects();
 	void randomizeEffects();
-	void saveWAV(const char *filename);
+	/** Saves FLAC if the file name ends in .flac, WAV otherwise. Returns false if the file could not be written */
+	bool saveWAV(const char *filename) const;
 	void loadWAV(const char *filename);
 	/** Writes to a global state */
-	void copy(Wave *dst);
-	void clipboardCopy();
+	void copy(const WaveT *dst);
+	void clipboardCopy() const;
 	void clipboardPaste();
+	void computeSpectrum() const;
+	/** Applies effects to the sample array */
+	void computePost() const;
 };
 
+/** Wave with the length of the current wavetable format */
+typedef WaveT<WAVE_LEN> Wave;
+
 extern bool clipboardActive;
 
 ////////////////////
@@ -328,6 +546,8 @@ struct BaseWave {
 	void updateShape();
 	void updatePhasor();
 	void generateSamples(bool update_waves);
+	/** Computes samples and harmonics from the shape and phasor without updating the bank */
+	void renderSamples();
 	void updateSamples(bool update_waves);
 	
 	void generateShape(const float *shape_phasor, float *samples);
@@ -341,6 +561,44 @@ struct BaseWave {
 };
 
 
+////////////////////
+// fm.cpp
+////////////////////
+
+#define FM_OPERATORS_LEN 6
+
+enum FMSourceID {
+	FM_SINE,
+	FM_CARRIER,
+	FM_MODULATOR,
+	FM_SOURCES_LEN
+};
+
+extern const char *fmSourceNames[FM_SOURCES_LEN];
+
+struct FMOperator {
+	/** Frequency relative to the wave. Fractional ratios are hard synced to the wave period. */
+	float ratio;
+	/** Amount of the operator in the rendered wave */
+	float level;
+	FMSourceID source;
+};
+
+/** Matrix of operators where any operator can phase or frequency modulate any other, including itself for feedback */
+struct FMMatrix {
+	FMOperator operators[FM_OPERATORS_LEN];
+	/** Phase modulation depth in cycles, from operator `j` into operator `i` at [i][j] */
+	float pm[FM_OPERATORS_LEN][FM_OPERATORS_LEN];
+	/** Frequency modulation depth relative to the operator frequency, from `j` into `i` at [i][j] */
+	float fm[FM_OPERATORS_LEN][FM_OPERATORS_LEN];
+
+	/** Sets a single sine operator at ratio 1 with no modulation */
+	void clear();
+	/** Renders one period of WAVE_LEN samples. `carrier` and `modulator` are used by operators reading those sources. */
+	void render(const float *carrier, const float *modulator, float *out) const;
+};
+
+
 ////////////////////
 // bank.cpp
 ////////////////////
@@ -353,16 +611,42 @@ struct BaseWave {
 #define BANK_LEN 256
 #define BANK_GRID_WIDTH 16
 #define BANK_GRID_HEIGHT 16
+// Number of hex digits of data per line in saved ROM files
 #define HEX_LINE_WIDTH 32
-// This is width of actual data per HEX file line, currently hardcoded to avoid proper file parsing
 
 #elif WAVETABLE_FORMAT_BLOFELD
 #define BANK_LEN 64
 #define BANK_GRID_WIDTH 8
 #define BANK_GRID_HEIGHT 8
 
+#elif WAVETABLE_FORMAT_LARGE
+// Frames of modern software wavetable synths, 512k samples per bank
+#define BANK_LEN 256
+#define BANK_GRID_WIDTH 16
+#define BANK_GRID_HEIGHT 16
+
 #endif
 
+enum WavetableFormatID {
+	FORMAT_WAVEEDIT,
+	FORMAT_PHMK2,
+	FORMAT_BLOFELD,
+	FORMAT_LARGE,
+	WAVETABLE_FORMATS_LEN
+};
+
+struct WavetableFormat {
+	const char *name;
+	int waveLen;
+	int bankLen;
+	int gridWidth;
+};
+
+/** Geometry of every format, bank files saved by any of them can be opened */
+extern const WavetableFormat wavetableFormats[WAVETABLE_FORMATS_LEN];
+/** Format selected with WT_FORMAT at build time */
+extern const WavetableFormatID currentFormat;
+
 
 enum CrossmodID {
     MODULATOR_ROTATION,
@@ -377,43 +661,161 @@ enum CrossmodID {
 
 extern const char *crossmodNames[CROSSMOD_LEN];
 
+enum MorphMode {
+	/** Every BANK_GRID_WIDTH-th wave is a key, the waves after it fade towards the next key */
+	MORPH_Z,
+	/** Each row fades from its first to its last wave */
+	MORPH_ROWS,
+	/** Each column fades from its top to its bottom wave */
+	MORPH_COLUMNS,
+	/** The whole grid is interpolated from its four corner waves */
+	MORPH_BILINEAR,
+	MORPH_MODES_LEN
+};
+
+extern const char *morphModeNames[MORPH_MODES_LEN];
+
+
+/** Called by CowPtr::write() before it hands out a block which it holds alone
+Only waves are read by other threads, see the overload in wave.cpp.
+*/
+template <typename T>
+inline void cowAcquire(const T &block) {}
+template <int N>
+void cowAcquire(const WaveT<N> &wave);
+
+/** Reference-counted copy-on-write handle to an immutable block
+Copying a handle only shares the block. Reads go through `->` and `*`, which are const.
+Call write() before mutating, which copies the block first if anyone else is holding it.
+Default-constructed handles share a single value-initialized block.
+*/
+template <typename T>
+struct CowPtr {
+	std::shared_ptr<T> block;
+
+	CowPtr() {
+		static const std::shared_ptr<T> empty = std::make_shared<T>();
+		block = empty;
+	}
+	const T &operator*() const {
+		return *block;
+	}
+	const T *operator->() const {
+		return block.get();
+	}
+	/** Returns a pointer which is safe to mutate, detaching from other holders if needed */
+	T *write() {
+		if (block.use_count() != 1)
+			block = std::make_shared<T>(*block);
+		else
+			cowAcquire(*block);
+		return block.get();
+	}
+	bool shares(const CowPtr &other) const {
+		return block == other.block;
+	}
+};
+
 
 struct Bank {
-	Wave waves[BANK_LEN];
-	BaseWave carrier_wave;
-	BaseWave modulator_wave;
+	/** Copying a Bank only copies BANK_LEN pointers, waves are detached individually when written */
+	CowPtr<Wave> waves[BANK_LEN];
+	/** Shared like the waves, so undo history does not copy them on every edit */
+	CowPtr<BaseWave> carrier_wave;
+	CowPtr<BaseWave> modulator_wave;
     
 	float crossmod[CROSSMOD_LEN];
+	FMMatrix fm;
 	float samples[WAVE_LEN];
 	float harmonics[WAVE_LEN / 2];
+	/** Renders the crossmod wave and copies it to every wave in the bank */
 	void updateCrossmod();
+	/** Computes `samples` and `harmonics` from the carrier, modulator and crossmod parameters only */
+	void renderCrossmod();
 	void clear();
 	void swap(int i, int j);
 	void randomize();
-	void morph();
+	/** Renders the FM matrix from the base waves into a wave */
+	void renderFM(int waveId);
+	/** Interpolates effects of the waves between the key waves of the given mode */
+	void morph(MorphMode mode = MORPH_Z);
 	void shuffle();
 	/** `in` must be length BANK_LEN * WAVE_LEN */
 	void setSamples(const float *in);
 	void getPostSamples(float *out);
-	/** Binary dump of the bank struct */
-	void save(const char *filename);
-	void load(const char *filename);
-	/** WAV file with BANK_LEN * WAVE_LEN samples */
-	void saveWAV(const char *filename);
-	void loadWAV(const char *filename);
-	/** Saves each wave to its own file in a directory */
-	void saveWaves(const char *dirname);
+	/** Queues waves with out of date derived data for the background worker, starting with the ones about to be played.
+	UI thread only, since it reads the play position. Loaders leave it to the next frame, so they may run on any thread.
+	*/
+	void validateLater();
+	/** Versioned chunked file with source data only, see bank.cpp for the layout
+	load() also reads the binary struct dump written by older versions of any format.
+	Like the other savers and loaders below, they return false if the file could not be written or read. A failed load may leave the bank cleared.
+	*/
+	bool save(const char *filename);
+	bool load(const char *filename);
+	/** Writes the same bytes as save() into `buf` */
+	void serialize(std::vector<uint8_t> &buf);
+	/** WAV file with BANK_LEN * WAVE_LEN samples, or FLAC if the file name ends in .flac.
+	loadWAV() reads anything libsndfile can.
+	*/
+	bool saveWAV(const char *filename);
+	bool loadWAV(const char *filename);
+	/** Wavetable of software synths, frames of `frameLen` samples one after another, as WAV or FLAC.
+	Frames are resampled from and to WAVE_LEN, so tables of 2048-sample frames can be shared with builds of any wave length.
+	*/
+	bool saveWAVTable(const char *filename, int frameLen = 2048);
+	bool loadWAVTable(const char *filename, int frameLen = 2048);
+	/** Saves waves `start` to `end - 1` to their own files in a directory, writing up to `threads` files at once.
+	With `sync`, the files are flushed to disk together once all of them are written.
+	Returns the number of files which failed, and appends their names to `errors` if given.
+	*/
+	int saveWaves(const char *dirname, int start = 0, int end = BANK_LEN, int threads = 4, bool sync = false, std::string *errors = NULL);
 #if WAVETABLE_FORMAT_PHMK2
-	/** ROM file with BANK_LEN * WAVE_LEN samples */
-	void saveROM(const char *filename);
-	void loadROM(const char *filename);
+	/** Intel HEX ROM file with BANK_LEN * WAVE_LEN unsigned 8-bit samples */
+	bool saveROM(const char *filename);
+	bool loadROM(const char *filename);
+	/** The same ROM image as raw binary */
+	bool saveROMBinary(const char *filename);
 #endif
 #if WAVETABLE_FORMAT_BLOFELD
-	void saveBlofeldWavetable(const char *filename);
-	void loadBlofeldWavetable(const char *filename);
+	/** Blofeld wavetable dump as raw SysEx for .syx files, or a standard MIDI file otherwise.
+	The slot and name are taken from the file name, e.g. "05Name.syx" is saved to slot 85.
+	*/
+	bool saveBlofeldWavetable(const char *filename);
+	/** Loads wavetable `slot` (0 for 80) from a possibly multi-slot dump, or the first slot found if negative */
+	bool loadBlofeldWavetable(const char *filename, int slot = -1);
 #endif
 };
 
+/** Returns the WavetableFormatID a file saved with Bank::save() was written in, or -1 if Bank::load() cannot read it */
+int bankFileFormat(const char *filename);
+/** Starts and stops the background worker used by Bank::validateLater() */
+void validateInit();
+void validateDestroy();
+#if WAVETABLE_FORMAT_PHMK2
+/** Converts a sample to the unsigned 8-bit ROM range */
+inline uint8_t romSample(float x) {
+	return (uint8_t) rescalef(x, -1.0, 1.0, 0.0, 255.0);
+}
+#endif
+#if WAVETABLE_FORMAT_BLOFELD
+/** Length of a wave dump message from F0 to F7 */
+#define BLOFELD_MESSAGE_LEN 410
+/** User wavetables occupy slots 80 to 118 */
+#define BLOFELD_SLOT_OFFSET 0x50
+#define BLOFELD_SLOTS 39
+
+/** Converts a sample to the Blofeld's signed 21-bit range */
+inline int32_t blofeldSample(float x) {
+	return (int32_t) (clampf(x, -1.0, 1.0) * 1048575.0);
+}
+/** Takes the slot from a two digit prefix of the file name and the wavetable name from the rest */
+void getBlofeldName(const char *filename, char *name, int *slot);
+/** Writes one wave dump message of BLOFELD_MESSAGE_LEN bytes into `msg` from blofeldSample() values */
+void packBlofeldWave(uint8_t *msg, const int32_t *samples, int slot, int wave, const char *name);
+/** Streams every bank WAV file in `dirname` into one multi-slot Blofeld dump, in name order from slot 80 */
+void saveBlofeldDump(const char *filename, const char *dirname);
+#endif
 void ringModulation(float *carrier, const float *modulator, float index, float depth);
 void amplitudeModulation(float *carrier, const float *modulator, float index, float depth);
 void phaseModulation(float *carrier, const float *modulator, float index, float depth);
@@ -424,15 +826,285 @@ void convolution(float *carrier, const float *modulator, float depth);
 // history.cpp
 ////////////////////
 
-/** Call as much as you like. History will only be pushed if a time delay between the last call has occurred. */
+struct HistoryStats {
+	int steps;
+	/** States with no later state, including the current one if nothing was undone */
+	int branches;
+	/** Approximate memory held by the steps */
+	size_t bytes;
+	size_t lastStepBytes;
+	/** Oldest steps dropped to stay within historyBudget */
+	int evicted;
+	/** Size of the journal file */
+	size_t journalBytes;
+	int journalCheckpoints;
+	/** Times the journal writer fell behind, and its queued records were replaced by a checkpoint */
+	int journalOverflows;
+	int journalFailures;
+	/** Seconds spent writing the last checkpoint */
+	double journalCheckpointTime;
+};
+
+/** A state in the undo tree, as listed by historyGetNodes() */
+struct HistoryNodeInfo {
+	int id;
+	/** -1 for the oldest state */
+	int parent;
+	/** Branch column, the first child of a state continues its parent's column */
+	int column;
+	/** Waves which changed since the parent state */
+	int waves;
+	/** Whether the crossmod or FM settings changed since the parent state */
+	bool bank;
+	bool current;
+	/** Seconds since the epoch */
+	int64_t time;
+};
+
+/** Megabytes of undo history kept before the oldest steps are dropped */
+extern int historyBudget;
+extern HistoryStats historyStats;
+
+/** Call as much as you like. History will only be pushed if a time delay between the last call has occurred.
+Each step only stores the source data of the waves which changed since the previous one, derived arrays are recomputed after undo and redo.
+*/
 void historyPush();
+/** Groups the edits until the matching historyCommit() into one undo step, which is never merged with its neighbors by time.
+Pushes in between do nothing. Edits made since the last push are part of the step too, so the transaction may begin after the bank was changed.
+Transactions may nest, only the outermost one is recorded.
+*/
+void historyBegin();
+void historyCommit();
+/** Moves to the parent state. Edits after an undo start a new branch, the states which were undone are kept. */
 void historyUndo();
+/** Moves to the child state which was visited last */
 void historyRedo();
+/** Moves to any state in the undo tree. Only the waves which differ along the way are rebuilt. */
+void historyJump(int id);
 void historyClear();
+/** Lists the undo tree depth first, each state after its parent */
+void historyGetNodes(std::vector<HistoryNodeInfo> &infos);
+/** Sets `waves` to the indices of the waves which differ between the current state and state `id`, and copies the samples of wave `waveId` in state `id` to `samples` if it is not NULL.
+Returns whether the crossmod or FM settings may differ too.
+*/
+bool historyCompare(int id, std::vector<int> &waves, float *samples, int waveId);
+/** Restores currentBank and its undo history from the journal in `filename`, then keeps the journal up to date from a background thread.
+Returns false if there was no journal this build can read, in which case the history is left empty.
+*/
+bool historyJournalOpen(const char *filename);
+/** Writes the remaining journal records and stops the thread */
+void historyJournalClose();
+
+/** Scope guard for a history transaction, for discrete operations like buttons and menu items. Continuous drags should call historyPush() instead. */
+struct HistoryTransaction {
+	HistoryTransaction() {
+		historyBegin();
+	}
+	~HistoryTransaction() {
+		historyCommit();
+	}
+};
 
 extern Bank currentBank;
 
 
+////////////////////
+// io.cpp
+////////////////////
+
+/** Reports the fraction done from within long file operations.
+Returns false if the operation should stop early, which only happens for cancelled background tasks.
+*/
+bool ioProgress(float progress);
+/** Runs `load` on a staging copy of currentBank on the I/O thread.
+Unless cancelled or `load` returns false, the staging bank then replaces currentBank and `done` is called from ioStep().
+A failed load of `filename` is reported by ioTakeFailures(). `filename` may be NULL for loads which cannot fail.
+*/
+void ioLoad(const char *label, const char *filename, const std::function<bool(Bank &bank)> &load, const std::function<void()> &done = NULL);
+/** Runs `save` on a snapshot of currentBank on the I/O thread.
+`save` is given a temporary file name which replaces `filename` once it is written.
+If `save` returns false, `filename` is left as it was and the failure is reported by ioTakeFailures().
+*/
+void ioSave(const char *label, const char *filename, const std::function<bool(Bank &bank, const char *filename)> &save);
+/** Runs `work` on a snapshot of currentBank on the I/O thread, for exports writing several files.
+Unless cancelled, `done` is then called from ioStep().
+*/
+void ioExport(const char *label, const std::function<void(Bank &bank)> &work, const std::function<void()> &done = NULL);
+/** Commits finished tasks and starts the next queued one. Call once per frame from the UI thread. */
+void ioStep();
+/** Stops the running task and drops queued ones */
+void ioCancel();
+bool ioBusy();
+/** Returns the label of the running task, or NULL if idle */
+const char *ioStatus(float *progress);
+/** Blocks until every queued task is done */
+void ioFlush();
+/** Returns a line for each load and save which failed since the last call, or an empty string. UI thread only. */
+std::string ioTakeFailures();
+
+
+////////////////////
+// autosave.cpp
+////////////////////
+
+struct AutosaveStats {
+	int writes;
+	/** Autosaves skipped because the bank had not changed */
+	int skips;
+	int failures;
+	/** Seconds spent serializing and writing the last autosave */
+	double lastWriteTime;
+	size_t lastBytes;
+	size_t totalBytes;
+	/** Smoothed seconds between autosaves */
+	double averageInterval;
+};
+
+/** Seconds between autosaves */
+extern float autosaveInterval;
+/** Number of history steps which trigger an autosave sooner */
+extern int autosaveEdits;
+extern AutosaveStats autosaveStats;
+
+/** Call after loading `filename` into currentBank. NULL disables autosaving for this session. */
+void autosaveInit(const char *filename);
+/** Counts an edit towards autosaveEdits */
+void autosaveEdit();
+/** Starts a background autosave when due. Call once per frame from the UI thread. */
+void autosaveStep();
+/** Waits for a running autosave and writes the final one */
+void autosaveDestroy();
+
+////////////////////
+// export.cpp
+////////////////////
+
+enum ExportTarget {
+	/** The whole bank as one 16-bit WAV file */
+	EXPORT_WAV = 1 << 0,
+	/** Each wave as its own 16-bit WAV file */
+	EXPORT_WAVES = 1 << 1,
+	/** Intel HEX ROM */
+	EXPORT_ROM = 1 << 2,
+	/** Raw binary ROM */
+	EXPORT_ROM_BINARY = 1 << 3,
+	/** Blofeld SysEx wavetable dump */
+	EXPORT_BLOFELD = 1 << 4,
+	/** The whole bank as one 16-bit FLAC file */
+	EXPORT_FLAC = 1 << 5,
+	/** Each wave as its own 16-bit FLAC file */
+	EXPORT_WAVES_FLAC = 1 << 6,
+};
+
+/** Targets which the current wavetable format can export */
+#if WAVETABLE_FORMAT_PHMK2
+#define EXPORT_TARGETS (EXPORT_WAV | EXPORT_WAVES | EXPORT_FLAC | EXPORT_WAVES_FLAC | EXPORT_ROM | EXPORT_ROM_BINARY)
+#elif WAVETABLE_FORMAT_BLOFELD
+#define EXPORT_TARGETS (EXPORT_WAV | EXPORT_WAVES | EXPORT_FLAC | EXPORT_WAVES_FLAC | EXPORT_BLOFELD)
+#else
+#define EXPORT_TARGETS (EXPORT_WAV | EXPORT_WAVES | EXPORT_FLAC | EXPORT_WAVES_FLAC)
+#endif
+
+/** Writes the selected targets of `bank` into `dirname`, named after `name`, writing up to `threads` files at once.
+All targets are made from one snapshot of the post samples, converted once per bit depth.
+A `name.manifest` file lists the size and hash of every file written.
+Returns the number of files which failed, and appends their names to `errors` if given.
+*/
+int exportBank(Bank &bank, const char *dirname, const char *name, int targets, int threads = 4, std::string *errors = NULL);
+/** Parses a comma separated list of target names, e.g. "wav,flac,hex". Returns -1 for an unknown or unavailable name */
+int exportParseTargets(const char *list);
+/** Loads a bank with the loader for the extension of `filename`, and sets `name` to the file name without directory or extension.
+Returns false if the file cannot be read.
+*/
+bool exportLoadBank(Bank &bank, const char *filename, std::string *name = NULL);
+/** Handles `WaveEdit --export <bank> <directory> [targets]` without opening a window. Returns the exit code. */
+int exportCommand(int argc, char **argv);
+
+
+////////////////////
+// render.cpp
+////////////////////
+
+struct MidiRenderSettings {
+	int sampleRate = 44100;
+	/** Maximum number of notes sounding at once. Further notes take the voice of the oldest one. */
+	int polyphony = 32;
+	/** Morphs across the grid with X and Y instead of along Z */
+	bool modeXY = false;
+	/** Controllers which set morph X, Y and Z over their whole range, per MIDI channel */
+	int controllerX = 16;
+	int controllerY = 17;
+	int controllerZ = 1;
+	/** Morph position before any controller is received */
+	float morphX = 0.0;
+	float morphY = 0.0;
+	float morphZ = 0.0;
+	/** Output gain in dB, with room for several voices at full level */
+	float volume = -20.0;
+};
+
+struct MidiRenderStats {
+	/** Seconds of audio rendered */
+	double duration = 0.0;
+	/** Seconds the render took */
+	double time = 0.0;
+	/** Sum of the seconds each voice sounded. Divided by `time`, the voices times realtime the renderer achieved. */
+	double voiceSeconds = 0.0;
+	int notes = 0;
+	int peakVoices = 0;
+	/** Notes which took the voice of a note still sounding */
+	int stolen = 0;
+	/** Output samples beyond full scale */
+	int clipped = 0;
+};
+
+/** Renders a standard MIDI file through the waves of `bank` as 16-bit mono WAV into `out`.
+Keys set the pitch, velocity the level, and the controllers of the settings morph the channel's notes.
+Each voice renders blocks of up to AUDIO_BLOCK_LEN samples with the playback oscillator, without a sound card or any shared state, so several renders may run at once.
+Returns false if the MIDI file cannot be read.
+*/
+bool renderMidi(const Bank &bank, const char *midiFilename, std::vector<uint8_t> &out, const MidiRenderSettings &settings, MidiRenderStats *stats = NULL);
+/** Handles `WaveEdit --midi [options] <file.mid> <directory> <bank>...` without opening a window. Returns the exit code. */
+int renderMidiCommand(int argc, char **argv);
+
+enum AuditionPath {
+	/** One wave, without morphing */
+	AUDITION_WAVE,
+	/** Along Z from the first wave to the last */
+	AUDITION_Z_SWEEP,
+	/** Across the grid through the points of `xyPath` */
+	AUDITION_XY_PATH,
+};
+
+struct AuditionSettings {
+	AuditionPath path = AUDITION_Z_SWEEP;
+	float frequency = 220.0;
+	/** Seconds, over which the path is followed once */
+	float duration = 4.0;
+	int sampleRate = 44100;
+	/** Output gain in dB */
+	float volume = -12.0;
+	/** Wave played by AUDITION_WAVE */
+	int wave = 0;
+	/** x, y pairs of grid positions, moved through at constant speed. Every row of the grid in alternating directions if empty. */
+	std::vector<float> xyPath;
+};
+
+struct AuditionStats {
+	/** Seconds of audio rendered */
+	double duration = 0.0;
+	/** Seconds the render took */
+	double time = 0.0;
+};
+
+/** Plays `bank` along a path at one pitch as 16-bit mono WAV into `out`.
+Runs a Player of its own, the same oscillator and smoothing as playback, without an audio device, so any number of renders may run at once.
+*/
+void renderAudition(const Bank &bank, const AuditionSettings &settings, std::vector<uint8_t> &out, AuditionStats *stats = NULL);
+/** Handles `WaveEdit --audition [options] <directory> <bank>...` without opening a window. Returns the exit code. */
+int auditionCommand(int argc, char **argv);
+
+
 ////////////////////
 // catalog.cpp
 ////////////////////
@@ -466,7 +1138,6 @@ enum PlaySource {
 
 extern float playVolume;
 extern float playFrequency;
-extern float playFrequencySmooth;
 extern bool playEnabled;
 extern PlaySource playSource;
 extern bool playModeXY;
@@ -478,13 +1149,179 @@ extern float morphZSpeed;
 extern int playIndex;
 extern const char *audioDeviceName;
 extern Bank *playingBank;
+/** Asked for when opening the device, which may choose otherwise. See audioStats for what it chose. */
+extern int audioSampleRate;
+/** Samples per callback */
+extern int audioBufferSize;
+
+/** Callbacks kept for the load meter */
+#define AUDIO_LOAD_HISTORY 256
+
+/** Timing of the audio callback since the device was opened, gathered by audioStep() */
+struct AudioStats {
+	/** As the device was opened */
+	int sampleRate = 0;
+	int bufferSize = 0;
+	int64_t callbacks = 0;
+	/** Callback durations in seconds. The percentiles are of the last 1024 callbacks. */
+	double lastDuration = 0.0;
+	double maxDuration = 0.0;
+	double p50 = 0.0;
+	double p95 = 0.0;
+	double p99 = 0.0;
+	/** Callbacks which took longer than their buffer lasts, or came so late after the previous one that the device probably ran dry */
+	int xruns = 0;
+	int overBudget = 0;
+	int late = 0;
+	/** Timings lost because the UI thread did not collect them in time */
+	int dropped = 0;
+	/** Fraction of the buffer period each recent callback took, oldest first */
+	float load[AUDIO_LOAD_HISTORY] = {};
+};
+
+extern AudioStats audioStats;
+
+/** Morphing is ramped and the mips are chosen over blocks of this many samples */
+#define AUDIO_BLOCK_LEN 64
+
+/** What a block of playback reads, chosen once per block */
+enum RenderMode {
+	RENDER_Z,
+	RENDER_XY,
+	RENDER_CROSSMOD,
+	RENDER_CARRIER,
+	RENDER_MODULATOR,
+};
+
+/** Smoothed morph positions at the start and end of a block, which each sample interpolates between */
+struct MorphRamp {
+	float x0, x1;
+	float y0, y1;
+	float z0, z1;
+};
+
+/** The two mip levels playback crossfades between, chosen from the frequency */
+struct MipChoice {
+	int offset0, len0;
+	int offset1, len1;
+	float mix;
+};
+
+MipChoice chooseMips(float frequency, float sampleRate);
+
+/** Where each sample of a block reads a mip level, the index of the sample it falls after and the 6-point Lagrange weights of the samples from index - 2 to index + 3.
+Every wave read in a block shares the phase, so this is computed once per level and block rather than for every wave.
+*/
+struct MipTaps {
+	int index[AUDIO_BLOCK_LEN];
+	float w0[AUDIO_BLOCK_LEN];
+	float w1[AUDIO_BLOCK_LEN];
+	float w2[AUDIO_BLOCK_LEN];
+	float w3[AUDIO_BLOCK_LEN];
+	float w4[AUDIO_BLOCK_LEN];
+	float w5[AUDIO_BLOCK_LEN];
+};
+
+/** Phase increment per sample of a tone at `frequency`, in cycles as 32-bit fixed point */
+uint32_t phaseIncrement(float frequency, float sampleRate);
+/** Fills `taps` for `len` samples starting at `phase`, advancing by `phaseStep` per sample, both in cycles as 32-bit fixed point */
+void computeTaps(MipTaps &taps, int mipLen, uint32_t phase, uint32_t phaseStep, int len);
+
+/** A wave played as it is, with its mips. The crossmod, carrier and modulator waves have no derived arrays, so snapshots compute their own. */
+struct SourceMips {
+	float samples[WAVE_LEN];
+	float mips[mipsLength(WAVE_LEN)];
+};
+
+/** Everything playback reads of a bank, built by makePlaySnapshot() and never changed afterwards.
+It holds the blocks of the waves rather than copies. A held block is shared, so the UI copies it before writing, and published mips stay as they were.
+*/
+struct PlaySnapshot {
+	/** Blocks whose mips were valid when taken, or NULL for waves which have none yet */
+	std::shared_ptr<const Wave> waves[BANK_LEN];
+	std::shared_ptr<const SourceMips> crossmod;
+	std::shared_ptr<const SourceMips> carrier;
+	std::shared_ptr<const SourceMips> modulator;
+
+	const float *getMips(int i) const {
+		return waves[i] ? waves[i]->mips : NULL;
+	}
+};
+
+/** Takes the waves of `bank` whose mips are valid.
+A wave still being validated keeps its block in `previous`, so it plays its last version instead of dropping out. Pass `previous` only if it was made from the same bank.
+Returns `previous` itself if nothing changed since it was made.
+*/
+std::shared_ptr<const PlaySnapshot> makePlaySnapshot(const Bank &bank, const std::shared_ptr<const PlaySnapshot> &previous = std::shared_ptr<const PlaySnapshot>());
+/** Fills `out` with `len` samples of the snapshot without gain, reading the mips through the taps of the two levels.
+Waves without mips are silent, so validate the bank before taking the snapshot when every wave must sound.
+Only reads its arguments, so any thread may render any snapshot.
+*/
+void renderBlock(RenderMode mode, const PlaySnapshot &snapshot, const MorphRamp &ramp, const MipChoice &mip, const MipTaps &taps0, const MipTaps &taps1, float *out, int len);
+
+/** What playback reads from the UI, taken once per block */
+struct PlayParameters {
+	/** Gain in dB */
+	float volume = -12.0;
+	PlaySource source = PLAY_WAVE;
+	bool modeXY = false;
+	bool interpolate = true;
+	float x = 0.0;
+	float y = 0.0;
+	float z = 0.0;
+};
+
+/** An oscillator playing a bank. The audio callback plays one, and offline renders run their own. */
+struct Player {
+	/** Oscillator phase in cycles as 32-bit fixed point, which wraps by itself. A float phase jitters enough to alias at -110 dB. */
+	uint32_t phase = 0;
+	float morphXSmooth = 0.0;
+	float morphYSmooth = 0.0;
+	float morphZSmooth = 0.0;
+	MipTaps taps0;
+	MipTaps taps1;
+
+	/** Moves the smoothed morph position straight to that of `params` */
+	void snapMorph(const PlayParameters &params);
+	/** Renders up to AUDIO_BLOCK_LEN samples of `snapshot` at `frequency`, moving the morph position towards that of `params` */
+	void render(const PlaySnapshot &snapshot, const PlayParameters &params, float frequency, float sampleRate, float *out, int len);
+};
 
 int audioGetDeviceCount();
 const char *audioGetDeviceName(int deviceId);
 void audioClose();
 void audioOpen(int deviceId);
+/** Reopens the current device with a new sample rate and buffer size */
+void audioSetFormat(int sampleRate, int bufferSize);
+/** Writes the timing of the callbacks since the device was opened, up to the last 131072, as CSV. Returns false if the file could not be written. */
+bool audioExportTimings(const char *filename);
 void audioInit();
 void audioDestroy();
+/** Sends the play globals changed since the last call to the audio thread, and takes back the Z position and play index it reports, and the timing of its callbacks.
+The globals belong to the UI thread, and the audio thread applies each change at the sample matching when it was sent. Call once per frame from the UI thread.
+Changes to playingBank reach the audio thread as a PlaySnapshot, once the waves which changed are validated.
+*/
+void audioStep();
+/** Runs the audio callback over `len` samples at `sampleRate` without a device, as the audio thread.
+For tests and benchmarks. Call from one thread at a time, and never while a device is open.
+*/
+void audioRender(float *out, int len, int sampleRate);
+
+
+////////////////////
+// stress.cpp
+////////////////////
+
+/** Handles `WaveEdit --stress [options]`, which plays the bank through audioRender() on one thread while editing it on another, for finding data races with ThreadSanitizer. Returns the exit code. */
+int stressCommand(int argc, char **argv);
+
+
+////////////////////
+// bench.cpp
+////////////////////
+
+/** Handles `WaveEdit --bench [options]`, which times the audio callback in every play mode, compares its aliasing with libsamplerate, and checks where changes land in the output. Returns the exit code. */
+int benchCommand(int argc, char **argv);
 
 
 ////////////////////
@@ -514,7 +1351,7 @@ Returns the relative amount dragged
 float renderBankWave(const char *name, float height, const float *lines, int linesLen, float bankStart, float bankEnd, int bankLen);
 // Functions for UI shortcuts
 extern void menuRandomizeBank();
-extern void menuMorphBank();
+extern void menuMorphBank(MorphMode mode = MORPH_Z);
 extern void menuShuffleBank();
 extern void menuClearBank();
 
@@ -546,3 +1383,13 @@ void dbPage();
 ////////////////////
 
 void importPage();
+
+
+////////////////////
+// main.cpp
+////////////////////
+
+/** Runs the editor in this format, or the command named by argv[1] such as `--export`. Returns the exit code. */
+int formatMain(int argc, char **argv);
+
+} // namespace WAVETABLE_NAMESPACE
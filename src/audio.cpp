@@ -1,11 +1,14 @@
 #include "WaveEdit.hpp"
 #include <SDL.h>
-#include <samplerate.h>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+
+namespace WAVETABLE_NAMESPACE {
 
 
 float playVolume = -12.0;
 float playFrequency = 220.0;
-float playFrequencySmooth = playFrequency;
 bool playModeXY = false;
 bool playEnabled = false;
 PlaySource playSource = PLAY_WAVE;
@@ -16,112 +19,587 @@ float morphZ = 0.0;
 float morphZSpeed = 0.0;
 int playIndex = 0;
 Bank *playingBank;
+int audioSampleRate = 44100;
+int audioBufferSize = 1024;
+AudioStats audioStats;
 
-static float morphXSmooth = morphX;
-static float morphYSmooth = morphY;
-static float morphZSmooth = morphZ;
 static SDL_AudioDeviceID audioDevice = 0;
 static SDL_AudioSpec audioSpec;
-static SRC_STATE *audioSrc = NULL;
-
-long srcCallback(void *cb_data, float **data) {
-	float gain = powf(10.0, playVolume / 20.0);
-	// Generate next samples
-	const int inLen = 64;
-	static float in[inLen];
-	for (int i = 0; i < inLen; i++) {
-		if (morphInterpolate) {
-			const float lambdaMorph = fminf(0.1 / playFrequency, 0.5);
-			morphXSmooth = crossf(morphXSmooth, clampf(morphX, 0.0, BANK_GRID_WIDTH - 1), lambdaMorph);
-			morphYSmooth = crossf(morphYSmooth, clampf(morphY, 0.0, BANK_GRID_HEIGHT - 1), lambdaMorph);
-			morphZSmooth = crossf(morphZSmooth, clampf(morphZ, 0.0, BANK_LEN - 1), lambdaMorph);
-		}
-		else {
-			// Snap X, Y, Z
-			morphXSmooth = roundf(morphX);
-			morphYSmooth = roundf(morphY);
-			morphZSmooth = roundf(morphZ);
-		}
+static int audioDeviceId = -1;
+
+enum PlayEventType {
+	PLAY_EVENT_ENABLED,
+	PLAY_EVENT_SNAPSHOT,
+	PLAY_EVENT_VOLUME,
+	PLAY_EVENT_FREQUENCY,
+	PLAY_EVENT_SOURCE,
+	PLAY_EVENT_MODE_XY,
+	PLAY_EVENT_INTERPOLATE,
+	PLAY_EVENT_MORPH_X,
+	PLAY_EVENT_MORPH_Y,
+	PLAY_EVENT_MORPH_Z,
+	PLAY_EVENT_MORPH_Z_SPEED,
+};
+
+/** A change of one play global by the UI thread */
+struct PlayEvent {
+	/** getTime() when the UI thread sent it */
+	double time;
+	/** Counts events sent, so the UI can tell which of them a status includes */
+	uint32_t serial;
+	PlayEventType type;
+	float value;
+	const PlaySnapshot *snapshot;
+};
+
+/** Reported by the audio thread after each callback */
+struct PlayStatus {
+	/** Serial of the last event applied */
+	uint32_t serial;
+	/** Morph Z as moved by morphZSpeed */
+	float morphZ;
+	int playIndex;
+};
+
+/** The play globals as one side knows them */
+struct PlayState {
+	bool enabled = false;
+	const PlaySnapshot *snapshot = NULL;
+	PlayParameters params;
+	float frequency = 220.0;
+	float frequencySmooth = 220.0;
+	float morphZSpeed = 0.0;
+	uint32_t serial = 0;
+};
+
+static SpscQueue<PlayEvent, 1024> playEvents;
+static SpscQueue<PlayStatus, 16> playStatus;
+
+/** How long one callback took, sent from the audio thread */
+struct AudioTiming {
+	/** getTime() at the start of the callback */
+	double time;
+	/** Seconds since the start of the previous callback, 0 for the first one */
+	float interval;
+	/** Seconds the callback took */
+	float duration;
+	int frames;
+	/** Timings lost before this one because the queue was full */
+	int dropped;
+};
+
+/** Callbacks which come more than this many buffer periods apart probably left a gap in the output */
+#define AUDIO_LATE_PERIODS 1.5
+/** Percentiles are over this many recent callbacks */
+#define AUDIO_STATS_WINDOW 1024
+/** Timings kept for exporting */
+#define AUDIO_TIMING_LOG_LEN (1 << 17)
+
+static SpscQueue<AudioTiming, 4096> audioTimings;
+
+// Audio thread only
+static Player player;
+static PlayState audioState;
+static double lastCallbackTime = 0.0;
+static int timingsDropped = 0;
+
+// UI thread only
+static std::deque<AudioTiming> timingLog;
+static PlayState sentState;
+static uint32_t sentSerial = 0;
+/** Serial of the last morph Z event sent */
+static uint32_t morphZSerial = 0;
+/** The last snapshot sent, the bank it was made from, and the serial of its event */
+static std::shared_ptr<const PlaySnapshot> sentSnapshot;
+static const Bank *sentSnapshotBank = NULL;
+static uint32_t sentSnapshotSerial = 0;
+/** The snapshot sent before, which the audio thread may still be playing until it applies the event of sentSnapshot */
+static std::shared_ptr<const PlaySnapshot> retiringSnapshot;
 
-		int index = (playIndex + i) % WAVE_LEN;
-		if (playSource == PLAY_WAVE) {
-			if (playModeXY) {
-				// Morph XY
-				int xi = morphXSmooth;
-				float xf = morphXSmooth - xi;
-				int yi = morphYSmooth;
-				float yf = morphYSmooth - yi;
-				// 2D linear interpolate
-				float v0 = crossf(
-					playingBank->waves[yi * BANK_GRID_WIDTH + xi].postSamples[index],
-					playingBank->waves[yi * BANK_GRID_WIDTH + eucmodi(xi + 1, BANK_GRID_WIDTH)].postSamples[index],
-					xf);
-				float v1 = crossf(
-					playingBank->waves[eucmodi(yi + 1, BANK_GRID_HEIGHT) * BANK_GRID_WIDTH + xi].postSamples[index],
-					playingBank->waves[eucmodi(yi + 1, BANK_GRID_HEIGHT) * BANK_GRID_WIDTH + eucmodi(xi + 1, BANK_GRID_WIDTH)].postSamples[index],
-					xf);
-				in[i] = crossf(v0, v1, yf);
+
+static double getTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static void applyEvent(const PlayEvent &event) {
+	PlayParameters &params = audioState.params;
+	switch (event.type) {
+		case PLAY_EVENT_ENABLED: audioState.enabled = event.value != 0.0; break;
+		case PLAY_EVENT_SNAPSHOT: audioState.snapshot = event.snapshot; break;
+		case PLAY_EVENT_VOLUME: params.volume = event.value; break;
+		case PLAY_EVENT_FREQUENCY: audioState.frequency = clampf(event.value, 1.0, 10000.0); break;
+		case PLAY_EVENT_SOURCE: params.source = (PlaySource) (int) event.value; break;
+		case PLAY_EVENT_MODE_XY: params.modeXY = event.value != 0.0; break;
+		case PLAY_EVENT_INTERPOLATE: params.interpolate = event.value != 0.0; break;
+		case PLAY_EVENT_MORPH_X: params.x = event.value; break;
+		case PLAY_EVENT_MORPH_Y: params.y = event.value; break;
+		case PLAY_EVENT_MORPH_Z: params.z = event.value; break;
+		case PLAY_EVENT_MORPH_Z_SPEED: audioState.morphZSpeed = event.value; break;
+	}
+	audioState.serial = event.serial;
+}
+
+
+MipChoice chooseMips(float frequency, float sampleRate) {
+	// Level k has no harmonics above Nyquist as long as k >= log2(WAVE_LEN * frequency / sampleRate). One level more leaves room to crossfade to the next level without aliasing.
+	int levels = mipLevels(WAVE_LEN);
+	float p = clampf(log2f(WAVE_LEN * frequency / sampleRate) + 1.0, 0.0, levels - 1);
+	int level = mini((int) p, levels - 1);
+	int next = mini(level + 1, levels - 1);
+	MipChoice mip;
+	mip.offset0 = mipOffset(WAVE_LEN, level);
+	mip.len0 = mipLength(WAVE_LEN, level);
+	mip.offset1 = mipOffset(WAVE_LEN, next);
+	mip.len1 = mipLength(WAVE_LEN, next);
+	mip.mix = p - level;
+	return mip;
+}
+
+uint32_t phaseIncrement(float frequency, float sampleRate) {
+	return (uint32_t) llround((double) frequency / sampleRate * 4294967296.0);
+}
+
+void computeTaps(MipTaps &taps, int mipLen, uint32_t phase, uint32_t phaseStep, int len) {
+	// Mip levels are powers of 2 long, so the top bits of the phase are the index and the rest its fraction
+	int shift = 32;
+	for (int l = mipLen; l > 1; l >>= 1)
+		shift--;
+	uint32_t fracMask = (1u << shift) - 1;
+	float fracScale = 1.f / (1u << shift);
+	for (int j = 0; j < len; j++) {
+		uint32_t ph = phase + phaseStep * (uint32_t) j;
+		int i = ph >> shift;
+		float f = (ph & fracMask) * fracScale;
+		// Distances to the samples at -2 to 3
+		float a = f + 2.f, b = f + 1.f, c = f, d = f - 1.f, e = f - 2.f, g = f - 3.f;
+		float ab = a * b;
+		float eg = e * g;
+		float abc = ab * c;
+		float deg = d * eg;
+		taps.index[j] = i;
+		taps.w0[j] = -1.f / 120.f * b * c * deg;
+		taps.w1[j] = 1.f / 24.f * a * c * deg;
+		taps.w2[j] = -1.f / 12.f * ab * deg;
+		taps.w3[j] = 1.f / 12.f * abc * eg;
+		taps.w4[j] = -1.f / 24.f * abc * d * g;
+		taps.w5[j] = 1.f / 120.f * abc * d * e;
+	}
+}
+
+/** Adds samples `start` to `end` of a mip level read through `taps`, scaled by `weight` and `gain`, to `out` */
+static void addMip(float *out, const float *table, int mipLen, const MipTaps &taps, const float *weight, float gain, int start, int end) {
+	int mask = mipLen - 1;
+	for (int j = start; j < end; j++) {
+		int i = taps.index[j];
+		float v = taps.w0[j] * table[(i - 2) & mask] + taps.w1[j] * table[(i - 1) & mask] + taps.w2[j] * table[i & mask] + taps.w3[j] * table[(i + 1) & mask] + taps.w4[j] * table[(i + 2) & mask] + taps.w5[j] * table[(i + 3) & mask];
+		out[j] += gain * weight[j] * v;
+	}
+}
+
+/** Position of sample `i` of the block, reaching `to` at its last sample */
+static inline float rampAt(float from, float to, int i, int len) {
+	return from + (to - from) * (i + 1) / len;
+}
+
+/** The block is split where the ramp crosses into another pair of waves, so each part reads the mips of the same two or four waves. Waves and levels with no weight are skipped. */
+template <int MODE>
+static void renderModeBlock(const PlaySnapshot &snapshot, const MorphRamp &ramp, const MipChoice &mip, const MipTaps &taps0, const MipTaps &taps1, float *out, int len) {
+	memset(out, 0, sizeof(float) * len);
+	auto addWave = [&](const float *mips, const float *weight, int start, int end) {
+		if (!mips)
+			return;
+		if (mip.mix < 1.0)
+			addMip(out, mips + mip.offset0, mip.len0, taps0, weight, 1.0 - mip.mix, start, end);
+		if (mip.mix > 0.0)
+			addMip(out, mips + mip.offset1, mip.len1, taps1, weight, mip.mix, start, end);
+	};
+	float wa[AUDIO_BLOCK_LEN];
+	float wb[AUDIO_BLOCK_LEN];
+	float wc[AUDIO_BLOCK_LEN];
+	float wd[AUDIO_BLOCK_LEN];
+
+	int i = 0;
+	while (i < len) {
+		int end = len;
+		if (MODE == RENDER_Z) {
+			int zi = rampAt(ramp.z0, ramp.z1, i, len);
+			// Only happens while the ramp moves across a wave
+			while (end > i + 1 && (int) rampAt(ramp.z0, ramp.z1, end - 1, len) != zi)
+				end--;
+			float step = (ramp.z1 - ramp.z0) / len;
+			float zf = rampAt(ramp.z0, ramp.z1, i, len) - zi;
+			for (int j = i; j < end; j++) {
+				wb[j] = zf + step * (j - i);
+				wa[j] = 1.f - wb[j];
 			}
-			else {
-				// Morph Z
-				int zi = morphZSmooth;
-				float zf = morphZSmooth - zi;
-				in[i] = crossf(
-					playingBank->waves[zi].postSamples[index],
-					playingBank->waves[eucmodi(zi + 1, BANK_LEN)].postSamples[index],
-					zf);
+			addWave(snapshot.getMips(zi), wa, i, end);
+			if (zf > 0.0 || step != 0.0)
+				addWave(snapshot.getMips(eucmodi(zi + 1, BANK_LEN)), wb, i, end);
+		}
+		else if (MODE == RENDER_XY) {
+			int xi = rampAt(ramp.x0, ramp.x1, i, len);
+			int yi = rampAt(ramp.y0, ramp.y1, i, len);
+			while (end > i + 1 && ((int) rampAt(ramp.x0, ramp.x1, end - 1, len) != xi || (int) rampAt(ramp.y0, ramp.y1, end - 1, len) != yi))
+				end--;
+			float xStep = (ramp.x1 - ramp.x0) / len;
+			float yStep = (ramp.y1 - ramp.y0) / len;
+			float xf = rampAt(ramp.x0, ramp.x1, i, len) - xi;
+			float yf = rampAt(ramp.y0, ramp.y1, i, len) - yi;
+			// 2D linear interpolate
+			for (int j = i; j < end; j++) {
+				float x = xf + xStep * (j - i);
+				float y = yf + yStep * (j - i);
+				wa[j] = (1.f - x) * (1.f - y);
+				wb[j] = x * (1.f - y);
+				wc[j] = (1.f - x) * y;
+				wd[j] = x * y;
 			}
+			bool moveX = xf > 0.0 || xStep != 0.0;
+			bool moveY = yf > 0.0 || yStep != 0.0;
+			int xi1 = eucmodi(xi + 1, BANK_GRID_WIDTH);
+			int yi1 = eucmodi(yi + 1, BANK_GRID_HEIGHT);
+			addWave(snapshot.getMips(yi * BANK_GRID_WIDTH + xi), wa, i, end);
+			if (moveX)
+				addWave(snapshot.getMips(yi * BANK_GRID_WIDTH + xi1), wb, i, end);
+			if (moveY)
+				addWave(snapshot.getMips(yi1 * BANK_GRID_WIDTH + xi), wc, i, end);
+			if (moveX && moveY)
+				addWave(snapshot.getMips(yi1 * BANK_GRID_WIDTH + xi1), wd, i, end);
 		}
-		else if (playSource == PLAY_CROSSMOD) {
-			in[i] = playingBank->samples[index];
-
+		else {
+			const SourceMips *source = (MODE == RENDER_CROSSMOD) ? snapshot.crossmod.get() : (MODE == RENDER_CARRIER) ? snapshot.carrier.get() : snapshot.modulator.get();
+			for (int j = i; j < end; j++) {
+				wa[j] = 1.f;
+			}
+			addWave(source ? source->mips : NULL, wa, i, end);
 		}
-		else if (playSource == PLAY_CARRIER) {
-			in[i] = playingBank->carrier_wave.samples[index];
+		i = end;
+	}
+}
+
+
+void renderBlock(RenderMode mode, const PlaySnapshot &snapshot, const MorphRamp &ramp, const MipChoice &mip, const MipTaps &taps0, const MipTaps &taps1, float *out, int len) {
+	switch (mode) {
+		case RENDER_Z: renderModeBlock<RENDER_Z>(snapshot, ramp, mip, taps0, taps1, out, len); break;
+		case RENDER_XY: renderModeBlock<RENDER_XY>(snapshot, ramp, mip, taps0, taps1, out, len); break;
+		case RENDER_CROSSMOD: renderModeBlock<RENDER_CROSSMOD>(snapshot, ramp, mip, taps0, taps1, out, len); break;
+		case RENDER_CARRIER: renderModeBlock<RENDER_CARRIER>(snapshot, ramp, mip, taps0, taps1, out, len); break;
+		case RENDER_MODULATOR: renderModeBlock<RENDER_MODULATOR>(snapshot, ramp, mip, taps0, taps1, out, len); break;
+	}
+}
+
+
+static bool sameSamples(const std::shared_ptr<const SourceMips> &source, const float *samples) {
+	return source && memcmp(source->samples, samples, sizeof(source->samples)) == 0;
+}
+
+/** Returns `previous` if it holds the same samples, otherwise their mips */
+static std::shared_ptr<const SourceMips> makeSourceMips(const float *samples, const std::shared_ptr<const SourceMips> &previous) {
+	if (sameSamples(previous, samples))
+		return previous;
+	std::shared_ptr<SourceMips> source = std::make_shared<SourceMips>();
+	memcpy(source->samples, samples, sizeof(source->samples));
+	computeMips(source->samples, WAVE_LEN, source->mips);
+	return source;
+}
+
+std::shared_ptr<const PlaySnapshot> makePlaySnapshot(const Bank &bank, const std::shared_ptr<const PlaySnapshot> &previous) {
+	// Playback asks every frame and the bank rarely changed, so look before allocating anything
+	if (previous) {
+		bool changed = !sameSamples(previous->crossmod, bank.samples) || !sameSamples(previous->carrier, bank.carrier_wave->samples) || !sameSamples(previous->modulator, bank.modulator_wave->samples);
+		for (int i = 0; i < BANK_LEN && !changed; i++) {
+			const std::shared_ptr<Wave> &block = bank.waves[i].block;
+			changed = block != previous->waves[i] && block->getValidMips();
 		}
-		else if (playSource == PLAY_MODULATOR) {
-			in[i] = playingBank->modulator_wave.samples[index];
-		};
-		in[i] = clampf(in[i] * gain, -1.0, 1.0);
+		if (!changed)
+			return previous;
+	}
+
+	std::shared_ptr<PlaySnapshot> snapshot = std::make_shared<PlaySnapshot>();
+	for (int i = 0; i < BANK_LEN; i++) {
+		const std::shared_ptr<Wave> &block = bank.waves[i].block;
+		if (block->getValidMips())
+			snapshot->waves[i] = block;
+		else if (previous)
+			snapshot->waves[i] = previous->waves[i];
 	}
+	snapshot->crossmod = makeSourceMips(bank.samples, previous ? previous->crossmod : nullptr);
+	snapshot->carrier = makeSourceMips(bank.carrier_wave->samples, previous ? previous->carrier : nullptr);
+	snapshot->modulator = makeSourceMips(bank.modulator_wave->samples, previous ? previous->modulator : nullptr);
+	return snapshot;
+}
 
-	playIndex += inLen;
-	playIndex %= WAVE_LEN;
 
-	*data = in;
-	return inLen;
+/** Moves a smoothed morph position by one block, returning the ramp to its new value.
+Exponential smoothing by `lambda` per wave sample, applied to the `count` wave samples a block plays at once.
+*/
+static void smoothMorph(float &smooth, float target, float lambda, float count, float &from, float &to) {
+	from = smooth;
+	smooth = target + (smooth - target) * powf(1.0 - lambda, count);
+	to = smooth;
 }
 
 
-void audioCallback(void *userdata, Uint8 *stream, int len) {
-	float *out = (float *) stream;
-	int outLen = len / sizeof(float);
+void Player::snapMorph(const PlayParameters &params) {
+	morphXSmooth = clampf(params.x, 0.0, BANK_GRID_WIDTH - 1);
+	morphYSmooth = clampf(params.y, 0.0, BANK_GRID_HEIGHT - 1);
+	morphZSmooth = clampf(params.z, 0.0, BANK_LEN - 1);
+}
+
+
+void Player::render(const PlaySnapshot &snapshot, const PlayParameters &params, float frequency, float sampleRate, float *out, int len) {
+	float gain = powf(10.0, params.volume / 20.0);
+
+	MorphRamp ramp;
+	if (params.interpolate) {
+		// Smoothing is per sample of the wave, as many as the block moves through
+		const float lambdaMorph = fminf(0.1 / frequency, 0.5);
+		float count = len * WAVE_LEN * frequency / sampleRate;
+		smoothMorph(morphXSmooth, clampf(params.x, 0.0, BANK_GRID_WIDTH - 1), lambdaMorph, count, ramp.x0, ramp.x1);
+		smoothMorph(morphYSmooth, clampf(params.y, 0.0, BANK_GRID_HEIGHT - 1), lambdaMorph, count, ramp.y0, ramp.y1);
+		smoothMorph(morphZSmooth, clampf(params.z, 0.0, BANK_LEN - 1), lambdaMorph, count, ramp.z0, ramp.z1);
+	}
+	else {
+		// Snap X, Y, Z
+		morphXSmooth = ramp.x0 = ramp.x1 = roundf(params.x);
+		morphYSmooth = ramp.y0 = ramp.y1 = roundf(params.y);
+		morphZSmooth = ramp.z0 = ramp.z1 = roundf(params.z);
+	}
+
+	RenderMode mode = RENDER_CROSSMOD;
+	if (params.source == PLAY_WAVE)
+		mode = params.modeXY ? RENDER_XY : RENDER_Z;
+	else if (params.source == PLAY_CARRIER)
+		mode = RENDER_CARRIER;
+	else if (params.source == PLAY_MODULATOR)
+		mode = RENDER_MODULATOR;
+
+	MipChoice mip = chooseMips(frequency, sampleRate);
+	uint32_t phaseStep = phaseIncrement(frequency, sampleRate);
+	if (mip.mix < 1.0)
+		computeTaps(taps0, mip.len0, phase, phaseStep, len);
+	if (mip.mix > 0.0)
+		computeTaps(taps1, mip.len1, phase, phaseStep, len);
+	phase += phaseStep * (uint32_t) len;
+
+	renderBlock(mode, snapshot, ramp, mip, taps0, taps1, out, len);
+	for (int i = 0; i < len; i++) {
+		out[i] = clampf(out[i] * gain, -1.0, 1.0);
+	}
+}
+
+
+/** The body of the callback, for `outLen` samples at `sampleRate` */
+static void audioProcess(float *out, int outLen, float sampleRate) {
+	// The buffer stands for the time since the previous callback, so events land at the sample matching when the UI made them, one buffer later
+	double now = getTime();
+	double previous = lastCallbackTime;
+	double start = lastCallbackTime;
+	if (start <= 0.0 || now - start > 4.0 * outLen / sampleRate)
+		start = now - outLen / sampleRate;
+	lastCallbackTime = now;
+	double samplesPerSecond = outLen / fmax(now - start, 1e-6);
 
-	if (playEnabled) {
-		// Apply exponential smoothing to frequency
-		const float lambdaFrequency = 0.5;
-		playFrequency = clampf(playFrequency, 1.0, 10000.0);
-		playFrequencySmooth = powf(playFrequencySmooth, 1.0 - lambdaFrequency) * powf(playFrequency, lambdaFrequency);
-		double ratio = (double)audioSpec.freq / WAVE_LEN / playFrequencySmooth;
+	int i = 0;
+	while (i < outLen) {
+		// Apply the events due by this sample, and end the block at the next one
+		int end = mini(i + AUDIO_BLOCK_LEN, outLen);
+		PlayEvent *event;
+		while ((event = playEvents.front())) {
+			int offset = (int) ((event->time - start) * samplesPerSecond);
+			if (offset > i) {
+				end = mini(end, offset);
+				break;
+			}
+			applyEvent(*event);
+			playEvents.pop();
+		}
+		int blockLen = end - i;
+
+		if (!audioState.enabled || !audioState.snapshot) {
+			memset(&out[i], 0, sizeof(float) * blockLen);
+			i = end;
+			continue;
+		}
 
-		src_callback_read(audioSrc, ratio, outLen, out);
+		// Exponential smoothing of frequency, halving the distance to the target every 1024 samples
+		float keep = powf(0.5, blockLen / 1024.0);
+		audioState.frequencySmooth = powf(audioState.frequencySmooth, keep) * powf(audioState.frequency, 1.0 - keep);
+		player.render(*audioState.snapshot, audioState.params, audioState.frequencySmooth, sampleRate, &out[i], blockLen);
 
 		// Modulate Z
-		if (!playModeXY && morphZSpeed > 0.f) {
-			float deltaZ = morphZSpeed * outLen / audioSpec.freq;
-			deltaZ = clampf(deltaZ, 0.f, 1.f);
-			morphZ += (BANK_LEN-1) * deltaZ;
-			if (morphZ >= (BANK_LEN-1)) {
-				morphZ = fmodf(morphZ, (BANK_LEN-1));
-				morphZSmooth = morphZ;
+		PlayParameters &params = audioState.params;
+		if (!params.modeXY && audioState.morphZSpeed > 0.f) {
+			float deltaZ = clampf(audioState.morphZSpeed * blockLen / sampleRate, 0.f, 1.f);
+			params.z += (BANK_LEN-1) * deltaZ;
+			if (params.z >= (BANK_LEN-1)) {
+				params.z = fmodf(params.z, (BANK_LEN-1));
+				player.morphZSmooth = params.z;
 			}
 		}
+		i = end;
 	}
-	else {
-		for (int i = 0; i < outLen; i++) {
-			out[i] = 0.0;
+
+	// The UI only needs the latest status, so a full queue just drops this one
+	PlayStatus status;
+	status.serial = audioState.serial;
+	status.morphZ = audioState.params.z;
+	status.playIndex = (int) ((uint64_t) player.phase * WAVE_LEN >> 32);
+	playStatus.push(status);
+
+	AudioTiming timing;
+	timing.time = now;
+	timing.interval = (previous > 0.0) ? now - previous : 0.0;
+	timing.duration = getTime() - now;
+	timing.frames = outLen;
+	timing.dropped = timingsDropped;
+	if (audioTimings.push(timing))
+		timingsDropped = 0;
+	else
+		timingsDropped++;
+}
+
+void audioCallback(void *userdata, Uint8 *stream, int len) {
+	audioProcess((float *) stream, len / sizeof(float), audioSpec.freq);
+}
+
+void audioRender(float *out, int len, int sampleRate) {
+	audioProcess(out, len, sampleRate);
+}
+
+
+/** Queues an event for the audio thread. Returns false if the queue is full. */
+static bool sendEvent(PlayEventType type, float value, const PlaySnapshot *snapshot = NULL) {
+	PlayEvent event;
+	event.time = getTime();
+	event.serial = sentSerial + 1;
+	event.type = type;
+	event.value = value;
+	event.snapshot = snapshot;
+	if (!playEvents.push(event))
+		return false;
+	sentSerial = event.serial;
+	return true;
+}
+
+
+/** Adds the timings sent since the last call to audioStats and the log */
+static void collectTimings() {
+	AudioStats &stats = audioStats;
+	bool received = false;
+	AudioTiming timing;
+	while (audioTimings.pop(timing)) {
+		received = true;
+		double period = (double) timing.frames / maxi(stats.sampleRate, 1);
+		stats.callbacks++;
+		stats.lastDuration = timing.duration;
+		stats.maxDuration = fmax(stats.maxDuration, timing.duration);
+		stats.dropped += timing.dropped;
+		bool overBudget = timing.duration > period;
+		bool late = timing.interval > AUDIO_LATE_PERIODS * period;
+		if (overBudget)
+			stats.overBudget++;
+		if (late)
+			stats.late++;
+		if (overBudget || late)
+			stats.xruns++;
+		memmove(&stats.load[0], &stats.load[1], sizeof(float) * (AUDIO_LOAD_HISTORY - 1));
+		stats.load[AUDIO_LOAD_HISTORY - 1] = timing.duration / period;
+
+		timingLog.push_back(timing);
+		if (timingLog.size() > AUDIO_TIMING_LOG_LEN)
+			timingLog.pop_front();
+	}
+	if (!received)
+		return;
+
+	int count = mini(timingLog.size(), AUDIO_STATS_WINDOW);
+	std::vector<float> durations(count);
+	for (int i = 0; i < count; i++) {
+		durations[i] = timingLog[timingLog.size() - count + i].duration;
+	}
+	auto percentile = [&](double p) {
+		int n = mini((int) (p * count), count - 1);
+		std::nth_element(durations.begin(), durations.begin() + n, durations.end());
+		return (double) durations[n];
+	};
+	stats.p50 = percentile(0.50);
+	stats.p95 = percentile(0.95);
+	stats.p99 = percentile(0.99);
+}
+
+
+bool audioExportTimings(const char *filename) {
+	FILE *f = fopen(filename, "w");
+	if (!f)
+		return false;
+	fprintf(f, "time_s,interval_ms,duration_ms,period_ms,load,late,over_budget,dropped_before\n");
+	double start = timingLog.empty() ? 0.0 : timingLog.front().time;
+	for (const AudioTiming &timing : timingLog) {
+		double period = (double) timing.frames / maxi(audioStats.sampleRate, 1);
+		fprintf(f, "%.6f,%.3f,%.3f,%.3f,%.4f,%d,%d,%d\n", timing.time - start, timing.interval * 1000.0, timing.duration * 1000.0, period * 1000.0,
+			timing.duration / period, timing.interval > AUDIO_LATE_PERIODS * period, timing.duration > period, timing.dropped);
+	}
+	return fclose(f) == 0;
+}
+
+
+void audioStep() {
+	collectTimings();
+
+	// Take Z from the audio thread while it modulates it, unless the UI moved Z since the audio thread last heard of it
+	PlayStatus status;
+	bool received = false;
+	while (playStatus.pop(status)) {
+		received = true;
+	}
+	if (received) {
+		playIndex = status.playIndex;
+		if ((int32_t) (status.serial - morphZSerial) >= 0 && morphZ == sentState.params.z)
+			morphZ = sentState.params.z = status.morphZ;
+		if ((int32_t) (status.serial - sentSnapshotSerial) >= 0)
+			retiringSnapshot.reset();
+	}
+
+	// The audio thread never reads the bank, only snapshots of it, which are freed here once it has moved on to a newer one.
+	// The next snapshot waits until it has, so no more than two are alive however long the device is closed.
+	if (!retiringSnapshot) {
+		std::shared_ptr<const PlaySnapshot> snapshot;
+		if (playingBank)
+			snapshot = makePlaySnapshot(*playingBank, (playingBank == sentSnapshotBank) ? sentSnapshot : nullptr);
+		if (snapshot != sentSnapshot && sendEvent(PLAY_EVENT_SNAPSHOT, 0.0, snapshot.get())) {
+			retiringSnapshot = sentSnapshot;
+			sentSnapshot = snapshot;
+			sentSnapshotBank = playingBank;
+			sentSnapshotSerial = sentSerial;
 		}
 	}
+
+	// Every change which does not fit in the queue is sent again on the next frame
+	PlayParameters &sent = sentState.params;
+	if (playEnabled != sentState.enabled && sendEvent(PLAY_EVENT_ENABLED, playEnabled))
+		sentState.enabled = playEnabled;
+	if (playVolume != sent.volume && sendEvent(PLAY_EVENT_VOLUME, playVolume))
+		sent.volume = playVolume;
+	if (playFrequency != sentState.frequency && sendEvent(PLAY_EVENT_FREQUENCY, playFrequency))
+		sentState.frequency = playFrequency;
+	if (playSource != sent.source && sendEvent(PLAY_EVENT_SOURCE, playSource))
+		sent.source = playSource;
+	if (playModeXY != sent.modeXY && sendEvent(PLAY_EVENT_MODE_XY, playModeXY))
+		sent.modeXY = playModeXY;
+	if (morphInterpolate != sent.interpolate && sendEvent(PLAY_EVENT_INTERPOLATE, morphInterpolate))
+		sent.interpolate = morphInterpolate;
+	if (morphX != sent.x && sendEvent(PLAY_EVENT_MORPH_X, morphX))
+		sent.x = morphX;
+	if (morphY != sent.y && sendEvent(PLAY_EVENT_MORPH_Y, morphY))
+		sent.y = morphY;
+	if (morphZ != sent.z && sendEvent(PLAY_EVENT_MORPH_Z, morphZ)) {
+		sent.z = morphZ;
+		morphZSerial = sentSerial;
+	}
+	if (morphZSpeed != sentState.morphZSpeed && sendEvent(PLAY_EVENT_MORPH_Z_SPEED, morphZSpeed))
+		sentState.morphZSpeed = morphZSpeed;
 }
 
 int audioGetDeviceCount() {
@@ -135,38 +613,55 @@ const char *audioGetDeviceName(int deviceId) {
 void audioClose() {
 	if (audioDevice > 0) {
 		SDL_CloseAudioDevice(audioDevice);
+		audioDevice = 0;
 	}
 }
 
 /** if deviceName is -1, the default audio device is chosen */
 void audioOpen(int deviceId) {
 	audioClose();
+	audioDeviceId = deviceId;
+
+	// The callback is stopped, so its timings and timestamps can be reset from here
+	AudioTiming timing;
+	while (audioTimings.pop(timing)) {}
+	timingLog.clear();
+	audioStats = AudioStats();
+	lastCallbackTime = 0.0;
+	timingsDropped = 0;
 
 	SDL_AudioSpec spec;
 	memset(&spec, 0, sizeof(spec));
-	spec.freq = 44100;
+	spec.freq = audioSampleRate;
 	spec.format = AUDIO_F32;
 	spec.channels = 1;
-	spec.samples = 1024;
+	spec.samples = audioBufferSize;
 	spec.callback = audioCallback;
 
 	const char *deviceName = deviceId >= 0 ? SDL_GetAudioDeviceName(deviceId, 0) : NULL;
 	// TODO Be more tolerant of devices which can't use floats or 1 channel
 	audioDevice = SDL_OpenAudioDevice(deviceName, 0, &spec, &audioSpec, SDL_AUDIO_ALLOW_ANY_CHANGE);
-	if (audioDevice <= 0)
+	if (audioDevice <= 0) {
+		audioDevice = 0;
 		return;
+	}
+	audioStats.sampleRate = audioSpec.freq;
+	audioStats.bufferSize = audioSpec.samples;
 	SDL_PauseAudioDevice(audioDevice, 0);
 }
 
+void audioSetFormat(int sampleRate, int bufferSize) {
+	audioSampleRate = sampleRate;
+	audioBufferSize = bufferSize;
+	audioOpen(audioDeviceId);
+}
+
 void audioInit() {
-	assert(!audioSrc);
-	int err;
-	audioSrc = src_callback_new(srcCallback, SRC_SINC_FASTEST, 1, &err, NULL);
-	assert(audioSrc);
 	audioOpen(-1);
 }
 
 void audioDestroy() {
 	audioClose();
-	src_delete(audioSrc);
 }
+
+} // namespace WAVETABLE_NAMESPACE
@@ -0,0 +1,139 @@
+#include "WaveEdit.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace WAVETABLE_NAMESPACE {
+
+
+float autosaveInterval = 30.0;
+int autosaveEdits = 20;
+AutosaveStats autosaveStats = {};
+
+static std::string autosaveFilename;
+static std::thread autosaveThread;
+static std::atomic<bool> autosaveFinished(true);
+/** Only touched by the autosave thread while it runs, and by the UI thread otherwise */
+static uint64_t autosaveHash = 0;
+static Bank *autosaveSnapshot = NULL;
+static AutosaveStats runStats;
+static int editCount = 0;
+static double lastTime = 0.0;
+
+
+static double getTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/** Writes the serialized bank beside the autosave file and moves it into place, so a crash mid-write never loses the previous autosave */
+static bool writeAtomic(const std::vector<uint8_t> &buf) {
+	std::string temp = autosaveFilename + ".tmp";
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (!f)
+		return false;
+	bool success = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+	success = (fclose(f) == 0) && success;
+	if (!success || !replaceFile(temp.c_str(), autosaveFilename.c_str())) {
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+static void autosaveRun() {
+	double start = getTime();
+	std::vector<uint8_t> buf;
+	autosaveSnapshot->serialize(buf);
+	uint64_t hash = hashBytes(buf.data(), buf.size());
+	if (hash == autosaveHash) {
+		runStats.skips++;
+	}
+	else if (writeAtomic(buf)) {
+		autosaveHash = hash;
+		runStats.writes++;
+		runStats.lastBytes = buf.size();
+		runStats.totalBytes += buf.size();
+		runStats.lastWriteTime = getTime() - start;
+	}
+	else {
+		runStats.failures++;
+	}
+	autosaveFinished = true;
+}
+
+
+/** Joins a finished autosave and releases its snapshot. Returns false if one is still running. */
+static bool autosaveReap() {
+	if (!autosaveFinished)
+		return false;
+	if (autosaveThread.joinable())
+		autosaveThread.join();
+	if (autosaveSnapshot)
+		autosaveStats = runStats;
+	delete autosaveSnapshot;
+	autosaveSnapshot = NULL;
+	return true;
+}
+
+
+void autosaveInit(const char *filename) {
+	autosaveFilename = filename ? filename : "";
+	if (!filename)
+		return;
+	// The loaded bank is already on disk, unless there was no file to load
+	FILE *f = fopen(filename, "rb");
+	if (f) {
+		fclose(f);
+		std::vector<uint8_t> buf;
+		currentBank.serialize(buf);
+		autosaveHash = hashBytes(buf.data(), buf.size());
+	}
+	lastTime = getTime();
+	editCount = 0;
+}
+
+
+void autosaveEdit() {
+	editCount++;
+}
+
+
+void autosaveStep() {
+	if (autosaveFilename.empty())
+		return;
+	if (!autosaveReap())
+		return;
+	double time = getTime();
+	if (time - lastTime < autosaveInterval && editCount < autosaveEdits)
+		return;
+
+	// Smoothed time between autosaves
+	if (autosaveStats.writes + autosaveStats.skips + autosaveStats.failures > 0)
+		autosaveStats.averageInterval = crossf(autosaveStats.averageInterval, time - lastTime, 0.25);
+	else
+		autosaveStats.averageInterval = time - lastTime;
+	lastTime = time;
+	editCount = 0;
+	// Copying the bank only copies wave pointers, serializing and writing happens on the autosave thread
+	runStats = autosaveStats;
+	autosaveSnapshot = new Bank(currentBank);
+	autosaveFinished = false;
+	autosaveThread = std::thread(autosaveRun);
+}
+
+
+void autosaveDestroy() {
+	if (autosaveFilename.empty())
+		return;
+	while (!autosaveReap()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	runStats = autosaveStats;
+	autosaveSnapshot = new Bank(currentBank);
+	autosaveRun();
+	autosaveReap();
+}
+
+} // namespace WAVETABLE_NAMESPACE
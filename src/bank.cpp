@@ -1,15 +1,20 @@
 #include "WaveEdit.hpp"
 #include <string.h>
 #include <sndfile.h>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
 
 #ifdef WAVETABLE_FORMAT_BLOFELD
 #include <libgen.h>
-#include <numeric>
-#include "MidiFile.h"
-#include "MidiEvent.h"
-using namespace smf;
+#include <strings.h>
+#include <dirent.h>
 #endif
 
+namespace WAVETABLE_NAMESPACE {
+
 
 const char *crossmodNames[CROSSMOD_LEN] {
 	"Modulator Rotation",
@@ -24,9 +29,10 @@ const char *crossmodNames[CROSSMOD_LEN] {
 
 void ringModulation(float *carrier, const float *modulator, float index, float depth) {
 	const int oversample = 4;
-	float tmp[WAVE_LEN * oversample + 1];
-	float carrier_tmp[WAVE_LEN * oversample];
-	float modulator_tmp[WAVE_LEN * oversample + 1];
+	Workspace ws;
+	float *tmp = ws.alloc(WAVE_LEN * oversample + 1);
+	float *carrier_tmp = ws.alloc(WAVE_LEN * oversample);
+	float *modulator_tmp = ws.alloc(WAVE_LEN * oversample + 1);
 	cyclicOversample(carrier, carrier_tmp, WAVE_LEN, oversample);
 	cyclicOversample(modulator, modulator_tmp, WAVE_LEN, oversample);
 	modulator_tmp[WAVE_LEN * oversample] = modulator_tmp[0];
@@ -51,9 +57,10 @@ void ringModulation(float *carrier, const float *modulator, float index, float d
 
 void amplitudeModulation(float *carrier, const float *modulator, float index, float depth) {
 	const int oversample = 4;
-	float tmp[WAVE_LEN * oversample + 1];
-	float carrier_tmp[WAVE_LEN * oversample];
-	float modulator_tmp[WAVE_LEN * oversample + 1];
+	Workspace ws;
+	float *tmp = ws.alloc(WAVE_LEN * oversample + 1);
+	float *carrier_tmp = ws.alloc(WAVE_LEN * oversample);
+	float *modulator_tmp = ws.alloc(WAVE_LEN * oversample + 1);
 	cyclicOversample(carrier, carrier_tmp, WAVE_LEN, oversample);
 	cyclicOversample(modulator, modulator_tmp, WAVE_LEN, oversample);
 	modulator_tmp[WAVE_LEN * oversample] = modulator_tmp[0];
@@ -78,9 +85,10 @@ void amplitudeModulation(float *carrier, const float *modulator, float index, fl
 
 void phaseModulation(float *carrier, const float *modulator, float index, float depth) {
 	const int oversample = 4;
-	float tmp[WAVE_LEN * oversample + 1];
-	float carrier_tmp[WAVE_LEN * oversample];
-	float modulator_tmp[WAVE_LEN * oversample + 1];
+	Workspace ws;
+	float *tmp = ws.alloc(WAVE_LEN * oversample + 1);
+	float *carrier_tmp = ws.alloc(WAVE_LEN * oversample);
+	float *modulator_tmp = ws.alloc(WAVE_LEN * oversample + 1);
 	cyclicOversample(carrier, carrier_tmp, WAVE_LEN, oversample);
 	cyclicOversample(modulator, modulator_tmp, WAVE_LEN, oversample);
 	modulator_tmp[WAVE_LEN * oversample] = modulator_tmp[0];
@@ -108,9 +116,10 @@ void phaseModulation(float *carrier, const float *modulator, float index, float
 
 void frequencyModulation(float *carrier, const float *modulator, float index, float depth) {
 	const int oversample = 4;
-	float tmp[WAVE_LEN * oversample + 1];
-	float carrier_tmp[WAVE_LEN * oversample];
-	float modulator_tmp[WAVE_LEN * oversample + 1];
+	Workspace ws;
+	float *tmp = ws.alloc(WAVE_LEN * oversample + 1);
+	float *carrier_tmp = ws.alloc(WAVE_LEN * oversample);
+	float *modulator_tmp = ws.alloc(WAVE_LEN * oversample + 1);
 	cyclicOversample(carrier, carrier_tmp, WAVE_LEN, oversample);
 	cyclicOversample(modulator, modulator_tmp, WAVE_LEN, oversample);
 	modulator_tmp[WAVE_LEN * oversample] = modulator_tmp[0];
@@ -152,9 +161,10 @@ void frequencyModulation(float *carrier, const float *modulator, float index, fl
 
 void convolution(float *carrier, const float *modulator, float depth) {
 	// Build the kernel in Fourier space
-	float fft[WAVE_LEN];
-	float kernel[WAVE_LEN];
-	float tmp[WAVE_LEN];
+	Workspace ws;
+	float *fft = ws.alloc(WAVE_LEN);
+	float *kernel = ws.alloc(WAVE_LEN);
+	float *tmp = ws.alloc(WAVE_LEN);
 	memcpy(tmp, carrier, sizeof(float) * WAVE_LEN);
 	
 	RFFT(modulator, kernel, WAVE_LEN);
@@ -171,14 +181,26 @@ void convolution(float *carrier, const float *modulator, float depth) {
 }
 
 void Bank::updateCrossmod() {
-	float tmp_mod[WAVE_LEN];
-	float out[WAVE_LEN];
+	renderCrossmod();
+
+	for (int i = 0; i < BANK_LEN; i++) {
+		Wave *wave = waves[i].write();
+		memcpy(wave->samples, samples, sizeof(float) * WAVE_LEN);
+		wave->commitSamples();
+	}
+}
 
-	float tmp[WAVE_LEN];
-	memcpy(out, carrier_wave.samples, sizeof(float) * WAVE_LEN);
+
+void Bank::renderCrossmod() {
+	Workspace ws;
+	float *tmp_mod = ws.alloc(WAVE_LEN);
+	float *out = ws.alloc(WAVE_LEN);
+
+	float *tmp = ws.alloc(WAVE_LEN);
+	memcpy(out, carrier_wave->samples, sizeof(float) * WAVE_LEN);
     
 	if (crossmod[MODULATOR_ROTATION] > 0.0) {
-		RFFT(modulator_wave.samples, tmp, WAVE_LEN);
+		RFFT(modulator_wave->samples, tmp, WAVE_LEN);
 		for (int k = 0; k < WAVE_LEN / 2; k++) {
 			float phase = clampf(crossmod[MODULATOR_ROTATION], 0.0, 1.0);
 			float br = cosf(2 * M_PI * phase);
@@ -188,7 +210,7 @@ void Bank::updateCrossmod() {
 		IRFFT(tmp, tmp_mod, WAVE_LEN);
 	}
 		else {
-			memcpy(tmp_mod, modulator_wave.samples, sizeof(float) * WAVE_LEN);
+			memcpy(tmp_mod, modulator_wave->samples, sizeof(float) * WAVE_LEN);
 		};
 
 
@@ -233,46 +255,263 @@ void Bank::updateCrossmod() {
 		harmonics[i] = hypotf(tmp[2 * i], tmp[2 * i + 1]) * 2.0;
 	}
 	IRFFT(tmp, samples, WAVE_LEN);
-    
 	//memcpy(samples, out, sizeof(float) * WAVE_LEN);
-	for (int i = 0; i < BANK_LEN; i++) {
-		memcpy(waves[i].samples, samples, sizeof(float) * WAVE_LEN);
-		waves[i].commitSamples();
-	}
 }
 
 
 void Bank::clear() {
 	*this = Bank();
-	modulator_wave.clear();
-	carrier_wave.clear();
-
+	fm.clear();
+	modulator_wave.write()->clear();
+	carrier_wave.write()->clear();
+	renderCrossmod();
+
+	// All waves share a single committed blank wave until they are edited
+	CowPtr<Wave> blank;
+	Wave *wave = blank.write();
+	wave->clear();
+	wave->commitSamples();
 	for (int i = 0; i < BANK_LEN; i++) {
-        waves[i].normalize = true;
-		waves[i].commitSamples();
+		waves[i] = blank;
 	}
 }
 
 
+static std::thread validateThread;
+static std::mutex validateMutex;
+static std::condition_variable validateCv;
+/** Strong references, so CowPtr::write() copies a queued wave instead of editing it while the worker may be computing it */
+static std::deque<std::shared_ptr<Wave>> validateQueue;
+static bool validateRunning = false;
+
+/** A wave which validateLater() found stale, and its stale bits and invalidation count at the time */
+struct ValidateRequest {
+	std::weak_ptr<Wave> wave;
+	uint32_t stale;
+
+	bool operator==(const ValidateRequest &other) const {
+		// Compares the blocks by owner, which stays unique while either request holds it even if the block is freed and its address reused
+		return stale == other.stale && !wave.owner_before(other.wave) && !other.wave.owner_before(wave);
+	}
+};
+/** What the queue was last built from, the first validateRequestsUrgent of them around the play position */
+static std::vector<ValidateRequest> validateRequests;
+static int validateRequestsUrgent = 0;
+
+static void validateRun() {
+	std::unique_lock<std::mutex> lock(validateMutex);
+	while (validateRunning) {
+		if (validateQueue.empty()) {
+			validateCv.wait(lock);
+			continue;
+		}
+		std::shared_ptr<Wave> wave = std::move(validateQueue.front());
+		validateQueue.pop_front();
+		lock.unlock();
+		wave->validate();
+		wave.reset();
+		lock.lock();
+	}
+}
+
+void validateInit() {
+	assert(!validateRunning);
+	validateRunning = true;
+	validateThread = std::thread(validateRun);
+}
+
+void validateDestroy() {
+	{
+		std::lock_guard<std::mutex> lock(validateMutex);
+		validateRunning = false;
+		validateQueue.clear();
+	}
+	validateCv.notify_one();
+	if (validateThread.joinable())
+		validateThread.join();
+}
+
+
+void Bank::validateLater() {
+	// Waves around the play position come first, since playback skips them until they are computed
+	int order[BANK_LEN];
+	int len = 0;
+	bool queued[BANK_LEN] = {};
+	auto add = [&](int j) {
+		j = eucmodi(j, BANK_LEN);
+		if (!queued[j]) {
+			queued[j] = true;
+			order[len++] = j;
+		}
+	};
+	if (playModeXY) {
+		int xi = clampi(morphX, 0, BANK_GRID_WIDTH - 1);
+		int yi = clampi(morphY, 0, BANK_GRID_HEIGHT - 1);
+		add(yi * BANK_GRID_WIDTH + xi);
+		add(yi * BANK_GRID_WIDTH + eucmodi(xi + 1, BANK_GRID_WIDTH));
+		add(eucmodi(yi + 1, BANK_GRID_HEIGHT) * BANK_GRID_WIDTH + xi);
+		add(eucmodi(yi + 1, BANK_GRID_HEIGHT) * BANK_GRID_WIDTH + eucmodi(xi + 1, BANK_GRID_WIDTH));
+	}
+	else {
+		int zi = clampi(morphZ, 0, BANK_LEN - 1);
+		add(zi);
+		add(zi + 1);
+	}
+	int urgent = len;
+	for (int j = 0; j < BANK_LEN; j++) {
+		add(j);
+	}
+
+	// Each stale wave with its invalidation count, which changes whenever the wave is edited again
+	ValidateRequest pending[BANK_LEN];
+	int pendingLen = 0;
+	int pendingUrgent = 0;
+	for (int i = 0; i < len; i++) {
+		const CowPtr<Wave> &wave = waves[order[i]];
+		uint32_t stale = __atomic_load_n(&wave->stale, __ATOMIC_ACQUIRE);
+		if (!(stale & WAVE_DERIVED_ALL))
+			continue;
+		pending[pendingLen].wave = wave.block;
+		pending[pendingLen].stale = stale;
+		pendingLen++;
+		if (i < urgent)
+			pendingUrgent = pendingLen;
+	}
+
+	std::lock_guard<std::mutex> lock(validateMutex);
+	if (!validateRunning)
+		return;
+	// Views call this every frame while anything is stale. The queue is only rebuilt if a wave was invalidated or replaced since it was built, or another stale wave is about to be played.
+	// Waves computed meanwhile just drop out of `pending`, which needs no new queue.
+	bool changed = false;
+	for (int i = 0; i < pendingLen && !changed; i++) {
+		auto end = (i < pendingUrgent) ? validateRequests.begin() + validateRequestsUrgent : validateRequests.end();
+		if (std::find(validateRequests.begin(), end, pending[i]) == end)
+			changed = true;
+	}
+	if (!changed)
+		return;
+	// Replace previous requests, the latest call knows best what is about to be played
+	validateRequests.assign(pending, pending + pendingLen);
+	validateRequestsUrgent = pendingUrgent;
+	validateQueue.clear();
+	for (int i = 0; i < pendingLen; i++) {
+		// Still held by this bank, so never empty
+		validateQueue.push_back(pending[i].wave.lock());
+	}
+	if (!validateQueue.empty())
+		validateCv.notify_one();
+}
+
+
+void Bank::renderFM(int waveId) {
+	Wave *wave = waves[waveId].write();
+	fm.render(carrier_wave->samples, modulator_wave->samples, wave->samples);
+	wave->commitSamples();
+}
+
+
 void Bank::swap(int i, int j) {
-	Wave tmp = waves[i];
-	waves[i] = waves[j];
-	waves[j] = tmp;
+	std::swap(waves[i], waves[j]);
 }
 
 
 void Bank::randomize() {
 	for (int i = 0; i < BANK_LEN; i++) {
-		waves[i].randomizeEffects();
+		waves[i].write()->randomizeEffects();
 	}
 }
 
-void Bank::morph() {
-	for (int i = 0; i < BANK_GRID_WIDTH; i++) {
-		for (int j = 1; j < BANK_GRID_HEIGHT; j++) {
-			waves[i * BANK_GRID_WIDTH + j].morphAllEffects(&waves[i * BANK_GRID_WIDTH], &waves[(i + 1) * BANK_GRID_WIDTH % BANK_LEN], ((float) j) / BANK_GRID_WIDTH);
+const char *morphModeNames[MORPH_MODES_LEN] {
+	"Z",
+	"Rows",
+	"Columns",
+	"Corners",
+};
+
+
+/** A wave to be set to a weighted sum of the effects of up to four key waves */
+struct MorphTarget {
+	int wave;
+	int keys[4];
+	float weights[4];
+};
+
+static void addLinearTarget(std::vector<MorphTarget> &targets, int wave, int from, int to, float fade) {
+	targets.push_back({wave, {from, to, from, from}, {1.f - fade, fade, 0.f, 0.f}});
+}
+
+void Bank::morph(MorphMode mode) {
+	std::vector<MorphTarget> targets;
+	targets.reserve(BANK_LEN);
+	switch (mode) {
+		case MORPH_Z: {
+			for (int i = 0; i < BANK_GRID_HEIGHT; i++) {
+				for (int j = 1; j < BANK_GRID_WIDTH; j++) {
+					addLinearTarget(targets, i * BANK_GRID_WIDTH + j, i * BANK_GRID_WIDTH, (i + 1) * BANK_GRID_WIDTH % BANK_LEN, ((float) j) / BANK_GRID_WIDTH);
+				}
+			}
+		} break;
+		case MORPH_ROWS: {
+			for (int i = 0; i < BANK_GRID_HEIGHT; i++) {
+				for (int j = 1; j < BANK_GRID_WIDTH - 1; j++) {
+					addLinearTarget(targets, i * BANK_GRID_WIDTH + j, i * BANK_GRID_WIDTH, i * BANK_GRID_WIDTH + BANK_GRID_WIDTH - 1, ((float) j) / (BANK_GRID_WIDTH - 1));
+				}
+			}
+		} break;
+		case MORPH_COLUMNS: {
+			for (int i = 1; i < BANK_GRID_HEIGHT - 1; i++) {
+				for (int j = 0; j < BANK_GRID_WIDTH; j++) {
+					addLinearTarget(targets, i * BANK_GRID_WIDTH + j, j, (BANK_GRID_HEIGHT - 1) * BANK_GRID_WIDTH + j, ((float) i) / (BANK_GRID_HEIGHT - 1));
+				}
+			}
+		} break;
+		case MORPH_BILINEAR: {
+			int corners[4] = {0, BANK_GRID_WIDTH - 1, (BANK_GRID_HEIGHT - 1) * BANK_GRID_WIDTH, BANK_LEN - 1};
+			for (int i = 0; i < BANK_GRID_HEIGHT; i++) {
+				for (int j = 0; j < BANK_GRID_WIDTH; j++) {
+					int wave = i * BANK_GRID_WIDTH + j;
+					if (wave == corners[0] || wave == corners[1] || wave == corners[2] || wave == corners[3])
+						continue;
+					float x = ((float) j) / (BANK_GRID_WIDTH - 1);
+					float y = ((float) i) / (BANK_GRID_HEIGHT - 1);
+					targets.push_back({wave, {corners[0], corners[1], corners[2], corners[3]}, {(1.f - x) * (1.f - y), x * (1.f - y), (1.f - x) * y, x * y}});
+				}
+			}
+		} break;
+		default: return;
+	}
+	int len = targets.size();
+
+	// Key waves are never targets, so all effects can be read up front and mixed in one pass over contiguous arrays
+	float keyEffects[BANK_LEN][EFFECTS_LEN];
+	float outEffects[BANK_LEN][EFFECTS_LEN];
+	for (int j = 0; j < BANK_LEN; j++) {
+		memcpy(keyEffects[j], waves[j]->effects, sizeof(float) * EFFECTS_LEN);
+	}
+	for (int t = 0; t < len; t++) {
+		const MorphTarget &target = targets[t];
+		const float *a = keyEffects[target.keys[0]];
+		const float *b = keyEffects[target.keys[1]];
+		const float *c = keyEffects[target.keys[2]];
+		const float *d = keyEffects[target.keys[3]];
+		float wa = target.weights[0], wb = target.weights[1], wc = target.weights[2], wd = target.weights[3];
+		for (int k = 0; k < EFFECTS_LEN; k++) {
+			outEffects[t][k] = wa * a[k] + wb * b[k] + wc * c[k] + wd * d[k];
 		}
 	}
+
+	// Detaching from history must happen on this thread, only the post arrays and mips are computed in parallel
+	Wave *targetWaves[BANK_LEN];
+	for (int t = 0; t < len; t++) {
+		Wave *wave = waves[targets[t].wave].write();
+		memcpy(wave->effects, outEffects[t], sizeof(float) * EFFECTS_LEN);
+		wave->updatePost();
+		targetWaves[t] = wave;
+	}
+	parallelFor(len, [&](int t) {
+		targetWaves[t]->validate(WAVE_POST | WAVE_MIPS);
+	});
 }
 
 void Bank::shuffle() {
@@ -285,261 +524,1065 @@ void Bank::shuffle() {
 
 void Bank::setSamples(const float *in) {
 	for (int j = 0; j < BANK_LEN; j++) {
-		memcpy(waves[j].samples, &in[j * WAVE_LEN], sizeof(float) * WAVE_LEN);
-		waves[j].commitSamples();
+		Wave *wave = waves[j].write();
+		memcpy(wave->samples, &in[j * WAVE_LEN], sizeof(float) * WAVE_LEN);
+		wave->commitSamples();
 	}
 }
 
 
 void Bank::getPostSamples(float *out) {
 	for (int j = 0; j < BANK_LEN; j++) {
-		memcpy(&out[j * WAVE_LEN], waves[j].postSamples, sizeof(float) * WAVE_LEN);
+		memcpy(&out[j * WAVE_LEN], waves[j]->getPostSamples(), sizeof(float) * WAVE_LEN);
 	}
 }
 
 
-void Bank::save(const char *filename) {
+/*
+Bank file layout, all values little-endian
+
+	char magic[4] = "WEBK"
+	uint32 version
+	uint16 format (WavetableFormatID)
+	uint16 reserved
+	uint16 WAVE_LEN
+	uint16 BANK_LEN
+
+followed by chunks, each starting with
+
+	char id[4]
+	uint32 size, not including the header or the padding to the next multiple of 4 bytes
+
+	SMPL	float samples[BANK_LEN][WAVE_LEN]
+	EFCT	uint32 count, float effects[BANK_LEN][count]
+	FLAG	uint8 flags[BANK_LEN], see BANK_FLAG_*
+	XMOD	uint32 count, float crossmod[count]
+	CARR	carrier wave, see writeBaseWave()
+	MODL	modulator wave
+	FMOP	uint32 count, then per operator float ratio, float level, uint32 source,
+		then float pm[count][count], float fm[count][count]
+
+Only source data is stored. Spectra, harmonics and post arrays are recomputed on load.
+Unknown chunks are skipped, and chunks with fewer entries than expected leave the rest cleared.
+Files saved by a build for another format are converted, see adoptWaves().
+*/
+
+#define BANK_FILE_VERSION 1
+
+const WavetableFormat wavetableFormats[WAVETABLE_FORMATS_LEN] = {
+	{"WaveEdit", 256, 64, 8},
+	{"PHMK2", 256, 256, 16},
+	{"Blofeld", 128, 64, 8},
+	{"Large", 2048, 256, 16},
+};
+
+#if WAVETABLE_FORMAT_WAVEEDIT
+const WavetableFormatID currentFormat = FORMAT_WAVEEDIT;
+#elif WAVETABLE_FORMAT_PHMK2
+const WavetableFormatID currentFormat = FORMAT_PHMK2;
+#elif WAVETABLE_FORMAT_BLOFELD
+const WavetableFormatID currentFormat = FORMAT_BLOFELD;
+#elif WAVETABLE_FORMAT_LARGE
+const WavetableFormatID currentFormat = FORMAT_LARGE;
+#endif
+
+enum {
+	BANK_FLAG_CYCLE = 1 << 0,
+	BANK_FLAG_NORMALIZE = 1 << 1,
+};
+
+static const int BANK_HEADER_LEN = 16;
+/** Number of float parameters in a base wave record, before the bytes and the shape/phasor arrays */
+static const int BASEWAVE_PARAMS_LEN = 16;
+
+// Stored values are copied as-is, so only little-endian hosts are supported, which covers every platform WaveEdit builds on.
+
+static void putBytes(std::vector<uint8_t> &buf, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t*) data;
+	buf.insert(buf.end(), p, p + len);
+}
+
+static void putU16(std::vector<uint8_t> &buf, uint16_t x) {
+	putBytes(buf, &x, sizeof(x));
+}
+
+static void putU32(std::vector<uint8_t> &buf, uint32_t x) {
+	putBytes(buf, &x, sizeof(x));
+}
+
+/** Writes a chunk header and returns the offset of its size field, to be filled in by endChunk() */
+static size_t beginChunk(std::vector<uint8_t> &buf, const char *id) {
+	putBytes(buf, id, 4);
+	putU32(buf, 0);
+	return buf.size() - 4;
+}
+
+static void endChunk(std::vector<uint8_t> &buf, size_t sizePos) {
+	uint32_t size = buf.size() - (sizePos + 4);
+	memcpy(&buf[sizePos], &size, sizeof(size));
+	while (buf.size() % 4)
+		buf.push_back(0);
+}
+
+static void writeBaseWave(std::vector<uint8_t> &buf, const BaseWave &baseWave) {
+	float params[BASEWAVE_PARAMS_LEN] = {
+		baseWave.lower_shape, baseWave.upper_shape,
+		baseWave.pulse_width, baseWave.brightness,
+		baseWave.bottom_angle, baseWave.bottom_magnitude,
+		baseWave.bottom_x, baseWave.bottom_y,
+		baseWave.top_angle, baseWave.top_magnitude,
+		baseWave.top_x, baseWave.top_y,
+		baseWave.bezier_ratio, baseWave.bezier_weight,
+		baseWave.resonance, 0.0,
+	};
+	putBytes(buf, params, sizeof(params));
+	uint8_t bytes[4] = {baseWave.lock_shapes, baseWave.is_frozen, (uint8_t) baseWave.multi_algo, 0};
+	putBytes(buf, bytes, sizeof(bytes));
+	putBytes(buf, baseWave.shape, sizeof(baseWave.shape));
+	putBytes(buf, baseWave.phasor, sizeof(baseWave.phasor));
+}
+
+static void readBaseWave(const uint8_t *data, size_t size, BaseWave *baseWave) {
+	const size_t recordLen = sizeof(float) * BASEWAVE_PARAMS_LEN + 4 + sizeof(float) * WAVE_LEN * 2;
+	if (size < recordLen)
+		return;
+	float params[BASEWAVE_PARAMS_LEN];
+	memcpy(params, data, sizeof(params));
+	data += sizeof(params);
+	baseWave->lower_shape = params[0];
+	baseWave->upper_shape = params[1];
+	baseWave->pulse_width = params[2];
+	baseWave->brightness = params[3];
+	baseWave->bottom_angle = params[4];
+	baseWave->bottom_magnitude = params[5];
+	baseWave->bottom_x = params[6];
+	baseWave->bottom_y = params[7];
+	baseWave->top_angle = params[8];
+	baseWave->top_magnitude = params[9];
+	baseWave->top_x = params[10];
+	baseWave->top_y = params[11];
+	baseWave->bezier_ratio = params[12];
+	baseWave->bezier_weight = params[13];
+	baseWave->resonance = params[14];
+	baseWave->lock_shapes = data[0];
+	baseWave->is_frozen = data[1];
+	baseWave->multi_algo = (MultiplicationAlgo) clampi(data[2], MUL_RESONANT, MUL_HARMONIC);
+	data += 4;
+	memcpy(baseWave->shape, data, sizeof(baseWave->shape));
+	data += sizeof(baseWave->shape);
+	memcpy(baseWave->phasor, data, sizeof(baseWave->phasor));
+}
+
+
+void Bank::serialize(std::vector<uint8_t> &buf) {
+	buf.clear();
+	buf.reserve(BANK_HEADER_LEN + sizeof(float) * BANK_LEN * (WAVE_LEN + EFFECTS_LEN) + sizeof(float) * WAVE_LEN * 4 + 1024);
+
+	putBytes(buf, "WEBK", 4);
+	putU32(buf, BANK_FILE_VERSION);
+	putU16(buf, currentFormat);
+	putU16(buf, 0);
+	putU16(buf, WAVE_LEN);
+	putU16(buf, BANK_LEN);
+
+	size_t chunk = beginChunk(buf, "SMPL");
+	for (int j = 0; j < BANK_LEN; j++) {
+		putBytes(buf, waves[j]->samples, sizeof(float) * WAVE_LEN);
+	}
+	endChunk(buf, chunk);
+
+	chunk = beginChunk(buf, "EFCT");
+	putU32(buf, EFFECTS_LEN);
+	for (int j = 0; j < BANK_LEN; j++) {
+		putBytes(buf, waves[j]->effects, sizeof(float) * EFFECTS_LEN);
+	}
+	endChunk(buf, chunk);
+
+	chunk = beginChunk(buf, "FLAG");
+	for (int j = 0; j < BANK_LEN; j++) {
+		buf.push_back((waves[j]->cycle ? BANK_FLAG_CYCLE : 0) | (waves[j]->normalize ? BANK_FLAG_NORMALIZE : 0));
+	}
+	endChunk(buf, chunk);
+
+	chunk = beginChunk(buf, "XMOD");
+	putU32(buf, CROSSMOD_LEN);
+	putBytes(buf, crossmod, sizeof(crossmod));
+	endChunk(buf, chunk);
+
+	chunk = beginChunk(buf, "FMOP");
+	putU32(buf, FM_OPERATORS_LEN);
+	for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+		putBytes(buf, &fm.operators[i].ratio, sizeof(float));
+		putBytes(buf, &fm.operators[i].level, sizeof(float));
+		putU32(buf, fm.operators[i].source);
+	}
+	putBytes(buf, fm.pm, sizeof(fm.pm));
+	putBytes(buf, fm.fm, sizeof(fm.fm));
+	endChunk(buf, chunk);
+
+	chunk = beginChunk(buf, "CARR");
+	writeBaseWave(buf, *carrier_wave);
+	endChunk(buf, chunk);
+
+	chunk = beginChunk(buf, "MODL");
+	writeBaseWave(buf, *modulator_wave);
+	endChunk(buf, chunk);
+}
+
+
+bool Bank::save(const char *filename) {
+	std::vector<uint8_t> buf;
+	serialize(buf);
 	FILE *f = fopen(filename, "wb");
 	if (!f)
+		return false;
+	bool success = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+	return (fclose(f) == 0) && success;
+}
+
+
+static void readFM(const uint8_t *data, size_t size, FMMatrix *fm) {
+	uint32_t count;
+	memcpy(&count, data, 4);
+	if (count > 64 || size < 4 + count * 12 + count * count * 8)
 		return;
-	fwrite(this, sizeof(*this), 1, f);
-	fclose(f);
+	const uint8_t *p = data + 4;
+	int len = mini(count, FM_OPERATORS_LEN);
+	for (int i = 0; i < (int) count; i++, p += 12) {
+		if (i >= len)
+			continue;
+		uint32_t source;
+		memcpy(&fm->operators[i].ratio, p, 4);
+		memcpy(&fm->operators[i].level, p + 4, 4);
+		memcpy(&source, p + 8, 4);
+		fm->operators[i].source = (FMSourceID) clampi(source, 0, FM_SOURCES_LEN - 1);
+	}
+	for (int m = 0; m < 2; m++) {
+		float (*matrix)[FM_OPERATORS_LEN] = m == 0 ? fm->pm : fm->fm;
+		for (int i = 0; i < len; i++) {
+			memcpy(matrix[i], p + 4 * count * i, 4 * len);
+		}
+		p += 4 * count * count;
+	}
+}
+
+
+/** Moves waves of the same length as this build's into the bank, only sharing the blocks */
+static void adoptWaves(Bank *bank, std::vector<CowPtr<Wave>> &waves) {
+	int len = mini(waves.size(), BANK_LEN);
+	for (int j = 0; j < len; j++) {
+		bank->waves[j] = waves[j];
+	}
+}
+
+/** Converts waves read from a file saved for another format
+Samples are resampled to WAVE_LEN, effects and flags are kept. Extra waves are dropped, missing waves are left cleared.
+*/
+template <int N>
+static void adoptWaves(Bank *bank, std::vector<CowPtr<WaveT<N>>> &waves) {
+	int len = mini(waves.size(), BANK_LEN);
+	for (int j = 0; j < len; j++) {
+		const WaveT<N> &src = *waves[j];
+		Wave *dst = bank->waves[j].write();
+		cyclicResample(src.samples, N, dst->samples, WAVE_LEN);
+		memcpy(dst->effects, src.effects, sizeof(dst->effects));
+		dst->cycle = src.cycle;
+		dst->normalize = src.normalize;
+	}
 }
 
+/** Reads the chunks of a bank file with L waves of N samples
+Base waves are only read if their length matches this build.
+*/
+template <int N, int L>
+static void readChunks(const uint8_t *data, size_t size, Bank *bank) {
+	std::vector<CowPtr<WaveT<N>>> waves(L);
+	size_t pos = BANK_HEADER_LEN;
+	while (pos + 8 <= size) {
+		const uint8_t *id = data + pos;
+		uint32_t chunkSize;
+		memcpy(&chunkSize, data + pos + 4, 4);
+		pos += 8;
+		if (chunkSize > size - pos)
+			break;
+		const uint8_t *chunk = data + pos;
+
+		if (!memcmp(id, "SMPL", 4)) {
+			size_t len = std::min<size_t>(chunkSize / (sizeof(float) * N), L);
+			for (size_t j = 0; j < len; j++) {
+				memcpy(waves[j].write()->samples, chunk + sizeof(float) * N * j, sizeof(float) * N);
+			}
+		}
+		else if (!memcmp(id, "EFCT", 4) && chunkSize >= 4) {
+			uint32_t count;
+			memcpy(&count, chunk, 4);
+			if (count > 0 && (chunkSize - 4) / sizeof(float) >= (size_t) count * L) {
+				for (int j = 0; j < L; j++) {
+					memcpy(waves[j].write()->effects, chunk + 4 + sizeof(float) * count * j, sizeof(float) * std::min<size_t>(count, EFFECTS_LEN));
+				}
+			}
+		}
+		else if (!memcmp(id, "FLAG", 4)) {
+			size_t len = std::min<size_t>(chunkSize, L);
+			for (size_t j = 0; j < len; j++) {
+				WaveT<N> *wave = waves[j].write();
+				wave->cycle = chunk[j] & BANK_FLAG_CYCLE;
+				wave->normalize = chunk[j] & BANK_FLAG_NORMALIZE;
+			}
+		}
+		else if (!memcmp(id, "XMOD", 4) && chunkSize >= 4) {
+			uint32_t count;
+			memcpy(&count, chunk, 4);
+			// The count comes from the file, so clamp it without converting to int
+			size_t len = std::min<size_t>({count, (chunkSize - 4) / sizeof(float), CROSSMOD_LEN});
+			memcpy(bank->crossmod, chunk + 4, sizeof(float) * len);
+		}
+		else if (!memcmp(id, "FMOP", 4) && chunkSize >= 4) {
+			readFM(chunk, chunkSize, &bank->fm);
+		}
+		else if (!memcmp(id, "CARR", 4) && N == WAVE_LEN) {
+			readBaseWave(chunk, chunkSize, bank->carrier_wave.write());
+		}
+		else if (!memcmp(id, "MODL", 4) && N == WAVE_LEN) {
+			readBaseWave(chunk, chunkSize, bank->modulator_wave.write());
+		}
+
+		pos += (chunkSize + 3) & ~3;
+	}
+	adoptWaves(bank, waves);
+}
+
+
+/** Field layout of the structs dumped by versions which saved the Bank with a single fwrite()
+Kept separate from Wave and BaseWave so those can change without breaking old autosave.dat files.
+Each of those versions was built for one format, so there is a layout per wave length.
+*/
+template <int N>
+struct LegacyWave {
+	float samples[N];
+	float spectrum[N];
+	float harmonics[N / 2];
+	float postSamples[N];
+	float postSpectrum[N];
+	float postHarmonics[N / 2];
+	float effects[21];
+	bool cycle;
+	bool normalize;
+};
+
+template <int N>
+struct LegacyBaseWave {
+	float lower_shape, upper_shape;
+	bool lock_shapes;
+	float pulse_width, brightness;
+	float bottom_angle, bottom_magnitude;
+	float bottom_x, bottom_y;
+	float top_angle, top_magnitude;
+	float top_x, top_y;
+	float bezier_ratio, bezier_weight;
+	float resonance;
+	bool is_frozen;
+	int32_t multi_algo;
+	float samples[N];
+	float shape[N];
+	float phasor[N];
+	float harmonics[N / 2];
+};
 
-void Bank::load(const char *filename) {
+/** Size of a struct dump of L waves of N samples, which is all that identifies one */
+template <int N, int L>
+static size_t legacyBankLen() {
+	return sizeof(LegacyWave<N>) * L + sizeof(LegacyBaseWave<N>) * 2 + sizeof(float) * (7 + N + N / 2);
+}
+
+template <int N>
+static void loadLegacyBaseWave(const uint8_t *data, BaseWave *baseWave) {
+	LegacyBaseWave<N> legacy;
+	memcpy(&legacy, data, sizeof(legacy));
+	baseWave->lower_shape = legacy.lower_shape;
+	baseWave->upper_shape = legacy.upper_shape;
+	baseWave->lock_shapes = legacy.lock_shapes;
+	baseWave->pulse_width = legacy.pulse_width;
+	baseWave->brightness = legacy.brightness;
+	baseWave->bottom_angle = legacy.bottom_angle;
+	baseWave->bottom_magnitude = legacy.bottom_magnitude;
+	baseWave->bottom_x = legacy.bottom_x;
+	baseWave->bottom_y = legacy.bottom_y;
+	baseWave->top_angle = legacy.top_angle;
+	baseWave->top_magnitude = legacy.top_magnitude;
+	baseWave->top_x = legacy.top_x;
+	baseWave->top_y = legacy.top_y;
+	baseWave->bezier_ratio = legacy.bezier_ratio;
+	baseWave->bezier_weight = legacy.bezier_weight;
+	baseWave->resonance = legacy.resonance;
+	baseWave->is_frozen = legacy.is_frozen;
+	baseWave->multi_algo = (MultiplicationAlgo) clampi(legacy.multi_algo, MUL_RESONANT, MUL_HARMONIC);
+	// Shapes of another length are left cleared, like the CARR and MODL chunks
+	if (N == WAVE_LEN) {
+		memcpy(baseWave->shape, legacy.shape, sizeof(baseWave->shape));
+		memcpy(baseWave->phasor, legacy.phasor, sizeof(baseWave->phasor));
+	}
+}
+
+/** Reads a struct dump of L waves of N samples, converting the waves like readChunks() */
+template <int N, int L>
+static void loadLegacy(Bank *bank, const uint8_t *data) {
+	std::vector<CowPtr<WaveT<N>>> waves(L);
+	for (int j = 0; j < L; j++) {
+		LegacyWave<N> legacy;
+		memcpy(&legacy, data, sizeof(legacy));
+		data += sizeof(legacy);
+		WaveT<N> *wave = waves[j].write();
+		memcpy(wave->samples, legacy.samples, sizeof(legacy.samples));
+		memcpy(wave->effects, legacy.effects, sizeof(float) * mini(21, EFFECTS_LEN));
+		wave->cycle = legacy.cycle;
+		wave->normalize = legacy.normalize;
+	}
+	adoptWaves(bank, waves);
+	loadLegacyBaseWave<N>(data, bank->carrier_wave.write());
+	data += sizeof(LegacyBaseWave<N>);
+	loadLegacyBaseWave<N>(data, bank->modulator_wave.write());
+	data += sizeof(LegacyBaseWave<N>);
+	memcpy(bank->crossmod, data, sizeof(float) * mini(7, CROSSMOD_LEN));
+}
+
+
+/** Returns the format a bank file was saved in, or -1 if it is not one */
+static int bankFormat(const uint8_t *data, size_t size) {
+	if (size >= BANK_HEADER_LEN && !memcmp(data, "WEBK", 4)) {
+		uint32_t version;
+		uint16_t format, waveLen, bankLen;
+		memcpy(&version, data + 4, 4);
+		memcpy(&format, data + 8, 2);
+		memcpy(&waveLen, data + 12, 2);
+		memcpy(&bankLen, data + 14, 2);
+		if (version > BANK_FILE_VERSION || format >= WAVETABLE_FORMATS_LEN || waveLen != wavetableFormats[format].waveLen || bankLen != wavetableFormats[format].bankLen)
+			return -1;
+		return format;
+	}
+	// Struct dumps of the four geometries all differ in size
+	if (size == legacyBankLen<256, 64>())
+		return FORMAT_WAVEEDIT;
+	if (size == legacyBankLen<256, 256>())
+		return FORMAT_PHMK2;
+	if (size == legacyBankLen<128, 64>())
+		return FORMAT_BLOFELD;
+	if (size == legacyBankLen<2048, 256>())
+		return FORMAT_LARGE;
+	return -1;
+}
+
+int bankFileFormat(const char *filename) {
+	size_t size;
+	const uint8_t *data = mapFile(filename, &size);
+	if (!data)
+		return -1;
+	int format = bankFormat(data, size);
+	unmapFile(data, size);
+	return format;
+}
+
+
+bool Bank::load(const char *filename) {
 	clear();
 
-	FILE *f = fopen(filename, "rb");
-	if (!f)
-		return;
-	int ignored __attribute__((unused));
-	ignored = fread(this, sizeof(*this), 1, f);
-	fclose(f);
+	size_t size;
+	const uint8_t *data = mapFile(filename, &size);
+	if (!data)
+		return false;
+
+	// Dispatch to the reader compiled for the file's geometry
+	int format = bankFormat(data, size);
+	bool chunked = size >= 4 && !memcmp(data, "WEBK", 4);
+	switch (format) {
+		case FORMAT_WAVEEDIT:
+			if (chunked)
+				readChunks<256, 64>(data, size, this);
+			else
+				loadLegacy<256, 64>(this, data);
+			break;
+		case FORMAT_PHMK2:
+			if (chunked)
+				readChunks<256, 256>(data, size, this);
+			else
+				loadLegacy<256, 256>(this, data);
+			break;
+		case FORMAT_BLOFELD:
+			if (chunked)
+				readChunks<128, 64>(data, size, this);
+			else
+				loadLegacy<128, 64>(this, data);
+			break;
+		case FORMAT_LARGE:
+			if (chunked)
+				readChunks<2048, 256>(data, size, this);
+			else
+				loadLegacy<2048, 256>(this, data);
+			break;
+		default:
+			unmapFile(data, size);
+			return false;
+	}
+	unmapFile(data, size);
 
+	// Recompute derived data
+	carrier_wave.write()->renderSamples();
+	modulator_wave.write()->renderSamples();
+	renderCrossmod();
 	for (int j = 0; j < BANK_LEN; j++) {
-		waves[j].commitSamples();
+		waves[j].write()->commitSamples();
 	}
+	return true;
 }
 
 
-void Bank::saveWAV(const char *filename) {
+bool Bank::saveWAV(const char *filename) {
 	SF_INFO info;
 	info.samplerate = 44100;
 	info.channels = 1;
-	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
+	info.format = soundFileFormat(filename);
 	SNDFILE *sf = sf_open(filename, SFM_WRITE, &info);
 	if (!sf)
-		return;
-
-	for (int j = 0; j < BANK_LEN; j++) {
-		sf_write_float(sf, waves[j].postSamples, WAVE_LEN);
+		return false;
+
+	bool success = true;
+	for (int j = 0; j < BANK_LEN && success; j++) {
+		if (!ioProgress((float) j / BANK_LEN))
+			success = false;
+		else
+			success = sf_write_float(sf, waves[j]->getPostSamples(), WAVE_LEN) == WAVE_LEN;
 	}
 
-	sf_close(sf);
+	return (sf_close(sf) == 0) && success;
 }
 
 
-void Bank::loadWAV(const char *filename) {
+bool Bank::loadWAV(const char *filename) {
 	clear();
 
+	MappedWAV wav;
+	if (wav.open(filename)) {
+		size_t len = wav.frames * wav.channels;
+		for (int i = 0; i < BANK_LEN; i++) {
+			Wave *wave = waves[i].write();
+			size_t offset = (size_t) i * WAVE_LEN;
+			if (offset < len)
+				wav.read(wave->samples, offset, std::min((size_t) WAVE_LEN, len - offset));
+			wave->commitSamples();
+		}
+		wav.close();
+		return true;
+	}
+
 	SF_INFO info;
 	SNDFILE *sf = sf_open(filename, SFM_READ, &info);
 	if (!sf)
-		return;
+		return false;
 
 	for (int i = 0; i < BANK_LEN; i++) {
-		sf_read_float(sf, waves[i].samples, WAVE_LEN);
-		waves[i].commitSamples();
+		Wave *wave = waves[i].write();
+		sf_read_float(sf, wave->samples, WAVE_LEN);
+		wave->commitSamples();
 	}
 
 	sf_close(sf);
+	return true;
+}
+
+
+bool Bank::saveWAVTable(const char *filename, int frameLen) {
+	std::vector<float> post(BANK_LEN * WAVE_LEN);
+	getPostSamples(post.data());
+	std::vector<float> table((size_t) BANK_LEN * frameLen);
+	if (frameLen == WAVE_LEN)
+		table = post;
+	else
+		cyclicResample(post.data(), WAVE_LEN, table.data(), frameLen, BANK_LEN);
+	if (!ioProgress(0.5))
+		return false;
+
+	SF_INFO info;
+	info.samplerate = 44100;
+	info.channels = 1;
+	info.format = soundFileFormat(filename);
+	SNDFILE *sf = sf_open(filename, SFM_WRITE, &info);
+	if (!sf)
+		return false;
+	bool success = sf_write_float(sf, table.data(), table.size()) == (sf_count_t) table.size();
+	return (sf_close(sf) == 0) && success;
 }
 
 
-void Bank::saveWaves(const char *dirname) {
-	for (int b = 0; b < BANK_LEN; b++) {
-		char filename[1024];
-		snprintf(filename, sizeof(filename), "%s/%02d.wav", dirname, b);
+bool Bank::loadWAVTable(const char *filename, int frameLen) {
+	int len;
+	float *audio = loadAudio(filename, &len);
+	if (!audio)
+		return false;
 
-		waves[b].saveWAV(filename);
+	clear();
+	// A partial frame at the end is dropped, missing frames are left cleared
+	int frames = mini(len / frameLen, BANK_LEN);
+	if (frames == 0) {
+		delete[] audio;
+		return false;
+	}
+	std::vector<float> table(frames * WAVE_LEN);
+	if (frameLen == WAVE_LEN)
+		memcpy(table.data(), audio, sizeof(float) * table.size());
+	else
+		cyclicResample(audio, frameLen, table.data(), WAVE_LEN, frames);
+	delete[] audio;
+
+	for (int i = 0; i < frames; i++) {
+		Wave *wave = waves[i].write();
+		memcpy(wave->samples, &table[i * WAVE_LEN], sizeof(float) * WAVE_LEN);
+		wave->commitSamples();
 	}
+	return true;
 }
 
-#if WAVETABLE_FORMAT_PHMK2
-void Bank::saveROM(const char *filename) {
-	FILE *f = fopen(filename, "w");
 
-	if (!f)
-        	return;
-	
-	char line[43];
-	char byte[4];
-	char index[5];
-	int checksum;
-	char checksum_str[3];
-	
+int Bank::saveWaves(const char *dirname, int start, int end, int threads, bool sync, std::string *errors) {
+	start = clampi(start, 0, BANK_LEN);
+	end = clampi(end, start, BANK_LEN);
+	int count = end - start;
+	if (count == 0)
+		return 0;
+
+	std::vector<std::string> filenames(count);
+	// 0 = not written, 1 = written, -1 = failed
+	std::vector<int> status(count, 0);
+	std::atomic<int> written(0);
+	std::atomic<bool> cancelled(false);
+	// Each file is small, so the time goes into opening and closing it and overlapping those hides the latency of slow disks and network shares
+	parallelFor(count, [&](int i) {
+		if (cancelled)
+			return;
+		// Only reports from the I/O thread itself, which is one of the workers
+		if (!ioProgress((float) written / count)) {
+			cancelled = true;
+			return;
+		}
+		filenames[i] = stringf("%s/%02d.wav", dirname, start + i);
+		status[i] = waves[start + i]->saveWAV(filenames[i].c_str()) ? 1 : -1;
+		written++;
+	}, threads);
+
+	if (sync && !cancelled) {
+		// One pass over the finished files lets the disk batch the flushes instead of waiting on each file as it is written
+		parallelFor(count, [&](int i) {
+			if (status[i] == 1 && !syncFile(filenames[i].c_str()))
+				status[i] = -1;
+		}, threads);
+#if !defined(_WIN32)
+		syncFile(dirname);
+#endif
+	}
+
+	int failures = 0;
+	for (int i = 0; i < count; i++) {
+		if (status[i] >= 0)
+			continue;
+		failures++;
+		if (errors) {
+			*errors += filenames[i];
+			*errors += "\n";
+		}
+	}
+	return failures;
+}
+
+#if WAVETABLE_FORMAT_PHMK2
+/** Fills `image` with BANK_LEN * WAVE_LEN unsigned 8-bit post samples */
+static void getROMImage(const Bank &bank, uint8_t *image) {
 	for (int i = 0; i < BANK_LEN; i++) {
-		for (int j = 0; j < WAVE_LEN / HEX_LINE_WIDTH * 2; j++) {
-                        strcpy(line, "10");
-			sprintf(index, "%04X", (i * 16 + j) * 16);
-			strcat(line, index);
-			strcat(line, "00");
-			for (int k = 0; k < HEX_LINE_WIDTH / 2; k++) {
-				sprintf(byte, "%02X", (uint8_t) rescalef(waves[i].postSamples[j * HEX_LINE_WIDTH / 2 + k], -1.0, 1.0, 0.0, 255.0));
-				strcat(line, byte);
-			};
-			checksum = 0;
-			
-			for (size_t l = 0; l < strlen(line) / 2; l++) {
-				strncpy(byte, line + l * 2, 2);
-				checksum += strtol(byte, NULL, 16);
-				checksum &= 0xFF;
-			};
-			checksum = (0x100 - checksum) & 0xFF;
-			sprintf(checksum_str, "%02X", checksum);
-			strcat(line, checksum_str);
-			fprintf(f, ":%s\n", line);
-		};
+		if (!ioProgress((float) i / BANK_LEN))
+			return;
+		const float *post = bank.waves[i]->getPostSamples();
+		for (int j = 0; j < WAVE_LEN; j++) {
+			image[i * WAVE_LEN + j] = romSample(post[j]);
+		}
 	}
+}
 
-	fprintf(f, ":00000001FF\n");
-	fclose(f);
+
+bool Bank::saveROM(const char *filename) {
+	FILE *f = fopen(filename, "w");
+	if (!f)
+		return false;
+
+	std::vector<uint8_t> image(BANK_LEN * WAVE_LEN);
+	getROMImage(*this, image.data());
+	bool success = ihexWrite(f, image.data(), image.size(), HEX_LINE_WIDTH / 2);
+	return (fclose(f) == 0) && success;
 }
 
 
-void Bank::loadROM(const char *filename) {
+bool Bank::loadROM(const char *filename) {
 	FILE *f = fopen(filename, "r");
-
 	if (!f)
-        	return;
+		return false;
 
-	char * line = NULL;
-	size_t len = 0;
-	ssize_t read;
-	int data;
-	char byte[2];
-	
-	clear();
+	// Decode the whole file before touching the bank so a corrupt ROM leaves it intact
+	std::vector<uint8_t> image(BANK_LEN * WAVE_LEN, 0x80);
+	size_t written;
+	bool success = ihexRead(f, image.data(), image.size(), &written);
+	fclose(f);
+	if (!success || written == 0)
+		return false;
 
+	clear();
 	for (int i = 0; i < BANK_LEN; i++) {
-		for (int j = 0; j < WAVE_LEN / HEX_LINE_WIDTH * 2; j++) {
-			while ((getline(&line, &len, f)) != -1) {
-				if ((line[7] != '0') || (line[8] != '0'))
-					continue;
-				for (int k = 0; k < HEX_LINE_WIDTH / 2; k+= 1) {
-					byte[0] = line[k * 2 + 9];
-					byte[1] = line[k * 2 + 10];
-					waves[i].samples[j * HEX_LINE_WIDTH / 2 + k] = rescalef(float(strtol(byte, NULL, 16)), 0.0, 255.0, -1.0, 1.0);
-				};
-				break;
-			}
-		};
-		waves[i].commitSamples();
+		Wave *wave = waves[i].write();
+		for (int j = 0; j < WAVE_LEN; j++) {
+			wave->samples[j] = rescalef(image[i * WAVE_LEN + j], 0.0, 255.0, -1.0, 1.0);
+		}
+		wave->commitSamples();
 	}
+	return true;
+}
 
-	fclose(f);
-	if (line)
-		free(line);
+
+bool Bank::saveROMBinary(const char *filename) {
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	std::vector<uint8_t> image(BANK_LEN * WAVE_LEN);
+	getROMImage(*this, image.data());
+	bool success = fwrite(image.data(), 1, image.size(), f) == image.size();
+	return (fclose(f) == 0) && success;
 }
 #endif
 
 #if WAVETABLE_FORMAT_BLOFELD
-void Bank::saveBlofeldWavetable(const char *filename){
-	MidiFile outfile(filename);
-	outfile.clear();
-	outfile.setTicksPerQuarterNote(100);
-	
-	int slot = 0;
+void getBlofeldName(const char *filename, char *name, int *slot) {
+	memset(name, ' ', 14);
+	*slot = 0;
 	char *fn = strdup(filename);
-	char *base = basename(fn);
-	free(fn);
-	char name[15] = "              ";
-	if (strlen(base) > 1) {
-		int first_char = 0;
+	const char *base = basename(fn);
+	int len = strlen(base);
+	if (len > 1) {
+		int first = 0;
 		if (base[0] >= '0' && base[0] <= '9' && base[1] >= '0' && base[1] <= '9') {
-			char buf[3];
-			strncpy(buf, base, 2);
-			buf[2] = '\0';
-			slot = atoi(buf);
-			slot = mini(38, slot);
-			first_char = 2;
-		};
-		for (int i = first_char; i < mini(first_char + 14, strlen(base)); i++){
+			*slot = mini((base[0] - '0') * 10 + (base[1] - '0'), BLOFELD_SLOTS - 1);
+			first = 2;
+		}
+		for (int i = first; i < mini(first + 14, len); i++) {
 			if (base[i] == '.')
 				break;
-			name[i - first_char] = base[i];
+			name[i - first] = base[i];
 		}
 	}
 	else {
-		strcpy(name, "Untitled      ");
-	};
-	
-	for (int wave = 0; wave < BANK_LEN; wave++) {
-		std::vector<uchar> mm(410);
-		mm[0] = 0xf0; // SysEx
-		mm[1] = 0x3e; // Waldorf ID
-		mm[2] = 0x13; // Blofeld ID
-		mm[3] = 0x00; // Device ID
-		mm[4] = 0x12; // Wavetable Dump
-		mm[5] = 0x50 + slot; // Wavetable Number
-		mm[6] = wave & 0x7f; // Wave Number
-		mm[7] = 0x00; // Format
-		printf("%x %x %x %x %x %x %x %x\n", mm[0], mm[1], mm[2], mm[3], mm[4], mm[5], mm[6], mm[7]);
-		//f0 3e 13 0 12 50 11 0
-
-		// actual samples
-		for (int i = 0; i < WAVE_LEN; i++){
-			int32_t sample = (int32_t) ((clampf(waves[wave].postSamples[i], -1.0, 1.0)) * 1048575.0);
-			mm[8  + 3 * i] = (sample >> 14) & 0x7f;
-			mm[9  + 3 * i] = (sample >>  7) & 0x7f;
-			mm[10 + 3 * i] = (sample      ) & 0x7f;
+		memcpy(name, "Untitled", 8);
+	}
+	free(fn);
+}
+
+
+void packBlofeldWave(uint8_t *msg, const int32_t *samples, int slot, int wave, const char *name) {
+	msg[0] = 0xf0; // SysEx
+	msg[1] = 0x3e; // Waldorf ID
+	msg[2] = 0x13; // Blofeld ID
+	msg[3] = 0x00; // Device ID
+	msg[4] = 0x12; // Wavetable Dump
+	msg[5] = BLOFELD_SLOT_OFFSET + slot; // Wavetable Number
+	msg[6] = wave & 0x7f; // Wave Number
+	msg[7] = 0x00; // Format
+	// 21-bit signed samples, 7 bits per byte
+	for (int i = 0; i < WAVE_LEN; i++) {
+		int32_t sample = samples[i];
+		msg[8 + 3 * i] = (sample >> 14) & 0x7f;
+		msg[9 + 3 * i] = (sample >> 7) & 0x7f;
+		msg[10 + 3 * i] = sample & 0x7f;
+	}
+	for (int i = 0; i < 14; i++) {
+		msg[392 + i] = name[i] & 0x7f;
+	}
+	msg[406] = 0x00; // Reserved
+	msg[407] = 0x00; // Reserved
+	uint32_t checksum = 0;
+	for (int i = 7; i < 407; i++) {
+		checksum += msg[i];
+	}
+	msg[408] = checksum & 0x7f;
+	msg[409] = 0xf7; // End
+}
+
+
+/** Decodes a wave dump message of `len` bytes starting at F0. Returns false if it is not a well-formed Blofeld wave dump */
+static bool parseBlofeldWave(const uint8_t *msg, size_t len, float *samples, int *slot, int *wave) {
+	if (len < BLOFELD_MESSAGE_LEN)
+		return false;
+	if (msg[0] != 0xf0 || msg[1] != 0x3e || msg[2] != 0x13 || msg[4] != 0x12 || msg[409] != 0xf7)
+		return false;
+	uint32_t checksum = 0;
+	for (int i = 7; i < 407; i++) {
+		checksum += msg[i];
+	}
+	if ((checksum & 0x7f) != msg[408])
+		return false;
+
+	*slot = msg[5] - BLOFELD_SLOT_OFFSET;
+	*wave = msg[6];
+	for (int i = 0; i < WAVE_LEN; i++) {
+		int32_t sample = (msg[8 + 3 * i] << 14) | (msg[9 + 3 * i] << 7) | msg[10 + 3 * i];
+		// Sign extend from 21 bits
+		if (sample & 0x00100000)
+			sample |= 0xfff00000;
+		samples[i] = clampf(sample / 1048575.0, -1.0, 1.0);
+	}
+	return true;
+}
+
+
+/** Streams wavetable dumps of one or more slots to a raw .syx file, or to a single track standard MIDI file for any other extension */
+struct BlofeldWriter {
+	FILE *f = NULL;
+	bool smf = false;
+	long trackStart = 0;
+	int events = 0;
+	/** One wavetable worth of messages, each with room for the MIDI delta time and length */
+	uint8_t buffer[BANK_LEN * (BLOFELD_MESSAGE_LEN + 3)];
+
+	bool open(const char *filename) {
+		f = fopen(filename, "wb");
+		if (!f)
+			return false;
+		const char *ext = strrchr(filename, '.');
+		smf = !(ext && strcasecmp(ext, ".syx") == 0);
+		if (smf) {
+			// Format 0, one track, 100 ticks per quarter note
+			static const uint8_t header[] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 100};
+			static const uint8_t track[] = {'M', 'T', 'r', 'k', 0, 0, 0, 0};
+			fwrite(header, 1, sizeof(header), f);
+			fwrite(track, 1, sizeof(track), f);
+			trackStart = ftell(f);
+		}
+		return true;
+	}
+
+	void write(const Bank &bank, int slot, const char *name) {
+		uint8_t *p = buffer;
+		for (int wave = 0; wave < BANK_LEN; wave++) {
+			int32_t samples[WAVE_LEN];
+			const float *post = bank.waves[wave]->getPostSamples();
+			for (int i = 0; i < WAVE_LEN; i++) {
+				samples[i] = blofeldSample(post[i]);
+			}
+			if (smf) {
+				// One tick apart, then F0 and the remaining length as a variable length quantity
+				uint8_t msg[BLOFELD_MESSAGE_LEN];
+				packBlofeldWave(msg, samples, slot, wave, name);
+				*p++ = events > 0 ? 1 : 0;
+				*p++ = 0xf0;
+				*p++ = 0x80 | ((BLOFELD_MESSAGE_LEN - 1) >> 7);
+				*p++ = (BLOFELD_MESSAGE_LEN - 1) & 0x7f;
+				memcpy(p, msg + 1, BLOFELD_MESSAGE_LEN - 1);
+				p += BLOFELD_MESSAGE_LEN - 1;
+			}
+			else {
+				packBlofeldWave(p, samples, slot, wave, name);
+				p += BLOFELD_MESSAGE_LEN;
+			}
+			events++;
+		}
+		fwrite(buffer, 1, p - buffer, f);
+	}
+
+	/** Returns false if anything failed to be written */
+	bool close() {
+		if (smf) {
+			// End of track, then patch the track length
+			static const uint8_t end[] = {0, 0xff, 0x2f, 0};
+			fwrite(end, 1, sizeof(end), f);
+			uint32_t len = ftell(f) - trackStart;
+			uint8_t lenBytes[4] = {(uint8_t) (len >> 24), (uint8_t) (len >> 16), (uint8_t) (len >> 8), (uint8_t) len};
+			fseek(f, trackStart - 4, SEEK_SET);
+			fwrite(lenBytes, 1, 4, f);
 		}
+		bool success = !ferror(f);
+		success = (fclose(f) == 0) && success;
+		f = NULL;
+		return success;
+	}
+};
+
+
+static uint32_t readVarLen(const uint8_t *&p, const uint8_t *end) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4 && p < end; i++) {
+		uint8_t c = *p++;
+		value = (value << 7) | (c & 0x7f);
+		if (!(c & 0x80))
+			break;
+	}
+	return value;
+}
+
 
-		// wavetable name
-		for (int i = 0; i < 14; i++){
-			mm[392 + i] = name[i] & 0x7f;
+/** Calls `f(msg, len)` for every SysEx message in a raw .syx or standard MIDI file, pointing directly into `data`.
+MIDI file messages do not include their F0 status byte, so `msg` points at the byte after it.
+*/
+static void forEachSysex(const uint8_t *data, size_t size, const std::function<void(const uint8_t*, size_t, bool)> &f) {
+	const uint8_t *end = data + size;
+	if (size >= 14 && memcmp(data, "MThd", 4) == 0) {
+		const uint8_t *p = data;
+		while (end - p >= 8) {
+			uint32_t len = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+			const uint8_t *chunk = p + 8;
+			const uint8_t *chunkEnd = (size_t) (end - chunk) < len ? end : chunk + len;
+			if (memcmp(p, "MTrk", 4) == 0) {
+				const uint8_t *q = chunk;
+				uint8_t status = 0;
+				while (q < chunkEnd) {
+					readVarLen(q, chunkEnd);
+					if (q >= chunkEnd)
+						break;
+					if (*q & 0x80)
+						status = *q++;
+					if (status == 0xf0 || status == 0xf7) {
+						uint32_t msgLen = readVarLen(q, chunkEnd);
+						if ((size_t) (chunkEnd - q) < msgLen)
+							break;
+						if (status == 0xf0)
+							f(q, msgLen, true);
+						q += msgLen;
+						status = 0;
+					}
+					else if (status == 0xff) {
+						if (q >= chunkEnd)
+							break;
+						q++;
+						uint32_t msgLen = readVarLen(q, chunkEnd);
+						if ((size_t) (chunkEnd - q) < msgLen)
+							break;
+						q += msgLen;
+						status = 0;
+					}
+					else if (status >= 0x80) {
+						q += ((status & 0xf0) == 0xc0 || (status & 0xf0) == 0xd0) ? 1 : 2;
+					}
+					else {
+						// Data byte without running status
+						break;
+					}
+				}
+			}
+			p = chunkEnd;
+		}
+	}
+	else {
+		const uint8_t *p = data;
+		while ((p = (const uint8_t*) memchr(p, 0xf0, end - p))) {
+			const uint8_t *msgEnd = (const uint8_t*) memchr(p, 0xf7, end - p);
+			if (!msgEnd)
+				break;
+			f(p, msgEnd + 1 - p, false);
+			p = msgEnd + 1;
 		}
+	}
+}
 
-		mm[406] = 0x0; // Reserved
-		mm[407] = 0x0; // Reserved
 
-		int checksum = std::accumulate(mm.begin() + 7, mm.begin() + 407, 0);
-		printf("%i\n", checksum);
-		mm[408] = checksum & 0x7f;
-		mm[409] = 0xf7; // End
+bool Bank::saveBlofeldWavetable(const char *filename) {
+	char name[14];
+	int slot;
+	getBlofeldName(filename, name, &slot);
 
-		outfile.addEvent(0, wave, mm);
+	BlofeldWriter *writer = new BlofeldWriter();
+	bool success = writer->open(filename);
+	if (success) {
+		writer->write(*this, slot, name);
+		success = writer->close();
 	}
+	delete writer;
+	return success;
+}
 
-	outfile.write(filename);
-	
-};
 
-void Bank::loadBlofeldWavetable(const char *filename){
-	MidiFile infile(filename);
-	float samples[WAVE_LEN] = {};
-	int wave = 0;
-	for (int i = 0; i < infile.getEventCount(0) && wave < BANK_LEN; i++) {
-		MidiEvent event = infile.getEvent(0, i);
-		printf("%x %x %x %x %x %x %x %x\n", event[0], event[1], event[2], event[3], event[4], event[5], event[6], event[7]);
-		if (event[0] != 0xf0 || event[1] != 0x3e || event[2] != 0x13 || event[3] != 0x00 || event[4] != 0x12)
-			continue;
-		for (int j = 0; j < WAVE_LEN; j++){
-			int32_t sample = (
-				((int32_t)(event[8  + 3 * j]) << 14) |
-				((int32_t)(event[9  + 3 * j]) << 7) |
-				((int32_t)(event[10 + 3 * j]))
-			);
-			if (sample &  0x00100000) 
-				sample |= 0xfff00000;
-			waves[wave].samples[j] = clampf(((float) sample) / 1048575.0, -1.0, 1.0);
-			if (wave == 0) printf("%i %x,%x,%x %i %f\n", j, event[8 + 3 * j], event[9 + 3 * j], event[10 + 3 * j], sample, waves[wave].samples[j]);
+bool Bank::loadBlofeldWavetable(const char *filename, int slot) {
+	size_t size;
+	const uint8_t *data = mapFile(filename, &size);
+	if (!data)
+		return false;
+
+	// Decode everything first so a file without a matching dump leaves the bank intact
+	std::vector<float> samples(BANK_LEN * WAVE_LEN);
+	bool found = false;
+	// A message rebuilt with its F0, for MIDI files
+	uint8_t msg[BLOFELD_MESSAGE_LEN];
+	forEachSysex(data, size, [&](const uint8_t *p, size_t len, bool stripped) {
+		if (stripped) {
+			if (len + 1 != BLOFELD_MESSAGE_LEN)
+				return;
+			msg[0] = 0xf0;
+			memcpy(msg + 1, p, len);
+			p = msg;
+			len++;
 		}
-		
-		int checksum = std::accumulate(event.begin() + 7, event.begin() + 407, 0);
-		waves[wave].commitSamples();
-		wave++;
+		float wave[WAVE_LEN];
+		int msgSlot, msgWave;
+		if (!parseBlofeldWave(p, len, wave, &msgSlot, &msgWave))
+			return;
+		// Take the first slot in the file unless one was asked for
+		if (slot < 0)
+			slot = msgSlot;
+		if (msgSlot != slot || msgWave >= BANK_LEN)
+			return;
+		memcpy(&samples[msgWave * WAVE_LEN], wave, sizeof(wave));
+		found = true;
+	});
+	unmapFile(data, size);
+	if (!found)
+		return false;
+
+	clear();
+	for (int i = 0; i < BANK_LEN; i++) {
+		Wave *wave = waves[i].write();
+		memcpy(wave->samples, &samples[i * WAVE_LEN], sizeof(wave->samples));
+		wave->commitSamples();
 	}
-};
+	return true;
+}
+
+
+void saveBlofeldDump(const char *filename, const char *dirname) {
+	DIR *dir = opendir(dirname);
+	if (!dir)
+		return;
+	std::vector<std::string> paths;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		const char *ext = strrchr(entry->d_name, '.');
+		if (entry->d_name[0] != '.' && ext && strcasecmp(ext, ".wav") == 0)
+			paths.push_back(stringf("%s/%s", dirname, entry->d_name));
+	}
+	closedir(dir);
+	std::sort(paths.begin(), paths.end());
+	if (paths.empty())
+		return;
+
+	BlofeldWriter *writer = new BlofeldWriter();
+	Bank *bank = new Bank();
+	if (writer->open(filename)) {
+		int count = mini(paths.size(), BLOFELD_SLOTS);
+		for (int i = 0; i < count; i++) {
+			if (!ioProgress((float) i / count))
+				break;
+			char name[14];
+			int slot;
+			getBlofeldName(paths[i].c_str(), name, &slot);
+			bank->loadWAV(paths[i].c_str());
+			// Slots follow the sorted file order
+			writer->write(*bank, i, name);
+		}
+		writer->close();
+	}
+	delete bank;
+	delete writer;
+}
 #endif
+
+} // namespace WAVETABLE_NAMESPACE
@@ -1,8 +1,7 @@
 #include "WaveEdit.hpp"
 #include <string.h>
 
-
-Oscillator osc;
+namespace WAVETABLE_NAMESPACE {
 
 
 void BaseWave::clear() {
@@ -26,7 +25,8 @@ void BaseWave::clear() {
 	multi_algo = MUL_RESONANT;
 	updateShape();
 	updatePhasor();
-	generateSamples(false);
+	// Only render, the owning bank may not be currentBank and resets its own waves
+	renderSamples();
 }
 
 
@@ -48,6 +48,8 @@ void BaseWave::updateShape() {
 	flshape = fmod(flshape, 1.0);
 	fushape = fmod(fushape, 1.0);
 
+	// Local, since banks are loaded on other threads than the UI
+	Oscillator osc;
 	osc.dt = powf(2.0, (1.0 - clampf(brightness, 0.0, 1.0)) * 4) / (float) WAVE_LEN;
 	osc.pulse_width = clampf(pulse_width, 0.0, 1.0);	
 	osc.render(
@@ -155,6 +157,14 @@ void BaseWave::updatePhasor() {
 
 // Apply phasor to base wave shape
 void BaseWave::generateSamples(bool update_waves) {
+	renderSamples();
+	//updateSamples(update_waves);
+
+	currentBank.updateCrossmod();
+};
+
+
+void BaseWave::renderSamples() {
 	const int MAX_RESONANCE = 4;
 	float tmp[WAVE_LEN + 1];
 	memcpy(tmp, phasor, sizeof(float) * WAVE_LEN);
@@ -229,18 +239,15 @@ void BaseWave::generateSamples(bool update_waves) {
 		harmonics[i] = hypotf(tmp[2 * i], tmp[2 * i + 1]) * 2.0;
 	};
 	memcpy(samples, tmp_samples, sizeof(float) * WAVE_LEN);
-
-	//updateSamples(update_waves);
-    
-    currentBank.updateCrossmod();
 };
 
 
 void BaseWave::updateSamples(bool copy_samples) {
 	for (int j = 0; j < BANK_LEN; j++) {
+		Wave *wave = currentBank.waves[j].write();
 		if (copy_samples)
-			memcpy(currentBank.waves[j].samples, samples, sizeof(float) * WAVE_LEN);
-		currentBank.waves[j].commitSamples();
+			memcpy(wave->samples, samples, sizeof(float) * WAVE_LEN);
+		wave->commitSamples();
 	}
 };
 
@@ -249,3 +256,5 @@ void BaseWave::loadSamples(const Wave& wave){
 	//updatePhasor();
 	generateSamples(false);
 };
+
+} // namespace WAVETABLE_NAMESPACE
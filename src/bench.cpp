@@ -0,0 +1,617 @@
+#include "WaveEdit.hpp"
+#include <samplerate.h>
+#include <chrono>
+#include <complex>
+#include <algorithm>
+
+namespace WAVETABLE_NAMESPACE {
+
+
+static double getTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+struct BenchSettings {
+	int sampleRate = 44100;
+	int bufferSize = 1024;
+	/** Seconds of audio rendered for each measurement */
+	double duration = 60.0;
+};
+
+
+/** Band-limited saws, every other one darker, and a cosine last, whose first sample after silence is never zero */
+static void benchBank(Bank &bank) {
+	bank.clear();
+	for (int w = 0; w < BANK_LEN; w++) {
+		Wave *wave = bank.waves[w].write();
+		for (int k = 0; k < WAVE_LEN; k++) {
+			double x = 0.0;
+			if (w == BANK_LEN - 1) {
+				x = cos(2 * M_PI * k / WAVE_LEN);
+			}
+			else {
+				for (int h = 1; h < WAVE_LEN / 2; h++) {
+					x += sin(2 * M_PI * h * k / WAVE_LEN) / h * ((w % 2) ? 1.0 : 1.0 / (1 + h * 0.01)) * 0.5;
+				}
+			}
+			wave->samples[k] = x;
+		}
+		wave->normalize = false;
+		wave->commitSamples();
+	}
+	bank.renderCrossmod();
+	for (int w = 0; w < BANK_LEN; w++) {
+		bank.waves[w]->validate(WAVE_MIPS);
+	}
+}
+
+
+/** Plays `frames` samples through the callback, in buffers of bufferSize */
+static void benchPlay(const BenchSettings &settings, float *out, int frames) {
+	for (int i = 0; i < frames; i += settings.bufferSize) {
+		audioRender(&out[i], mini(settings.bufferSize, frames - i), settings.sampleRate);
+	}
+}
+
+/** Lets the smoothed frequency and morph position reach the globals */
+static void benchSettle(const BenchSettings &settings) {
+	audioStep();
+	std::vector<float> out(settings.bufferSize);
+	for (int i = 0; i < 64; i++) {
+		audioRender(out.data(), settings.bufferSize, settings.sampleRate);
+	}
+	audioStep();
+}
+
+
+enum BenchMode {
+	BENCH_Z_STILL,
+	BENCH_Z_MORPHING,
+	BENCH_XY_STILL,
+	BENCH_XY_MORPHING,
+	BENCH_Z_SNAPPED,
+	BENCH_CROSSMOD,
+	BENCH_CARRIER,
+	BENCH_MODULATOR,
+	BENCH_MODES_LEN
+};
+
+static const char *benchModeNames[BENCH_MODES_LEN] = {
+	"Z still",
+	"Z morphing",
+	"XY still",
+	"XY morphing",
+	"Z snapped",
+	"crossmod",
+	"carrier",
+	"modulator",
+};
+
+/** Runs the callback back to back in each play mode at 220 Hz, moving the controls between callbacks like the UI. */
+static void benchModes(const BenchSettings &settings) {
+	printf("Callback, %d samples at %d Hz, 220 Hz tone, best of 3 runs of %g s of audio\n", settings.bufferSize, settings.sampleRate, settings.duration);
+	printf("  %-14s %10s %10s %10s %10s\n", "mode", "ns/sample", "p50 load", "p99 load", "max load");
+	int callbacks = maxi((int) (settings.duration * settings.sampleRate / settings.bufferSize), 1);
+	double period = (double) settings.bufferSize / settings.sampleRate;
+	std::vector<float> out(settings.bufferSize);
+	std::vector<float> durations(callbacks);
+	for (int m = 0; m < BENCH_MODES_LEN; m++) {
+		playSource = (m == BENCH_CROSSMOD) ? PLAY_CROSSMOD : (m == BENCH_CARRIER) ? PLAY_CARRIER : (m == BENCH_MODULATOR) ? PLAY_MODULATOR : PLAY_WAVE;
+		playModeXY = (m == BENCH_XY_STILL || m == BENCH_XY_MORPHING);
+		morphInterpolate = (m != BENCH_Z_SNAPPED);
+		bool moving = (m == BENCH_Z_MORPHING || m == BENCH_XY_MORPHING);
+		playFrequency = 220.0;
+		morphX = 1.4;
+		morphY = 2.6;
+		morphZ = 2.3;
+		benchSettle(settings);
+
+		double best = INFINITY;
+		for (int run = 0; run < 3; run++) {
+			double start = getTime();
+			for (int c = 0; c < callbacks; c++) {
+				if (moving) {
+					// Across the bank every 10 s
+					float t = fmodf((float) c * settings.bufferSize / settings.sampleRate / 10.0, 1.0);
+					morphZ = t * (BANK_LEN - 1);
+					morphX = t * (BANK_GRID_WIDTH - 1);
+					morphY = (1.0 - t) * (BANK_GRID_HEIGHT - 1);
+					audioStep();
+				}
+				double callbackStart = getTime();
+				audioRender(out.data(), settings.bufferSize, settings.sampleRate);
+				durations[c] = getTime() - callbackStart;
+			}
+			best = fmin(best, getTime() - start);
+		}
+		std::sort(durations.begin(), durations.end());
+		printf("  %-14s %10.2f %9.3f%% %9.3f%% %9.3f%%\n", benchModeNames[m], best / callbacks / settings.bufferSize * 1e9,
+			100.0 * durations[callbacks / 2] / period, 100.0 * durations[mini(callbacks * 99 / 100, callbacks - 1)] / period, 100.0 * durations[callbacks - 1] / period);
+	}
+}
+
+
+/** Renders the FM matrix into every wave of a copy of the bank, like Bank::renderFM() does while an FM control is dragged.
+Every operator is on, reads one of the sources and modulates every other one, so no lane is skipped.
+*/
+static void benchFM(const Bank &bank) {
+	Bank *fmBank = new Bank(bank);
+	FMMatrix &fm = fmBank->fm;
+	for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+		fm.operators[i].ratio = i + 1;
+		fm.operators[i].level = 1.0 / FM_OPERATORS_LEN;
+		fm.operators[i].source = (FMSourceID) (i % FM_SOURCES_LEN);
+		for (int j = 0; j < FM_OPERATORS_LEN; j++) {
+			fm.pm[i][j] = 0.1 * ((i + j) % 3);
+			fm.fm[i][j] = 0.01 * ((i * j) % 4);
+		}
+	}
+
+	double best = INFINITY;
+	for (int run = 0; run < 3; run++) {
+		double start = getTime();
+		for (int w = 0; w < BANK_LEN; w++) {
+			fmBank->renderFM(w);
+		}
+		best = fmin(best, getTime() - start);
+	}
+	delete fmBank;
+	printf("FM matrix, %d operators, best of 3 renders of the bank\n", FM_OPERATORS_LEN);
+	printf("  %.1f us/wave, %.1f ms for all %d waves\n", best / BANK_LEN * 1e6, best * 1e3, BANK_LEN);
+}
+
+
+/** Best time of 3 runs of `reps` calls of `f`, per call */
+static double benchBest(int reps, const std::function<void()> &f) {
+	double best = INFINITY;
+	for (int run = 0; run < 3; run++) {
+		double start = getTime();
+		for (int i = 0; i < reps; i++) {
+			f();
+		}
+		best = fmin(best, getTime() - start);
+	}
+	return best / reps;
+}
+
+/** Times what runs between an edit and its result on screen: post arrays, an effect dragged over the whole bank, crossmod, and undo history.
+All on this thread, the UI spreads whole-bank work over the parallelFor() pool.
+*/
+static void benchEdits(const Bank &bank) {
+	printf("Edit latency, one thread\n");
+
+	// Six effects with and without the FFT based ones, comb and harmonic shift
+	Wave *wave = new Wave(*bank.waves[1]);
+	const EffectID heavy[] = {PRE_GAIN, HARMONIC_SHIFT, HARMONIC_STRETCH, COMB, LOWPASS, POST_GAIN};
+	const EffectID light[] = {PRE_GAIN, CUBIC_DISTORTION, CHEBYSHEV, SLEW, LOWPASS, POST_GAIN};
+	memset(wave->effects, 0, sizeof(wave->effects));
+	for (EffectID effect : heavy) {
+		wave->effects[effect] = 0.5;
+	}
+	double heavyTime = benchBest(20, [&]() {
+		wave->computePost();
+	});
+	memset(wave->effects, 0, sizeof(wave->effects));
+	for (EffectID effect : light) {
+		wave->effects[effect] = 0.5;
+	}
+	double lightTime = benchBest(20, [&]() {
+		wave->computePost();
+	});
+	delete wave;
+	printf("  %-40s %10.1f us\n", "computePost, 6 effects incl. comb", heavyTime * 1e6);
+	printf("  %-40s %10.1f us\n", "computePost, 6 effects without FFT", lightTime * 1e6);
+
+	// Dragging an effect slider with all waves selected, until every wave can be played again
+	Bank *edited = new Bank(bank);
+	float amount = 0.0;
+	double dragTime = benchBest(1, [&]() {
+		amount += 0.1;
+		for (int w = 0; w < BANK_LEN; w++) {
+			Wave *wave = edited->waves[w].write();
+			wave->effects[LOWPASS] = amount;
+			wave->updatePost();
+			wave->validate(WAVE_POST | WAVE_MIPS);
+		}
+	});
+	printf("  %-40s %10.2f ms\n", stringf("effect on all %d waves, post and mips", BANK_LEN).c_str(), dragTime * 1e3);
+
+	for (int i = 0; i < CROSSMOD_LEN; i++) {
+		edited->crossmod[i] = 0.5;
+	}
+	double crossmodTime = benchBest(20, [&]() {
+		edited->renderCrossmod();
+	});
+	printf("  %-40s %10.2f ms\n", "renderCrossmod, every control at 0.5", crossmodTime * 1e3);
+	delete edited;
+
+	// Single-wave edits, each its own undo step like a click on a button
+	Bank saved = currentBank;
+	currentBank = bank;
+	historyClear();
+	historyPush();
+	const int edits = 100;
+	double start = getTime();
+	for (int i = 0; i < edits; i++) {
+		HistoryTransaction transaction;
+		Wave *wave = currentBank.waves[i % BANK_LEN].write();
+		wave->samples[i % WAVE_LEN] = 0.0;
+		wave->commitSamples();
+	}
+	double pushTime = (getTime() - start) / edits;
+	start = getTime();
+	for (int i = 0; i < edits; i++) {
+		historyUndo();
+	}
+	double undoTime = (getTime() - start) / edits;
+	printf("  %-40s %10.1f KB\n", "sizeof(Bank), held by each undo step", sizeof(Bank) / 1024.0);
+	printf("  %-40s %10.1f MB\n", stringf("history of %d single-wave edits", edits).c_str(), historyStats.bytes / 1048576.0);
+	printf("  %-40s %10.1f us\n", "edit and push", pushTime * 1e6);
+	printf("  %-40s %10.1f us\n", "undo", undoTime * 1e6);
+	historyClear();
+	currentBank = saved;
+}
+
+
+/** In-place radix-2 FFT in double precision. RFFT() works in single precision, and its rounding spurs near -80 dB hide everything the mips and the sinc filter reach. */
+static void fftDouble(std::complex<double> *x, int len) {
+	for (int i = 1, j = 0; i < len; i++) {
+		int bit = len >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			std::swap(x[i], x[j]);
+	}
+	for (int n = 2; n <= len; n <<= 1) {
+		for (int k = 0; k < n / 2; k++) {
+			std::complex<double> w = std::polar(1.0, -2 * M_PI * k / n);
+			for (int i = k; i < len; i += n) {
+				std::complex<double> t = w * x[i + n / 2];
+				x[i + n / 2] = x[i] - t;
+				x[i] += t;
+			}
+		}
+	}
+}
+
+/** Energy away from the harmonics of `frequency` relative to the harmonics, in dB, through a 7-term Blackman-Harris window. `len` must be a power of 2.
+The window's sidelobes are below -180 dB, so the leakage of the harmonics stays far under any aliasing worth measuring.
+*/
+static float aliasingDb(const float *in, int len, float frequency, float sampleRate) {
+	static const double window[7] = {0.27105140069342, -0.43329793923448, 0.21812299954311, -0.06592544638803, 0.01081174209837, -0.00077658482522, 0.00001388721735};
+	std::vector<std::complex<double>> x(len);
+	for (int i = 0; i < len; i++) {
+		double w = 0.0;
+		for (int k = 0; k < 7; k++) {
+			w += window[k] * cos(2 * M_PI * k * i / len);
+		}
+		x[i] = in[i] * w;
+	}
+	fftDouble(x.data(), len);
+	// The window's main lobe is 7 bins wide on each side
+	double binWidth = sampleRate / len;
+	double harmonics = 0.0;
+	double aliases = 0.0;
+	for (int b = 1; b < len / 2; b++) {
+		double energy = std::norm(x[b]);
+		double f = b * binWidth;
+		double h = round(f / frequency);
+		if (h >= 1 && fabs(f - h * frequency) < 9 * binWidth)
+			harmonics += energy;
+		else
+			aliases += energy;
+	}
+	return 10 * log10(aliases / harmonics);
+}
+
+
+/** The wave-rate samples the callback produced before band-limited mips, in blocks of 64 like its srcCallback.
+Each sample crossfades the post samples of two neighboring waves, so this is the cost of the old callback without its resampler.
+*/
+static void benchOldBlocks(const Bank &bank, int waveId, float gain, float *in, int inLen) {
+	const float *a = bank.waves[waveId]->getPostSamples();
+	const float *b = bank.waves[eucmodi(waveId + 1, BANK_LEN)]->getPostSamples();
+	int index = 0;
+	for (int block = 0; block < inLen; block += 64) {
+		int len = mini(64, inLen - block);
+		float *out = &in[block];
+		int i = 0;
+		while (i < len) {
+			int n = mini(len - i, WAVE_LEN - index);
+			for (int j = 0; j < n; j++) {
+				out[i + j] = crossf(a[index + j], b[index + j], 0.0);
+			}
+			i += n;
+			index = (index + n) % WAVE_LEN;
+		}
+		for (int j = 0; j < len; j++) {
+			out[j] = clampf(out[j] * gain, -1.0, 1.0);
+		}
+	}
+}
+
+
+/** The inner loop of libsamplerate's SRC_SINC_FASTEST, for builds where the library is not available.
+Ports calc_output_single() of src_sinc.c with its 12-bit fixed point filter index, float coefficients and double accumulators. Like the library, the filter is stretched by the ratio when downsampling, so the number of taps grows with the pitch.
+The coefficient table has FASTEST's length, 2464 samples for half the filter at 128 per zero crossing. It is a Kaiser windowed sinc designed for the library's published 97 dB SNR, with its stopband starting at Nyquist.
+Input is read from one array instead of the library's ring buffer, so this slightly flatters the sinc path.
+*/
+struct BenchSincModel {
+	enum {
+		HALF_LEN = 2464,
+		INDEX_INC = 128,
+		SHIFT_BITS = 12,
+		FP_ONE = 1 << SHIFT_BITS,
+	};
+	float coeffs[HALF_LEN + 2];
+
+	BenchSincModel() {
+		// Kaiser: beta for 97 dB, transition width for a filter spanning 2 * HALF_LEN / INDEX_INC zero crossings
+		const double attenuation = 97.0;
+		double beta = 0.1102 * (attenuation - 8.7);
+		double transition = (attenuation - 8.0) / (2.285 * M_PI * 2.0 * HALF_LEN / INDEX_INC);
+		double cutoff = 1.0 - transition / 2.0;
+		auto besselI0 = [](double x) {
+			double sum = 1.0, term = 1.0;
+			for (int k = 1; k < 50; k++) {
+				term *= (x / (2 * k)) * (x / (2 * k));
+				sum += term;
+			}
+			return sum;
+		};
+		for (int i = 0; i < HALF_LEN + 2; i++) {
+			double t = fmin((double) i / HALF_LEN, 1.0);
+			double window = besselI0(beta * sqrt(1.0 - t * t)) / besselI0(beta);
+			double x = M_PI * cutoff * i / INDEX_INC;
+			coeffs[i] = cutoff * (i == 0 ? 1.0 : sin(x) / x) * window;
+		}
+	}
+
+	/** One output sample around in[current], `startIndex` and `increment` in fixed point */
+	double output(const float *in, int current, int32_t increment, int32_t startIndex) const {
+		int32_t maxIndex = HALF_LEN << SHIFT_BITS;
+
+		// Left half of the filter
+		int32_t filterIndex = startIndex;
+		int count = (maxIndex - filterIndex) / increment;
+		filterIndex += count * increment;
+		int dataIndex = current - count;
+		double left = 0.0;
+		do {
+			double fraction = (filterIndex & (FP_ONE - 1)) * (1.0 / FP_ONE);
+			int i = filterIndex >> SHIFT_BITS;
+			double coeff = coeffs[i] + fraction * (coeffs[i + 1] - coeffs[i]);
+			left += coeff * in[dataIndex];
+			filterIndex -= increment;
+			dataIndex++;
+		} while (filterIndex >= 0);
+
+		// Right half
+		filterIndex = increment - startIndex;
+		count = (maxIndex - filterIndex) / increment;
+		filterIndex += count * increment;
+		dataIndex = current + 1 + count;
+		double right = 0.0;
+		do {
+			double fraction = (filterIndex & (FP_ONE - 1)) * (1.0 / FP_ONE);
+			int i = filterIndex >> SHIFT_BITS;
+			double coeff = coeffs[i] + fraction * (coeffs[i + 1] - coeffs[i]);
+			right += coeff * in[dataIndex];
+			filterIndex -= increment;
+			dataIndex--;
+		} while (filterIndex > 0);
+		return left + right;
+	}
+
+	/** Input samples the filter reads on each side of the current one */
+	static int margin(double ratio) {
+		return (int) (HALF_LEN / (INDEX_INC * fmin(ratio, 1.0))) + 2;
+	}
+
+	/** Resamples by `ratio` output samples per input sample, like sinc_mono_vari_process() at a constant ratio. `in` must have margin() samples before the first one read. */
+	void process(const float *in, double ratio, float *out, int len) const {
+		double floatIncrement = INDEX_INC * fmin(ratio, 1.0);
+		int32_t increment = lrint(floatIncrement * FP_ONE);
+		double scale = floatIncrement / INDEX_INC;
+		int current = margin(ratio);
+		double index = 0.0;
+		for (int i = 0; i < len; i++) {
+			int32_t startIndex = lrint(index * floatIncrement * FP_ONE);
+			out[i] = scale * output(in, current, increment, startIndex);
+			index += 1.0 / ratio;
+			double whole = floor(index);
+			current += (int) whole;
+			index -= whole;
+		}
+	}
+};
+
+
+/** The playback path before band-limited mips: the cycle at WAVE_LEN samples per period, pitched by libsamplerate */
+struct BenchSinc {
+	const float *cycle;
+	int index = 0;
+	float block[64];
+
+	static long callback(void *data, float **out) {
+		BenchSinc *sinc = (BenchSinc*) data;
+		for (int i = 0; i < 64; i++) {
+			sinc->block[i] = sinc->cycle[sinc->index];
+			sinc->index = (sinc->index + 1) % WAVE_LEN;
+		}
+		*out = sinc->block;
+		return 64;
+	}
+};
+
+/** Plays the full saw at several pitches through the mips, through linear interpolation of the raw cycle, and through the path the mips replaced.
+That path is timed as the old block generator plus BenchSincModel, and also run through libsamplerate's SRC_SINC_FASTEST if it is available.
+*/
+static void benchAliasing(const Bank &bank, const BenchSettings &settings) {
+	const int len = 1 << 16;
+	const int waveId = 1;
+	const float *cycle = bank.waves[waveId]->getPostSamples();
+	float gain = powf(10.0, playVolume / 20.0);
+	std::vector<float> out(len);
+	BenchSincModel *model = new BenchSincModel();
+	printf("Aliasing of a saw (harmonics up to %d) in dB, and ns/sample\n", WAVE_LEN / 2 - 1);
+	printf("  %8s %16s %16s %16s %16s %8s\n", "pitch", "mips", "linear", "sinc model", "sinc fastest", "old/new");
+
+	playSource = PLAY_WAVE;
+	playModeXY = false;
+	morphInterpolate = false;
+	morphZ = waveId;
+	const float pitches[] = {55.0, 220.0, 880.0, 1760.0, 3520.0, 7040.0};
+	for (float pitch : pitches) {
+		float phaseStep = pitch / settings.sampleRate;
+		double ratio = (double) settings.sampleRate / WAVE_LEN / pitch;
+
+		playFrequency = pitch;
+		benchSettle(settings);
+		double mipsTime = benchBest(1, [&]() {
+			benchPlay(settings, out.data(), len);
+		});
+		float mipsDb = aliasingDb(out.data(), len, pitch, settings.sampleRate);
+
+		double linearTime = benchBest(1, [&]() {
+			float phase = 0.0;
+			for (int i = 0; i < len; i++) {
+				float pos = phase * WAVE_LEN;
+				int j = (int) pos;
+				float f = pos - j;
+				out[i] = gain * crossf(cycle[j], cycle[(j + 1) % WAVE_LEN], f);
+				phase += phaseStep;
+				phase -= (int) phase;
+			}
+		});
+		float linearDb = aliasingDb(out.data(), len, pitch, settings.sampleRate);
+
+		// Wave-rate input with the filter's margin on both sides, which the old callback also had to produce
+		int margin = BenchSincModel::margin(ratio);
+		std::vector<float> in((size_t) (len / ratio) + 2 * margin + 2);
+		double modelTime = benchBest(1, [&]() {
+			benchOldBlocks(bank, waveId, gain, in.data(), in.size());
+			model->process(in.data(), ratio, out.data(), len);
+		});
+		float modelDb = aliasingDb(out.data(), len, pitch, settings.sampleRate);
+
+		BenchSinc sinc;
+		sinc.cycle = cycle;
+		int err;
+		SRC_STATE *src = src_callback_new(BenchSinc::callback, SRC_SINC_FASTEST, 1, &err, &sinc);
+		float sincDb = NAN;
+		double sincTime = NAN;
+		if (src) {
+			// Skip the filter's startup
+			src_callback_read(src, ratio, 4096, out.data());
+			double start = getTime();
+			long frames = src_callback_read(src, ratio, len, out.data());
+			sincTime = getTime() - start;
+			src_delete(src);
+			for (int i = 0; i < len; i++) {
+				out[i] *= gain;
+			}
+			if (frames == len)
+				sincDb = aliasingDb(out.data(), len, pitch, settings.sampleRate);
+		}
+
+		printf("  %5.0f Hz %7.1f %6.1f ns %7.1f %6.1f ns %7.1f %6.1f ns %7.1f %6.1f ns %7.1fx\n", pitch,
+			mipsDb, mipsTime / len * 1e9, linearDb, linearTime / len * 1e9, modelDb, modelTime / len * 1e9, sincDb, sincTime / len * 1e9, modelTime / mipsTime);
+	}
+	delete model;
+}
+
+
+/** Sends a note-on like change at fractions of a buffer period after a callback, pacing callbacks like a device, and reports where in the next buffer it starts */
+static void benchEventTiming(const BenchSettings &settings) {
+	double period = (double) settings.bufferSize / settings.sampleRate;
+	std::vector<float> out(settings.bufferSize);
+	playSource = PLAY_WAVE;
+	playModeXY = false;
+	morphInterpolate = false;
+	morphZ = BANK_LEN - 1;
+	playFrequency = 220.0;
+	printf("Event placement, %d samples at %d Hz\n", settings.bufferSize, settings.sampleRate);
+	int worst = 0;
+	for (int run = 0; run < 20; run++) {
+		playEnabled = false;
+		audioStep();
+		audioRender(out.data(), settings.bufferSize, settings.sampleRate);
+		std::this_thread::sleep_for(std::chrono::duration<double>(period));
+		audioRender(out.data(), settings.bufferSize, settings.sampleRate);
+		double fraction = (run % 5 + 1) / 6.0;
+		std::this_thread::sleep_for(std::chrono::duration<double>(period * fraction));
+		playEnabled = true;
+		audioStep();
+		std::this_thread::sleep_for(std::chrono::duration<double>(period * (1.0 - fraction)));
+		audioRender(out.data(), settings.bufferSize, settings.sampleRate);
+		int first = 0;
+		while (first < settings.bufferSize && out[first] == 0.0)
+			first++;
+		int error = first - (int) roundf(fraction * settings.bufferSize);
+		if (abs(error) > abs(worst))
+			worst = error;
+	}
+	printf("  a change sent at 1/6 to 5/6 of a period starts at most %d samples from there over 20 runs\n", abs(worst));
+}
+
+
+int benchCommand(int argc, char **argv) {
+	BenchSettings settings;
+	bool sinc = true;
+	int arg = 0;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char *option = argv[arg];
+		const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+		if (strcmp(option, "--rate") == 0 && value) {
+			settings.sampleRate = clampi(atoi(value), 8000, 192000);
+			arg++;
+		}
+		else if (strcmp(option, "--buffer") == 0 && value) {
+			settings.bufferSize = clampi(atoi(value), 16, 8192);
+			arg++;
+		}
+		else if (strcmp(option, "--duration") == 0 && value) {
+			settings.duration = clampf(atof(value), 0.1, 3600.0);
+			arg++;
+		}
+		else if (strcmp(option, "--no-sinc") == 0) {
+			sinc = false;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", option);
+			fprintf(stderr, "Usage: WaveEdit --bench [options]\n");
+			fprintf(stderr, "Times the audio callback in every play mode without a device, the FM matrix render and edits, measures aliasing against the libsamplerate path it replaced, and checks where events land.\n");
+			fprintf(stderr, "  --rate hz           sample rate, %d by default\n", settings.sampleRate);
+			fprintf(stderr, "  --buffer n          samples per callback, %d by default\n", settings.bufferSize);
+			fprintf(stderr, "  --duration s        seconds of audio per measurement, %g by default\n", settings.duration);
+			fprintf(stderr, "  --no-sinc           skip the aliasing comparison\n");
+			return 1;
+		}
+	}
+
+	Bank *bank = new Bank();
+	benchBank(*bank);
+	playingBank = bank;
+	playEnabled = true;
+	playVolume = -6.0;
+	morphZSpeed = 0.0;
+	printf("%s format, %d waves of %d samples\n", wavetableFormats[currentFormat].name, BANK_LEN, WAVE_LEN);
+	benchModes(settings);
+	benchFM(*bank);
+	benchEdits(*bank);
+	if (sinc)
+		benchAliasing(*bank, settings);
+	benchEventTiming(settings);
+
+	// The audio thread state keeps the snapshot, so stop playing before freeing the bank
+	playingBank = NULL;
+	playEnabled = false;
+	audioStep();
+	delete bank;
+	return 0;
+}
+
+} // namespace WAVETABLE_NAMESPACE
@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <dirent.h>
 
+namespace WAVETABLE_NAMESPACE {
+
 
 std::vector<CatalogCategory> catalogCategories;
 
@@ -94,6 +96,20 @@ void catalogInit() {
 			CatalogFile catalogFile;
 			catalogFile.name = std::string(name, period - name);
 
+			// Convert straight into the catalog file when the WAV can be mapped
+			MappedWAV wav;
+			if (wav.open(filePath)) {
+				if (wav.frames == WAVE_LEN) {
+					wav.readMono(catalogFile.samples, 0, WAVE_LEN);
+					catalogCategory.files.push_back(catalogFile);
+				}
+				else {
+					printf("%s has length %d but needs %d\n", filePath, (int) wav.frames, WAVE_LEN);
+				}
+				wav.close();
+				continue;
+			}
+
 			int length;
 			float *samples = loadAudio(filePath, &length);
 			if (samples) {
@@ -114,3 +130,5 @@ void catalogInit() {
 
 	closedir(rootDir);
 }
+
+} // namespace WAVETABLE_NAMESPACE
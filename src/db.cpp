@@ -5,6 +5,8 @@
 #include <jansson.h>
 #include "imgui.h"
 
+namespace WAVETABLE_NAMESPACE {
+
 
 static const char *api_host = "http://waveeditonline.com";
 
@@ -466,3 +468,5 @@ void dbInit() {
 		fclose(sekretFile);
 	}
 }
+
+} // namespace WAVETABLE_NAMESPACE
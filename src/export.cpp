@@ -0,0 +1,289 @@
+#include "WaveEdit.hpp"
+#include <string.h>
+#include <strings.h>
+#include <atomic>
+#include <string>
+
+namespace WAVETABLE_NAMESPACE {
+
+
+struct ExportTargetName {
+	int target;
+	const char *name;
+};
+
+static const ExportTargetName exportTargetNames[] = {
+	{EXPORT_WAV, "wav"},
+	{EXPORT_WAVES, "waves"},
+	{EXPORT_ROM, "hex"},
+	{EXPORT_ROM_BINARY, "bin"},
+	{EXPORT_BLOFELD, "syx"},
+	{EXPORT_FLAC, "flac"},
+	{EXPORT_WAVES_FLAC, "flac-waves"},
+};
+
+
+/** One file of an export, encoded by whichever worker picks it up */
+struct ExportFile {
+	std::string filename;
+	/** Returns false if the file cannot be encoded */
+	std::function<bool(std::vector<uint8_t> &out)> encode;
+	size_t size = 0;
+	uint64_t hash = 0;
+	/** 0 = not written, 1 = written, -1 = failed */
+	int status = 0;
+};
+
+
+static bool writeBuffer(const std::string &path, const std::vector<uint8_t> &buf) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f)
+		return false;
+	bool success = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+	return (fclose(f) == 0) && success;
+}
+
+
+int exportBank(Bank &bank, const char *dirname, const char *name, int targets, int threads, std::string *errors) {
+	targets &= EXPORT_TARGETS;
+	if (!targets)
+		return 0;
+
+	// Every target reads the same snapshot, so they agree even if validation or edits happen meanwhile
+	std::vector<float> post(BANK_LEN * WAVE_LEN);
+	bank.getPostSamples(post.data());
+
+	// Each bit depth is converted once, however many targets use it
+	std::vector<int16_t> pcm;
+	if (targets & (EXPORT_WAV | EXPORT_WAVES | EXPORT_FLAC | EXPORT_WAVES_FLAC)) {
+		pcm.resize(post.size());
+		for (size_t i = 0; i < post.size(); i++) {
+			pcm[i] = (int16_t) lrintf(clampf(post[i], -1.0, 1.0) * 32767.0);
+		}
+	}
+#if WAVETABLE_FORMAT_PHMK2
+	std::vector<uint8_t> rom;
+	if (targets & (EXPORT_ROM | EXPORT_ROM_BINARY)) {
+		rom.resize(post.size());
+		for (size_t i = 0; i < post.size(); i++) {
+			rom[i] = romSample(post[i]);
+		}
+	}
+#endif
+#if WAVETABLE_FORMAT_BLOFELD
+	std::vector<int32_t> blofeld;
+	if (targets & EXPORT_BLOFELD) {
+		blofeld.resize(post.size());
+		for (size_t i = 0; i < post.size(); i++) {
+			blofeld[i] = blofeldSample(post[i]);
+		}
+	}
+#endif
+
+	std::vector<ExportFile> files;
+	auto add = [&](const std::string &filename, const std::function<bool(std::vector<uint8_t> &out)> &encode) {
+		ExportFile file;
+		file.filename = filename;
+		file.encode = encode;
+		files.push_back(file);
+	};
+	if (targets & EXPORT_WAV) {
+		add(stringf("%s.wav", name), [&](std::vector<uint8_t> &out) {
+			wavEncode(out, pcm.data(), pcm.size());
+			return true;
+		});
+	}
+	if (targets & EXPORT_WAVES) {
+		for (int i = 0; i < BANK_LEN; i++) {
+			add(stringf("%s-%02d.wav", name, i), [&, i](std::vector<uint8_t> &out) {
+				wavEncode(out, &pcm[i * WAVE_LEN], WAVE_LEN);
+				return true;
+			});
+		}
+	}
+	if (targets & EXPORT_FLAC) {
+		add(stringf("%s.flac", name), [&](std::vector<uint8_t> &out) {
+			return flacEncode(out, pcm.data(), pcm.size());
+		});
+	}
+	// libsndfile encodes a stream on one thread, so FLAC is spread over the workers one wave per file
+	if (targets & EXPORT_WAVES_FLAC) {
+		for (int i = 0; i < BANK_LEN; i++) {
+			add(stringf("%s-%02d.flac", name, i), [&, i](std::vector<uint8_t> &out) {
+				return flacEncode(out, &pcm[i * WAVE_LEN], WAVE_LEN);
+			});
+		}
+	}
+#if WAVETABLE_FORMAT_PHMK2
+	if (targets & EXPORT_ROM) {
+		add(stringf("%s.hex", name), [&](std::vector<uint8_t> &out) {
+			ihexEncode(out, rom.data(), rom.size(), HEX_LINE_WIDTH / 2);
+			return true;
+		});
+	}
+	if (targets & EXPORT_ROM_BINARY) {
+		add(stringf("%s.bin", name), [&](std::vector<uint8_t> &out) {
+			out.assign(rom.begin(), rom.end());
+			return true;
+		});
+	}
+#endif
+#if WAVETABLE_FORMAT_BLOFELD
+	if (targets & EXPORT_BLOFELD) {
+		std::string filename = stringf("%s.syx", name);
+		add(filename, [&, filename](std::vector<uint8_t> &out) {
+			char blofeldName[14];
+			int slot;
+			getBlofeldName(filename.c_str(), blofeldName, &slot);
+			out.resize(BANK_LEN * BLOFELD_MESSAGE_LEN);
+			for (int wave = 0; wave < BANK_LEN; wave++) {
+				packBlofeldWave(&out[wave * BLOFELD_MESSAGE_LEN], &blofeld[wave * WAVE_LEN], slot, wave, blofeldName);
+			}
+			return true;
+		});
+	}
+#endif
+
+	int count = files.size();
+	std::atomic<int> finished(0);
+	std::atomic<bool> cancelled(false);
+	parallelFor(count, [&](int i) {
+		if (cancelled)
+			return;
+		// Only reports from the I/O thread itself, which is one of the workers
+		if (!ioProgress((float) finished / count)) {
+			cancelled = true;
+			return;
+		}
+		ExportFile &file = files[i];
+		std::vector<uint8_t> buf;
+		if (file.encode(buf)) {
+			file.size = buf.size();
+			file.hash = hashBytes(buf.data(), buf.size());
+			file.status = writeBuffer(stringf("%s/%s", dirname, file.filename.c_str()), buf) ? 1 : -1;
+		}
+		else {
+			file.status = -1;
+		}
+		finished++;
+	}, threads);
+
+	int failures = 0;
+	std::string manifest = "# FNV-1a 64-bit hash, size in bytes, file name\n";
+	for (const ExportFile &file : files) {
+		if (file.status > 0) {
+			manifest += stringf("%016llx %8lu %s\n", (unsigned long long) file.hash, (unsigned long) file.size, file.filename.c_str());
+		}
+		else if (file.status < 0) {
+			failures++;
+			if (errors)
+				*errors += stringf("%s/%s\n", dirname, file.filename.c_str());
+		}
+	}
+	// A manifest of a cancelled export would not describe a complete set
+	if (!cancelled) {
+		std::string manifestPath = stringf("%s/%s.manifest", dirname, name);
+		if (!writeBuffer(manifestPath, std::vector<uint8_t>(manifest.begin(), manifest.end()))) {
+			failures++;
+			if (errors)
+				*errors += manifestPath + "\n";
+		}
+	}
+	return failures;
+}
+
+
+int exportParseTargets(const char *list) {
+	int targets = 0;
+	std::string str = list;
+	size_t pos = 0;
+	while (pos <= str.size()) {
+		size_t comma = str.find(',', pos);
+		if (comma == std::string::npos)
+			comma = str.size();
+		std::string name = str.substr(pos, comma - pos);
+		int target = 0;
+		for (const ExportTargetName &targetName : exportTargetNames) {
+			if (name == targetName.name)
+				target = targetName.target;
+		}
+		if (!(target & EXPORT_TARGETS))
+			return -1;
+		targets |= target;
+		pos = comma + 1;
+	}
+	return targets;
+}
+
+
+bool exportLoadBank(Bank &bank, const char *filename, std::string *name) {
+	// Exported files are named after the bank
+	std::string base = filename;
+	size_t slash = base.find_last_of("/\\");
+	if (slash != std::string::npos)
+		base = base.substr(slash + 1);
+	std::string ext;
+	size_t dot = base.find_last_of('.');
+	if (dot != std::string::npos) {
+		ext = base.substr(dot);
+		base = base.substr(0, dot);
+	}
+	if (name)
+		*name = base;
+
+	if (strcasecmp(ext.c_str(), ".wav") == 0 || strcasecmp(ext.c_str(), ".flac") == 0)
+		return bank.loadWAV(filename);
+#if WAVETABLE_FORMAT_PHMK2
+	if (strcasecmp(ext.c_str(), ".hex") == 0)
+		return bank.loadROM(filename);
+#endif
+#if WAVETABLE_FORMAT_BLOFELD
+	if (strcasecmp(ext.c_str(), ".syx") == 0 || strcasecmp(ext.c_str(), ".mid") == 0)
+		return bank.loadBlofeldWavetable(filename);
+#endif
+	return bank.load(filename);
+}
+
+
+int exportCommand(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: WaveEdit --export <bank> <directory> [targets]\n");
+		fprintf(stderr, "Targets is a comma separated list of");
+		for (const ExportTargetName &targetName : exportTargetNames) {
+			if (targetName.target & EXPORT_TARGETS)
+				fprintf(stderr, " %s", targetName.name);
+		}
+		fprintf(stderr, ", all of them by default\n");
+		return 1;
+	}
+	const char *filename = argv[0];
+	const char *dirname = argv[1];
+	int targets = EXPORT_TARGETS;
+	if (argc >= 3) {
+		targets = exportParseTargets(argv[2]);
+		if (targets < 0) {
+			fprintf(stderr, "Unknown export target in \"%s\"\n", argv[2]);
+			return 1;
+		}
+	}
+
+	Bank *bank = new Bank();
+	std::string name;
+	if (!exportLoadBank(*bank, filename, &name)) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		delete bank;
+		return 1;
+	}
+
+	std::string errors;
+	int failures = exportBank(*bank, dirname, name.c_str(), targets, 4, &errors);
+	delete bank;
+	if (failures > 0) {
+		fprintf(stderr, "Could not write\n%s", errors.c_str());
+		return 1;
+	}
+	printf("Exported %s to %s\n", filename, dirname);
+	return 0;
+}
+
+} // namespace WAVETABLE_NAMESPACE
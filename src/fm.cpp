@@ -0,0 +1,133 @@
+#include "WaveEdit.hpp"
+#include <string.h>
+
+namespace WAVETABLE_NAMESPACE {
+
+
+const char *fmSourceNames[FM_SOURCES_LEN] = {
+	"Sine",
+	"Carrier Wave",
+	"Modulator Wave",
+};
+
+
+// Operators are evaluated in lanes padded to a multiple of 4 so the per-sample loops vectorize
+#define FM_LANES 8
+static const int FM_OVERSAMPLE = 4;
+static const int FM_LEN = WAVE_LEN * FM_OVERSAMPLE;
+
+
+void FMMatrix::clear() {
+	memset(this, 0, sizeof(FMMatrix));
+	for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+		operators[i].ratio = i + 1;
+		operators[i].source = FM_SINE;
+	}
+	operators[0].level = 1.0;
+}
+
+
+/** Oversampled sine with guard samples for interpolation. Built on first use, which C++11 makes safe from any thread. */
+struct FMSineTable {
+	float values[FM_LEN + 2];
+
+	FMSineTable() {
+		for (int i = 0; i < FM_LEN + 2; i++) {
+			values[i] = sinf(2 * M_PI * i / FM_LEN);
+		}
+	}
+};
+
+
+void FMMatrix::render(const float *carrier, const float *modulator, float *out) const {
+	static const FMSineTable sineTable;
+	// The oversampled tables and mix take over 100 KB at 2048 samples, too much stack for the render threads
+	Workspace ws;
+	// Oversampled source tables one after another, so every lane reads through one base pointer.
+	// Each has two guard samples, a phase which rounds up to 1 reads the last one.
+	const int stride = FM_LEN + 2;
+	float *tables = ws.alloc(FM_SOURCES_LEN * stride);
+	memcpy(&tables[FM_SINE * stride], sineTable.values, sizeof(sineTable.values));
+	bool used[FM_SOURCES_LEN] = {};
+	for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+		used[clampi(operators[i].source, 0, FM_SOURCES_LEN - 1)] = true;
+	}
+	if (used[FM_CARRIER]) {
+		float *table = &tables[FM_CARRIER * stride];
+		cyclicOversample(carrier, table, WAVE_LEN, FM_OVERSAMPLE);
+		table[FM_LEN] = table[0];
+		table[FM_LEN + 1] = table[1];
+	}
+	if (used[FM_MODULATOR]) {
+		float *table = &tables[FM_MODULATOR * stride];
+		cyclicOversample(modulator, table, WAVE_LEN, FM_OVERSAMPLE);
+		table[FM_LEN] = table[0];
+		table[FM_LEN + 1] = table[1];
+	}
+
+	// Lay out the matrices by source so the inner loop runs over destination lanes
+	int base[FM_LANES] = {};
+	float increment[FM_LANES] = {};
+	float level[FM_LANES] = {};
+	float pmByLane[FM_LANES][FM_LANES] = {};
+	float fmByLane[FM_LANES][FM_LANES] = {};
+	for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+		const FMOperator &op = operators[i];
+		base[i] = clampi(op.source, 0, FM_SOURCES_LEN - 1) * stride;
+		increment[i] = op.ratio / FM_LEN;
+		level[i] = op.level;
+		for (int j = 0; j < FM_OPERATORS_LEN; j++) {
+			pmByLane[j][i] = pm[i][j];
+			fmByLane[j][i] = fm[i][j];
+		}
+	}
+
+	// All operators are stepped together from the previous sample's outputs, which also makes the diagonal a feedback path.
+	// The first period only settles the feedback, the second one is kept.
+	// Padding lanes have no level or modulation and stay at phase 0.
+	float prev[FM_LANES] = {};
+	float *mix = ws.alloc(FM_LEN);
+	for (int pass = 0; pass < 2; pass++) {
+		float phase[FM_LANES] = {};
+		for (int n = 0; n < FM_LEN; n++) {
+			float pmod[FM_LANES] = {};
+			float fmod[FM_LANES] = {};
+			for (int j = 0; j < FM_OPERATORS_LEN; j++) {
+				for (int i = 0; i < FM_LANES; i++) {
+					pmod[i] += pmByLane[j][i] * prev[j];
+					fmod[i] += fmByLane[j][i] * prev[j];
+				}
+			}
+
+			// Table lookups run over all lanes at once. Only loading the two neighbors is a gather, the index, fraction and interpolation are vector operations.
+			int index[FM_LANES];
+			float frac[FM_LANES];
+			for (int i = 0; i < FM_LANES; i++) {
+				float p = phase[i] + pmod[i];
+				float x = (p - floorf(p)) * FM_LEN;
+				int xi = (int) x;
+				frac[i] = x - xi;
+				index[i] = base[i] + xi;
+				phase[i] += increment[i] * (1.f + fmod[i]);
+				phase[i] -= floorf(phase[i]);
+			}
+			float a[FM_LANES];
+			float b[FM_LANES];
+			for (int i = 0; i < FM_LANES; i++) {
+				a[i] = tables[index[i]];
+				b[i] = tables[index[i] + 1];
+			}
+			float value = 0.f;
+			for (int i = 0; i < FM_LANES; i++) {
+				prev[i] = a[i] + (b[i] - a[i]) * frac[i];
+				value += level[i] * prev[i];
+			}
+			mix[n] = value;
+		}
+	}
+
+	cyclicUndersample(mix, out, FM_LEN, FM_OVERSAMPLE);
+	normalize_array(out, WAVE_LEN, -1.0, 1.0, 0.0);
+}
+
+} // namespace WAVETABLE_NAMESPACE
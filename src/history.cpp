@@ -1,46 +1,1041 @@
 #include "WaveEdit.hpp"
 #include <SDL.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <string>
+
+namespace WAVETABLE_NAMESPACE {
 
 
 Bank currentBank;
+int historyBudget = 256;
+HistoryStats historyStats = {};
+
+
+/** The data of a wave which cannot be computed from the rest */
+struct WaveSource {
+	int index;
+	float samples[WAVE_LEN];
+	float effects[EFFECTS_LEN];
+	bool cycle;
+	bool normalize;
+};
+
+/** The fields of a Bank outside its waves, except `samples` and `harmonics` which renderCrossmod() computes */
+struct BankSource {
+	CowPtr<BaseWave> carrier_wave;
+	CowPtr<BaseWave> modulator_wave;
+	float crossmod[CROSSMOD_LEN];
+	FMMatrix fm;
+};
 
-static std::vector<Bank> history;
-static int currentIndex = -1;
+/** The difference between two neighboring history states.
+A step holds the side of the difference which is not current. Applying it moves the bank to that side and leaves the other side in the step, so the same step serves undo and redo.
+*/
+struct HistoryStep {
+	std::vector<WaveSource> waves;
+	/** NULL if only waves changed. Replaced instead of modified, since copies of the step share it. */
+	std::shared_ptr<BankSource> bank;
+	size_t bytes = 0;
+};
+
+/** A state in the undo tree */
+struct HistoryNode {
+	int parent = -1;
+	/** In order of creation */
+	std::vector<int> children;
+	/** The child which redo moves to, the one visited last */
+	int redoChild = -1;
+	/** Edge from the parent, which holds whichever side of it the current state is not on. Empty for the root. */
+	CowPtr<HistoryStep> step;
+	/** Wall clock time of the first edit of the node */
+	int64_t time = 0;
+};
+
+/** The undo tree by node id. Ids increase with creation, so the oldest nodes come first. Steps are copy-on-write so journal checkpoints can share them. */
+static std::map<int, HistoryNode> nodes;
+static int rootId = -1;
+static int currentId = -1;
+static int nextId = 0;
+/** currentBank as of the last push or undo, which the next push is compared with. Only holds wave pointers. */
+static Bank recorded;
 static double previousTime = -INFINITY;
 static const double delayTime = 0.2;
+static int transactionDepth = 0;
+/** Nodes are only evicted once replaying is done, so that every node the journal refers to exists */
+static bool journalReplaying = false;
+
+static void journalEdit(bool merge, const std::vector<int> &waves, bool bank);
+static void journalUndo(bool redo);
+static void journalJump(int id);
+static void journalCheckpoint();
+
+
+static void getSource(WaveSource &source, const Wave &wave) {
+	memcpy(source.samples, wave.samples, sizeof(wave.samples));
+	memcpy(source.effects, wave.effects, sizeof(wave.effects));
+	source.cycle = wave.cycle;
+	source.normalize = wave.normalize;
+}
+
+/** Replaces the wave with a new one which only has its source set, the derived arrays are recomputed by validation */
+static void setSource(CowPtr<Wave> &wave, const WaveSource &source) {
+	CowPtr<Wave> restored;
+	Wave *w = restored.write();
+	w->clear();
+	memcpy(w->samples, source.samples, sizeof(w->samples));
+	memcpy(w->effects, source.effects, sizeof(w->effects));
+	w->cycle = source.cycle;
+	w->normalize = source.normalize;
+	wave = restored;
+}
+
+static bool sourceEquals(const Wave &a, const Wave &b) {
+	return memcmp(a.samples, b.samples, sizeof(a.samples)) == 0
+		&& memcmp(a.effects, b.effects, sizeof(a.effects)) == 0
+		&& a.cycle == b.cycle && a.normalize == b.normalize;
+}
+
+static void getSource(BankSource &source, const Bank &bank) {
+	source.carrier_wave = bank.carrier_wave;
+	source.modulator_wave = bank.modulator_wave;
+	memcpy(source.crossmod, bank.crossmod, sizeof(bank.crossmod));
+	source.fm = bank.fm;
+}
+
+/** Does not render the crossmod wave */
+static void setSource(Bank &bank, const BankSource &source) {
+	bank.carrier_wave = source.carrier_wave;
+	bank.modulator_wave = source.modulator_wave;
+	memcpy(bank.crossmod, source.crossmod, sizeof(bank.crossmod));
+	bank.fm = source.fm;
+}
+
+static bool sourceEquals(const Bank &a, const Bank &b) {
+	return a.carrier_wave.shares(b.carrier_wave) && a.modulator_wave.shares(b.modulator_wave)
+		&& memcmp(a.crossmod, b.crossmod, sizeof(a.crossmod)) == 0
+		&& memcmp(&a.fm, &b.fm, sizeof(a.fm)) == 0;
+}
+
+/** Appends the indices of the waves whose source differs between the banks */
+static void diffWaves(const Bank &from, const Bank &to, std::vector<int> &waves) {
+	for (int i = 0; i < BANK_LEN; i++) {
+		// Rendering the crossmod wave rewrites every wave, often with what it held already
+		if (!from.waves[i].shares(to.waves[i]) && !sourceEquals(*from.waves[i], *to.waves[i]))
+			waves.push_back(i);
+	}
+}
+
+
+static size_t stepBytes(const HistoryStep &step) {
+	size_t bytes = sizeof(HistoryStep) + step.waves.capacity() * sizeof(WaveSource);
+	// Base waves are counted in full, although the bank or other steps may share them
+	if (step.bank)
+		bytes += sizeof(BankSource) + 2 * sizeof(BaseWave);
+	return bytes;
+}
+
+
+/** Adds the sides of `from` which changed to the step, keeping what the step already holds */
+static void addDifference(HistoryStep &step, const Bank &from, const std::vector<int> &waves, bool bank) {
+	bool present[BANK_LEN] = {};
+	for (const WaveSource &source : step.waves) {
+		present[source.index] = true;
+	}
+	for (int i : waves) {
+		if (present[i])
+			continue;
+		step.waves.emplace_back();
+		WaveSource &source = step.waves.back();
+		source.index = i;
+		getSource(source, *from.waves[i]);
+	}
+	if (!step.bank && bank) {
+		step.bank = std::make_shared<BankSource>();
+		getSource(*step.bank, from);
+	}
+	step.bytes = stepBytes(step);
+}
+
+
+/** Node ids whose edges are crossed in order to move from one node to another */
+static void getPath(int from, int to, std::vector<int> &up, std::vector<int> &down) {
+	std::set<int> ancestors;
+	for (int id = from; id >= 0; id = nodes[id].parent) {
+		ancestors.insert(id);
+	}
+	for (int id = to; !ancestors.count(id); id = nodes[id].parent) {
+		down.push_back(id);
+	}
+	int common = down.empty() ? to : nodes[down.back()].parent;
+	for (int id = from; id != common; id = nodes[id].parent) {
+		up.push_back(id);
+	}
+	std::reverse(down.begin(), down.end());
+}
+
+
+/** Moves `recorded` and currentBank to another node.
+Each crossed edge swaps its side with the bank's, but waves are only rebuilt once however many edges change them, so long jumps cost about as much as the waves which differ.
+*/
+static void moveTo(int target) {
+	std::vector<int> up, down;
+	getPath(currentId, target, up, down);
+	std::vector<int> edges = up;
+	edges.insert(edges.end(), down.begin(), down.end());
+
+	int slots[BANK_LEN];
+	std::fill(slots, slots + BANK_LEN, -1);
+	std::vector<WaveSource> values;
+	std::shared_ptr<BankSource> bank;
+	for (int id : edges) {
+		HistoryStep *step = nodes[id].step.write();
+		for (WaveSource &source : step->waves) {
+			int &slot = slots[source.index];
+			if (slot < 0) {
+				slot = values.size();
+				values.emplace_back();
+				values.back().index = source.index;
+				getSource(values.back(), *recorded.waves[source.index]);
+			}
+			std::swap(values[slot], source);
+		}
+		if (step->bank) {
+			if (!bank) {
+				bank = std::make_shared<BankSource>();
+				getSource(*bank, recorded);
+			}
+			std::swap(bank, step->bank);
+		}
+	}
+	for (const WaveSource &source : values) {
+		setSource(recorded.waves[source.index], source);
+	}
+	if (bank) {
+		setSource(recorded, *bank);
+		recorded.renderCrossmod();
+	}
+	// Redo follows the path which was taken last
+	for (int id : down) {
+		nodes[nodes[id].parent].redoChild = id;
+	}
+	currentId = target;
+	currentBank = recorded;
+	currentBank.validateLater();
+}
+
+
+static void updateStats() {
+	historyStats.steps = 0;
+	historyStats.branches = 0;
+	historyStats.bytes = 0;
+	for (const auto &node : nodes) {
+		if (node.second.parent >= 0) {
+			historyStats.steps++;
+			historyStats.bytes += node.second.step->bytes;
+		}
+		if (node.second.children.empty())
+			historyStats.branches++;
+	}
+}
+
+
+static void removeStep(HistoryNode &node) {
+	historyStats.bytes -= node.step->bytes;
+	historyStats.steps--;
+	historyStats.evicted++;
+	node.step = CowPtr<HistoryStep>();
+}
+
+
+/** Drops the oldest states until history fits in the budget.
+The root goes first while it has a single child, then the oldest leaves which are not current. The current state always keeps one undo step.
+*/
+static void evict() {
+	if (journalReplaying)
+		return;
+	size_t budget = (size_t) historyBudget << 20;
+	while (historyStats.bytes > budget) {
+		HistoryNode &root = nodes[rootId];
+		if (root.children.size() == 1 && rootId != currentId && rootId != nodes[currentId].parent) {
+			// The current state is below the only child, so the child's edge only holds the root's side
+			int child = root.children[0];
+			nodes.erase(rootId);
+			HistoryNode &newRoot = nodes[child];
+			removeStep(newRoot);
+			newRoot.parent = -1;
+			rootId = child;
+			continue;
+		}
+		int victim = -1;
+		for (const auto &node : nodes) {
+			if (node.second.children.empty() && node.first != currentId) {
+				victim = node.first;
+				break;
+			}
+		}
+		if (victim < 0)
+			break;
+		HistoryNode &parent = nodes[nodes[victim].parent];
+		parent.children.erase(std::find(parent.children.begin(), parent.children.end(), victim));
+		if (parent.redoChild == victim)
+			parent.redoChild = parent.children.empty() ? -1 : parent.children.back();
+		removeStep(nodes[victim]);
+		nodes.erase(victim);
+	}
+	updateStats();
+}
+
+
+/** Records the difference between currentBank and the last push.
+With `merge` it is folded into the edge to the current node if that is a leaf, otherwise a new child of the current node is made, leaving its other children as branches.
+Returns false if there was nothing to record.
+*/
+static bool record(bool merge) {
+	if (currentId < 0) {
+		rootId = currentId = nextId++;
+		nodes[currentId].time = time(NULL);
+		recorded = currentBank;
+		updateStats();
+		autosaveEdit();
+		journalCheckpoint();
+		return true;
+	}
+
+	std::vector<int> waves;
+	diffWaves(recorded, currentBank, waves);
+	bool bank = !sourceEquals(recorded, currentBank);
+	// Pushing nothing would make an undo step which does nothing
+	if (waves.empty() && !bank)
+		return false;
+
+	// Changing a node with children would change the states below it too
+	if (merge && nodes[currentId].children.empty()) {
+		// The root has no edge to fold into, so its state is replaced
+		HistoryNode &node = nodes[currentId];
+		if (node.parent >= 0) {
+			HistoryStep *step = node.step.write();
+			addDifference(*step, recorded, waves, bank);
+			historyStats.lastStepBytes = step->bytes;
+		}
+	}
+	else {
+		int id = nextId++;
+		HistoryNode &node = nodes[id];
+		node.parent = currentId;
+		node.time = time(NULL);
+		addDifference(*node.step.write(), recorded, waves, bank);
+		historyStats.lastStepBytes = node.step->bytes;
+		HistoryNode &parent = nodes[currentId];
+		parent.children.push_back(id);
+		parent.redoChild = id;
+		currentId = id;
+		autosaveEdit();
+	}
+
+	recorded = currentBank;
+	updateStats();
+	evict();
+	journalEdit(merge, waves, bank);
+	return true;
+}
+
+
+static bool undo() {
+	if (currentId < 0 || nodes[currentId].parent < 0)
+		return false;
+	int id = currentId;
+	moveTo(nodes[id].parent);
+	nodes[currentId].redoChild = id;
+	return true;
+}
+
+
+static bool redo() {
+	if (currentId < 0 || nodes[currentId].redoChild < 0)
+		return false;
+	moveTo(nodes[currentId].redoChild);
+	return true;
+}
+
+
+static bool jump(int id) {
+	if (currentId < 0 || !nodes.count(id))
+		return false;
+	moveTo(id);
+	return true;
+}
 
 
 void historyPush() {
+	// Transactions are recorded as a whole when they are committed
+	if (transactionDepth > 0)
+		return;
 	double time = SDL_GetTicks() / 1000.0;
-	if (time - previousTime >= delayTime) {
-		currentIndex++;
-	}
+	bool merge = time - previousTime < delayTime;
+	// Pauses in a drag with nothing to record still keep its steps together
+	if (record(merge) || merge)
+		previousTime = time;
+}
 
-	// Delete redo history
-	history.resize(currentIndex + 1);
+void historyBegin() {
+	transactionDepth++;
+}
 
-	history[currentIndex] = currentBank;
-	previousTime = time;
+void historyCommit() {
+	if (transactionDepth <= 0)
+		return;
+	transactionDepth--;
+	if (transactionDepth > 0)
+		return;
+	// Neither merged into the previous step nor the next one
+	record(false);
+	previousTime = -INFINITY;
 }
 
 void historyUndo() {
-	if (currentIndex >= 1) {
-		currentIndex--;
-		currentBank = history[currentIndex];
+	if (undo()) {
+		journalUndo(false);
 		previousTime = -INFINITY;
 	}
 }
 
 void historyRedo() {
-	if ((int) history.size() > currentIndex + 1) {
-		currentIndex++;
-		currentBank = history[currentIndex];
+	if (redo()) {
+		journalUndo(true);
+		previousTime = -INFINITY;
+	}
+}
+
+void historyJump(int id) {
+	if (id != currentId && jump(id)) {
+		journalJump(id);
 		previousTime = -INFINITY;
 	}
 }
 
 void historyClear() {
-	history.clear();
-	currentIndex = -1;
+	nodes.clear();
+	rootId = currentId = -1;
+	nextId = 0;
+	recorded = Bank();
 	previousTime = -INFINITY;
+	updateStats();
+}
+
+
+void historyGetNodes(std::vector<HistoryNodeInfo> &infos) {
+	infos.clear();
+	if (rootId < 0)
+		return;
+	// Depth first without recursion, since a long session is a very deep tree. The first child continues its parent's column.
+	std::vector<std::pair<int, int>> stack;
+	stack.push_back(std::make_pair(rootId, 0));
+	while (!stack.empty()) {
+		int id = stack.back().first;
+		int column = stack.back().second;
+		stack.pop_back();
+		const HistoryNode &node = nodes[id];
+		HistoryNodeInfo info;
+		info.id = id;
+		info.parent = node.parent;
+		info.column = column;
+		info.time = node.time;
+		info.waves = node.parent >= 0 ? node.step->waves.size() : 0;
+		info.bank = node.parent >= 0 && node.step->bank;
+		info.current = id == currentId;
+		infos.push_back(info);
+		for (int i = node.children.size() - 1; i >= 0; i--) {
+			stack.push_back(std::make_pair(node.children[i], i == 0 ? column : column + 1));
+		}
+	}
 }
+
+
+bool historyCompare(int id, std::vector<int> &waves, float *samples, int waveId) {
+	waves.clear();
+	if (currentId < 0 || !nodes.count(id))
+		return false;
+	std::vector<int> up, down;
+	getPath(currentId, id, up, down);
+	std::vector<int> edges = up;
+	edges.insert(edges.end(), down.begin(), down.end());
+	// The side each edge holds is the one reached by crossing it, so the last value along the path is the node's
+	const WaveSource *values[BANK_LEN] = {};
+	bool bank = false;
+	for (int e : edges) {
+		const HistoryStep &step = *nodes[e].step;
+		for (const WaveSource &source : step.waves) {
+			values[source.index] = &source;
+		}
+		bank = bank || step.bank;
+	}
+	for (int i = 0; i < BANK_LEN; i++) {
+		if (!values[i])
+			continue;
+		const Wave &wave = *recorded.waves[i];
+		if (memcmp(values[i]->samples, wave.samples, sizeof(wave.samples)) != 0 || memcmp(values[i]->effects, wave.effects, sizeof(wave.effects)) != 0 || values[i]->cycle != wave.cycle || values[i]->normalize != wave.normalize)
+			waves.push_back(i);
+	}
+	if (samples && 0 <= waveId && waveId < BANK_LEN)
+		memcpy(samples, values[waveId] ? values[waveId]->samples : recorded.waves[waveId]->samples, sizeof(float) * WAVE_LEN);
+	return bank;
+}
+
+
+////////////////////
+// Journal
+////////////////////
+
+/** Layout of the journal file
+Header:
+	"WEHJ"
+	u32 version
+	u16 WAVE_LEN, BANK_LEN, EFFECTS_LEN, CROSSMOD_LEN
+	u32 sizeof(BaseWave), sizeof(FMMatrix)
+followed by records, each of which is
+	u32 size of the type and payload
+	u32 type
+	payload
+	u32 low bits of hashBytes() of the type and payload
+The first record is a checkpoint with the whole history, every later one replays a call of the history functions.
+Base waves and the FM matrix are stored as they are in memory, so a journal is only read by the build which wrote it. Other builds fall back to autosave.dat.
+*/
+
+#define JOURNAL_VERSION 2
+
+enum JournalRecordType {
+	/** i32 root id, i32 current id, i32 next id, u32 node count, the waves and bank source of the current state, then each node in order of id as i32 id, i32 parent, i32 redo child, i64 time, u32 wave count, u8 has bank source, and the waves and bank source of its edge */
+	JOURNAL_CHECKPOINT = 1,
+	/** u8 merge, u32 wave count, u8 has bank source, then the new waves and bank source */
+	JOURNAL_EDIT,
+	JOURNAL_UNDO,
+	JOURNAL_REDO,
+	/** i32 node id */
+	JOURNAL_JUMP,
+};
+
+static const int JOURNAL_HEADER_LEN = 24;
+/** Queued records the writer may fall behind by before they are replaced with a checkpoint */
+static const size_t journalQueueMax = 16 << 20;
+/** Records written since the last checkpoint before another one compacts the file, unless the history is larger */
+static const size_t journalCheckpointMin = 4 << 20;
+
+/** The history at one point, sharing its steps and waves instead of copying them */
+struct JournalSnapshot {
+	Bank recorded;
+	std::map<int, HistoryNode> nodes;
+	int rootId;
+	int currentId;
+	int nextId;
+};
+
+/** Either a record to append or a checkpoint which starts a new file */
+struct JournalJob {
+	std::vector<uint8_t> record;
+	std::shared_ptr<JournalSnapshot> snapshot;
+};
+
+static std::string journalFilename;
+static std::thread journalThread;
+static std::mutex journalMutex;
+static std::condition_variable journalCv;
+/** Guarded by journalMutex */
+static std::deque<JournalJob> journalQueue;
+static size_t journalQueueBytes = 0;
+static bool journalRunning = false;
+/** Journal fields of the writer, guarded by journalMutex and copied to historyStats whenever a job is queued */
+static HistoryStats writerStats = {};
+/** Only touched by the UI thread */
+static bool journalOpen = false;
+static size_t journalBytesSinceCheckpoint = 0;
+/** Only touched by the journal thread */
+static FILE *journalFile = NULL;
+
+
+static void put(std::vector<uint8_t> &buf, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t*) data;
+	buf.insert(buf.end(), p, p + len);
+}
+
+template <typename T>
+static void putValue(std::vector<uint8_t> &buf, T x) {
+	put(buf, &x, sizeof(x));
+}
+
+static void putWave(std::vector<uint8_t> &buf, int index, const float *samples, const float *effects, bool cycle, bool normalize) {
+	putValue<uint32_t>(buf, index);
+	put(buf, samples, sizeof(float) * WAVE_LEN);
+	put(buf, effects, sizeof(float) * EFFECTS_LEN);
+	putValue<uint8_t>(buf, cycle | (normalize << 1));
+}
+
+static void putBank(std::vector<uint8_t> &buf, const BankSource &source) {
+	put(buf, &*source.carrier_wave, sizeof(BaseWave));
+	put(buf, &*source.modulator_wave, sizeof(BaseWave));
+	put(buf, source.crossmod, sizeof(source.crossmod));
+	put(buf, &source.fm, sizeof(source.fm));
+}
+
+
+/** Reads a record payload, failing once it runs out */
+struct JournalReader {
+	const uint8_t *data;
+	size_t size;
+	size_t pos = 0;
+
+	bool get(void *out, size_t len) {
+		if (len > size - pos)
+			return false;
+		memcpy(out, data + pos, len);
+		pos += len;
+		return true;
+	}
+
+	template <typename T>
+	bool getValue(T *x) {
+		return get(x, sizeof(T));
+	}
+
+	bool getWave(WaveSource &source) {
+		uint32_t index;
+		uint8_t flags;
+		if (!getValue(&index) || index >= BANK_LEN)
+			return false;
+		source.index = index;
+		if (!get(source.samples, sizeof(source.samples)) || !get(source.effects, sizeof(source.effects)) || !getValue(&flags))
+			return false;
+		source.cycle = flags & 1;
+		source.normalize = flags & 2;
+		return true;
+	}
+
+	bool getBank(BankSource &source) {
+		return get(source.carrier_wave.write(), sizeof(BaseWave))
+			&& get(source.modulator_wave.write(), sizeof(BaseWave))
+			&& get(source.crossmod, sizeof(source.crossmod))
+			&& get(&source.fm, sizeof(source.fm));
+	}
+};
+
+
+static void putHeader(std::vector<uint8_t> &buf) {
+	put(buf, "WEHJ", 4);
+	putValue<uint32_t>(buf, JOURNAL_VERSION);
+	putValue<uint16_t>(buf, WAVE_LEN);
+	putValue<uint16_t>(buf, BANK_LEN);
+	putValue<uint16_t>(buf, EFFECTS_LEN);
+	putValue<uint16_t>(buf, CROSSMOD_LEN);
+	putValue<uint32_t>(buf, sizeof(BaseWave));
+	putValue<uint32_t>(buf, sizeof(FMMatrix));
+}
+
+/** Starts a record, which endRecord() finishes */
+static void beginRecord(std::vector<uint8_t> &buf, JournalRecordType type) {
+	buf.clear();
+	putValue<uint32_t>(buf, 0);
+	putValue<uint32_t>(buf, type);
+}
+
+static void endRecord(std::vector<uint8_t> &buf) {
+	uint32_t size = buf.size() - 4;
+	memcpy(&buf[0], &size, 4);
+	putValue<uint32_t>(buf, (uint32_t) hashBytes(&buf[4], size));
+}
+
+
+static double getTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/** Writes the snapshot to a new file which replaces the journal, and reopens it for the following records */
+static void writeCheckpoint(const JournalSnapshot &snapshot, HistoryStats &stats) {
+	double start = getTime();
+	std::vector<uint8_t> buf;
+	putHeader(buf);
+	std::vector<uint8_t> rec;
+	beginRecord(rec, JOURNAL_CHECKPOINT);
+	putValue<int32_t>(rec, snapshot.rootId);
+	putValue<int32_t>(rec, snapshot.currentId);
+	putValue<int32_t>(rec, snapshot.nextId);
+	putValue<uint32_t>(rec, snapshot.nodes.size());
+	for (int i = 0; i < BANK_LEN; i++) {
+		const Wave &wave = *snapshot.recorded.waves[i];
+		putWave(rec, i, wave.samples, wave.effects, wave.cycle, wave.normalize);
+	}
+	BankSource bankSource;
+	getSource(bankSource, snapshot.recorded);
+	putBank(rec, bankSource);
+	for (const auto &it : snapshot.nodes) {
+		const HistoryNode &node = it.second;
+		const CowPtr<HistoryStep> &step = node.step;
+		putValue<int32_t>(rec, it.first);
+		putValue<int32_t>(rec, node.parent);
+		putValue<int32_t>(rec, node.redoChild);
+		putValue<int64_t>(rec, node.time);
+		putValue<uint32_t>(rec, step->waves.size());
+		putValue<uint8_t>(rec, step->bank ? 1 : 0);
+		for (const WaveSource &source : step->waves) {
+			putWave(rec, source.index, source.samples, source.effects, source.cycle, source.normalize);
+		}
+		if (step->bank)
+			putBank(rec, *step->bank);
+	}
+	endRecord(rec);
+	put(buf, rec.data(), rec.size());
+
+	if (journalFile)
+		fclose(journalFile);
+	journalFile = NULL;
+	// The old journal stays in place until the new one is complete
+	std::string temp = journalFilename + ".tmp";
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (!f) {
+		stats.journalFailures++;
+		return;
+	}
+	bool success = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+	success = (fclose(f) == 0) && success;
+	if (!success || !replaceFile(temp.c_str(), journalFilename.c_str())) {
+		remove(temp.c_str());
+		stats.journalFailures++;
+		return;
+	}
+	journalFile = fopen(journalFilename.c_str(), "ab");
+	stats.journalBytes = buf.size();
+	stats.journalCheckpoints++;
+	stats.journalCheckpointTime = getTime() - start;
+}
+
+
+static void journalRun() {
+	std::unique_lock<std::mutex> lock(journalMutex);
+	while (true) {
+		if (journalQueue.empty()) {
+			if (!journalRunning)
+				break;
+			journalCv.wait(lock);
+			continue;
+		}
+		std::deque<JournalJob> jobs;
+		jobs.swap(journalQueue);
+		journalQueueBytes = 0;
+		HistoryStats stats = writerStats;
+		lock.unlock();
+
+		for (JournalJob &job : jobs) {
+			if (job.snapshot) {
+				writeCheckpoint(*job.snapshot, stats);
+			}
+			// Records after a failed checkpoint are dropped, the next checkpoint starts over
+			else if (journalFile) {
+				if (fwrite(job.record.data(), 1, job.record.size(), journalFile) == job.record.size())
+					stats.journalBytes += job.record.size();
+				else
+					stats.journalFailures++;
+			}
+		}
+		if (journalFile)
+			fflush(journalFile);
+		// Releases the snapshots here instead of on the UI thread
+		jobs.clear();
+
+		lock.lock();
+		writerStats.journalBytes = stats.journalBytes;
+		writerStats.journalCheckpoints = stats.journalCheckpoints;
+		writerStats.journalFailures = stats.journalFailures;
+		writerStats.journalCheckpointTime = stats.journalCheckpointTime;
+	}
+}
+
+
+static std::shared_ptr<JournalSnapshot> takeSnapshot() {
+	std::shared_ptr<JournalSnapshot> snapshot = std::make_shared<JournalSnapshot>();
+	snapshot->recorded = recorded;
+	snapshot->nodes = nodes;
+	snapshot->rootId = rootId;
+	snapshot->currentId = currentId;
+	snapshot->nextId = nextId;
+	return snapshot;
+}
+
+
+/** Never waits for the writer, only for the lock which it holds while taking the queue */
+static void queueJob(JournalJob &job) {
+	std::lock_guard<std::mutex> lock(journalMutex);
+	if (!job.snapshot && journalQueueBytes + job.record.size() > journalQueueMax) {
+		// The writer cannot keep up, so the queued records are replaced with a checkpoint which shares its memory with the history
+		journalQueue.clear();
+		journalQueueBytes = 0;
+		writerStats.journalOverflows++;
+		journalBytesSinceCheckpoint = 0;
+		job.record.clear();
+		job.snapshot = takeSnapshot();
+	}
+	journalQueueBytes += job.record.size();
+	journalQueue.push_back(std::move(job));
+	journalCv.notify_one();
+
+	historyStats.journalBytes = writerStats.journalBytes;
+	historyStats.journalCheckpoints = writerStats.journalCheckpoints;
+	historyStats.journalOverflows = writerStats.journalOverflows;
+	historyStats.journalFailures = writerStats.journalFailures;
+	historyStats.journalCheckpointTime = writerStats.journalCheckpointTime;
+}
+
+
+static void journalCheckpoint() {
+	if (!journalOpen || journalReplaying)
+		return;
+	JournalJob job;
+	job.snapshot = takeSnapshot();
+	journalBytesSinceCheckpoint = 0;
+	queueJob(job);
+}
+
+
+/** Called after the history has been updated, so a checkpoint can stand in for the record */
+static void journalRecord(JournalJob &job) {
+	journalBytesSinceCheckpoint += job.record.size();
+	if (journalBytesSinceCheckpoint > std::max(journalCheckpointMin, historyStats.bytes)) {
+		journalCheckpoint();
+		return;
+	}
+	queueJob(job);
+}
+
+
+static void journalEdit(bool merge, const std::vector<int> &waves, bool bank) {
+	if (!journalOpen || journalReplaying)
+		return;
+	JournalJob job;
+	beginRecord(job.record, JOURNAL_EDIT);
+	putValue<uint8_t>(job.record, merge);
+	putValue<uint32_t>(job.record, waves.size());
+	putValue<uint8_t>(job.record, bank);
+	for (int i : waves) {
+		const Wave &wave = *recorded.waves[i];
+		putWave(job.record, i, wave.samples, wave.effects, wave.cycle, wave.normalize);
+	}
+	if (bank) {
+		BankSource bankSource;
+		getSource(bankSource, recorded);
+		putBank(job.record, bankSource);
+	}
+	endRecord(job.record);
+	journalRecord(job);
+}
+
+
+static void journalUndo(bool redo) {
+	if (!journalOpen || journalReplaying)
+		return;
+	JournalJob job;
+	beginRecord(job.record, redo ? JOURNAL_REDO : JOURNAL_UNDO);
+	endRecord(job.record);
+	journalRecord(job);
+}
+
+
+static void journalJump(int id) {
+	if (!journalOpen || journalReplaying)
+		return;
+	JournalJob job;
+	beginRecord(job.record, JOURNAL_JUMP);
+	putValue<int32_t>(job.record, id);
+	endRecord(job.record);
+	journalRecord(job);
+}
+
+
+static bool replayCheckpoint(JournalReader &r) {
+	int32_t root, current, next;
+	uint32_t count;
+	if (!r.getValue(&root) || !r.getValue(&current) || !r.getValue(&next) || !r.getValue(&count))
+		return false;
+	Bank bank;
+	for (int i = 0; i < BANK_LEN; i++) {
+		WaveSource source;
+		if (!r.getWave(source))
+			return false;
+		setSource(bank.waves[source.index], source);
+	}
+	BankSource bankSource;
+	if (!r.getBank(bankSource))
+		return false;
+	setSource(bank, bankSource);
+
+	std::map<int, HistoryNode> tree;
+	for (uint32_t n = 0; n < count; n++) {
+		int32_t id, parent, redoChild;
+		int64_t time;
+		uint32_t len;
+		uint8_t hasBank;
+		if (!r.getValue(&id) || !r.getValue(&parent) || !r.getValue(&redoChild) || !r.getValue(&time))
+			return false;
+		if (!r.getValue(&len) || len > BANK_LEN || !r.getValue(&hasBank))
+			return false;
+		// Parents are written before their children, and only the root has none
+		if (id < 0 || id >= next || tree.count(id) || (parent < 0) != (id == root) || (parent >= 0 && !tree.count(parent)))
+			return false;
+		HistoryNode &node = tree[id];
+		node.parent = parent;
+		node.redoChild = redoChild;
+		node.time = time;
+		if (parent >= 0) {
+			tree[parent].children.push_back(id);
+			HistoryStep *st = node.step.write();
+			st->waves.resize(len);
+			for (WaveSource &source : st->waves) {
+				if (!r.getWave(source))
+					return false;
+			}
+			if (hasBank) {
+				st->bank = std::make_shared<BankSource>();
+				if (!r.getBank(*st->bank))
+					return false;
+			}
+			st->bytes = stepBytes(*st);
+		}
+	}
+	if (!tree.count(root) || !tree.count(current))
+		return false;
+	for (const auto &it : tree) {
+		int redoChild = it.second.redoChild;
+		if (redoChild >= 0 && !(tree.count(redoChild) && tree[redoChild].parent == it.first))
+			return false;
+	}
+
+	nodes.swap(tree);
+	rootId = root;
+	currentId = current;
+	nextId = next;
+	recorded = bank;
+	recorded.renderCrossmod();
+	currentBank = recorded;
+	updateStats();
+	return true;
+}
+
+
+static bool replayEdit(JournalReader &r) {
+	uint8_t merge, bank;
+	uint32_t count;
+	if (!r.getValue(&merge) || !r.getValue(&count) || count > BANK_LEN || !r.getValue(&bank))
+		return false;
+	for (uint32_t i = 0; i < count; i++) {
+		WaveSource source;
+		if (!r.getWave(source))
+			return false;
+		setSource(currentBank.waves[source.index], source);
+	}
+	if (bank) {
+		BankSource bankSource;
+		if (!r.getBank(bankSource))
+			return false;
+		setSource(currentBank, bankSource);
+		currentBank.renderCrossmod();
+	}
+	record(merge);
+	return true;
+}
+
+
+/** Replays the records of a journal. Stops at the first incomplete or damaged record, which is where a crash interrupted the writer. */
+static bool replay(const uint8_t *data, size_t size) {
+	std::vector<uint8_t> header;
+	putHeader(header);
+	if (size < JOURNAL_HEADER_LEN || memcmp(data, header.data(), JOURNAL_HEADER_LEN) != 0)
+		return false;
+
+	size_t pos = JOURNAL_HEADER_LEN;
+	bool restored = false;
+	while (pos + 12 <= size) {
+		uint32_t recordSize, type, check;
+		memcpy(&recordSize, data + pos, 4);
+		if (recordSize < 4 || recordSize > size - pos - 8)
+			break;
+		memcpy(&check, data + pos + 4 + recordSize, 4);
+		if ((uint32_t) hashBytes(data + pos + 4, recordSize) != check)
+			break;
+		memcpy(&type, data + pos + 4, 4);
+		JournalReader r;
+		r.data = data + pos + 8;
+		r.size = recordSize - 4;
+
+		bool success = false;
+		if (type == JOURNAL_CHECKPOINT)
+			success = replayCheckpoint(r);
+		// Everything else needs the checkpoint before it
+		else if (restored && type == JOURNAL_EDIT)
+			success = replayEdit(r);
+		else if (restored && type == JOURNAL_UNDO)
+			success = undo();
+		else if (restored && type == JOURNAL_REDO)
+			success = redo();
+		else if (restored && type == JOURNAL_JUMP) {
+			int32_t id;
+			success = r.getValue(&id) && jump(id);
+		}
+		if (!success)
+			break;
+		restored = true;
+		pos += recordSize + 8;
+	}
+	return restored;
+}
+
+
+bool historyJournalOpen(const char *filename) {
+	journalFilename = filename;
+	bool restored = false;
+	size_t size;
+	const uint8_t *data = mapFile(filename, &size);
+	if (data) {
+		journalReplaying = true;
+		restored = replay(data, size);
+		journalReplaying = false;
+		unmapFile(data, size);
+		if (restored) {
+			evict();
+			currentBank.validateLater();
+			previousTime = -INFINITY;
+		}
+		else {
+			historyClear();
+		}
+	}
+
+	journalRunning = true;
+	journalThread = std::thread(journalRun);
+	journalOpen = true;
+	// Rewrites the replayed journal without its damaged tail and evicted steps
+	if (restored)
+		journalCheckpoint();
+	return restored;
+}
+
+
+void historyJournalClose() {
+	if (!journalOpen)
+		return;
+	journalOpen = false;
+	{
+		std::lock_guard<std::mutex> lock(journalMutex);
+		journalRunning = false;
+		journalCv.notify_one();
+	}
+	journalThread.join();
+	if (journalFile)
+		fclose(journalFile);
+	journalFile = NULL;
+}
+
+} // namespace WAVETABLE_NAMESPACE
@@ -7,6 +7,8 @@
 #include <libgen.h>
 #include "osdialog/osdialog.h"
 
+namespace WAVETABLE_NAMESPACE {
+
 
 
 enum ImportMode {
@@ -108,7 +110,8 @@ static void computeImport(float *samples) {
 		return;
 	}
 
-	float importSamples[BANK_LEN * WAVE_LEN] = {};
+	Workspace ws;
+	float *importSamples = ws.calloc(BANK_LEN * WAVE_LEN);
 
 	// A bunch of weird constants to align the resampler correctly
 	// Basically x's and w's are indices for the audio array, y's are for the bank array
@@ -184,10 +187,13 @@ void importPage() {
 		playingBank = &importBank;
 		float amp = powf(10.0, gain / 20.0);
 
+		// Whole-bank buffers are too large for the stack with long waves
+		Workspace ws;
+
 		// Audio preview
 		ImGui::Text("Imported Audio Preview");
 		if (audioPreview) {
-			float audioPreviewGain[BANK_LEN * WAVE_LEN] = {};
+			float *audioPreviewGain = ws.alloc(BANK_LEN * WAVE_LEN);
 			for (int i = 0; i < BANK_LEN * WAVE_LEN; i++) {
 				audioPreviewGain[i] = amp * audioPreview[i];
 			}
@@ -212,7 +218,7 @@ void importPage() {
 		// Bank preview
 		ImGui::Text("Bank Preview");
 		// Initialize from previous bank
-		float bankSamples[BANK_LEN * WAVE_LEN];
+		float *bankSamples = ws.alloc(BANK_LEN * WAVE_LEN);
 		computeImport(bankSamples);
 		importBank.setSamples(bankSamples);
 		float deltaBank = renderBankWave("bank preview", 200.0, bankSamples,
@@ -295,3 +301,5 @@ void importPage() {
 	}
 	ImGui::EndChild();
 }
+
+} // namespace WAVETABLE_NAMESPACE
@@ -0,0 +1,185 @@
+#include "WaveEdit.hpp"
+#include <atomic>
+#include <deque>
+#include <string>
+
+namespace WAVETABLE_NAMESPACE {
+
+
+/** One queued file operation. Tasks run one at a time in the order they were queued. */
+struct IOTask {
+	std::string label;
+	bool load = false;
+	/** What to tell the user if `work` returns false */
+	std::string failure;
+	std::function<bool(Bank &bank)> work;
+	std::function<void()> done;
+	/** Staging bank for loads, snapshot for saves. Created when the task starts so it sees the result of earlier tasks. */
+	Bank *bank = NULL;
+	std::thread thread;
+	/** Written before `finished` is set */
+	bool failed = false;
+	std::atomic<bool> finished;
+	std::atomic<bool> cancelled;
+	std::atomic<float> progress;
+
+	IOTask() : finished(false), cancelled(false), progress(0.0) {}
+};
+
+
+static std::deque<IOTask*> ioQueue;
+static IOTask *ioCurrent = NULL;
+static thread_local IOTask *ioThreadTask = NULL;
+static std::string ioFailures;
+
+
+bool ioProgress(float progress) {
+	if (!ioThreadTask)
+		return true;
+	ioThreadTask->progress = progress;
+	return !ioThreadTask->cancelled;
+}
+
+
+static void ioRun(IOTask *task) {
+	ioThreadTask = task;
+	task->failed = !task->work(*task->bank);
+	ioThreadTask = NULL;
+	task->finished = true;
+}
+
+
+static void ioPush(IOTask *task) {
+	ioQueue.push_back(task);
+	// Start right away if idle
+	ioStep();
+}
+
+
+void ioLoad(const char *label, const char *filename, const std::function<bool(Bank &bank)> &load, const std::function<void()> &done) {
+	IOTask *task = new IOTask();
+	task->label = label;
+	task->load = true;
+	if (filename)
+		task->failure = stringf("Could not open %s", filename);
+	task->work = load;
+	task->done = done;
+	ioPush(task);
+}
+
+
+/** A file beside `filename` which keeps its name up to the extension, since some savers take the format or slot from it */
+static std::string tempFilename(const std::string &filename) {
+	size_t slash = filename.find_last_of("/\\");
+	size_t base = (slash == std::string::npos) ? 0 : slash + 1;
+	size_t dot = filename.find_last_of('.');
+	if (dot == std::string::npos || dot < base)
+		return filename + ".~tmp";
+	return filename.substr(0, dot) + ".~tmp" + filename.substr(dot);
+}
+
+
+void ioSave(const char *label, const char *filename, const std::function<bool(Bank &bank, const char *filename)> &save) {
+	std::string path = filename;
+	IOTask *task = new IOTask();
+	task->label = label;
+	task->failure = stringf("Could not save %s", filename);
+	task->work = [path, save](Bank &bank) {
+		// Never leave a half written file behind if saving fails or is cancelled, or the app dies
+		std::string temp = tempFilename(path);
+		bool saved = save(bank, temp.c_str());
+		if (!saved || ioThreadTask->cancelled || !replaceFile(temp.c_str(), path.c_str())) {
+			remove(temp.c_str());
+			return false;
+		}
+		return true;
+	};
+	ioPush(task);
+}
+
+
+void ioExport(const char *label, const std::function<void(Bank &bank)> &work, const std::function<void()> &done) {
+	IOTask *task = new IOTask();
+	task->label = label;
+	// Exports report the files which failed themselves
+	task->work = [work](Bank &bank) {
+		work(bank);
+		return true;
+	};
+	task->done = done;
+	ioPush(task);
+}
+
+
+void ioStep() {
+	if (ioCurrent && ioCurrent->finished) {
+		ioCurrent->thread.join();
+		if (ioCurrent->cancelled) {
+			// Nothing to commit or report
+		}
+		else if (ioCurrent->failed) {
+			// A failed load is not committed, which leaves currentBank as it was
+			if (!ioCurrent->failure.empty())
+				ioFailures += ioCurrent->failure + "\n";
+		}
+		else {
+			// Committing a load only swaps wave pointers, the decoding already happened on the I/O thread
+			if (ioCurrent->load)
+				currentBank = *ioCurrent->bank;
+			if (ioCurrent->done)
+				ioCurrent->done();
+		}
+		delete ioCurrent->bank;
+		delete ioCurrent;
+		ioCurrent = NULL;
+	}
+
+	if (!ioCurrent && !ioQueue.empty()) {
+		ioCurrent = ioQueue.front();
+		ioQueue.pop_front();
+		// Saves need a snapshot of the bank as it is now. Loads get one too, although the loaders clear it first.
+		ioCurrent->bank = new Bank(currentBank);
+		ioCurrent->thread = std::thread(ioRun, ioCurrent);
+	}
+}
+
+
+void ioCancel() {
+	for (IOTask *task : ioQueue) {
+		delete task;
+	}
+	ioQueue.clear();
+	if (ioCurrent)
+		ioCurrent->cancelled = true;
+}
+
+
+bool ioBusy() {
+	return ioCurrent || !ioQueue.empty();
+}
+
+
+const char *ioStatus(float *progress) {
+	if (!ioCurrent)
+		return NULL;
+	if (progress)
+		*progress = ioCurrent->progress;
+	return ioCurrent->label.c_str();
+}
+
+
+void ioFlush() {
+	while (ioBusy()) {
+		ioStep();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+
+std::string ioTakeFailures() {
+	std::string failures;
+	failures.swap(ioFailures);
+	return failures;
+}
+
+} // namespace WAVETABLE_NAMESPACE
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+
+// The rest of src/ is compiled once per format by the Makefile, each into the namespace named in WaveEdit.hpp
+namespace waveedit { int formatMain(int argc, char **argv); }
+namespace phmk2 { int formatMain(int argc, char **argv); }
+namespace blofeld { int formatMain(int argc, char **argv); }
+namespace large { int formatMain(int argc, char **argv); }
+
+
+struct Format {
+	const char *name;
+	int (*formatMain)(int argc, char **argv);
+};
+
+static const Format formats[] = {
+	{"WaveEdit", waveedit::formatMain},
+	{"PHMK2", phmk2::formatMain},
+	{"Blofeld", blofeld::formatMain},
+	{"Large", large::formatMain},
+};
+
+static const int formatsLen = sizeof(formats) / sizeof(formats[0]);
+
+// Picked with WT_FORMAT at build time, so `make WT_FORMAT=PHMK2 run` still starts in that format
+#if WAVETABLE_FORMAT_PHMK2
+static const int defaultFormat = 1;
+#elif WAVETABLE_FORMAT_BLOFELD
+static const int defaultFormat = 2;
+#elif WAVETABLE_FORMAT_LARGE
+static const int defaultFormat = 3;
+#else
+static const int defaultFormat = 0;
+#endif
+
+
+int main(int argc, char **argv) {
+	srand(time(NULL));
+
+	// `WaveEdit --format name ...` runs the editor or any headless command in that format
+	int format = defaultFormat;
+	if (argc >= 3 && strcmp(argv[1], "--format") == 0) {
+		format = -1;
+		for (int i = 0; i < formatsLen; i++) {
+			if (strcasecmp(argv[2], formats[i].name) == 0)
+				format = i;
+		}
+		if (format < 0) {
+			fprintf(stderr, "Unknown format %s, expected one of:", argv[2]);
+			for (int i = 0; i < formatsLen; i++) {
+				fprintf(stderr, " %s", formats[i].name);
+			}
+			fprintf(stderr, "\n");
+			return 1;
+		}
+		// Keep the program name in argv[0]
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+	return formats[format].formatMain(argc, argv);
+}
@@ -10,13 +10,22 @@
 #include "imgui/examples/imgui_impl_sdl.h"
 #include "imgui/examples/imgui_impl_opengl2.h"
 
-
 #ifdef ARCH_MAC
-
 #include <unistd.h> // for chdir
 #include <libgen.h> // for dirname
 #include <mach-o/dyld.h> // for _NSGetExecutablePath
 #include <limits.h> // for PATH_MAX?
+#endif
+
+
+#ifdef ARCH_LIN
+__asm__(".symver realpath,realpath@GLIBC_2.2.5");
+#endif
+
+namespace WAVETABLE_NAMESPACE {
+
+
+#ifdef ARCH_MAC
 
 void fixWorkingDirectory() {
 	char path[PATH_MAX];
@@ -38,13 +47,66 @@ void fixWorkingDirectory() {
 #endif
 
 
-#ifdef ARCH_LIN
-__asm__(".symver realpath,realpath@GLIBC_2.2.5");
-#endif
+/** Each format keeps its own session, since the journal only replays into the geometry it was written with.
+WaveEdit keeps the names from before there were formats.
+*/
+static std::string sessionFilename(int format, const char *name, const char *extension) {
+	if (format == FORMAT_WAVEEDIT)
+		return stringf("%s.%s", name, extension);
+	std::string formatName = wavetableFormats[format].name;
+	for (char &c : formatName) {
+		c = tolower(c);
+	}
+	return stringf("%s-%s.%s", name, formatName.c_str(), extension);
+}
 
+static bool fileExists(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	fclose(f);
+	return true;
+}
 
-int main(int argc, char **argv) {
-	srand(time(NULL));
+/** Builds for a single format all autosaved to autosave.dat. Moves one saved by another format to where that format now looks for it, before any format can convert and autosave over it. */
+static void migrateAutosave() {
+	int format = bankFileFormat("autosave.dat");
+	if (format < 0 || format == FORMAT_WAVEEDIT)
+		return;
+	std::string filename = sessionFilename(format, "autosave", "dat");
+	if (fileExists(filename.c_str()))
+		return;
+	if (replaceFile("autosave.dat", filename.c_str()))
+		printf("Moved the %s autosave.dat to %s\n", wavetableFormats[format].name, filename.c_str());
+}
+
+/** Renames a file which was not loaded to the first free "<filename>.<n>", so autosaving cannot replace it. Returns false if it is still in the way. */
+static bool keepAside(const char *filename) {
+	for (int i = 1; i < 1000; i++) {
+		std::string kept = stringf("%s.%d", filename, i);
+		if (fileExists(kept.c_str()))
+			continue;
+		if (!replaceFile(filename, kept.c_str()))
+			return false;
+		printf("Could not load %s, kept it as %s\n", filename, kept.c_str());
+		return true;
+	}
+	return false;
+}
+
+
+int formatMain(int argc, char **argv) {
+	// Headless export for scripts, before any window or change of working directory
+	if (argc >= 2 && strcmp(argv[1], "--export") == 0)
+		return exportCommand(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--midi") == 0)
+		return renderMidiCommand(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--audition") == 0)
+		return auditionCommand(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--stress") == 0)
+		return stressCommand(argc - 2, argv + 2);
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+		return benchCommand(argc - 2, argv + 2);
 
 #ifdef ARCH_MAC
 	fixWorkingDirectory();
@@ -86,9 +148,24 @@ int main(int argc, char **argv) {
 
 	// Initialize modules
 	uiInit();
+	validateInit();
 	historyClear();
-	currentBank.load("autosave.dat");
-	historyPush();
+	migrateAutosave();
+	std::string autosaveFilename = sessionFilename(currentFormat, "autosave", "dat");
+	std::string journalFilename = sessionFilename(currentFormat, "history", "journal");
+	// The journal also restores the undo history, the autosave is the fallback
+	bool autosaveSafe = true;
+	if (!historyJournalOpen(journalFilename.c_str())) {
+		// Another format's autosave which could not be moved would be converted, so it counts as unreadable too
+		int format = bankFileFormat(autosaveFilename.c_str());
+		if (format == currentFormat)
+			currentBank.load(autosaveFilename.c_str());
+		else if (fileExists(autosaveFilename.c_str()))
+			autosaveSafe = keepAside(autosaveFilename.c_str());
+		historyPush();
+	}
+	// Never autosave over a file which might hold someone's work
+	autosaveInit(autosaveSafe ? autosaveFilename.c_str() : NULL);
 	catalogInit();
 	audioInit();
 	dbInit();
@@ -105,6 +182,12 @@ int main(int argc, char **argv) {
 			}
 		}
 
+		// Commit finished loads before anything reads the bank this frame
+		ioStep();
+		autosaveStep();
+		// Loads, undo and edits leave waves stale, and playback keeps their previous version until they are computed
+		currentBank.validateLater();
+
 		// Start the Dear ImGui frame
 		ImGui_ImplOpenGL2_NewFrame();
 		ImGui_ImplSDL2_NewFrame(window);
@@ -122,10 +205,10 @@ int main(int argc, char **argv) {
 			snprintf(lastBasename, sizeof(lastBasename), "%s", lastFilename);
 			lastBasenameP = basename(lastBasename);
 #endif
-			snprintf(newTitle, sizeof(newTitle), "Synthesis Technology WaveEdit - %s", lastBasenameP);
+			snprintf(newTitle, sizeof(newTitle), "Synthesis Technology WaveEdit (%s) - %s", wavetableFormats[currentFormat].name, lastBasenameP);
 		}
 		else {
-			snprintf(newTitle, sizeof(newTitle), "Synthesis Technology WaveEdit");
+			snprintf(newTitle, sizeof(newTitle), "Synthesis Technology WaveEdit (%s)", wavetableFormats[currentFormat].name);
 		}
 		if (strcmp(title, newTitle) != 0) {
 			SDL_SetWindowTitle(window, newTitle);
@@ -137,6 +220,8 @@ int main(int argc, char **argv) {
 			// Build render buffer
 			uiRender();
 		}
+		// Hand this frame's changes of the play globals to the audio thread
+		audioStep();
 
 		// Render frame
 		ImGui::Render();
@@ -147,9 +232,13 @@ int main(int argc, char **argv) {
 		SDL_GL_SwapWindow(window);
 	}
 
-	currentBank.save("autosave.dat");
+	// Let queued saves finish before quitting
+	ioFlush();
+	autosaveDestroy();
+	historyJournalClose();
 
 	// Cleanup
+	validateDestroy();
 	uiDestroy();
 	ImGui_ImplSDL2_Shutdown();
 	SDL_GL_DeleteContext(glContext);
@@ -157,3 +246,5 @@ int main(int argc, char **argv) {
 	SDL_Quit();
 	return 0;
 }
+
+} // namespace WAVETABLE_NAMESPACE
@@ -2,32 +2,56 @@
 #include <string.h>
 #include "pffft/pffft.h"
 #include <samplerate.h>
+#include <map>
+#include <mutex>
 
+namespace WAVETABLE_NAMESPACE {
 
-static void FFT(const float *in, float *out, int len, bool inverse) {
-	PFFFT_Setup *setup = pffft_new_setup(len, PFFFT_REAL);
-	float *work = NULL;
-	if (len >= 4096)
-		work = (float*)pffft_aligned_malloc(sizeof(float) * len);
-	pffft_transform_ordered(setup, in, out, work, inverse ? PFFFT_BACKWARD : PFFFT_FORWARD);
-	pffft_destroy_setup(setup);
-	if (work)
-		pffft_aligned_free(work);
+
+/** Returns the shared setup for real FFTs of `len` samples. Setups are kept until exit, there are only a few lengths. */
+static PFFFT_Setup *fftSetup(int len) {
+	static std::mutex setupsMutex;
+	static std::map<int, PFFFT_Setup*> setups;
+	std::lock_guard<std::mutex> lock(setupsMutex);
+	PFFFT_Setup *&setup = setups[len];
+	if (!setup)
+		setup = pffft_new_setup(len, PFFFT_REAL);
+	return setup;
+}
+
+
+static void FFT(const float *in, float *out, int len, int count, bool inverse) {
+	PFFFT_Setup *setup = fftSetup(len);
+	Workspace ws;
+	float *work = ws.alloc(len);
+	for (int i = 0; i < count; i++) {
+		pffft_transform_ordered(setup, in + i * len, out + i * len, work, inverse ? PFFFT_BACKWARD : PFFFT_FORWARD);
+	}
 }
 
 
 void RFFT(const float *in, float *out, int len) {
-	FFT(in, out, len, false);
+	RFFTBatch(in, out, len, 1);
+}
+
+
+void IRFFT(const float *in, float *out, int len) {
+	IRFFTBatch(in, out, len, 1);
+}
+
+
+void RFFTBatch(const float *in, float *out, int len, int count) {
+	FFT(in, out, len, count, false);
 
 	float a = 1.0 / len;
-	for (int i = 0; i < len; i++) {
+	for (int i = 0; i < len * count; i++) {
 		out[i] *= a;
 	}
 }
 
 
-void IRFFT(const float *in, float *out, int len) {
-	FFT(in, out, len, true);
+void IRFFTBatch(const float *in, float *out, int len, int count) {
+	FFT(in, out, len, count, true);
 }
 
 
@@ -46,13 +70,13 @@ int resample(const float *in, int inLen, float *out, int outLen, double ratio) {
 
 
 void cyclicOversample(const float *in, float *out, int len, int oversample) {
-	float x[len * oversample];
-	memset(x, 0, sizeof(x));
+	Workspace ws;
+	float *x = ws.calloc(len * oversample);
 	// Zero-stuff oversampled buffer
 	for (int i = 0; i < len; i++) {
 		x[i * oversample] = in[i] * oversample;
 	}
-	float fft[len * oversample];
+	float *fft = ws.alloc(len * oversample);
 	RFFT(x, fft, len * oversample);
 
 	// Apply brick wall filter
@@ -69,8 +93,9 @@ void cyclicOversample(const float *in, float *out, int len, int oversample) {
 
 
 void cyclicUndersample(const float *in, float *out, int len, int undersample) {
-	float x[len];
-	float fft[len];
+	Workspace ws;
+	float *x = ws.alloc(len);
+	float *fft = ws.alloc(len);
 	
 	RFFT(in, fft, len);
 
@@ -93,6 +118,39 @@ void cyclicUndersample(const float *in, float *out, int len, int undersample) {
 }
 
 
+void cyclicResample(const float *in, int inLen, float *out, int outLen, int count) {
+	Workspace ws;
+	float *fft = ws.alloc((size_t) inLen * count);
+	RFFTBatch(in, fft, inLen, count);
+	float *outFft = ws.calloc((size_t) outLen * count);
+	// RFFT is normalized, so the bins can be copied as-is
+	int len = mini(inLen, outLen);
+	for (int i = 0; i < count; i++) {
+		memcpy(&outFft[i * outLen], &fft[i * inLen], sizeof(float) * len);
+		// y_{N/2} = 0, since the Nyquist bin of either length is not a bin of the other
+		outFft[i * outLen + 1] = 0.0;
+	}
+	IRFFTBatch(outFft, out, outLen, count);
+}
+
+void computeMips(const float *in, int len, float *mips) {
+	Workspace ws;
+	float *fft = ws.alloc(len);
+	RFFT(in, fft, len);
+	// y_{N/2} = 0, the Nyquist bin has no phase to play back at other lengths
+	fft[1] = 0.0;
+	float *levelFft = ws.alloc(mipLength(len, 0));
+	for (int level = 0; level < mipLevels(len); level++) {
+		int levelLen = mipLength(len, level);
+		int harmonics = len / 2 >> level;
+		memset(levelFft, 0, sizeof(float) * levelLen);
+		// RFFT is normalized, so the bins can be copied as-is
+		memcpy(levelFft, fft, sizeof(float) * 2 * mini(harmonics + 1, len / 2));
+		IRFFT(levelFft, &mips[mipOffset(len, level)], levelLen);
+	}
+}
+
+
 void i16_to_f32(const int16_t *in, float *out, int length) {
 	for (int i = 0; i < length; i++) {
 		out[i] = in[i] / 32767.f;
@@ -104,3 +162,5 @@ void f32_to_i16(const float *in, int16_t *out, int length) {
 		out[i] = roundf(clampf(in[i], -1.0, 1.0) * 32767.f);
 	}
 }
+
+} // namespace WAVETABLE_NAMESPACE
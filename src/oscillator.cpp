@@ -1,6 +1,8 @@
 #include "WaveEdit.hpp"
 #include <string.h>
 
+namespace WAVETABLE_NAMESPACE {
+
 
 void Oscillator::render(WaveShapeID lower_a, WaveShapeID lower_b, float lower_ratio, WaveShapeID upper_a, WaveShapeID upper_b, float upper_ratio, float *samples) {
 	float compensation_a[WAVE_LEN] = {};
@@ -253,3 +255,5 @@ void Oscillator::trapezoidWave(bool lower, bool upper, float *samples, float *co
 		};
 	}
 };
+
+} // namespace WAVETABLE_NAMESPACE
@@ -0,0 +1,616 @@
+#include "WaveEdit.hpp"
+#include <string.h>
+#include <chrono>
+#include <string>
+#include "MidiFile.h"
+
+namespace WAVETABLE_NAMESPACE {
+
+
+/** Notes fade in and out linearly over these times, so starting and stopping mid-cycle does not click */
+#define MIDI_ATTACK_TIME 0.002
+#define MIDI_RELEASE_TIME 0.05
+#define MIDI_CHANNELS 16
+
+
+enum MidiRenderEventType {
+	MIDI_NOTE_ON,
+	MIDI_NOTE_OFF,
+	MIDI_CONTROLLER,
+};
+
+/** The part of a MIDI message the renderer uses, at the output sample it takes effect */
+struct MidiRenderEvent {
+	int frame;
+	MidiRenderEventType type;
+	int channel;
+	/** Key or controller number */
+	int number;
+	/** Velocity or controller value */
+	int value;
+};
+
+struct MidiVoice {
+	bool active = false;
+	bool released = false;
+	int channel = 0;
+	int note = 0;
+	/** Number of notes started before this one, to steal the oldest voice */
+	int order = 0;
+	/** Phase in cycles as 32-bit fixed point and its increment per sample */
+	uint32_t phase = 0;
+	uint32_t phaseStep = 0;
+	MipChoice mip;
+	/** Gain from the velocity */
+	float level = 0.0;
+	/** Position of the attack or release fade, from 0 to 1 */
+	float envelope = 0.0;
+};
+
+/** Morph position of a MIDI channel, shared by its voices */
+struct MidiChannelMorph {
+	/** Where the controllers last set it */
+	float x, y, z;
+	/** Where the previous block ended. Each block ramps from here to the controller position. */
+	float lastX, lastY, lastZ;
+};
+
+
+static double getTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static bool writeFile(const std::string &path, const std::vector<uint8_t> &buf) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f)
+		return false;
+	bool success = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+	return (fclose(f) == 0) && success;
+}
+
+
+/** Reads the note and controller messages of all tracks, in time order */
+static bool readMidiEvents(const char *filename, float sampleRate, std::vector<MidiRenderEvent> &events) {
+	smf::MidiFile midi;
+	if (!midi.read(filename))
+		return false;
+	midi.joinTracks();
+	midi.doTimeAnalysis();
+
+	smf::MidiEventList &list = midi[0];
+	for (int i = 0; i < list.size(); i++) {
+		smf::MidiEvent &message = list[i];
+		MidiRenderEvent event;
+		event.frame = (int) lround(message.seconds * sampleRate);
+		event.channel = message.getChannel();
+		// Note on with a velocity of 0 counts as note off
+		if (message.isNoteOn()) {
+			event.type = MIDI_NOTE_ON;
+			event.number = message.getKeyNumber();
+			event.value = message.getVelocity();
+		}
+		else if (message.isNoteOff()) {
+			event.type = MIDI_NOTE_OFF;
+			event.number = message.getKeyNumber();
+			event.value = 0;
+		}
+		else if (message.isController()) {
+			event.type = MIDI_CONTROLLER;
+			event.number = message.getControllerNumber();
+			event.value = message.getControllerValue();
+		}
+		else {
+			continue;
+		}
+		event.channel = clampi(event.channel, 0, MIDI_CHANNELS - 1);
+		events.push_back(event);
+	}
+	return true;
+}
+
+
+bool renderMidi(const Bank &bank, const char *midiFilename, std::vector<uint8_t> &out, const MidiRenderSettings &settings, MidiRenderStats *stats) {
+	double startTime = getTime();
+	float sampleRate = settings.sampleRate;
+	std::vector<MidiRenderEvent> events;
+	if (!readMidiEvents(midiFilename, sampleRate, events))
+		return false;
+	// Blocks skip waves without mips, so every wave is computed up front
+	for (int w = 0; w < BANK_LEN; w++) {
+		bank.waves[w]->validate(WAVE_MIPS);
+	}
+	std::shared_ptr<const PlaySnapshot> snapshot = makePlaySnapshot(bank);
+
+	int releaseFrames = (int) ceilf(MIDI_RELEASE_TIME * sampleRate);
+	int lastFrame = events.empty() ? 0 : events.back().frame;
+	int frames = lastFrame + releaseFrames;
+	std::vector<int16_t> pcm(frames);
+
+	std::vector<MidiVoice> voices(maxi(settings.polyphony, 1));
+	MidiChannelMorph channels[MIDI_CHANNELS];
+	for (MidiChannelMorph &channel : channels) {
+		channel.x = channel.lastX = clampf(settings.morphX, 0.0, BANK_GRID_WIDTH - 1);
+		channel.y = channel.lastY = clampf(settings.morphY, 0.0, BANK_GRID_HEIGHT - 1);
+		channel.z = channel.lastZ = clampf(settings.morphZ, 0.0, BANK_LEN - 1);
+	}
+	RenderMode mode = settings.modeXY ? RENDER_XY : RENDER_Z;
+	float gain = powf(10.0, settings.volume / 20.0);
+	float attackStep = 1.0 / (MIDI_ATTACK_TIME * sampleRate);
+	float releaseStep = 1.0 / (MIDI_RELEASE_TIME * sampleRate);
+	MidiRenderStats result;
+
+	auto noteOn = [&](int channel, int note, int velocity) {
+		// A free voice, otherwise the oldest released one, otherwise the oldest
+		MidiVoice *voice = NULL;
+		for (MidiVoice &v : voices) {
+			if (!v.active) {
+				voice = &v;
+				break;
+			}
+			if (!voice || (v.released && !voice->released) || (v.released == voice->released && v.order < voice->order))
+				voice = &v;
+		}
+		if (voice->active)
+			result.stolen++;
+		float frequency = 440.0 * powf(2.0, (note - 69) / 12.0);
+		voice->active = true;
+		voice->released = false;
+		voice->channel = channel;
+		voice->note = note;
+		voice->order = result.notes++;
+		voice->phase = 0;
+		voice->phaseStep = phaseIncrement(frequency, sampleRate);
+		voice->mip = chooseMips(frequency, sampleRate);
+		voice->level = velocity / 127.0;
+		voice->envelope = 0.0;
+	};
+	auto noteOff = [&](int channel, int note) {
+		for (MidiVoice &v : voices) {
+			if (v.active && v.channel == channel && v.note == note)
+				v.released = true;
+		}
+	};
+	auto controller = [&](int channel, int number, int value) {
+		float v = value / 127.0;
+		MidiChannelMorph &morph = channels[channel];
+		if (number == settings.controllerX)
+			morph.x = v * (BANK_GRID_WIDTH - 1);
+		if (number == settings.controllerY)
+			morph.y = v * (BANK_GRID_HEIGHT - 1);
+		if (number == settings.controllerZ)
+			morph.z = v * (BANK_LEN - 1);
+	};
+
+	MipTaps taps0, taps1;
+	float mix[AUDIO_BLOCK_LEN];
+	float voiceOut[AUDIO_BLOCK_LEN];
+	size_t next = 0;
+	int frame = 0;
+	while (frame < frames) {
+		// Blocks end at the next event, so every event takes effect at its own sample
+		for (; next < events.size() && events[next].frame <= frame; next++) {
+			const MidiRenderEvent &event = events[next];
+			if (event.type == MIDI_NOTE_ON)
+				noteOn(event.channel, event.number, event.value);
+			else if (event.type == MIDI_NOTE_OFF)
+				noteOff(event.channel, event.number);
+			else
+				controller(event.channel, event.number, event.value);
+		}
+		// Notes still held at the end fade out
+		if (next == events.size()) {
+			for (MidiVoice &v : voices) {
+				v.released = true;
+			}
+		}
+		int len = mini(AUDIO_BLOCK_LEN, frames - frame);
+		if (next < events.size())
+			len = mini(len, events[next].frame - frame);
+
+		MorphRamp ramps[MIDI_CHANNELS];
+		for (int c = 0; c < MIDI_CHANNELS; c++) {
+			MidiChannelMorph &morph = channels[c];
+			ramps[c].x0 = morph.lastX;
+			ramps[c].x1 = morph.lastX = morph.x;
+			ramps[c].y0 = morph.lastY;
+			ramps[c].y1 = morph.lastY = morph.y;
+			ramps[c].z0 = morph.lastZ;
+			ramps[c].z1 = morph.lastZ = morph.z;
+		}
+
+		// Each voice renders the whole block into its own buffer, then fades and adds it to the mix
+		memset(mix, 0, sizeof(mix));
+		int sounding = 0;
+		for (MidiVoice &v : voices) {
+			if (!v.active)
+				continue;
+			sounding++;
+			if (v.mip.mix < 1.0)
+				computeTaps(taps0, v.mip.len0, v.phase, v.phaseStep, len);
+			if (v.mip.mix > 0.0)
+				computeTaps(taps1, v.mip.len1, v.phase, v.phaseStep, len);
+			v.phase += v.phaseStep * (uint32_t) len;
+			renderBlock(mode, *snapshot, ramps[v.channel], v.mip, taps0, taps1, voiceOut, len);
+
+			float envelope = v.envelope;
+			float step = v.released ? -releaseStep : attackStep;
+			float level = v.level;
+			for (int j = 0; j < len; j++) {
+				mix[j] += level * clampf(envelope + step * (j + 1), 0.f, 1.f) * voiceOut[j];
+			}
+			v.envelope = clampf(envelope + step * len, 0.0, 1.0);
+			if (v.released && v.envelope <= 0.0)
+				v.active = false;
+		}
+		result.peakVoices = maxi(result.peakVoices, sounding);
+		result.voiceSeconds += (double) sounding * len / sampleRate;
+
+		for (int j = 0; j < len; j++) {
+			float v = mix[j] * gain;
+			if (fabsf(v) > 1.0)
+				result.clipped++;
+			pcm[frame + j] = (int16_t) lrintf(clampf(v, -1.0, 1.0) * 32767.0);
+		}
+		frame += len;
+	}
+
+	wavEncode(out, pcm.data(), pcm.size(), settings.sampleRate);
+	result.duration = (double) frames / sampleRate;
+	result.time = getTime() - startTime;
+	if (stats)
+		*stats = result;
+	return true;
+}
+
+
+/** Parses "x,y,z" controller numbers */
+static bool parseControllers(const char *str, MidiRenderSettings &settings) {
+	int x, y, z;
+	if (sscanf(str, "%d,%d,%d", &x, &y, &z) != 3)
+		return false;
+	settings.controllerX = x;
+	settings.controllerY = y;
+	settings.controllerZ = z;
+	return true;
+}
+
+
+int renderMidiCommand(int argc, char **argv) {
+	MidiRenderSettings settings;
+	int arg = 0;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char *option = argv[arg];
+		const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+		if (strcmp(option, "--xy") == 0) {
+			settings.modeXY = true;
+		}
+		else if (strcmp(option, "--rate") == 0 && value) {
+			settings.sampleRate = clampi(atoi(value), 8000, 192000);
+			arg++;
+		}
+		else if (strcmp(option, "--voices") == 0 && value) {
+			settings.polyphony = clampi(atoi(value), 1, 256);
+			arg++;
+		}
+		else if (strcmp(option, "--volume") == 0 && value) {
+			settings.volume = atof(value);
+			arg++;
+		}
+		else if (strcmp(option, "--cc") == 0 && value && parseControllers(value, settings)) {
+			arg++;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", option);
+			return 1;
+		}
+	}
+	if (argc - arg < 3) {
+		fprintf(stderr, "Usage: WaveEdit --midi [options] <file.mid> <directory> <bank>...\n");
+		fprintf(stderr, "Renders the MIDI file through each bank to <directory>/<bank name>.wav\n");
+		fprintf(stderr, "  --xy          morph across the grid with X and Y instead of along Z\n");
+		fprintf(stderr, "  --cc x,y,z    controllers which set morph X, Y and Z, %d,%d,%d by default\n", settings.controllerX, settings.controllerY, settings.controllerZ);
+		fprintf(stderr, "  --voices n    polyphony, %d by default\n", settings.polyphony);
+		fprintf(stderr, "  --rate hz     sample rate, %d by default\n", settings.sampleRate);
+		fprintf(stderr, "  --volume db   output gain, %g by default\n", settings.volume);
+		return 1;
+	}
+	const char *midiFilename = argv[arg];
+	const char *dirname = argv[arg + 1];
+	char **banks = &argv[arg + 2];
+	int count = argc - arg - 2;
+
+	// Each bank renders on its own thread
+	std::vector<std::string> reports(count);
+	std::vector<MidiRenderStats> stats(count);
+	// Not vector<bool>, whose packed bits the workers would race on
+	std::vector<char> failed(count, false);
+	double startTime = getTime();
+	parallelFor(count, [&](int i) {
+		Bank *bank = new Bank();
+		std::string name;
+		std::vector<uint8_t> wav;
+		if (!exportLoadBank(*bank, banks[i], &name)) {
+			reports[i] = stringf("Could not open %s", banks[i]);
+			failed[i] = true;
+		}
+		else if (!renderMidi(*bank, midiFilename, wav, settings, &stats[i])) {
+			reports[i] = stringf("Could not read %s", midiFilename);
+			failed[i] = true;
+		}
+		else {
+			std::string path = stringf("%s/%s.wav", dirname, name.c_str());
+			if (writeFile(path, wav)) {
+				const MidiRenderStats &s = stats[i];
+				reports[i] = stringf("%s: %.1f s, %d notes, peak %d voices, %d stolen, %d clipped, %.1fx realtime, %.1f voices x realtime",
+					path.c_str(), s.duration, s.notes, s.peakVoices, s.stolen, s.clipped, s.duration / s.time, s.voiceSeconds / s.time);
+			}
+			else {
+				reports[i] = stringf("Could not write %s", path.c_str());
+				failed[i] = true;
+			}
+		}
+		delete bank;
+	});
+	double time = getTime() - startTime;
+
+	int failures = 0;
+	double duration = 0.0;
+	double voiceSeconds = 0.0;
+	for (int i = 0; i < count; i++) {
+		fprintf(failed[i] ? stderr : stdout, "%s\n", reports[i].c_str());
+		if (failed[i]) {
+			failures++;
+			continue;
+		}
+		duration += stats[i].duration;
+		voiceSeconds += stats[i].voiceSeconds;
+	}
+	if (count > 1)
+		printf("Rendered %d banks in %.2f s, %.1fx realtime, %.1f voices x realtime\n", count - failures, time, duration / time, voiceSeconds / time);
+	return failures > 0 ? 1 : 0;
+}
+
+
+/** Position along the polyline through `points` of x, y pairs, at fraction `t` of its length */
+static void pathAt(const std::vector<float> &points, float t, float &x, float &y) {
+	int count = points.size() / 2;
+	x = points[0];
+	y = points[1];
+	float length = 0.0;
+	for (int i = 1; i < count; i++) {
+		length += hypotf(points[2 * i] - points[2 * i - 2], points[2 * i + 1] - points[2 * i - 1]);
+	}
+	float distance = t * length;
+	for (int i = 1; i < count; i++) {
+		float dx = points[2 * i] - points[2 * i - 2];
+		float dy = points[2 * i + 1] - points[2 * i - 1];
+		float segment = hypotf(dx, dy);
+		if (distance <= segment || i == count - 1) {
+			float f = segment > 0.0 ? clampf(distance / segment, 0.0, 1.0) : 0.0;
+			x = points[2 * i - 2] + dx * f;
+			y = points[2 * i - 1] + dy * f;
+			return;
+		}
+		distance -= segment;
+	}
+}
+
+
+void renderAudition(const Bank &bank, const AuditionSettings &settings, std::vector<uint8_t> &out, AuditionStats *stats) {
+	double startTime = getTime();
+	float sampleRate = settings.sampleRate;
+	int frames = maxi((int) (settings.duration * sampleRate), 1);
+	std::vector<int16_t> pcm(frames);
+	for (int w = 0; w < BANK_LEN; w++) {
+		bank.waves[w]->validate(WAVE_MIPS);
+	}
+	std::shared_ptr<const PlaySnapshot> snapshot = makePlaySnapshot(bank);
+
+	std::vector<float> points = settings.xyPath;
+	if (points.size() < 2) {
+		// Every row, alternating direction
+		points.clear();
+		for (int y = 0; y < BANK_GRID_HEIGHT; y++) {
+			points.push_back(y % 2 ? BANK_GRID_WIDTH - 1 : 0);
+			points.push_back(y);
+			points.push_back(y % 2 ? 0 : BANK_GRID_WIDTH - 1);
+			points.push_back(y);
+		}
+	}
+
+	PlayParameters params;
+	params.volume = settings.volume;
+	params.modeXY = (settings.path == AUDITION_XY_PATH);
+	params.interpolate = (settings.path != AUDITION_WAVE);
+	params.z = settings.wave;
+	Player *player = new Player();
+	float block[AUDIO_BLOCK_LEN];
+	for (int frame = 0; frame < frames; frame += AUDIO_BLOCK_LEN) {
+		int len = mini(AUDIO_BLOCK_LEN, frames - frame);
+		// The path is followed like the morph controls moved by hand, so the player smooths it the same way
+		float t = (float) (frame + len) / frames;
+		if (settings.path == AUDITION_Z_SWEEP)
+			params.z = t * (BANK_LEN - 1);
+		else if (settings.path == AUDITION_XY_PATH)
+			pathAt(points, t, params.x, params.y);
+		if (frame == 0)
+			player->snapMorph(params);
+		player->render(*snapshot, params, settings.frequency, sampleRate, block, len);
+		for (int j = 0; j < len; j++) {
+			pcm[frame + j] = (int16_t) lrintf(block[j] * 32767.0);
+		}
+	}
+	delete player;
+
+	wavEncode(out, pcm.data(), pcm.size(), settings.sampleRate);
+	if (stats) {
+		stats->duration = (double) frames / sampleRate;
+		stats->time = getTime() - startTime;
+	}
+}
+
+
+/** Parses a list of numbers separated by `,` or `:` */
+static std::vector<float> parseNumbers(const char *str) {
+	std::vector<float> numbers;
+	const char *p = str;
+	while (*p) {
+		char *end;
+		float v = strtof(p, &end);
+		if (end == p)
+			return std::vector<float>();
+		numbers.push_back(v);
+		p = end;
+		if (*p == ',' || *p == ':')
+			p++;
+	}
+	return numbers;
+}
+
+
+int auditionCommand(int argc, char **argv) {
+	AuditionSettings settings;
+	std::vector<float> pitches = {220.0};
+	int threads = 0;
+	int arg = 0;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char *option = argv[arg];
+		const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+		if (strcmp(option, "--sweep") == 0) {
+			settings.path = AUDITION_Z_SWEEP;
+		}
+		else if (strcmp(option, "--wave") == 0 && value) {
+			settings.path = AUDITION_WAVE;
+			settings.wave = clampi(atoi(value), 0, BANK_LEN - 1);
+			arg++;
+		}
+		else if (strcmp(option, "--xy") == 0) {
+			settings.path = AUDITION_XY_PATH;
+		}
+		else if (strcmp(option, "--path") == 0 && value) {
+			settings.path = AUDITION_XY_PATH;
+			settings.xyPath = parseNumbers(value);
+			if (settings.xyPath.size() < 2 || settings.xyPath.size() % 2 != 0) {
+				fprintf(stderr, "Expected x,y:x,y... in \"%s\"\n", value);
+				return 1;
+			}
+			arg++;
+		}
+		else if (strcmp(option, "--pitch") == 0 && value) {
+			pitches = parseNumbers(value);
+			if (pitches.empty()) {
+				fprintf(stderr, "Expected frequencies in \"%s\"\n", value);
+				return 1;
+			}
+			for (float &pitch : pitches) {
+				pitch = clampf(pitch, 1.0, 10000.0);
+			}
+			arg++;
+		}
+		else if (strcmp(option, "--duration") == 0 && value) {
+			settings.duration = clampf(atof(value), 0.01, 3600.0);
+			arg++;
+		}
+		else if (strcmp(option, "--rate") == 0 && value) {
+			settings.sampleRate = clampi(atoi(value), 8000, 192000);
+			arg++;
+		}
+		else if (strcmp(option, "--volume") == 0 && value) {
+			settings.volume = atof(value);
+			arg++;
+		}
+		else if (strcmp(option, "--threads") == 0 && value) {
+			threads = maxi(atoi(value), 0);
+			arg++;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", option);
+			return 1;
+		}
+	}
+	if (argc - arg < 2) {
+		fprintf(stderr, "Usage: WaveEdit --audition [options] <directory> <bank>...\n");
+		fprintf(stderr, "Plays each bank at each pitch to <directory>/<bank name>-<path>-<pitch>.wav\n");
+		fprintf(stderr, "  --sweep             morph along Z from the first wave to the last (default)\n");
+		fprintf(stderr, "  --wave n            play wave n only\n");
+		fprintf(stderr, "  --xy                morph through every row of the grid\n");
+		fprintf(stderr, "  --path x,y:x,y...   morph through the grid along these points\n");
+		fprintf(stderr, "  --pitch hz,hz...    frequencies, 220 by default\n");
+		fprintf(stderr, "  --duration s        length of each file, %g by default\n", settings.duration);
+		fprintf(stderr, "  --rate hz           sample rate, %d by default\n", settings.sampleRate);
+		fprintf(stderr, "  --volume db         output gain, %g by default\n", settings.volume);
+		fprintf(stderr, "  --threads n         renders at once, one per core by default\n");
+		return 1;
+	}
+	const char *dirname = argv[arg];
+	char **filenames = &argv[arg + 1];
+	int bankCount = argc - arg - 1;
+	std::string pathName = (settings.path == AUDITION_Z_SWEEP) ? "sweep" : (settings.path == AUDITION_XY_PATH) ? "xy" : stringf("wave%02d", settings.wave);
+
+	// Banks are loaded and their mips computed up front, so the renders only read them
+	double startTime = getTime();
+	std::vector<Bank*> banks(bankCount, NULL);
+	std::vector<std::string> names(bankCount);
+	parallelFor(bankCount, [&](int i) {
+		Bank *bank = new Bank();
+		if (!exportLoadBank(*bank, filenames[i], &names[i])) {
+			delete bank;
+			return;
+		}
+		for (int w = 0; w < BANK_LEN; w++) {
+			bank->waves[w]->validate(WAVE_MIPS);
+		}
+		banks[i] = bank;
+	}, threads);
+	double loadTime = getTime() - startTime;
+
+	int pitchCount = pitches.size();
+	int count = bankCount * pitchCount;
+	std::vector<std::string> reports(count);
+	std::vector<AuditionStats> stats(count);
+	// Not vector<bool>, whose packed bits the workers would race on
+	std::vector<char> failed(count, false);
+	startTime = getTime();
+	parallelFor(count, [&](int i) {
+		int b = i / pitchCount;
+		if (!banks[b]) {
+			failed[i] = true;
+			if (i % pitchCount == 0)
+				reports[i] = stringf("Could not open %s", filenames[b]);
+			return;
+		}
+		AuditionSettings s = settings;
+		s.frequency = pitches[i % pitchCount];
+		std::vector<uint8_t> wav;
+		renderAudition(*banks[b], s, wav, &stats[i]);
+		std::string path = stringf("%s/%s-%s-%g.wav", dirname, names[b].c_str(), pathName.c_str(), s.frequency);
+		if (writeFile(path, wav)) {
+			reports[i] = stringf("%s: %.1fx realtime", path.c_str(), stats[i].duration / stats[i].time);
+		}
+		else {
+			reports[i] = stringf("Could not write %s", path.c_str());
+			failed[i] = true;
+		}
+	}, threads);
+	double time = getTime() - startTime;
+	for (Bank *bank : banks) {
+		delete bank;
+	}
+
+	int failures = 0;
+	double duration = 0.0;
+	for (int i = 0; i < count; i++) {
+		if (!reports[i].empty())
+			fprintf(failed[i] ? stderr : stdout, "%s\n", reports[i].c_str());
+		if (failed[i]) {
+			failures++;
+			continue;
+		}
+		duration += stats[i].duration;
+	}
+	printf("Rendered %d files, %.1f s of audio in %.2f s after %.2f s loading, %.1fx realtime\n", count - failures, duration, time, loadTime, duration / time);
+	return failures > 0 ? 1 : 0;
+}
+
+} // namespace WAVETABLE_NAMESPACE
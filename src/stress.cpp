@@ -0,0 +1,163 @@
+#include "WaveEdit.hpp"
+#include <chrono>
+#include <string>
+
+namespace WAVETABLE_NAMESPACE {
+
+
+static double getTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/** One frame's worth of what a user does to the bank, picked at random */
+static void stressEdit(const std::string &bankFilename) {
+	int waveId = rand() % BANK_LEN;
+	switch (rand() % 12) {
+		case 0:
+		case 1:
+		case 2: {
+			// Drawing in the editor
+			Wave *wave = currentBank.waves[waveId].write();
+			int start = rand() % WAVE_LEN;
+			for (int i = 0; i < WAVE_LEN / 8; i++) {
+				wave->samples[(start + i) % WAVE_LEN] = randf() * 2.0 - 1.0;
+			}
+			wave->commitSamples();
+			historyPush();
+		} break;
+		case 3:
+		case 4: {
+			// Dragging an effect slider
+			Wave *wave = currentBank.waves[waveId].write();
+			wave->effects[rand() % EFFECTS_LEN] = randf();
+			wave->updatePost();
+			historyPush();
+		} break;
+		case 5: {
+			historyUndo();
+		} break;
+		case 6: {
+			historyRedo();
+		} break;
+		case 7: {
+			HistoryTransaction transaction;
+			currentBank.clear();
+		} break;
+		case 8: {
+			// Committed by ioStep() on a later frame, like File > Open
+			ioLoad("Opening", bankFilename.c_str(), [bankFilename](Bank &bank) {
+				return bank.load(bankFilename.c_str());
+			}, []() {
+				HistoryTransaction transaction;
+			});
+		} break;
+		case 9: {
+			HistoryTransaction transaction;
+			currentBank.randomize();
+		} break;
+		case 10: {
+			HistoryTransaction transaction;
+			currentBank.morph();
+		} break;
+		case 11: {
+			HistoryTransaction transaction;
+			currentBank.carrier_wave.write()->samples[rand() % WAVE_LEN] = randf();
+			currentBank.renderCrossmod();
+		} break;
+	}
+
+	// Moving the play controls
+	playSource = (PlaySource) (rand() % 4);
+	playModeXY = rand() % 2;
+	morphX = randf() * (BANK_GRID_WIDTH - 1);
+	morphY = randf() * (BANK_GRID_HEIGHT - 1);
+	morphZ = randf() * (BANK_LEN - 1);
+	playFrequency = 20.0 + randf() * 2000.0;
+}
+
+
+int stressCommand(int argc, char **argv) {
+	double duration = 3.0;
+	int sampleRate = 44100;
+	int bufferSize = 256;
+	int arg = 0;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char *option = argv[arg];
+		const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+		if (strcmp(option, "--duration") == 0 && value) {
+			duration = clampf(atof(value), 0.1, 3600.0);
+			arg++;
+		}
+		else if (strcmp(option, "--rate") == 0 && value) {
+			sampleRate = clampi(atoi(value), 8000, 192000);
+			arg++;
+		}
+		else if (strcmp(option, "--buffer") == 0 && value) {
+			bufferSize = clampi(atoi(value), 16, 8192);
+			arg++;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", option);
+			fprintf(stderr, "Usage: WaveEdit --stress [options]\n");
+			fprintf(stderr, "Edits, undoes, clears and loads the bank on this thread while another one runs the audio callback back to back.\n");
+			fprintf(stderr, "Meant for builds with -fsanitize=thread, see `make tsan`.\n");
+			fprintf(stderr, "  --duration s        %g by default\n", duration);
+			fprintf(stderr, "  --rate hz           sample rate, %d by default\n", sampleRate);
+			fprintf(stderr, "  --buffer n          samples per callback, %d by default\n", bufferSize);
+			return 1;
+		}
+	}
+
+	// A bank file to load while playing
+	std::string bankFilename = "stress.dat";
+	validateInit();
+	currentBank.clear();
+	currentBank.randomize();
+	if (!currentBank.save(bankFilename.c_str())) {
+		fprintf(stderr, "Could not write %s\n", bankFilename.c_str());
+		return 1;
+	}
+	historyClear();
+	historyPush();
+	playingBank = &currentBank;
+	playEnabled = true;
+	audioStep();
+
+	std::atomic<bool> running(true);
+	std::atomic<int64_t> callbacks(0);
+	std::atomic<int64_t> badSamples(0);
+	std::thread audioThread([&]() {
+		std::vector<float> out(bufferSize);
+		while (running) {
+			audioRender(out.data(), bufferSize, sampleRate);
+			for (float x : out) {
+				if (!std::isfinite(x))
+					badSamples++;
+			}
+			callbacks++;
+		}
+	});
+
+	int64_t frames = 0;
+	double start = getTime();
+	while (getTime() - start < duration) {
+		ioStep();
+		stressEdit(bankFilename);
+		currentBank.validateLater();
+		audioStep();
+		frames++;
+	}
+
+	ioFlush();
+	ioStep();
+	running = false;
+	audioThread.join();
+	validateDestroy();
+	remove(bankFilename.c_str());
+
+	printf("%lld frames of edits against %lld callbacks of %d samples in %.2f s, %lld bad samples\n", (long long) frames, (long long) callbacks.load(), bufferSize, getTime() - start, (long long) badSamples.load());
+	return badSamples > 0 ? 1 : 0;
+}
+
+} // namespace WAVETABLE_NAMESPACE
@@ -6,7 +6,7 @@ https://github.com/ocornut/imgui/issues/261
 */
 
 namespace ImGui {
-IMGUI_API  bool TabLabels(int numTabs, const char** tabLabels, int *selectedIndex, const char** tabLabelTooltips, bool autoLayout, int *pOptionalHoveredIndex) {
+static bool TabLabels(int numTabs, const char** tabLabels, int *selectedIndex, const char** tabLabelTooltips, bool autoLayout, int *pOptionalHoveredIndex) {
 	ImGuiStyle& style = ImGui::GetStyle();
 
 	const ImVec2 itemSpacing =  style.ItemSpacing;
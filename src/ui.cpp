@@ -22,8 +22,27 @@
 
 #include "tablabels.hpp"
 
+namespace WAVETABLE_NAMESPACE {
+
 
 static bool showTestWindow = false;
+static bool showDiagnostics = false;
+static bool showHistoryTree = false;
+/** State of the undo tree compared with the current one, or -1 */
+static int historyCompareId = -1;
+static bool showExportPopup = false;
+static bool showExportErrors = false;
+/** Targets and file name of File > Export */
+static unsigned int exportSelection = EXPORT_TARGETS;
+static char exportName[128] = "Untitled";
+static std::string exportErrors;
+/** Loads and saves which failed, shown until dismissed */
+static std::string ioFailures;
+/** Files written at once by Save Waves to Folder */
+static int exportThreads = 4;
+static bool exportSync = false;
+/** Result of the last Render MIDI File, shown in the diagnostics */
+static MidiRenderStats midiRenderStats;
 static ImTextureID logoTextureLight;
 static ImTextureID logoTextureDark;
 static ImTextureID logoTexture;
@@ -31,7 +50,6 @@ char lastFilename[1024] = "";
 static int styleId = 0;
 int selectedId = 0;
 int lastSelectedId = 0;
-extern Oscillator osc;
 
 
 static void refreshStyle();
@@ -47,6 +65,7 @@ enum Page {
 	WATERFALL_PAGE,
 	IMPORT_PAGE,
 	DB_PAGE,
+	FM_PAGE,
 	NUM_PAGES
 };
 
@@ -139,9 +158,14 @@ static void menuWebsite() {
 
 static void menuNewBank() {
 	showCurrentBankPage();
-	currentBank.clear();
-	lastFilename[0] = '\0';
-	historyPush();
+	// Queued behind pending loads so that it is not overwritten by them
+	ioLoad("New bank", NULL, [](Bank &bank) {
+		bank.clear();
+		return true;
+	}, []() {
+		HistoryTransaction transaction;
+		lastFilename[0] = '\0';
+	});
 }
 
 /** Caller must free() return value, guaranteed to not be NULL */
@@ -157,14 +181,25 @@ static char *getLastDir() {
 	}
 }
 
+/** Loads `path` on the I/O thread and makes it the current file once the staging bank is committed */
+static void openBank(const char *path, const std::function<bool(Bank &bank, const char *filename)> &load) {
+	showCurrentBankPage();
+	std::string filename = path;
+	ioLoad("Opening", path, [filename, load](Bank &bank) {
+		return load(bank, filename.c_str());
+	}, [filename]() {
+		HistoryTransaction transaction;
+		snprintf(lastFilename, sizeof(lastFilename), "%s", filename.c_str());
+	});
+}
+
 static void menuOpenBank() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
 	if (path) {
-		showCurrentBankPage();
-		currentBank.loadWAV(path);
-		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
-		historyPush();
+		openBank(path, [](Bank &bank, const char *filename) {
+			return bank.loadWAV(filename);
+		});
 		free(path);
 	}
 	free(dir);
@@ -174,7 +209,9 @@ static void menuSaveBankAs() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.wav", NULL);
 	if (path) {
-		currentBank.saveWAV(path);
+		ioSave("Saving", path, [](Bank &bank, const char *filename) {
+			return bank.saveWAV(filename);
+		});
 		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 		free(path);
 	}
@@ -183,30 +220,89 @@ static void menuSaveBankAs() {
 
 static void menuSaveBank() {
 	if (lastFilename[0] != '\0')
-		currentBank.saveWAV(lastFilename);
+		ioSave("Saving", lastFilename, [](Bank &bank, const char *filename) {
+			return bank.saveWAV(filename);
+		});
 	else
 		menuSaveBankAs();
 }
 
-static void menuSaveWaves() {
+#if WAVE_LEN != 2048
+/** Tables of 2048-sample frames, as saved by most software wavetable synths */
+static void menuImportWAVTable() {
+	char *dir = getLastDir();
+	char *path = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
+	if (path) {
+		// Not made the current file, saving it again would write WAVE_LEN frames
+		showCurrentBankPage();
+		std::string filename = path;
+		ioLoad("Importing", path, [filename](Bank &bank) {
+			return bank.loadWAVTable(filename.c_str());
+		}, []() {
+			// The imported bank becomes its own undo step
+			HistoryTransaction transaction;
+		});
+		free(path);
+	}
+	free(dir);
+}
+
+static void menuExportWAVTable() {
+	char *dir = getLastDir();
+	char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.wav", NULL);
+	if (path) {
+		ioSave("Exporting", path, [](Bank &bank, const char *filename) {
+			return bank.saveWAVTable(filename);
+		});
+		free(path);
+	}
+	free(dir);
+}
+#endif
+
+/** Lists the files which failed in a popup once an export is done */
+static std::function<void()> reportExportErrors(std::shared_ptr<std::string> errors) {
+	return [errors]() {
+		if (!errors->empty()) {
+			exportErrors = *errors;
+			showExportErrors = true;
+		}
+	};
+}
+
+/** Exports waves `start` to `end - 1` on the I/O thread */
+static void saveWaves(int start, int end) {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_OPEN_DIR, dir, NULL, NULL);
 	if (path) {
-		currentBank.saveWaves(path);
+		std::string dirname = path;
+		int threads = exportThreads;
+		bool sync = exportSync;
+		std::shared_ptr<std::string> errors = std::make_shared<std::string>();
+		ioExport("Saving waves", [dirname, start, end, threads, sync, errors](Bank &bank) {
+			bank.saveWaves(dirname.c_str(), start, end, threads, sync, errors.get());
+		}, reportExportErrors(errors));
 		free(path);
 	}
 	free(dir);
 }
 
+static void menuSaveWaves() {
+	saveWaves(0, BANK_LEN);
+}
+
+static void menuSaveSelectedWaves() {
+	saveWaves(mini(selectedId, lastSelectedId), maxi(selectedId, lastSelectedId) + 1);
+}
+
 #if WAVETABLE_FORMAT_PHMK2
 static void menuOpenRom() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
 	if (path) {
-		showCurrentBankPage();
-		currentBank.loadROM(path);
-		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
-		historyPush();
+		openBank(path, [](Bank &bank, const char *filename) {
+			return bank.loadROM(filename);
+		});
 		free(path);
 	}
 	free(dir);
@@ -216,7 +312,9 @@ static void menuSaveRomAs() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.hex", NULL);
 	if (path) {
-		currentBank.saveROM(path);
+		ioSave("Saving", path, [](Bank &bank, const char *filename) {
+			return bank.saveROM(filename);
+		});
 		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 		free(path);
 	}
@@ -225,10 +323,24 @@ static void menuSaveRomAs() {
 
 static void menuSaveRom() {
 	if (lastFilename[0] != '\0')
-		currentBank.saveROM(lastFilename);
+		ioSave("Saving", lastFilename, [](Bank &bank, const char *filename) {
+			return bank.saveROM(filename);
+		});
 	else
 		menuSaveRomAs();
 }
+
+static void menuExportRomBinary() {
+	char *dir = getLastDir();
+	char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.bin", NULL);
+	if (path) {
+		ioSave("Saving", path, [](Bank &bank, const char *filename) {
+			return bank.saveROMBinary(filename);
+		});
+		free(path);
+	}
+	free(dir);
+}
 #endif
 
 #if WAVETABLE_FORMAT_BLOFELD
@@ -236,10 +348,9 @@ static void menuOpenBlofeldWavetable() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
 	if (path) {
-		showCurrentBankPage();
-		currentBank.loadBlofeldWavetable(path);
-		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
-		historyPush();
+		openBank(path, [](Bank &bank, const char *filename) {
+			return bank.loadBlofeldWavetable(filename);
+		});
 		free(path);
 	}
 	free(dir);
@@ -249,7 +360,9 @@ static void menuSaveBlofeldWavetableAs() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.mid", NULL);
 	if (path) {
-		currentBank.saveBlofeldWavetable(path);
+		ioSave("Saving", path, [](Bank &bank, const char *filename) {
+			return bank.saveBlofeldWavetable(filename);
+		});
 		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 		free(path);
 	}
@@ -258,12 +371,105 @@ static void menuSaveBlofeldWavetableAs() {
 
 static void menuSaveBlofeldWavetable() {
 	if (lastFilename[0] != '\0')
-		currentBank.saveBlofeldWavetable(lastFilename);
+		ioSave("Saving", lastFilename, [](Bank &bank, const char *filename) {
+			return bank.saveBlofeldWavetable(filename);
+		});
 	else
 		menuSaveBlofeldWavetableAs();
 }
+
+static void menuSaveBlofeldDump() {
+	char *dir = getLastDir();
+	char *folder = osdialog_file(OSDIALOG_OPEN_DIR, dir, NULL, NULL);
+	if (folder) {
+		char *path = osdialog_file(OSDIALOG_SAVE, folder, "Untitled.syx", NULL);
+		if (path) {
+			std::string filename = path;
+			std::string dirname = folder;
+			ioExport("Saving dump", [filename, dirname](Bank &bank) {
+				saveBlofeldDump(filename.c_str(), dirname.c_str());
+			});
+			free(path);
+		}
+		free(folder);
+	}
+	free(dir);
+}
 #endif
 
+static void menuExport() {
+	showExportPopup = true;
+}
+
+static void exportToFolder() {
+	char *dir = getLastDir();
+	char *path = osdialog_file(OSDIALOG_OPEN_DIR, dir, NULL, NULL);
+	if (path) {
+		std::string dirname = path;
+		std::string name = exportName;
+		int targets = exportSelection;
+		int threads = exportThreads;
+		std::shared_ptr<std::string> errors = std::make_shared<std::string>();
+		ioExport("Exporting", [dirname, name, targets, threads, errors](Bank &bank) {
+			exportBank(bank, dirname.c_str(), name.c_str(), targets, threads, errors.get());
+		}, reportExportErrors(errors));
+		free(path);
+	}
+	free(dir);
+}
+
+static void exportAudioTimings() {
+	char *dir = getLastDir();
+	char *path = osdialog_file(OSDIALOG_SAVE, dir, "audio-timing.csv", NULL);
+	if (path) {
+		if (!audioExportTimings(path)) {
+			exportErrors = stringf("%s\n", path);
+			showExportErrors = true;
+		}
+		free(path);
+	}
+	free(dir);
+}
+
+/** Renders a MIDI file through a snapshot of the bank with the current morph mode and position */
+static void menuRenderMidi() {
+	char *dir = getLastDir();
+	char *midiPath = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
+	if (midiPath) {
+		char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.wav", NULL);
+		if (path) {
+			std::string midiFilename = midiPath;
+			std::string filename = path;
+			MidiRenderSettings settings;
+			settings.modeXY = playModeXY;
+			settings.morphX = morphX;
+			settings.morphY = morphY;
+			settings.morphZ = morphZ;
+			std::shared_ptr<MidiRenderStats> stats = std::make_shared<MidiRenderStats>();
+			std::shared_ptr<std::string> errors = std::make_shared<std::string>();
+			ioExport("Rendering MIDI", [midiFilename, filename, settings, stats, errors](Bank &bank) {
+				std::vector<uint8_t> wav;
+				if (!renderMidi(bank, midiFilename.c_str(), wav, settings, stats.get())) {
+					*errors += midiFilename + "\n";
+					return;
+				}
+				FILE *f = fopen(filename.c_str(), "wb");
+				bool written = f && fwrite(wav.data(), 1, wav.size(), f) == wav.size();
+				if (f && fclose(f) != 0)
+					written = false;
+				if (!written)
+					*errors += filename + "\n";
+			}, [stats, errors]() {
+				midiRenderStats = *stats;
+				reportExportErrors(errors)();
+			});
+			free(path);
+		}
+		free(midiPath);
+	}
+	free(dir);
+}
+
 static void menuQuit() {
 	SDL_Event event;
 	event.type = SDL_QUIT;
@@ -276,95 +482,98 @@ static void menuSelectAll() {
 }
 
 static void menuCopy() {
-	currentBank.waves[selectedId].clipboardCopy();
+	currentBank.waves[selectedId]->clipboardCopy();
 }
 
 static void menuCut() {
-	currentBank.waves[selectedId].clipboardCopy();
-	currentBank.waves[selectedId].clear();
-	historyPush();
+	HistoryTransaction transaction;
+	Wave *wave = currentBank.waves[selectedId].write();
+	wave->clipboardCopy();
+	wave->clear();
 }
 
 static void menuPaste() {
-	currentBank.waves[selectedId].clipboardPaste();
-	historyPush();
+	HistoryTransaction transaction;
+	currentBank.waves[selectedId].write()->clipboardPaste();
 }
 
 
 static void menuDuplicateToBank() {
+	HistoryTransaction transaction;
 	for (int i = 0; i < BANK_LEN; i++){
 		if (i != selectedId)
-			currentBank.waves[i].copy(&currentBank.waves[selectedId]);
+			currentBank.waves[i] = currentBank.waves[selectedId];
 	}
-	historyPush();
 }
 
 
 static void menuDuplicateToRow() {
+	HistoryTransaction transaction;
 	int pasteStart = selectedId / BANK_GRID_WIDTH * BANK_GRID_WIDTH;
 	for (int i = pasteStart; i < pasteStart + BANK_GRID_WIDTH; i++){
 		if (i != selectedId)
-			currentBank.waves[i].copy(&currentBank.waves[selectedId]);
+			currentBank.waves[i] = currentBank.waves[selectedId];
 	}
-	historyPush();
 }
 
 
 static void menuSetAsCarrierWave() {
-	currentBank.carrier_wave.setFrozen(true);
-	currentBank.carrier_wave.loadSamples(currentBank.waves[selectedId]);
-	historyPush();
+	HistoryTransaction transaction;
+	BaseWave *carrier = currentBank.carrier_wave.write();
+	carrier->setFrozen(true);
+	carrier->loadSamples(*currentBank.waves[selectedId]);
 }
 
 
 static void menuSetAsModulatorWave() {
-	currentBank.modulator_wave.setFrozen(true);
-	currentBank.modulator_wave.loadSamples(currentBank.waves[selectedId]);
-	historyPush();
+	HistoryTransaction transaction;
+	BaseWave *modulator = currentBank.modulator_wave.write();
+	modulator->setFrozen(true);
+	modulator->loadSamples(*currentBank.waves[selectedId]);
 }
 
 
 static void menuClear() {
+	HistoryTransaction transaction;
 	for (int i = mini(selectedId, lastSelectedId); i <= maxi(selectedId, lastSelectedId); i++) {
-		currentBank.waves[i].clear();
+		currentBank.waves[i].write()->clear();
 	}
-	historyPush();
 }
 
 static void menuRandomize() {
+	HistoryTransaction transaction;
 	for (int i = mini(selectedId, lastSelectedId); i <= maxi(selectedId, lastSelectedId); i++) {
-		currentBank.waves[i].randomizeEffects();
+		currentBank.waves[i].write()->randomizeEffects();
 	}
-	historyPush();
 }
 
 static void menuPasteSelected() {
+	HistoryTransaction transaction;
 	for (int i = mini(selectedId, lastSelectedId); i <= maxi(selectedId, lastSelectedId); i++) {
-		currentBank.waves[i].clipboardPaste();
+		currentBank.waves[i].write()->clipboardPaste();
 	}
-	historyPush();
 }
 
 static void menuMorphEffectsAll() {
+	HistoryTransaction transaction;
 	int a = mini(selectedId, lastSelectedId);
 	int b = maxi(selectedId, lastSelectedId);
-	Wave *wave_a = &currentBank.waves[a];
-	Wave *wave_b = &currentBank.waves[b];
+	const Wave *wave_a = &*currentBank.waves[a];
+	const Wave *wave_b = &*currentBank.waves[b];
 	for (int i = a + 1; i < b; i++) {
-		currentBank.waves[i].morphAllEffects(wave_a, wave_b, (float)(i - a) / (float)(b - a));
+		currentBank.waves[i].write()->morphAllEffects(wave_a, wave_b, (float)(i - a) / (float)(b - a));
 	}
-	historyPush();
 }
 
 static void menuMorphEffect(EffectID effect) {
+	HistoryTransaction transaction;
 	int a = mini(selectedId, lastSelectedId);
 	int b = maxi(selectedId, lastSelectedId);
-	Wave *wave_a = &currentBank.waves[a];
-	Wave *wave_b = &currentBank.waves[b];
+	const Wave *wave_a = &*currentBank.waves[a];
+	const Wave *wave_b = &*currentBank.waves[b];
 	for (int i = a + 1; i < b; i++) {
-		currentBank.waves[i].morphEffect(wave_a, wave_b, effect, (float)(i - a) / (float)(b - a));
+		currentBank.waves[i].write()->morphEffect(wave_a, wave_b, effect, (float)(i - a) / (float)(b - a));
 	}
-	historyPush();
 }
 
 static void incrementSelectedId(int delta) {
@@ -470,6 +679,8 @@ static void menuKeyCommands() {
 				currentPage = IMPORT_PAGE;
 			if (ImGui::IsKeyPressed(SDL_SCANCODE_9))
 				currentPage = DB_PAGE;
+			if (ImGui::IsKeyPressed(SDL_SCANCODE_0))
+				currentPage = FM_PAGE;
 			if (ImGui::IsKeyPressed(SDL_SCANCODE_UP))
 				incrementSelectedId(currentPage == GRID_PAGE ? -BANK_GRID_WIDTH : -1);
 			if (ImGui::IsKeyPressed(SDL_SCANCODE_DOWN))
@@ -544,8 +755,8 @@ void renderWaveMenu() {
 		char *dir = getLastDir();
 		char *path = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
 		if (path) {
-			currentBank.waves[selectedId].loadWAV(path);
-			historyPush();
+			HistoryTransaction transaction;
+			currentBank.waves[selectedId].write()->loadWAV(path);
 			snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 			free(path);
 		}
@@ -555,7 +766,7 @@ void renderWaveMenu() {
 		char *dir = getLastDir();
 		char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.wav", NULL);
 		if (path) {
-			currentBank.waves[selectedId].saveWAV(path);
+			currentBank.waves[selectedId]->saveWAV(path);
 			snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 			free(path);
 		}
@@ -602,6 +813,14 @@ void renderMenu() {
 				menuSaveBankAs();
 			if (ImGui::MenuItem("Save Waves to Folder...", NULL))
 				menuSaveWaves();
+			if (ImGui::MenuItem("Save Selected Waves to Folder...", NULL))
+				menuSaveSelectedWaves();
+			#if WAVE_LEN != 2048
+			if (ImGui::MenuItem("Import 2048-Sample Wavetable...", NULL))
+				menuImportWAVTable();
+			if (ImGui::MenuItem("Export 2048-Sample Wavetable...", NULL))
+				menuExportWAVTable();
+			#endif
 			#ifdef WAVETABLE_FORMAT_PHMK2
 			if (ImGui::MenuItem("Open Rom...", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+R" : "Ctrl+R"))
 				menuOpenRom();
@@ -609,6 +828,8 @@ void renderMenu() {
 				menuSaveRom();
 			if (ImGui::MenuItem("Save Rom As...", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+Shift+M" : "Ctrl+Shift+M"))
 				menuSaveRomAs();
+			if (ImGui::MenuItem("Export Rom Binary...", NULL))
+				menuExportRomBinary();
 			#endif
 			#ifdef WAVETABLE_FORMAT_BLOFELD
 			if (ImGui::MenuItem("Open Blofeld Wavetable...", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+R" : "Ctrl+R"))
@@ -617,7 +838,13 @@ void renderMenu() {
 				menuSaveBlofeldWavetable();
 			if (ImGui::MenuItem("Save Blofeld Wavetable As...", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+Shift+M" : "Ctrl+Shift+M"))
 				menuSaveBlofeldWavetableAs();
+			if (ImGui::MenuItem("Save Blofeld Dump of Folder...", NULL))
+				menuSaveBlofeldDump();
 			#endif
+			if (ImGui::MenuItem("Export...", NULL))
+				menuExport();
+			if (ImGui::MenuItem("Render MIDI File...", NULL))
+				menuRenderMidi();
 			if (ImGui::MenuItem("Quit", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+Q" : "Ctrl+Q"))
 				menuQuit();
 
@@ -629,6 +856,8 @@ void renderMenu() {
 				historyUndo();
 			if (ImGui::MenuItem("Redo", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+Shift+Z" : "Ctrl+Shift+Z"))
 				historyRedo();
+			if (ImGui::MenuItem("History Tree", NULL, showHistoryTree))
+				showHistoryTree = !showHistoryTree;
 			if (ImGui::MenuItem("Select All", ImGui::GetIO().ConfigMacOSXBehaviors ? "Cmd+A" : "Ctrl+A"))
 				menuSelectAll();
 			ImGui::MenuItem("##spacer", NULL, false, false);
@@ -642,6 +871,24 @@ void renderMenu() {
 				const char *deviceName = audioGetDeviceName(deviceId);
 				if (ImGui::MenuItem(deviceName, NULL, false)) audioOpen(deviceId);
 			}
+			ImGui::Separator();
+			if (ImGui::BeginMenu("Sample Rate")) {
+				static const int sampleRates[] = {44100, 48000, 88200, 96000};
+				for (int sampleRate : sampleRates) {
+					if (ImGui::MenuItem(stringf("%d Hz", sampleRate).c_str(), NULL, audioSampleRate == sampleRate))
+						audioSetFormat(sampleRate, audioBufferSize);
+				}
+				ImGui::EndMenu();
+			}
+			if (ImGui::BeginMenu("Buffer Size")) {
+				for (int bufferSize = 64; bufferSize <= 4096; bufferSize *= 2) {
+					if (ImGui::MenuItem(stringf("%d samples (%.1f ms)", bufferSize, 1000.0 * bufferSize / audioSampleRate).c_str(), NULL, audioBufferSize == bufferSize))
+						audioSetFormat(audioSampleRate, bufferSize);
+				}
+				ImGui::EndMenu();
+			}
+			if (ImGui::MenuItem("Audio Meter", NULL, showDiagnostics))
+				showDiagnostics = !showDiagnostics;
 			ImGui::EndMenu();
 		}
 		// Colors
@@ -670,6 +917,8 @@ void renderMenu() {
 				menuManual();
 			if (ImGui::MenuItem("Webpage", "", false))
 				menuWebsite();
+			if (ImGui::MenuItem("Diagnostics", NULL, showDiagnostics))
+				showDiagnostics = !showDiagnostics;
 			// if (ImGui::MenuItem("imgui Demo", NULL, showTestWindow)) showTestWindow = !showTestWindow;
 			ImGui::EndMenu();
 		}
@@ -741,8 +990,11 @@ void effectSlider(EffectID effect) {
 	snprintf(id, sizeof(id), "##%s", effectNames[effect]);
 	char text[64];
 	snprintf(text, sizeof(text), "%s: %%.3f", effectNames[effect]);
-	if (ImGui::SliderFloat(id, &currentBank.waves[selectedId].effects[effect], 0.0f, 1.0f, text)) {
-		currentBank.waves[selectedId].updatePost();
+	float value = currentBank.waves[selectedId]->effects[effect];
+	if (ImGui::SliderFloat(id, &value, 0.0f, 1.0f, text)) {
+		Wave *wave = currentBank.waves[selectedId].write();
+		wave->effects[effect] = value;
+		wave->updatePost();
 		historyPush();
 	}
 }
@@ -773,8 +1025,9 @@ void editorPage() {
 	ImGui::SameLine();
 	ImGui::BeginChild("Editor", ImVec2(0, 0), true);
 	{
-		Wave *wave = &currentBank.waves[selectedId];
-		float *effects = wave->effects;
+		// Widgets edit copies, so the wave is only detached from the undo history by the edits themselves.
+		// History steps may share it again, so every edit calls write() for itself.
+		CowPtr<Wave> &wave = currentBank.waves[selectedId];
 
 		ImGui::PushItemWidth(-1);
 
@@ -783,8 +1036,8 @@ void editorPage() {
 
 		ImGui::SameLine();
 		if (ImGui::Button("Clear")) {
-			currentBank.waves[selectedId].clear();
-			historyPush();
+			HistoryTransaction transaction;
+			wave.write()->clear();
 		}
 
 
@@ -794,9 +1047,10 @@ void editorPage() {
 			if (ImGui::BeginPopup(catalogCategory.name.c_str())) {
 				for (const CatalogFile &catalogFile : catalogCategory.files) {
 					if (ImGui::Selectable(catalogFile.name.c_str())) {
-						memcpy(currentBank.waves[selectedId].samples, catalogFile.samples, sizeof(float) * WAVE_LEN);
-						currentBank.waves[selectedId].commitSamples();
-						historyPush();
+						HistoryTransaction transaction;
+						Wave *w = wave.write();
+						memcpy(w->samples, catalogFile.samples, sizeof(float) * WAVE_LEN);
+						w->commitSamples();
 					}
 				}
 				ImGui::EndPopup();
@@ -808,16 +1062,27 @@ void editorPage() {
 
 		ImGui::Text("Waveform");
 		const int oversample = 4;
-		float waveOversample[WAVE_LEN * oversample];
-		cyclicOversample(wave->postSamples, waveOversample, WAVE_LEN, oversample);
-		if (renderWave("WaveEditor", 200.0, wave->samples, WAVE_LEN, waveOversample, WAVE_LEN * oversample, tool)) {
-			currentBank.waves[selectedId].commitSamples();
+		Workspace ws;
+		float *waveOversample = ws.alloc(WAVE_LEN * oversample);
+		cyclicOversample(wave->getPostSamples(), waveOversample, WAVE_LEN, oversample);
+		float *samples = ws.alloc(WAVE_LEN);
+		memcpy(samples, wave->samples, sizeof(float) * WAVE_LEN);
+		if (renderWave("WaveEditor", 200.0, samples, WAVE_LEN, waveOversample, WAVE_LEN * oversample, tool)) {
+			Wave *w = wave.write();
+			memcpy(w->samples, samples, sizeof(float) * WAVE_LEN);
+			w->commitSamples();
 			historyPush();
 		}
 
 		ImGui::Text("Harmonics");
-		if (renderHistogram("HarmonicEditor", 200.0, wave->harmonics, WAVE_LEN / 2, wave->postHarmonics, WAVE_LEN / 2, tool)) {
-			currentBank.waves[selectedId].commitHarmonics();
+		float *harmonics = ws.alloc(WAVE_LEN / 2);
+		memcpy(harmonics, wave->getHarmonics(), sizeof(float) * (WAVE_LEN / 2));
+		if (renderHistogram("HarmonicEditor", 200.0, harmonics, WAVE_LEN / 2, wave->getPostHarmonics(), WAVE_LEN / 2, tool)) {
+			// commitHarmonics() keeps the phases of the spectrum, so it must be up to date
+			Wave *w = wave.write();
+			w->validate(WAVE_SPECTRUM);
+			memcpy(w->harmonics, harmonics, sizeof(float) * (WAVE_LEN / 2));
+			w->commitHarmonics();
 			historyPush();
 		}
 
@@ -826,29 +1091,35 @@ void editorPage() {
 			effectSlider((EffectID) i);
 		}
 
-		if (ImGui::Checkbox("Cycle", &currentBank.waves[selectedId].cycle)) {
-			currentBank.waves[selectedId].updatePost();
-			historyPush();
+		bool cycle = wave->cycle;
+		if (ImGui::Checkbox("Cycle", &cycle)) {
+			HistoryTransaction transaction;
+			Wave *w = wave.write();
+			w->cycle = cycle;
+			w->updatePost();
 		}
 		ImGui::SameLine();
-		if (ImGui::Checkbox("Normalize", &currentBank.waves[selectedId].normalize)) {
-			currentBank.waves[selectedId].updatePost();
-			historyPush();
+		bool normalize = wave->normalize;
+		if (ImGui::Checkbox("Normalize", &normalize)) {
+			HistoryTransaction transaction;
+			Wave *w = wave.write();
+			w->normalize = normalize;
+			w->updatePost();
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Randomize")) {
-			currentBank.waves[selectedId].randomizeEffects();
-			historyPush();
+			HistoryTransaction transaction;
+			wave.write()->randomizeEffects();
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Reset")) {
-			currentBank.waves[selectedId].clearEffects();
-			historyPush();
+			HistoryTransaction transaction;
+			wave.write()->clearEffects();
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Bake")) {
-			currentBank.waves[selectedId].bakeEffects();
-			historyPush();
+			HistoryTransaction transaction;
+			wave.write()->bakeEffects();
 		}
 
 		ImGui::PopItemWidth();
@@ -861,7 +1132,7 @@ void effectHistogram(EffectID effect, Tool tool) {
 	float value[BANK_LEN];
 	float average = 0.0;
 	for (int i = 0; i < BANK_LEN; i++) {
-		value[i] = currentBank.waves[i].effects[effect];
+		value[i] = currentBank.waves[i]->effects[effect];
 		average += value[i];
 	}
 	average /= BANK_LEN;
@@ -877,27 +1148,29 @@ void effectHistogram(EffectID effect, Tool tool) {
 		// Change the average effect level to the new average
 		float deltaAverage = average - oldAverage;
 		for (int i = 0; i < BANK_LEN; i++) {
+			Wave *wave = currentBank.waves[i].write();
 			if (0.0 < average && average < 1.0) {
-				currentBank.waves[i].effects[effect] = clampf(currentBank.waves[i].effects[effect] + deltaAverage, 0.0, 1.0);
+				wave->effects[effect] = clampf(wave->effects[effect] + deltaAverage, 0.0, 1.0);
 			}
 			else {
-				currentBank.waves[i].effects[effect] = average;
+				wave->effects[effect] = average;
 			}
-			currentBank.waves[i].updatePost();
-			historyPush();
+			wave->updatePost();
 		}
+		historyPush();
 	}
 
 	if (renderHistogram(effectNames[effect], 120, value, BANK_LEN, NULL, 0, tool)) {
 		for (int i = 0; i < BANK_LEN; i++) {
-			if (currentBank.waves[i].effects[effect] != value[i]) {
+			if (currentBank.waves[i]->effects[effect] != value[i]) {
 				// TODO This always selects the highest index. Select the index the mouse is hovering (requires renderHistogram() to return an int)
 				selectWave(i);
-				currentBank.waves[i].effects[effect] = value[i];
-				currentBank.waves[i].updatePost();
-				historyPush();
+				Wave *wave = currentBank.waves[i].write();
+				wave->effects[effect] = value[i];
+				wave->updatePost();
 			}
 		}
+		historyPush();
 	}
 }
 
@@ -914,55 +1187,59 @@ void effectPage() {
 		ImGui::PopItemWidth();
 
 		if (ImGui::Button("Cycle All")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].cycle = true;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				Wave *wave = currentBank.waves[i].write();
+				wave->cycle = true;
+				wave->updatePost();
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Cycle None")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].cycle = false;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				Wave *wave = currentBank.waves[i].write();
+				wave->cycle = false;
+				wave->updatePost();
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Normalize All")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].normalize = true;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				Wave *wave = currentBank.waves[i].write();
+				wave->normalize = true;
+				wave->updatePost();
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Normalize None")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].normalize = false;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				Wave *wave = currentBank.waves[i].write();
+				wave->normalize = false;
+				wave->updatePost();
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Randomize")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].randomizeEffects();
-				historyPush();
+				currentBank.waves[i].write()->randomizeEffects();
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Reset")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].clearEffects();
-				historyPush();
+				currentBank.waves[i].write()->clearEffects();
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Bake")) {
+			HistoryTransaction transaction;
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].bakeEffects();
-				historyPush();
+				currentBank.waves[i].write()->bakeEffects();
 			}
 		}
 	}
@@ -998,7 +1275,13 @@ void waterfallPage() {
 
 
 
-void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
+void baseWavePage(CowPtr<BaseWave> &handle, const char* title, bool update_waves) {
+	// Widgets edit a copy, which replaces the shared base wave only if something changed
+	BaseWave edit = *handle;
+	BaseWave *wave = &edit;
+	bool changed = false;
+	bool discrete = false;
+
 	ImGui::BeginChild("Sidebar", ImVec2(200, 0), true);
 	{
 		float dummyZ = 0.0;
@@ -1023,8 +1306,7 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 		//float samplesOversample[WAVE_LEN * oversample];
 		//cyclicOversample(wave->samples, samplesOversample, WAVE_LEN, oversample);
 		if (renderWave("FinalWaveEditor", 200.0, wave->samples, WAVE_LEN, wave->samples, WAVE_LEN, tool)) {
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		ImGui::Text("Harmonics");
@@ -1035,11 +1317,11 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
         ImGui::PushItemWidth(ImGui::GetWindowWidth() * 0.5f - 20);
 		ImGui::Text("Base Waveform");
         
-		float shapeOversample[WAVE_LEN * oversample];
+		Workspace ws;
+		float *shapeOversample = ws.alloc(WAVE_LEN * oversample);
 		cyclicOversample(wave->shape, shapeOversample, WAVE_LEN, oversample);
 		if (renderWave("WaveEditor", 200.0, wave->shape, WAVE_LEN, shapeOversample, WAVE_LEN * oversample, tool)) {
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		ImGui::NextColumn();
@@ -1052,22 +1334,21 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 
 		//cyclicOversample(wave->phasor, phasorOversample, WAVE_LEN, oversample);
 		if (renderPhasor("PhasorEditor", 200.0, wave->phasor, WAVE_LEN, phasorBuf, WAVE_LEN, tool, wave->bottom_x, wave->bottom_y, wave->bottom_magnitude, wave->top_x, wave->top_y, wave->top_magnitude)) {
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		ImGui::Columns();
 		
         ImGui::PushItemWidth(ImGui::GetWindowWidth());
 		
 		if (ImGui::Checkbox("Lock Shapes", &(wave->lock_shapes))) {
+			discrete = true;
 			wave->updateShape();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		};
 
 		ImGui::SameLine();
 		if (ImGui::Checkbox("Freeze Wave", &(wave->is_frozen))) {
-			historyPush();
+			discrete = true;
 		};
 
 		if (wave->is_frozen) {
@@ -1079,8 +1360,7 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 			if (wave->lock_shapes)
 				wave->upper_shape = wave->lower_shape;
 			wave->updateShape();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (wave->lock_shapes && !wave->is_frozen) {
@@ -1090,8 +1370,7 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 		
 		if (ImGui::SliderFloat("##upper_shape", &(wave->upper_shape), 0.0, 1.0, "Upper shape: %.3f")) {
 			wave->updateShape();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (wave->lock_shapes && !wave->is_frozen) {
@@ -1101,14 +1380,12 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 		
 		if (ImGui::SliderFloat("##pulse_width", &(wave->pulse_width), 0.0, 1.0, "Pulse width: %.3f")) {
 			wave->updateShape();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (ImGui::SliderFloat("##shape_brightness", &(wave->brightness), 0.0, 1.0, "Shape brightness: %.3f")) {
 			wave->updateShape();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 
 		if (wave->is_frozen) {
@@ -1118,38 +1395,32 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 
 		if (ImGui::SliderFloat("##bottom_angle", &(wave->bottom_angle), 0.0, 1.0, "Bottom angle: %.3f")) {
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (ImGui::SliderFloat("##bottom_magnitude", &(wave->bottom_magnitude), 0.0, 1.0, "Bottom magnitude: %.3f")) {
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (ImGui::SliderFloat("##top_angle", &(wave->top_angle), 0.0, 1.0, "Top angle: %.3f")) {
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (ImGui::SliderFloat("##top_magnitude", &(wave->top_magnitude), 0.0, 1.0, "Top magnitude: %.3f")) {
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (ImGui::SliderFloat("##bezier_weight", &(wave->bezier_weight), 0.0, 1.0, "Bezier weight: %.3f")) {
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		
 		if (ImGui::SliderFloat("##bezier_ratio", &(wave->bezier_ratio), 0.0, 1.0, "Bezier ratio: %.3f")) {
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 
 		//BulletText
@@ -1157,36 +1428,50 @@ void baseWavePage(BaseWave *wave, const char* title, bool update_waves) {
 		ImGui::Text("Resonance Mode:");
 		ImGui::SameLine();
 		if (ImGui::RadioButton("Resonant", wave->multi_algo == MUL_RESONANT)) {
+			discrete = true;
 			wave->multi_algo = MUL_RESONANT;            
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 
 		ImGui::SameLine();
 		if (ImGui::RadioButton("Divisor-modulo", wave->multi_algo == MUL_DIV_MOD)) {
+			discrete = true;
 			wave->multi_algo = MUL_DIV_MOD;
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 
 		ImGui::SameLine();
 		if (ImGui::RadioButton("Harmonic", wave->multi_algo == MUL_HARMONIC)) {
+			discrete = true;
 			wave->multi_algo = MUL_HARMONIC;
 			wave->updatePhasor();
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 		//static float resonance = 0.0;
 		//			if (ImGui::SliderFloat(id, &currentBank.waves[selectedId].effects[effect], 0.0f, 1.0f, text)) {
 		if (ImGui::SliderFloat("##resonance", &(wave->resonance), 0.0, 1.0, "Resonance: %.3f")) {
 			//wave->resonance = clampf(wave.resonance, 0.0, 1.0);
-			wave->generateSamples(update_waves);
-			historyPush();
+			changed = true;
 		}
 	}
 	ImGui::EndChild();
+
+	if (changed || discrete) {
+		// A transaction takes in the edits made before it began, so it can wrap storing the copy
+		if (discrete)
+			historyBegin();
+		BaseWave *stored = handle.write();
+		*stored = edit;
+		// Renders the crossmod wave from the bank's base waves, so only after storing
+		if (changed)
+			stored->generateSamples(update_waves);
+		if (discrete)
+			historyCommit();
+		else
+			historyPush();
+	}
 }
 
 
@@ -1228,13 +1513,17 @@ void crossmodWavePage() {
         
 		//float carrierOversample[WAVE_LEN * oversample];
 		//cyclicOversample(wave->shape, shapeOversample, WAVE_LEN, oversample);
-		renderWave("Carrier Wave", 200.0, currentBank.carrier_wave.samples, WAVE_LEN, nullptr, 0, NO_TOOL);
+		float carrierSamples[WAVE_LEN];
+		memcpy(carrierSamples, currentBank.carrier_wave->samples, sizeof(carrierSamples));
+		renderWave("Carrier Wave", 200.0, carrierSamples, WAVE_LEN, nullptr, 0, NO_TOOL);
 		
 		ImGui::NextColumn();
         ImGui::PushItemWidth(ImGui::GetWindowWidth() * 0.5f - 20);
 		//ImGui::Text("Modulator Wave");
         
-		renderWave("Modulator Wave", 200.0, currentBank.modulator_wave.samples, WAVE_LEN, nullptr, 0, NO_TOOL);
+		float modulatorSamples[WAVE_LEN];
+		memcpy(modulatorSamples, currentBank.modulator_wave->samples, sizeof(modulatorSamples));
+		renderWave("Modulator Wave", 200.0, modulatorSamples, WAVE_LEN, nullptr, 0, NO_TOOL);
 
         
 		ImGui::Columns();
@@ -1251,13 +1540,94 @@ void crossmodWavePage() {
 
 }
 
+void fmPage() {
+	ImGui::BeginChild("Sidebar", ImVec2(200, 0), true);
+	{
+		float dummyZ = 0.0;
+		ImGui::PushItemWidth(-1);
+		renderBankGrid("SidebarGrid", BANK_LEN * 35.0, 1, &dummyZ, &morphZ);
+		refreshMorphSnap();
+	}
+	ImGui::EndChild();
+
+	ImGui::SameLine();
+
+	ImGui::BeginChild("FM Matrix", ImVec2(0, 0), true);
+	{
+		ImGui::PushItemWidth(-1.0);
+		FMMatrix &fm = currentBank.fm;
+		bool changed = false;
+
+		ImGui::Text("Rendered Wave");
+		float samples[WAVE_LEN];
+		memcpy(samples, currentBank.waves[selectedId]->samples, sizeof(samples));
+		renderWave("FMWave", 200.0, samples, WAVE_LEN, nullptr, 0, NO_TOOL);
+
+		ImGui::Text("Operators");
+		ImGui::Columns(FM_OPERATORS_LEN, NULL, false);
+		for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+			FMOperator &op = fm.operators[i];
+			ImGui::PushID(i);
+			ImGui::PushItemWidth(-1.0);
+			ImGui::Text("Operator %d", i + 1);
+			changed |= ImGui::DragFloat("##ratio", &op.ratio, 0.01, 0.0, 32.0, "Ratio: %.2f");
+			changed |= ImGui::SliderFloat("##level", &op.level, 0.0, 1.0, "Level: %.3f");
+			changed |= ImGui::Combo("##source", (int*) &op.source, fmSourceNames, FM_SOURCES_LEN);
+			ImGui::PopItemWidth();
+			ImGui::PopID();
+			ImGui::NextColumn();
+		}
+		ImGui::Columns(1);
+
+		// Rows are the modulated operators, columns the modulating ones. The diagonal is feedback.
+		static bool showFrequency = false;
+		if (ImGui::RadioButton("Phase Modulation", !showFrequency)) showFrequency = false;
+		ImGui::SameLine();
+		if (ImGui::RadioButton("Frequency Modulation", showFrequency)) showFrequency = true;
+		float (*matrix)[FM_OPERATORS_LEN] = showFrequency ? fm.fm : fm.pm;
+		ImGui::Columns(FM_OPERATORS_LEN + 1, NULL, false);
+		ImGui::NextColumn();
+		for (int j = 0; j < FM_OPERATORS_LEN; j++) {
+			ImGui::Text("From %d", j + 1);
+			ImGui::NextColumn();
+		}
+		for (int i = 0; i < FM_OPERATORS_LEN; i++) {
+			ImGui::Text("Into %d", i + 1);
+			ImGui::NextColumn();
+			for (int j = 0; j < FM_OPERATORS_LEN; j++) {
+				ImGui::PushID(i * FM_OPERATORS_LEN + j);
+				ImGui::PushItemWidth(-1.0);
+				changed |= ImGui::DragFloat("##cell", &matrix[i][j], 0.005, -4.0, 4.0, "%.3f");
+				ImGui::PopItemWidth();
+				ImGui::PopID();
+				ImGui::NextColumn();
+			}
+		}
+		ImGui::Columns(1);
+
+		if (ImGui::Button("Reset Matrix")) {
+			HistoryTransaction transaction;
+			fm.clear();
+			currentBank.renderFM(selectedId);
+		}
+
+		// Re-rendering is cheap enough to follow every drag of a cell
+		if (changed) {
+			currentBank.renderFM(selectedId);
+			historyPush();
+		}
+	}
+	ImGui::EndChild();
+}
+
+
 void carrierWavePage() {
-	baseWavePage(&(currentBank.carrier_wave), "Carrier Wave", true);
+	baseWavePage(currentBank.carrier_wave, "Carrier Wave", true);
 }
 
 
 void modulatorWavePage() {
-	baseWavePage(&(currentBank.modulator_wave), "Modulator Wave", false);
+	baseWavePage(currentBank.modulator_wave, "Modulator Wave", false);
 }
 
 
@@ -1282,7 +1652,8 @@ void renderMain() {
 				"Grid XY View",
 				"Waterfall View",
 				"Import",
-				"WaveEdit Online"
+				"WaveEdit Online",
+				"FM Matrix"
 			};
 			static int hoveredTab = 0;
 			ImGui::TabLabels(NUM_PAGES, tabLabels, (int*)&currentPage, NULL, false, &hoveredTab);
@@ -1302,6 +1673,7 @@ void renderMain() {
 		case WATERFALL_PAGE: waterfallPage(); break;
 		case IMPORT_PAGE: importPage(); break;
 		case DB_PAGE: dbPage(); break;
+		case FM_PAGE: fmPage(); break;
 		default: break;
 		}
 	}
@@ -1593,6 +1965,243 @@ void uiDestroy() {
 }
 
 
+static void renderDiagnostics() {
+	if (!showDiagnostics)
+		return;
+	ImGui::SetNextWindowSize(ImVec2(360, 0), ImGuiCond_FirstUseEver);
+	if (ImGui::Begin("Diagnostics", &showDiagnostics)) {
+		if (ImGui::CollapsingHeader("Audio", ImGuiTreeNodeFlags_DefaultOpen)) {
+			const AudioStats &s = audioStats;
+			double period = s.sampleRate > 0 ? (double) s.bufferSize / s.sampleRate : 0.0;
+			ImGui::Text("%d Hz, %d samples, %.1f ms per buffer", s.sampleRate, s.bufferSize, period * 1000.0);
+			float load = period > 0.0 ? s.p95 / period : 0.0;
+			ImGui::ProgressBar(clampf(load, 0.0, 1.0), ImVec2(-1, 0), stringf("Load %.1f%% (95th percentile)", load * 100.0).c_str());
+			ImGui::PlotLines("##audioLoad", s.load, AUDIO_LOAD_HISTORY, 0, NULL, 0.0, 1.0, ImVec2(-1, 60));
+			ImGui::Text("Callback: last %.3f ms, max %.3f ms", s.lastDuration * 1000.0, s.maxDuration * 1000.0);
+			ImGui::Text("Percentiles: 50%% %.3f ms, 95%% %.3f ms, 99%% %.3f ms", s.p50 * 1000.0, s.p95 * 1000.0, s.p99 * 1000.0);
+			ImGui::Text("Xruns: %d (%d over budget, %d late) in %lld callbacks", s.xruns, s.overBudget, s.late, (long long) s.callbacks);
+			if (s.dropped > 0)
+				ImGui::Text("Timings dropped: %d", s.dropped);
+			if (ImGui::Button("Export CSV..."))
+				exportAudioTimings();
+		}
+		if (ImGui::CollapsingHeader("Autosave", ImGuiTreeNodeFlags_DefaultOpen)) {
+			ImGui::Text("Writes: %d, unchanged: %d, failed: %d", autosaveStats.writes, autosaveStats.skips, autosaveStats.failures);
+			ImGui::Text("Last write: %.2f ms, %d bytes", autosaveStats.lastWriteTime * 1000.0, (int) autosaveStats.lastBytes);
+			ImGui::Text("Total written: %.1f kB", autosaveStats.totalBytes / 1000.0);
+			ImGui::Text("Every %.1f s on average", autosaveStats.averageInterval);
+			ImGui::PushItemWidth(-140.0);
+			ImGui::SliderFloat("Interval (s)", &autosaveInterval, 5.0, 300.0, "%.0f");
+			ImGui::SliderInt("Edits", &autosaveEdits, 1, 200);
+			ImGui::PopItemWidth();
+		}
+		if (ImGui::CollapsingHeader("History", ImGuiTreeNodeFlags_DefaultOpen)) {
+			ImGui::Text("Steps: %d, branches: %d, dropped: %d", historyStats.steps, historyStats.branches, historyStats.evicted);
+			ImGui::Text("Memory: %.1f kB, last step %.1f kB", historyStats.bytes / 1000.0, historyStats.lastStepBytes / 1000.0);
+			ImGui::Text("Journal: %.1f kB, %d checkpoints, last %.2f ms", historyStats.journalBytes / 1000.0, historyStats.journalCheckpoints, historyStats.journalCheckpointTime * 1000.0);
+			ImGui::Text("Journal overflows: %d, failed writes: %d", historyStats.journalOverflows, historyStats.journalFailures);
+			ImGui::PushItemWidth(-140.0);
+			ImGui::SliderInt("Budget (MB)", &historyBudget, 1, 4096);
+			ImGui::PopItemWidth();
+		}
+		if (ImGui::CollapsingHeader("Export", ImGuiTreeNodeFlags_DefaultOpen)) {
+			ImGui::PushItemWidth(-140.0);
+			ImGui::SliderInt("Files at once", &exportThreads, 1, 16);
+			ImGui::PopItemWidth();
+			ImGui::Checkbox("Flush to disk", &exportSync);
+		}
+		if (ImGui::CollapsingHeader("MIDI Render", ImGuiTreeNodeFlags_DefaultOpen)) {
+			const MidiRenderStats &s = midiRenderStats;
+			ImGui::Text("Last: %.1f s of audio in %.2f s, %d notes", s.duration, s.time, s.notes);
+			ImGui::Text("Voices: peak %d, stolen %d, clipped samples: %d", s.peakVoices, s.stolen, s.clipped);
+			ImGui::Text("%.1fx realtime, %.1f voices x realtime", s.time > 0.0 ? s.duration / s.time : 0.0, s.time > 0.0 ? s.voiceSeconds / s.time : 0.0);
+		}
+	}
+	ImGui::End();
+}
+
+
+/** Lists the undo tree, one row per state indented by branch. Clicking a row compares it with the current state, double clicking jumps to it. */
+static void renderHistoryTree() {
+	if (!showHistoryTree)
+		return;
+	ImGui::SetNextWindowSize(ImVec2(420, 600), ImGuiCond_FirstUseEver);
+	if (ImGui::Begin("History Tree", &showHistoryTree)) {
+		static std::vector<HistoryNodeInfo> infos;
+		historyGetNodes(infos);
+		int jumpId = -1;
+
+		ImGui::BeginChild("States", ImVec2(0, -300), true);
+		// Long sessions have thousands of states, so only the visible rows are drawn
+		ImGuiListClipper clipper(infos.size(), ImGui::GetTextLineHeightWithSpacing());
+		while (clipper.Step()) {
+			for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+				const HistoryNodeInfo &info = infos[i];
+				char timeText[16];
+				time_t t = (time_t) info.time;
+				strftime(timeText, sizeof(timeText), "%H:%M:%S", localtime(&t));
+				std::string label = stringf("%s%*s#%d  %s", info.current ? "> " : "  ", info.column * 2, "", info.id, timeText);
+				if (info.parent < 0)
+					label += "  start";
+				else if (info.waves > 0)
+					label += stringf("  %d wave%s", info.waves, info.waves == 1 ? "" : "s");
+				if (info.bank)
+					label += "  crossmod/FM";
+				ImGui::PushID(info.id);
+				if (ImGui::Selectable(label.c_str(), info.id == historyCompareId, ImGuiSelectableFlags_AllowDoubleClick)) {
+					historyCompareId = info.id;
+					if (ImGui::IsMouseDoubleClicked(0))
+						jumpId = info.id;
+				}
+				ImGui::PopID();
+			}
+		}
+		ImGui::EndChild();
+
+		static std::vector<int> waves;
+		static float samples[WAVE_LEN];
+		static float currentSamples[WAVE_LEN];
+		bool bank = historyCompare(historyCompareId, waves, samples, selectedId);
+		bool found = false;
+		for (const HistoryNodeInfo &info : infos) {
+			if (info.id == historyCompareId)
+				found = !info.current;
+		}
+		if (found) {
+			ImGui::Text("State #%d: %d wave%s differ%s", historyCompareId, (int) waves.size(), waves.size() == 1 ? "" : "s", bank ? ", crossmod/FM may differ" : "");
+			ImGui::SameLine();
+			if (ImGui::Button("Jump"))
+				jumpId = historyCompareId;
+			for (int i : waves) {
+				ImGui::PushID(i);
+				if (ImGui::SmallButton(stringf("%d", i).c_str()))
+					selectWave(i);
+				ImGui::PopID();
+				ImGui::SameLine();
+			}
+			ImGui::NewLine();
+			memcpy(currentSamples, currentBank.waves[selectedId]->samples, sizeof(currentSamples));
+			ImGui::Text("Wave %d, current", selectedId);
+			renderWave("HistoryCurrent", 100.0, currentSamples, WAVE_LEN, NULL, 0, NO_TOOL);
+			ImGui::Text("Wave %d, state #%d", selectedId, historyCompareId);
+			renderWave("HistoryCompared", 100.0, samples, WAVE_LEN, NULL, 0, NO_TOOL);
+		}
+		else {
+			ImGui::TextWrapped("%s", "Click a state to compare it with the current one, double click to jump to it.");
+		}
+
+		if (jumpId >= 0)
+			historyJump(jumpId);
+	}
+	ImGui::End();
+}
+
+
+static void renderExportPopup() {
+	if (showExportPopup) {
+		showExportPopup = false;
+		ImGui::OpenPopup("Export");
+	}
+
+	ImGui::SetNextWindowContentWidth(400.0);
+
+	if (ImGui::BeginPopupModal("Export", NULL, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize)) {
+		ImGui::PushItemWidth(-140.0);
+		ImGui::InputText("Name", exportName, sizeof(exportName));
+		ImGui::PopItemWidth();
+		ImGui::CheckboxFlags("Bank WAV", &exportSelection, EXPORT_WAV);
+		ImGui::CheckboxFlags("WAV per wave", &exportSelection, EXPORT_WAVES);
+		ImGui::CheckboxFlags("Bank FLAC", &exportSelection, EXPORT_FLAC);
+		ImGui::CheckboxFlags("FLAC per wave", &exportSelection, EXPORT_WAVES_FLAC);
+#if WAVETABLE_FORMAT_PHMK2
+		ImGui::CheckboxFlags("ROM (Intel HEX)", &exportSelection, EXPORT_ROM);
+		ImGui::CheckboxFlags("ROM (binary)", &exportSelection, EXPORT_ROM_BINARY);
+#endif
+#if WAVETABLE_FORMAT_BLOFELD
+		ImGui::CheckboxFlags("Blofeld SysEx", &exportSelection, EXPORT_BLOFELD);
+#endif
+		ImGui::TextWrapped("%s", "All files are written from the same snapshot of the bank, along with a manifest of their sizes and hashes.");
+
+		if (ImGui::Button("Cancel"))
+			ImGui::CloseCurrentPopup();
+		ImGui::SameLine();
+		if (ImGui::Button("Choose Folder...")) {
+			ImGui::CloseCurrentPopup();
+			exportToFolder();
+		}
+		ImGui::EndPopup();
+	}
+}
+
+
+static void renderExportErrors() {
+	if (showExportErrors) {
+		showExportErrors = false;
+		ImGui::OpenPopup("Export Failed");
+	}
+
+	ImGui::SetNextWindowContentWidth(400.0);
+
+	if (ImGui::BeginPopupModal("Export Failed", NULL, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize)) {
+		ImGui::TextWrapped("%s", "These files could not be written:");
+		ImGui::Text("%s", exportErrors.c_str());
+
+		if (ImGui::Button("OK"))
+			ImGui::CloseCurrentPopup();
+		ImGui::EndPopup();
+	}
+}
+
+
+static void renderIOFailures() {
+	// Failures while the popup is open are added to it
+	std::string failures = ioTakeFailures();
+	if (!failures.empty()) {
+		ioFailures += failures;
+		ImGui::OpenPopup("File Operation Failed");
+	}
+
+	ImGui::SetNextWindowContentWidth(400.0);
+
+	if (ImGui::BeginPopupModal("File Operation Failed", NULL, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize)) {
+		ImGui::TextWrapped("%s", ioFailures.c_str());
+
+		if (ImGui::Button("OK")) {
+			ioFailures.clear();
+			ImGui::CloseCurrentPopup();
+		}
+		ImGui::EndPopup();
+	}
+}
+
+
+/** Shows the running file operation with a cancel button */
+static void renderIOStatus() {
+	float progress = 0.0;
+	const char *status = ioStatus(&progress);
+	if (!status)
+		return;
+
+	ImGui::SetNextWindowPos(ImVec2(ImGui::GetIO().DisplaySize.x - 320, ImGui::GetIO().DisplaySize.y - 60));
+	if (ImGui::Begin("File Operation", NULL, ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoFocusOnAppearing)) {
+		ImGui::Text("%s...", status);
+		ImGui::ProgressBar(progress, ImVec2(220, 0));
+		ImGui::SameLine();
+		if (ImGui::Button("Cancel"))
+			ioCancel();
+	}
+	ImGui::End();
+}
+
+
 void uiRender() {
 	renderMain();
+	renderDiagnostics();
+	renderHistoryTree();
+	renderExportPopup();
+	renderExportErrors();
+	renderIOFailures();
+	renderIOStatus();
 }
+
+} // namespace WAVETABLE_NAMESPACE
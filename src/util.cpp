@@ -1,13 +1,30 @@
 #include "WaveEdit.hpp"
 #include <string.h>
+#include <strings.h>
 #include <sndfile.h>
 #include <stdarg.h>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #if defined(_WIN32)
 #include <windows.h>
 #include <shellapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
+namespace WAVETABLE_NAMESPACE {
+
 void openBrowser(const char *url) {
 	// shell injection is possible if the URL is not trusted
 #if defined(__linux__)
@@ -27,6 +44,16 @@ void openBrowser(const char *url) {
 
 
 float *loadAudio(const char *filename, int *length) {
+	MappedWAV wav;
+	if (wav.open(filename)) {
+		float *samples = new float[wav.frames];
+		wav.readMono(samples, 0, wav.frames);
+		if (length)
+			*length = wav.frames;
+		wav.close();
+		return samples;
+	}
+
 	SF_INFO info;
 	SNDFILE *sf = sf_open(filename, SFM_READ, &info);
 	if (!sf)
@@ -34,8 +61,10 @@ float *loadAudio(const char *filename, int *length) {
 
 	// Get length of audio
 	int len = sf_seek(sf, 0, SEEK_END);
-	if (len <= 0)
+	if (len <= 0) {
+		sf_close(sf);
 		return NULL;
+	}
 	sf_seek(sf, 0, SEEK_SET);
 	float *samples = new float[len];
 
@@ -90,6 +119,647 @@ void ellipsize(char *str, int maxLen) {
 }
 
 
+uint64_t hashBytes(const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t*) data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+
+bool replaceFile(const char *from, const char *to) {
+#if defined(_WIN32)
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+
+bool syncFile(const char *filename) {
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	bool success = FlushFileBuffers(file);
+	CloseHandle(file);
+	return success;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool success = fsync(fd) == 0;
+	close(fd);
+	return success;
+#endif
+}
+
+
+const uint8_t *mapFile(const char *filename, size_t *size) {
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0) {
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+		return NULL;
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	// The view keeps the mapping alive
+	CloseHandle(mapping);
+	if (!data)
+		return NULL;
+	*size = fileSize.QuadPart;
+	return (const uint8_t*) data;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file alive
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return (const uint8_t*) data;
+#endif
+}
+
+
+void unmapFile(const uint8_t *data, size_t size) {
+	if (!data)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(data);
+#else
+	munmap((void*) data, size);
+#endif
+}
+
+
+
+
+static uint16_t readU16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t readU32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+bool MappedWAV::open(const char *filename) {
+	// Faulting in a fresh mapping costs more than a single read for small files, such as single waves and banks
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (size <= 0) {
+		fclose(f);
+		return false;
+	}
+	if (size < MAPPED_WAV_MIN_SIZE) {
+		buffer = new uint8_t[size];
+		fseek(f, 0, SEEK_SET);
+		mapSize = fread(buffer, 1, size, f);
+		map = buffer;
+		fclose(f);
+	}
+	else {
+		fclose(f);
+		map = mapFile(filename, &mapSize);
+	}
+	if (!map)
+		return false;
+	if (mapSize < 12 || memcmp(map, "RIFF", 4) || memcmp(map + 8, "WAVE", 4)) {
+		close();
+		return false;
+	}
+
+	int format = 0;
+	int bits = 0;
+	channels = 0;
+	const uint8_t *p = map + 12;
+	const uint8_t *end = map + mapSize;
+	while (end - p >= 8) {
+		uint32_t len = readU32(p + 4);
+		const uint8_t *chunk = p + 8;
+		if (!memcmp(p, "fmt ", 4) && len >= 16 && (size_t) (end - chunk) >= 16) {
+			format = readU16(chunk);
+			channels = readU16(chunk + 2);
+			bits = readU16(chunk + 14);
+			// WAVE_FORMAT_EXTENSIBLE keeps the real format at the start of the subformat GUID
+			if (format == 0xfffe && len >= 26 && (size_t) (end - chunk) >= 26)
+				format = readU16(chunk + 24);
+		}
+		else if (!memcmp(p, "data", 4) && channels > 0 && channels <= MAPPED_WAV_MAX_CHANNELS) {
+			// Tolerate truncated files and streaming headers with a bogus length
+			size_t available = end - chunk;
+			size_t dataLen = std::min((size_t) len, available);
+			if (format == 1 && bits == 16)
+				isFloat = false;
+			else if (format == 3 && bits == 32)
+				isFloat = true;
+			else
+				break;
+			data = chunk;
+			frames = dataLen / ((isFloat ? 4 : 2) * channels);
+			return frames > 0;
+		}
+		// Chunks are padded to an even length
+		if ((size_t) (end - chunk) < len + (len & 1))
+			break;
+		p = chunk + len + (len & 1);
+	}
+	close();
+	return false;
+}
+
+void MappedWAV::close() {
+	if (buffer) {
+		delete[] buffer;
+		buffer = NULL;
+	}
+	else {
+		unmapFile(map, mapSize);
+	}
+	map = NULL;
+	data = NULL;
+	frames = 0;
+}
+
+void MappedWAV::read(float *out, size_t offset, size_t len) const {
+	if (isFloat) {
+		memcpy(out, data + offset * 4, len * 4);
+		return;
+	}
+	const uint8_t *in = data + offset * 2;
+	size_t i = 0;
+#ifdef __SSE2__
+	// Sign extend 8 samples at a time by unpacking into the high halves of 32-bit lanes
+	const __m128 scale = _mm_set1_ps(1.f / 32768.f);
+	for (; i + 8 <= len; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (in + i * 2));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+#endif
+	for (; i < len; i++) {
+		out[i] = (int16_t) readU16(in + i * 2) / 32768.f;
+	}
+}
+
+void MappedWAV::readMono(float *out, size_t frame, size_t len) const {
+	if (channels == 1) {
+		read(out, frame, len);
+		return;
+	}
+	// Whole frames at a time, as many as fit
+	float buffer[1 << 12];
+	const size_t bufferFrames = (sizeof(buffer) / sizeof(float)) / channels;
+	for (size_t pos = 0; pos < len; pos += bufferFrames) {
+		size_t n = std::min(bufferFrames, len - pos);
+		read(buffer, (frame + pos) * channels, n * channels);
+		for (size_t i = 0; i < n; i++) {
+			float sample = 0.0;
+			for (int c = 0; c < channels; c++) {
+				sample += buffer[i * channels + c];
+			}
+			out[pos + i] = sample / channels;
+		}
+	}
+}
+
+static void writeU16(uint8_t *p, uint16_t x) {
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void writeU32(uint8_t *p, uint32_t x) {
+	writeU16(p, x);
+	writeU16(p + 2, x >> 16);
+}
+
+int soundFileFormat(const char *filename) {
+	const char *ext = strrchr(filename, '.');
+	if (ext && strcasecmp(ext, ".flac") == 0)
+		return SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+	return SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
+}
+
+/** Growable file in memory for libsndfile's virtual I/O, starting at the end of what `buf` already holds */
+struct MemoryFile {
+	std::vector<uint8_t> *buf;
+	size_t start;
+	size_t pos;
+};
+
+static sf_count_t memoryFileLength(void *user) {
+	MemoryFile *file = (MemoryFile*) user;
+	return file->buf->size() - file->start;
+}
+
+static sf_count_t memoryFileSeek(sf_count_t offset, int whence, void *user) {
+	MemoryFile *file = (MemoryFile*) user;
+	sf_count_t base = (whence == SEEK_CUR) ? file->pos : (whence == SEEK_END) ? memoryFileLength(user) : 0;
+	file->pos = std::max(base + offset, (sf_count_t) 0);
+	return file->pos;
+}
+
+static sf_count_t memoryFileRead(void *ptr, sf_count_t count, void *user) {
+	MemoryFile *file = (MemoryFile*) user;
+	sf_count_t len = std::min(count, memoryFileLength(user) - (sf_count_t) file->pos);
+	if (len <= 0)
+		return 0;
+	memcpy(ptr, file->buf->data() + file->start + file->pos, len);
+	file->pos += len;
+	return len;
+}
+
+static sf_count_t memoryFileWrite(const void *ptr, sf_count_t count, void *user) {
+	MemoryFile *file = (MemoryFile*) user;
+	size_t end = file->start + file->pos + count;
+	if (end > file->buf->size())
+		file->buf->resize(end);
+	memcpy(file->buf->data() + file->start + file->pos, ptr, count);
+	file->pos += count;
+	return count;
+}
+
+static sf_count_t memoryFileTell(void *user) {
+	return ((MemoryFile*) user)->pos;
+}
+
+bool flacEncode(std::vector<uint8_t> &out, const int16_t *samples, size_t frames, int sampleRate) {
+	MemoryFile file = {&out, out.size(), 0};
+	SF_VIRTUAL_IO io = {memoryFileLength, memoryFileSeek, memoryFileRead, memoryFileWrite, memoryFileTell};
+	SF_INFO info = {};
+	info.samplerate = sampleRate;
+	info.channels = 1;
+	info.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+	// Fails if libsndfile was built without FLAC
+	SNDFILE *sf = sf_open_virtual(&io, SFM_WRITE, &info, &file);
+	if (!sf) {
+		out.resize(file.start);
+		return false;
+	}
+	bool success = sf_write_short(sf, samples, frames) == (sf_count_t) frames;
+	return (sf_close(sf) == 0) && success;
+}
+
+void wavEncode(std::vector<uint8_t> &out, const int16_t *samples, size_t frames, int sampleRate) {
+	uint32_t bytes = frames * 2;
+	size_t start = out.size();
+	out.resize(start + 44 + bytes);
+	uint8_t *p = out.data() + start;
+	memcpy(p, "RIFF", 4);
+	writeU32(p + 4, 36 + bytes);
+	memcpy(p + 8, "WAVEfmt ", 8);
+	writeU32(p + 16, 16);
+	writeU16(p + 20, 1); // PCM
+	writeU16(p + 22, 1); // Mono
+	writeU32(p + 24, sampleRate);
+	writeU32(p + 28, sampleRate * 2);
+	writeU16(p + 32, 2); // Block align
+	writeU16(p + 34, 16); // Bits per sample
+	memcpy(p + 36, "data", 4);
+	writeU32(p + 40, bytes);
+	p += 44;
+	for (size_t i = 0; i < frames; i++) {
+		writeU16(p + 2 * i, samples[i]);
+	}
+}
+
+
+/** Blocks of one thread's Workspaces, kept for the life of the thread */
+struct WorkspaceArena {
+	std::vector<std::unique_ptr<float[]>> blocks;
+	std::vector<size_t> sizes;
+	int block = 0;
+	size_t used = 0;
+};
+
+static thread_local WorkspaceArena workspaceArena;
+
+Workspace::Workspace() {
+	block = workspaceArena.block;
+	used = workspaceArena.used;
+}
+
+Workspace::~Workspace() {
+	workspaceArena.block = block;
+	workspaceArena.used = used;
+}
+
+float *Workspace::alloc(size_t len) {
+	WorkspaceArena &arena = workspaceArena;
+	// Keep arrays 16-byte aligned for SIMD FFTs
+	len = (len + 3) & ~(size_t) 3;
+	while (arena.block < (int) arena.blocks.size() && arena.used + len > arena.sizes[arena.block]) {
+		arena.block++;
+		arena.used = 0;
+	}
+	if (arena.block == (int) arena.blocks.size()) {
+		size_t size = std::max(len, (size_t) 1 << 16);
+		arena.blocks.emplace_back(new float[size]);
+		arena.sizes.push_back(size);
+	}
+	float *p = arena.blocks[arena.block].get() + arena.used;
+	arena.used += len;
+	return p;
+}
+
+float *Workspace::calloc(size_t len) {
+	float *p = alloc(len);
+	memset(p, 0, sizeof(float) * len);
+	return p;
+}
+
+
+/** A parallelFor() call which pool workers may join */
+struct ParallelJob {
+	const std::function<void(int)> *f;
+	int n;
+	std::atomic<int> next;
+	/** Workers which may still join */
+	int slots;
+	/** Workers running items of the job */
+	int active;
+};
+
+/** Threads kept for parallelFor(), so calls do not pay for starting and joining threads */
+struct ParallelPool {
+	std::mutex mutex;
+	/** Signals workers that a job was queued or the pool is stopping */
+	std::condition_variable wake;
+	/** Signals callers that a worker left their job */
+	std::condition_variable left;
+	std::vector<std::thread> workers;
+	/** Jobs which have slots left, oldest first */
+	std::deque<ParallelJob*> jobs;
+	bool running = true;
+
+	~ParallelPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_all();
+		for (std::thread &worker : workers) {
+			worker.join();
+		}
+	}
+
+	void work() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			if (!running)
+				return;
+			if (jobs.empty()) {
+				wake.wait(lock);
+				continue;
+			}
+			ParallelJob *job = jobs.front();
+			if (--job->slots == 0)
+				jobs.pop_front();
+			job->active++;
+			lock.unlock();
+			int i;
+			while ((i = job->next++) < job->n) {
+				(*job->f)(i);
+			}
+			lock.lock();
+			// The caller may return and destroy the job as soon as it is left
+			if (--job->active == 0)
+				left.notify_all();
+		}
+	}
+
+	/** Starts workers until there are at least `count` */
+	void grow(int count) {
+		std::lock_guard<std::mutex> lock(mutex);
+		while ((int) workers.size() < count) {
+			workers.emplace_back(&ParallelPool::work, this);
+		}
+	}
+};
+
+static ParallelPool &parallelPool() {
+	static ParallelPool pool;
+	return pool;
+}
+
+void parallelFor(int n, const std::function<void(int)> &f, int threads) {
+	if (n <= 0)
+		return;
+	if (threads <= 0)
+		threads = std::thread::hardware_concurrency();
+	threads = clampi(threads, 1, n);
+	if (threads == 1) {
+		for (int i = 0; i < n; i++) {
+			f(i);
+		}
+		return;
+	}
+
+	// Workers are only started as needed and then kept. I/O bound callers ask for more threads than there are cores to overlap their waits.
+	ParallelPool &pool = parallelPool();
+	pool.grow(mini(threads - 1, PARALLEL_MAX_WORKERS));
+	ParallelJob job;
+	job.f = &f;
+	job.n = n;
+	job.next = 0;
+	job.slots = threads - 1;
+	job.active = 0;
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.jobs.push_back(&job);
+	}
+	pool.wake.notify_all();
+
+	// The calling thread does its share of the work, or all of it if the workers are busy with other jobs, so calls from within a job cannot deadlock
+	int i;
+	while ((i = job.next++) < n) {
+		f(i);
+	}
+
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	auto it = std::find(pool.jobs.begin(), pool.jobs.end(), &job);
+	if (it != pool.jobs.end())
+		pool.jobs.erase(it);
+	while (job.active > 0) {
+		pool.left.wait(lock);
+	}
+}
+
+
+static const char ihexDigits[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+
+/** Nibble value of every byte, -1 if not a hex digit */
+static const int8_t ihexValues[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/** Appends one record to `out` and returns the new end */
+static char *ihexRecord(char *out, uint8_t type, uint16_t address, const uint8_t *data, int len) {
+	uint8_t header[4] = {(uint8_t) len, (uint8_t) (address >> 8), (uint8_t) address, type};
+	uint8_t checksum = 0;
+	*out++ = ':';
+	for (int i = 0; i < 4; i++) {
+		*out++ = ihexDigits[header[i] >> 4];
+		*out++ = ihexDigits[header[i] & 0xf];
+		checksum += header[i];
+	}
+	for (int i = 0; i < len; i++) {
+		*out++ = ihexDigits[data[i] >> 4];
+		*out++ = ihexDigits[data[i] & 0xf];
+		checksum += data[i];
+	}
+	checksum = -checksum;
+	*out++ = ihexDigits[checksum >> 4];
+	*out++ = ihexDigits[checksum & 0xf];
+	*out++ = '\n';
+	return out;
+}
+
+void ihexEncode(std::vector<uint8_t> &out, const uint8_t *data, size_t len, int recordLen) {
+	recordLen = clampi(recordLen, 1, 255);
+	// Data records, one more wherever a record is cut at a 64K segment, an extended address record per segment and the end of file record
+	size_t records = len / recordLen + 2 * (len >> 16) + 4;
+	size_t start = out.size();
+	out.resize(start + records * (1 + 2 * (4 + recordLen + 1) + 1));
+	char *begin = (char*) out.data() + start;
+	char *p = begin;
+
+	uint32_t upper = 0;
+	for (size_t pos = 0; pos < len;) {
+		uint32_t address = pos;
+		if ((address >> 16) != upper) {
+			// Extended linear address record for the upper 16 bits
+			upper = address >> 16;
+			uint8_t ext[2] = {(uint8_t) (upper >> 8), (uint8_t) upper};
+			p = ihexRecord(p, 0x04, 0, ext, 2);
+		}
+		// Records never straddle a 64K segment
+		size_t n = std::min((size_t) recordLen, len - pos);
+		n = std::min(n, (size_t) (0x10000 - (address & 0xffff)));
+		p = ihexRecord(p, 0x00, address & 0xffff, data + pos, n);
+		pos += n;
+	}
+	p = ihexRecord(p, 0x01, 0, NULL, 0);
+	out.resize(start + (p - begin));
+}
+
+bool ihexWrite(FILE *f, const uint8_t *data, size_t len, int recordLen) {
+	std::vector<uint8_t> buffer;
+	ihexEncode(buffer, data, len, recordLen);
+	return fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+}
+
+bool ihexRead(FILE *f, uint8_t *image, size_t size, size_t *written) {
+	if (written)
+		*written = 0;
+	uint32_t base = 0;
+	// Longest record plus CRLF and NUL
+	char line[1 + 2 * (4 + 255 + 1) + 3];
+	uint8_t record[4 + 255 + 1];
+	while (fgets(line, sizeof(line), f)) {
+		const uint8_t *c = (const uint8_t*) line;
+		// Tolerate blank lines and trailing whitespace
+		while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')
+			c++;
+		if (*c == '\0')
+			continue;
+		if (*c++ != ':')
+			return false;
+
+		// Decode the byte count first to know how much to expect
+		int len = 0;
+		uint8_t checksum = 0;
+		for (int i = 0; i < 4 + 255 + 1; i++) {
+			int hi = ihexValues[c[0]];
+			int lo = hi >= 0 ? ihexValues[c[1]] : -1;
+			if (lo < 0)
+				return false;
+			record[i] = hi << 4 | lo;
+			checksum += record[i];
+			c += 2;
+			if (i == 0)
+				len = record[0];
+			if (i == 4 + len)
+				break;
+		}
+		if (checksum != 0)
+			return false;
+
+		uint16_t address = record[1] << 8 | record[2];
+		uint8_t type = record[3];
+		const uint8_t *data = record + 4;
+		switch (type) {
+			case 0x00: {
+				uint32_t start = base + address;
+				// start + len could wrap around with a base near 4 GB
+				if (start > size || (size_t) len > size - start)
+					return false;
+				memcpy(image + start, data, len);
+				if (written)
+					*written += len;
+			} break;
+			case 0x01:
+				return true;
+			case 0x02:
+				// Extended segment address
+				if (len != 2)
+					return false;
+				base = (data[0] << 8 | data[1]) << 4;
+				break;
+			case 0x04:
+				// Extended linear address
+				if (len != 2)
+					return false;
+				base = (uint32_t) (data[0] << 8 | data[1]) << 16;
+				break;
+			case 0x03:
+			case 0x05:
+				// Start addresses mean nothing for a data image
+				break;
+			default:
+				return false;
+		}
+	}
+	// No end of file record
+	return false;
+}
 
 
 /* This base64 implementation:
@@ -241,3 +911,5 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
 	*out_len = pos - out;
 	return out;
 }
+
+} // namespace WAVETABLE_NAMESPACE
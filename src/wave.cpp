@@ -1,11 +1,20 @@
 #include "WaveEdit.hpp"
 #include <string.h>
 #include <sndfile.h>
+#include <mutex>
+#include <algorithm>
+
+namespace WAVETABLE_NAMESPACE {
 
 
-static Wave clipboardWave = {};
 bool clipboardActive = false;
 
+template <int N>
+static WaveT<N> &clipboardWave() {
+	static WaveT<N> wave = {};
+	return wave;
+}
+
 
 const char *effectNames[EFFECTS_LEN] {
 	"Pre-Gain",
@@ -32,21 +41,106 @@ const char *effectNames[EFFECTS_LEN] {
 };
 
 
-void Wave::clear() {
-	memset(this, 0, sizeof(Wave));
-    normalize = true;
+template <int N>
+void WaveT<N>::clear() {
+	memset(samples, 0, sizeof(samples));
+	memset(effects, 0, sizeof(effects));
+	cycle = false;
+	normalize = true;
+	// Bumps the invalidation count rather than resetting it, so a validate() of the old samples which is running concurrently is not taken as valid
+	invalidate(WAVE_DERIVED_ALL);
+}
+
+/** Waves are shared between banks and threads, so validation locks are striped by address instead of stored in the (copyable) wave */
+static std::mutex validateLocks[16];
+
+static std::mutex &validateLock(const void *wave, size_t size) {
+	return validateLocks[((uintptr_t) wave / size) % 16];
+}
+
+/** The validate worker may have been the other holder until just now. use_count() does not order its reads of the samples before our writes, the validation lock does. */
+template <int N>
+void cowAcquire(const WaveT<N> &wave) {
+	std::lock_guard<std::mutex> lock(validateLock(&wave, sizeof(wave)));
+}
+
+template <int N>
+WaveT<N>::WaveT(const WaveT &other) {
+	*this = other;
+}
+
+template <int N>
+WaveT<N> &WaveT<N>::operator=(const WaveT &other) {
+	if (this == &other)
+		return *this;
+	std::lock_guard<std::mutex> lock(validateLock(&other, sizeof(other)));
+	memcpy(samples, other.samples, sizeof(samples));
+	memcpy(spectrum, other.spectrum, sizeof(spectrum));
+	memcpy(harmonics, other.harmonics, sizeof(harmonics));
+	memcpy(postSamples, other.postSamples, sizeof(postSamples));
+	memcpy(postSpectrum, other.postSpectrum, sizeof(postSpectrum));
+	memcpy(postHarmonics, other.postHarmonics, sizeof(postHarmonics));
+	memcpy(mips, other.mips, sizeof(mips));
+	memcpy(effects, other.effects, sizeof(effects));
+	cycle = other.cycle;
+	normalize = other.normalize;
+	__atomic_store_n(&stale, __atomic_load_n(&other.stale, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	return *this;
+}
+
+template <int N>
+void WaveT<N>::invalidate(int derived) {
+	uint32_t old = __atomic_load_n(&stale, __ATOMIC_RELAXED);
+	// Bump the invalidation count so a validate() which is running concurrently does not mark the new data as valid
+	while (!__atomic_compare_exchange_n(&stale, &old, ((old | derived) & WAVE_DERIVED_ALL) | ((old & ~WAVE_DERIVED_ALL) + (WAVE_DERIVED_ALL + 1)), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+template <int N>
+bool WaveT<N>::isValid(int derived) const {
+	return !(__atomic_load_n(&stale, __ATOMIC_ACQUIRE) & derived);
+}
+
+template <int N>
+void WaveT<N>::validate(int derived) const {
+	if (isValid(derived))
+		return;
+	std::lock_guard<std::mutex> lock(validateLock(this, sizeof(*this)));
+	uint32_t old = __atomic_load_n(&stale, __ATOMIC_ACQUIRE);
+	int todo = old & derived;
+	if (!todo)
+		return;
+	// Mips are computed from the post samples
+	if (todo & WAVE_MIPS)
+		todo |= old & WAVE_POST;
+	// Post data is computed from the samples only, so it does not depend on the spectrum
+	if (todo & WAVE_SPECTRUM)
+		computeSpectrum();
+	if (todo & WAVE_POST)
+		computePost();
+	if (todo & WAVE_MIPS)
+		computeMips(postSamples, N, mips);
+	// If the wave was invalidated while computing, leave it stale to be computed again
+	__atomic_compare_exchange_n(&stale, &old, old & ~todo, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 }
 
-void Wave::updatePost() {
-	float out[WAVE_LEN];
-	memcpy(out, samples, sizeof(float) * WAVE_LEN);
+template <int N>
+void WaveT<N>::updatePost() {
+	invalidate(WAVE_POST | WAVE_MIPS);
+}
+
+template <int N>
+void WaveT<N>::computePost() const {
+	// Scratch arrays come from the heap, a few of them at 2048 samples would be a lot of stack for the validate workers
+	Workspace ws;
+	float *out = ws.alloc(N);
+	memcpy(out, samples, sizeof(float) * N);
 
 	// Pre-gain with saturation / soft clipping
 	if (effects[PRE_GAIN]) {
 		float gain = powf(20.0, effects[PRE_GAIN]);
-		float tmp[WAVE_LEN];
-		memcpy(tmp, out, sizeof(float) * WAVE_LEN);
-		for (int i = 0; i < WAVE_LEN; i++) {
+		float *tmp = ws.alloc(N);
+		memcpy(tmp, out, sizeof(float) * N);
+		for (int i = 0; i < N; i++) {
 			out[i] *= gain;
 			if (fabs(out[i]) >= 1.0)
 				out[i] = clampf(out[i], -2.0 / 3.0, 2.0 / 3.0);
@@ -59,12 +153,12 @@ void Wave::updatePost() {
 	// Temporal and Harmonic Shift, Harmonic Asymetry, Harmonic Balance, Harmonic Stretch
 	if (effects[HARMONIC_STRETCH] > 0.0 || effects[PHASE_SHIFT] > 0.0 || effects[HARMONIC_ASYMETRY] > 0.0 || effects[HARMONIC_BALANCE] > 0.0 || effects[HARMONIC_SHIFT] > 0.0 || effects[HARMONIC_FOLD] > 0.0) {
 		// Shift Fourier phase proportionally
-		float tmp[WAVE_LEN];
-		float tmp1[WAVE_LEN] = {};
+		float *tmp = ws.alloc(N);
+		float *tmp1 = ws.calloc(N);
 		float *tmp2;
-		float tmp3[WAVE_LEN] = {};
-		RFFT(out, tmp, WAVE_LEN);
-		for (int k = 0; k < WAVE_LEN / 2; k++) {
+		float *tmp3 = ws.calloc(N);
+		RFFT(out, tmp, N);
+		for (int k = 0; k < N / 2; k++) {
 			float phase = clampf(effects[HARMONIC_SHIFT], 0.0, 1.0) + clampf(effects[PHASE_SHIFT], 0.0, 1.0) * k;
 			float br = cosf(2 * M_PI * phase);
 			float bi = -sinf(2 * M_PI * phase);
@@ -96,16 +190,16 @@ void Wave::updatePost() {
 					}
 				}
 			};
-			if (effects[HARMONIC_STRETCH] > 0.0 && k < WAVE_LEN) {
+			if (effects[HARMONIC_STRETCH] > 0.0 && k < N) {
 				const int steps = 8;
 				float scale = effects[HARMONIC_STRETCH] * steps;
-				float dstf = fmod(k + k * scale, WAVE_LEN / 2);
+				float dstf = fmod(k + k * scale, N / 2);
 				int dst = (int) dstf * 2;
 				float ratio = fmod(dstf, 1.0);
-				tmp1[dst % WAVE_LEN] += crossf(tmp[2 * k], 0.0, ratio);
-				tmp1[(dst + 1) % WAVE_LEN] += crossf(tmp[(2 * k + 1) % WAVE_LEN], 0.0, ratio);
-				tmp1[(dst + 2) % WAVE_LEN] += crossf(0.0, tmp[2 * k], ratio);
-				tmp1[(dst + 3) % WAVE_LEN] += crossf(0.0, tmp[(2 * k + 1) % WAVE_LEN], ratio);
+				tmp1[dst % N] += crossf(tmp[2 * k], 0.0, ratio);
+				tmp1[(dst + 1) % N] += crossf(tmp[(2 * k + 1) % N], 0.0, ratio);
+				tmp1[(dst + 2) % N] += crossf(0.0, tmp[2 * k], ratio);
+				tmp1[(dst + 3) % N] += crossf(0.0, tmp[(2 * k + 1) % N], ratio);
 			}
 		};
 		if (effects[HARMONIC_STRETCH] > 0.0) {
@@ -115,13 +209,13 @@ void Wave::updatePost() {
 			tmp2 = tmp;
 		}
 		if (effects[HARMONIC_FOLD] > 0.0){
-			float limit = rescalef(clampf(effects[HARMONIC_FOLD], 0.0, 1.0), 0.0, 1.0, (float) WAVE_LEN / 2, 1.0);
+			float limit = rescalef(clampf(effects[HARMONIC_FOLD], 0.0, 1.0), 0.0, 1.0, (float) N / 2, 1.0);
 			int ilimit = (int) limit;
 			float ratio = 1.0 - fmod(limit, 1.0);
 			for (int i = 0; i < ilimit * 2; i++) {
 				tmp3[i] = tmp2[i];
 			};
-			for (int i = ilimit; i < WAVE_LEN / 2; i++){
+			for (int i = ilimit; i < N / 2; i++){
 				int dst = i;
 				if (dst >= ilimit * 2)
 					dst = fmod(dst, ilimit * 2.0);
@@ -134,18 +228,18 @@ void Wave::updatePost() {
 			};
 			tmp2 = tmp3;
 		}
-		IRFFT(tmp2, out, WAVE_LEN);
+		IRFFT(tmp2, out, N);
 	}
 	
 	if (effects[PHASE_DISTORTION] > 0.0 || effects[CUBIC_DISTORTION] > 0.0) {
 		float phase, dst_phase;
-		float tmp[WAVE_LEN + 1];
-		memcpy(tmp, out, sizeof(float) * WAVE_LEN);
-		tmp[WAVE_LEN] = tmp[0];
+		float *tmp = ws.alloc(N + 1);
+		memcpy(tmp, out, sizeof(float) * N);
+		tmp[N] = tmp[0];
 		
 		float phase_midpoint = 0.5 + clampf(effects[PHASE_DISTORTION], 0.0, 1.0) / 2;
-		for (int i = 0; i < WAVE_LEN; i++) {
-			phase = ((float) i ) / WAVE_LEN;
+		for (int i = 0; i < N; i++) {
+			phase = ((float) i ) / N;
 			if (phase < phase_midpoint) {
 				dst_phase = rescalef(phase, 0.0, phase_midpoint, 0.0, 0.5);
 			}
@@ -158,8 +252,8 @@ void Wave::updatePost() {
 			
 			float final_phase = crossf(dst_phase, rescalef(cubic_phase, -1.0, 1.0, 0.0, 1.0), effects[CUBIC_DISTORTION]);
 			
-			int dst_idx = (int) (final_phase * WAVE_LEN);
-			float delta = (final_phase - ((float) dst_idx) / WAVE_LEN) * WAVE_LEN;
+			int dst_idx = (int) (final_phase * N);
+			float delta = (final_phase - ((float) dst_idx) / N) * N;
 			out[i] = crossf(tmp[dst_idx], tmp[dst_idx + 1], delta);
 		}
 	}
@@ -171,31 +265,39 @@ void Wave::updatePost() {
 
 		// Build the kernel in Fourier space
 		// Place taps at positions `comb * j`, with exponentially decreasing amplitude
-		float kernel[WAVE_LEN] = {};
-		for (int k = 0; k < WAVE_LEN / 2; k++) {
+		float *kernel = ws.calloc(N);
+		float amplitudes[taps];
+		for (int j = 0; j < taps; j++) {
+			// Normalize by sum of geometric series
+			amplitudes[j] = powf(base, j) * (1.0 - base);
+		}
+		for (int k = 0; k < N / 2; k++) {
+			// Step the tap phase by complex rotation, sines and cosines per tap would dominate at large N
+			double phase = -2.0 * M_PI * k * effects[COMB];
+			float stepr = cos(phase);
+			float stepi = sin(phase);
+			float tapr = 1.0;
+			float tapi = 0.0;
 			for (int j = 0; j < taps; j++) {
-				float amplitude = powf(base, j);
-				// Normalize by sum of geometric series
-				amplitude *= (1.0 - base);
-				float phase = -2.0 * M_PI * k * effects[COMB] * j;
-				kernel[2 * k] += amplitude * cosf(phase);
-				kernel[2 * k + 1] += amplitude * sinf(phase);
+				kernel[2 * k] += amplitudes[j] * tapr;
+				kernel[2 * k + 1] += amplitudes[j] * tapi;
+				cmultf(&tapr, &tapi, tapr, tapi, stepr, stepi);
 			}
 		}
 
 		// Convolve FFT of input with kernel
-		float fft[WAVE_LEN];
-		RFFT(out, fft, WAVE_LEN);
-		for (int k = 0; k < WAVE_LEN / 2; k++) {
+		float *fft = ws.alloc(N);
+		RFFT(out, fft, N);
+		for (int k = 0; k < N / 2; k++) {
 			cmultf(&fft[2 * k], &fft[2 * k + 1], fft[2 * k], fft[2 * k + 1], kernel[2 * k], kernel[2 * k + 1]);
 		}
-		IRFFT(fft, out, WAVE_LEN);
+		IRFFT(fft, out, N);
 	}
 
 	// Chebyshev waveshaping
 	if (effects[CHEBYSHEV] > 0.0) {
 		float n = powf(50.0, effects[CHEBYSHEV]);
-		for (int i = 0; i < WAVE_LEN; i++) {
+		for (int i = 0; i < N; i++) {
 			// Apply a distant variant of the Chebyshev polynomial of the first kind
 			if (-1.0 <= out[i] && out[i] <= 1.0)
 				out[i] = sinf(n * asinf(out[i]));
@@ -206,30 +308,30 @@ void Wave::updatePost() {
 
 	// Sample & Hold
 	if (effects[SAMPLE_AND_HOLD] > 0.0) {
-		float frameskip = powf(WAVE_LEN / 2.0, clampf(effects[SAMPLE_AND_HOLD], 0.0, 1.0));
-		float tmp[WAVE_LEN + 1];
-		memcpy(tmp, out, sizeof(float) * WAVE_LEN);
-		tmp[WAVE_LEN] = tmp[0];
+		float frameskip = powf(N / 2.0, clampf(effects[SAMPLE_AND_HOLD], 0.0, 1.0));
+		float *tmp = ws.alloc(N + 1);
+		memcpy(tmp, out, sizeof(float) * N);
+		tmp[N] = tmp[0];
 
 		// Dumb linear interpolation S&H
-		for (int i = 0; i < WAVE_LEN; i++) {
+		for (int i = 0; i < N; i++) {
 			float index = roundf(i / frameskip) * frameskip;
-			out[i] = linterpf(tmp, clampf(index, 0.0, WAVE_LEN - 1));
+			out[i] = linterpf(tmp, clampf(index, 0.0, N - 1));
 		}
 	}
 
 	// Track & Hold
 	if (effects[TRACK_AND_HOLD] > 0.0) {
-		float frameskip = powf(WAVE_LEN / 2.0, clampf(effects[TRACK_AND_HOLD], 0.0, 1.0));
-		float tmp[WAVE_LEN + 1];
-		memcpy(tmp, out, sizeof(float) * WAVE_LEN);
-		tmp[WAVE_LEN] = tmp[0];
+		float frameskip = powf(N / 2.0, clampf(effects[TRACK_AND_HOLD], 0.0, 1.0));
+		float *tmp = ws.alloc(N + 1);
+		memcpy(tmp, out, sizeof(float) * N);
+		tmp[N] = tmp[0];
 
 		// Dumb linear interpolation S&H
-		for (int i = 0; i < WAVE_LEN; i++) {
+		for (int i = 0; i < N; i++) {
 			float index = roundf(i / frameskip) * frameskip;
 			if (i >= index) {
-			    out[i] = linterpf(tmp, clampf(index, 0.0, WAVE_LEN - 1));
+			    out[i] = linterpf(tmp, clampf(index, 0.0, N - 1));
 			}
 		}
 	}
@@ -237,7 +339,7 @@ void Wave::updatePost() {
 	// Quantization
 	if (effects[QUANTIZATION] > 1e-3) {
 		float levels = powf(clampf(effects[QUANTIZATION], 0.0, 1.0), -1.5);
-		for (int i = 0; i < WAVE_LEN; i++) {
+		for (int i = 0; i < N; i++) {
 			out[i] = roundf(out[i] * levels) / levels;
 		}
 	}
@@ -247,7 +349,7 @@ void Wave::updatePost() {
 		float slew = powf(0.001, effects[SLEW]);
 
 		float y = out[0];
-		for (int i = 1; i < WAVE_LEN; i++) {
+		for (int i = 1; i < N; i++) {
 			float dxdt = out[i] - y;
 			float dydt = clampf(dxdt, -slew, slew);
 			y += dydt;
@@ -258,62 +360,62 @@ void Wave::updatePost() {
 	// Brick-wall lowpass / highpass filter
 	// TODO Maybe change this into a more musical filter
 	if (effects[LOWPASS] > 0.0 || effects[HIGHPASS]) {
-		float fft[WAVE_LEN];
-		RFFT(out, fft, WAVE_LEN);
+		float *fft = ws.alloc(N);
+		RFFT(out, fft, N);
 		float lowpass = 1.0 - effects[LOWPASS];
 		float highpass = effects[HIGHPASS];
-		for (int i = 1; i < WAVE_LEN / 2; i++) {
-			float v = clampf(WAVE_LEN / 2 * lowpass - i, 0.0, 1.0) * clampf(-WAVE_LEN / 2 * highpass + i, 0.0, 1.0);
+		for (int i = 1; i < N / 2; i++) {
+			float v = clampf(N / 2 * lowpass - i, 0.0, 1.0) * clampf(-N / 2 * highpass + i, 0.0, 1.0);
 			fft[2 * i] *= v;
 			fft[2 * i + 1] *= v;
 		}
-		IRFFT(fft, out, WAVE_LEN);
+		IRFFT(fft, out, N);
 	}
 		
 	if (effects[LOW_BOOST] > 0.0 || effects[MID_BOOST] > 0.0 || effects[HIGH_BOOST] > 0.0) {
 		// Generate boost factors for every harmonic
-		float boost[WAVE_LEN / 2];
+		float *boost = ws.alloc(N / 2);
 		const float boost_level = 4.0;
-		for (int i = 0; i < WAVE_LEN / 2; i++)
+		for (int i = 0; i < N / 2; i++)
 			boost[i] = 1.0;
 		// The lower harmonic, the higher is its boost factor and only lowest half of spectrum is boosted.
 		if (effects[LOW_BOOST] > 0.0)
-			for (int i = 0; i < WAVE_LEN / 4; i++)
-				boost[i] += boost_level * effects[LOW_BOOST] * (WAVE_LEN / 4 - i) / WAVE_LEN * 4.0;
+			for (int i = 0; i < N / 4; i++)
+				boost[i] += boost_level * effects[LOW_BOOST] * (N / 4 - i) / N * 4.0;
 		// The higher harmonic, the higher is its boost factor and only highest half of spectrum is boosted
 		if (effects[HIGH_BOOST] > 0.0)
-			for (int i = WAVE_LEN / 4; i < WAVE_LEN / 2; i++)
-				boost[i] += boost_level * effects[HIGH_BOOST] * (1 + i - WAVE_LEN / 4) / WAVE_LEN * 4.0;
+			for (int i = N / 4; i < N / 2; i++)
+				boost[i] += boost_level * effects[HIGH_BOOST] * (1 + i - N / 4) / N * 4.0;
 		// The closer harmonic is to the center, the higher is its boost factor. All spectrum is boosted.
 		// This effect is applied after the previous too and takes their boost into consideration.
 		if (effects[MID_BOOST] > 0.0) {
-			for (int i = 0; i < WAVE_LEN / 4; i++){
-				boost[i] *= (1 + boost_level * effects[MID_BOOST] * (i + 1) / WAVE_LEN * 4.0);
+			for (int i = 0; i < N / 4; i++){
+				boost[i] *= (1 + boost_level * effects[MID_BOOST] * (i + 1) / N * 4.0);
 			};
-			for (int i = WAVE_LEN / 4; i < WAVE_LEN / 2; i++){
-				boost[i] *= (1 + boost_level * effects[MID_BOOST] * (WAVE_LEN / 2 - i) / WAVE_LEN * 4.0);
+			for (int i = N / 4; i < N / 2; i++){
+				boost[i] *= (1 + boost_level * effects[MID_BOOST] * (N / 2 - i) / N * 4.0);
 			}
 		}
 		// FFT transform
-		float fft[WAVE_LEN];
-		RFFT(out, fft, WAVE_LEN);
+		float *fft = ws.alloc(N);
+		RFFT(out, fft, N);
 		
 		// Multiply harmonics by boost factors
-		for (int i = 0; i < WAVE_LEN / 2; i++) {
+		for (int i = 0; i < N / 2; i++) {
 			fft[i * 2] *= boost[i];
 			fft[i * 2 + 1] *= boost[i];
 		}
 
 		// Reverse FFT transform
-		IRFFT(fft, out, WAVE_LEN);
+		IRFFT(fft, out, N);
 	}
 	
 	// Post gain with saturation / soft clipping
 	if (effects[POST_GAIN]) {
 		float gain = powf(20.0, effects[POST_GAIN]);
-		float tmp[WAVE_LEN];
-		memcpy(tmp, out, sizeof(float) * WAVE_LEN);
-		for (int i = 0; i < WAVE_LEN; i++) {
+		float *tmp = ws.alloc(N);
+		memcpy(tmp, out, sizeof(float) * N);
+		for (int i = 0; i < N; i++) {
 			out[i] *= gain;
 			if (fabs(out[i]) >= 1.0)
 				out[i] = clampf(out[i], -2.0 / 3.0, 2.0 / 3.0);
@@ -326,47 +428,51 @@ void Wave::updatePost() {
 	// Cycle
 	if (cycle) {
 		float start = out[0];
-		float end = out[WAVE_LEN - 1] / (WAVE_LEN - 1) * WAVE_LEN;
+		float end = out[N - 1] / (N - 1) * N;
 
-		for (int i = 0; i < WAVE_LEN; i++) {
-			out[i] -= (end - start) * (i - WAVE_LEN / 2) / WAVE_LEN;
+		for (int i = 0; i < N; i++) {
+			out[i] -= (end - start) * (i - N / 2) / N;
 		}
 	}
 
 	// Normalize
 	if (normalize)
-		normalize_array(out, WAVE_LEN, -1.0, 1.0, 0.0);
+		normalize_array(out, N, -1.0, 1.0, 0.0);
 
 	// Hard clip :(
-	for (int i = 0; i < WAVE_LEN; i++) {
+	for (int i = 0; i < N; i++) {
 		out[i] = clampf(out[i], -1.0, 1.0);
 	}
 
-	// TODO Fix possible race condition with audio thread here
-	// Or not, because the race condition would only just replace samples as they are being read, which just gives a click sound.
-	memcpy(postSamples, out, sizeof(float)*WAVE_LEN);
+	memcpy(postSamples, out, sizeof(float)*N);
 
 	// Convert wave to spectrum
-	RFFT(postSamples, postSpectrum, WAVE_LEN);
+	RFFT(postSamples, postSpectrum, N);
 	// Convert spectrum to harmonics
-	for (int i = 0; i < WAVE_LEN / 2; i++) {
+	for (int i = 0; i < N / 2; i++) {
 		postHarmonics[i] = hypotf(postSpectrum[2 * i], postSpectrum[2 * i + 1]) * 2.0;
 	}
 }
 
-void Wave::commitSamples() {
+template <int N>
+void WaveT<N>::commitSamples() {
+	invalidate(WAVE_DERIVED_ALL);
+}
+
+template <int N>
+void WaveT<N>::computeSpectrum() const {
 	// Convert wave to spectrum
-	RFFT(samples, spectrum, WAVE_LEN);
+	RFFT(samples, spectrum, N);
 	// Convert spectrum to harmonics
-	for (int i = 0; i < WAVE_LEN / 2; i++) {
+	for (int i = 0; i < N / 2; i++) {
 		harmonics[i] = hypotf(spectrum[2 * i], spectrum[2 * i + 1]) * 2.0;
 	}
-	updatePost();
 }
 
-void Wave::commitHarmonics() {
+template <int N>
+void WaveT<N>::commitHarmonics() {
 	// Rescale spectrum by the new norm
-	for (int i = 0; i < WAVE_LEN / 2; i++) {
+	for (int i = 0; i < N / 2; i++) {
 		float oldHarmonic = hypotf(spectrum[2 * i], spectrum[2 * i + 1]);
 		float newHarmonic = harmonics[i] / 2.0;
 		if (oldHarmonic > 1.0e-6) {
@@ -394,81 +500,110 @@ void Wave::commitHarmonics() {
 		}
 	}
 	// Convert spectrum to wave
-	IRFFT(spectrum, samples, WAVE_LEN);
+	IRFFT(spectrum, samples, N);
 	updatePost();
 }
 
-void Wave::clearEffects() {
+template <int N>
+void WaveT<N>::clearEffects() {
 	memset(effects, 0, sizeof(float) * EFFECTS_LEN);
 	cycle = false;
 	normalize = true;
 	updatePost();
 }
 
-void Wave::bakeEffects() {
-	memcpy(samples, postSamples, sizeof(float)*WAVE_LEN);
+template <int N>
+void WaveT<N>::bakeEffects() {
+	memcpy(samples, getPostSamples(), sizeof(float)*N);
 	clearEffects();
 	commitSamples();
 }
 
-void Wave::randomizeEffects() {
+template <int N>
+void WaveT<N>::randomizeEffects() {
 	for (int i = 0; i < EFFECTS_LEN; i++) {
 		effects[i] = randf() > 0.75 ? powf(randf(), 2) : 0.0;
 	}
 	updatePost();
 }
 
-void Wave::morphEffect(Wave *from_wave, Wave *to_wave, EffectID effect, float fade) {
+template <int N>
+void WaveT<N>::morphEffect(const WaveT<N> *from_wave, const WaveT<N> *to_wave, EffectID effect, float fade) {
 	effects[effect] = crossf(from_wave->effects[effect], to_wave->effects[effect], fade);
 	updatePost();
 }
 
-void Wave::morphAllEffects(Wave *from_wave, Wave *to_wave, float fade) {
+template <int N>
+void WaveT<N>::morphAllEffects(const WaveT<N> *from_wave, const WaveT<N> *to_wave, float fade) {
 	for (int i = 0; i < EFFECTS_LEN; i++){
 		effects[i] = crossf(from_wave->effects[i], to_wave->effects[i], fade);
 	};
 	updatePost();
 }
 
-void Wave::saveWAV(const char *filename) {
+template <int N>
+bool WaveT<N>::saveWAV(const char *filename) const {
 	SF_INFO info;
 	info.samplerate = 44100;
 	info.channels = 1;
-	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
+	info.format = soundFileFormat(filename);
 	SNDFILE *sf = sf_open(filename, SFM_WRITE, &info);
 	if (!sf)
-		return;
+		return false;
 
-	sf_write_float(sf, postSamples, WAVE_LEN);
+	bool success = sf_write_float(sf, getPostSamples(), N) == N;
 
-	sf_close(sf);
+	return (sf_close(sf) == 0) && success;
 }
 
-void Wave::loadWAV(const char *filename) {
+template <int N>
+void WaveT<N>::loadWAV(const char *filename) {
 	clear();
 
+	MappedWAV wav;
+	if (wav.open(filename)) {
+		wav.read(samples, 0, std::min((size_t) N, wav.frames * wav.channels));
+		commitSamples();
+		wav.close();
+		return;
+	}
+
 	SF_INFO info;
 	SNDFILE *sf = sf_open(filename, SFM_READ, &info);
 	if (!sf)
 		return;
 
-	sf_read_float(sf, samples, WAVE_LEN);
+	sf_read_float(sf, samples, N);
 	commitSamples();
 
 	sf_close(sf);
 }
 
-void Wave::clipboardCopy() {
-	memcpy(&clipboardWave, this, sizeof(*this));
+template <int N>
+void WaveT<N>::clipboardCopy() const {
+	clipboardWave<N>() = *this;
 	clipboardActive = true;
 }
 
-void Wave::clipboardPaste() {
+template <int N>
+void WaveT<N>::clipboardPaste() {
 	if (clipboardActive) {
-		copy(&clipboardWave);
+		copy(&clipboardWave<N>());
 	}
 }
 
-void Wave::copy(Wave *dst) {
-	memcpy(this, dst, sizeof(*this));
+template <int N>
+void WaveT<N>::copy(const WaveT<N> *dst) {
+	*this = *dst;
 }
+
+
+// Every wave length used by a wavetable format
+template struct WaveT<128>;
+template struct WaveT<256>;
+template struct WaveT<2048>;
+template void cowAcquire<128>(const WaveT<128> &wave);
+template void cowAcquire<256>(const WaveT<256> &wave);
+template void cowAcquire<2048>(const WaveT<2048> &wave);
+
+} // namespace WAVETABLE_NAMESPACE
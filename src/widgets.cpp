@@ -4,6 +4,8 @@
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include "imgui_internal.h"
 
+namespace WAVETABLE_NAMESPACE {
+
 
 
 static void drawGrid(ImRect inner, int len) {
@@ -39,6 +41,53 @@ static void drawGrid(ImRect inner, int len) {
 	}
 }
 
+/** Replaces `vertices` with (index, value) pairs tracing `values`, using at most `maxVertices` of them.
+Longer arrays are split into maxVertices / 2 columns which keep their minimum and maximum in order, so peaks are not lost when thousands of samples share a few pixels.
+*/
+static void decimate(std::vector<ImVec2> &vertices, const float *values, int len, int maxVertices) {
+	vertices.clear();
+	if (len <= maxVertices || maxVertices < 4) {
+		for (int i = 0; i < len; i++) {
+			vertices.emplace_back(i, values[i]);
+		}
+		return;
+	}
+	int columns = maxVertices / 2;
+	for (int c = 0; c < columns; c++) {
+		int start = (int64_t) len * c / columns;
+		int end = (int64_t) len * (c + 1) / columns;
+		int minIndex = start;
+		int maxIndex = start;
+		for (int i = start + 1; i < end; i++) {
+			if (values[i] < values[minIndex])
+				minIndex = i;
+			if (values[i] > values[maxIndex])
+				maxIndex = i;
+		}
+		int first = mini(minIndex, maxIndex);
+		int second = maxi(minIndex, maxIndex);
+		vertices.emplace_back(first, values[first]);
+		if (second != first)
+			vertices.emplace_back(second, values[second]);
+	}
+	// Keep the end of the line where it was
+	if (vertices.back().x != len - 1)
+		vertices.emplace_back(len - 1, values[len - 1]);
+}
+
+/** Draws `values` across `inner` like renderWave() does, with at most one vertex per pixel */
+static void drawLines(ImRect inner, const float *values, int len, float minValue, float maxValue, ImU32 col) {
+	static std::vector<ImVec2> vertices;
+	decimate(vertices, values, len, (int) inner.GetWidth());
+	for (ImVec2 &vertex : vertices) {
+		vertex = ImVec2(rescalef(vertex.x, 0, len, inner.Min.x, inner.Max.x), rescalef(vertex.y, maxValue, minValue, inner.Min.y, inner.Max.y));
+	}
+	ImGui::GetCurrentWindow()->DrawList->AddPolyline(vertices.data(), vertices.size(), col, false, 1.0);
+}
+
+/** Points closer than this many pixels would merge into a band of dots, so they are drawn as a line instead */
+#define POINT_SPACING_MIN 1.0
+
 static void waveLine(float *points, int pointsLen, float startIndex, float endIndex, float startValue, float endValue) {
 	// Switch indices if out of order
 	if (startIndex > endIndex) {
@@ -192,19 +241,18 @@ bool renderWave(const char *name, float height, float *points, int pointsLen, co
 	ImGui::PushClipRect(box.Min, box.Max, true);
 	// Draw lines
 	if (lines) {
-		ImVec2 lastPos;
-		for (int i = 0; i < linesLen; i++) {
-			ImVec2 pos = ImVec2(rescalef(i, 0, linesLen, inner.Min.x, inner.Max.x), rescalef(lines[i], 1.0, -1.0, inner.Min.y, inner.Max.y));
-			if (i > 0)
-				window->DrawList->AddLine(lastPos, pos, ImGui::GetColorU32(ImGuiCol_PlotLines));
-			lastPos = pos;
-		}
+		drawLines(inner, lines, linesLen, -1.0, 1.0, ImGui::GetColorU32(ImGuiCol_PlotLines));
 	}
 	// Draw points
 	if (points) {
-		for (int i = 0; i < pointsLen; i++) {
-			ImVec2 pos = ImVec2(rescalef(i, 0, pointsLen, inner.Min.x, inner.Max.x), rescalef(points[i], 1.0, -1.0, inner.Min.y, inner.Max.y));
-			window->DrawList->AddCircleFilled(pos + ImVec2(0.5, 0.5), 2.0, ImGui::GetColorU32(ImGuiCol_PlotLines), 12);
+		if (inner.GetWidth() / pointsLen >= POINT_SPACING_MIN) {
+			for (int i = 0; i < pointsLen; i++) {
+				ImVec2 pos = ImVec2(rescalef(i, 0, pointsLen, inner.Min.x, inner.Max.x), rescalef(points[i], 1.0, -1.0, inner.Min.y, inner.Max.y));
+				window->DrawList->AddCircleFilled(pos + ImVec2(0.5, 0.5), 2.0, ImGui::GetColorU32(ImGuiCol_PlotLines), 12);
+			}
+		}
+		else {
+			drawLines(inner, points, pointsLen, -1.0, 1.0, ImGui::GetColorU32(ImGuiCol_PlotLines));
 		}
 	}
 	// Draw grid
@@ -269,24 +317,22 @@ bool renderPhasor(const char *name, float height, float *points, int pointsLen,
 	
 	// Draw lines
 	if (lines) {
-		ImVec2 lastPos;
-		ImVec2 firstPos;
-		for (int i = 0; i < linesLen; i++) {
-			ImVec2 pos = ImVec2(rescalef(i, 0, linesLen, inner.Min.x, inner.Max.x), rescalef(lines[i], 1.0, 0.0, inner.Min.y, inner.Max.y));
-			if (i == 0)
-				firstPos = pos;
-			else
-				window->DrawList->AddLine(lastPos, pos, ImGui::GetColorU32(ImGuiCol_PlotLines));
-			lastPos = pos;
-		}
-		firstPos.x = inner.Max.x;
+		drawLines(inner, lines, linesLen, 0.0, 1.0, ImGui::GetColorU32(ImGuiCol_PlotLines));
+		// Close the cycle at the right edge
+		ImVec2 lastPos = ImVec2(rescalef(linesLen - 1, 0, linesLen, inner.Min.x, inner.Max.x), rescalef(lines[linesLen - 1], 1.0, 0.0, inner.Min.y, inner.Max.y));
+		ImVec2 firstPos = ImVec2(inner.Max.x, rescalef(lines[0], 1.0, 0.0, inner.Min.y, inner.Max.y));
 		window->DrawList->AddLine(lastPos, firstPos, ImGui::GetColorU32(ImGuiCol_PlotLines));
 	}
 	// Draw points
 	if (points) {
-		for (int i = 0; i < pointsLen; i++) {
-			ImVec2 pos = ImVec2(rescalef(i, 0, pointsLen, inner.Min.x, inner.Max.x), rescalef(points[i], 1.0, 0.0, inner.Min.y, inner.Max.y));
-			window->DrawList->AddCircleFilled(pos + ImVec2(0.5, 0.5), 2.0, ImGui::GetColorU32(ImGuiCol_PlotLines), 12);
+		if (inner.GetWidth() / pointsLen >= POINT_SPACING_MIN) {
+			for (int i = 0; i < pointsLen; i++) {
+				ImVec2 pos = ImVec2(rescalef(i, 0, pointsLen, inner.Min.x, inner.Max.x), rescalef(points[i], 1.0, 0.0, inner.Min.y, inner.Max.y));
+				window->DrawList->AddCircleFilled(pos + ImVec2(0.5, 0.5), 2.0, ImGui::GetColorU32(ImGuiCol_PlotLines), 12);
+			}
+		}
+		else {
+			drawLines(inner, points, pointsLen, 0.0, 1.0, ImGui::GetColorU32(ImGuiCol_PlotLines));
 		}
 	}
 	// Draw grid
@@ -344,26 +390,26 @@ bool renderHistogram(const char *name, float height, float *bars, int barsLen, c
 
 
 void menuRandomizeBank() {
+	HistoryTransaction transaction;
 	currentBank.randomize();
-	historyPush();
 }
 
 
-void menuMorphBank() {
-	currentBank.morph();
-	historyPush();
+void menuMorphBank(MorphMode mode) {
+	HistoryTransaction transaction;
+	currentBank.morph(mode);
 }
 
 
 void menuShuffleBank() {
+	HistoryTransaction transaction;
 	currentBank.shuffle();
-	historyPush();
 }
 
 
 void menuClearBank() {
+	HistoryTransaction transaction;
 	currentBank.clear();
-	historyPush();
 }
 
 
@@ -378,6 +424,13 @@ static void waveMenu() {
 		if (ImGui::MenuItem("Morph Bank", "Alt+M")) {
 			menuMorphBank();
 		}
+		if (ImGui::BeginMenu("Morph Bank Along")) {
+			for (int i = 0; i < MORPH_MODES_LEN; i++) {
+				if (ImGui::MenuItem(morphModeNames[i]))
+					menuMorphBank((MorphMode) i);
+			}
+			ImGui::EndMenu();
+		}
 		if (ImGui::MenuItem("Shuffle Bank", "Alt+S")) {
 			menuShuffleBank();
 		}
@@ -412,12 +465,19 @@ void renderBankGrid(const char *name, float height, int gridWidth, float *gridX,
 	// Wave grid
 	int selectedStart = mini(selectedId, lastSelectedId);
 	int selectedEnd = maxi(selectedId, lastSelectedId);
+	// Waves without post data are previewed from their samples until the worker catches up
+	bool pending = false;
 	for (int j = 0; j < BANK_LEN; j++) {
 		int x = j % gridWidth;
 		int y = j / gridWidth;
+		if (!currentBank.waves[j]->isValid(WAVE_POST))
+			pending = true;
 		// Compute cell box
 		ImVec2 cellPos = ImVec2(box.Min.x + cellSize.x * x, box.Min.y + cellSize.y * y);
 		ImRect cellBox = ImRect(cellPos, cellPos + cellSize - padding);
+		// The sidebar grid is much taller than the window with 256 waves
+		if (!window->ClipRect.Overlaps(cellBox))
+			continue;
 		ImU32 col = ImGui::GetColorU32(ImGuiCol_FrameBg);
 		if (selectedStart <= j && j <= selectedEnd) {
 			col = ImGui::GetColorU32(ImGuiCol_WindowBg);
@@ -426,23 +486,14 @@ void renderBankGrid(const char *name, float height, int gridWidth, float *gridX,
 
 		// Draw lines
 		ImGui::PushClipRect(cellBox.Min, cellBox.Max, true);
-		// We only draw a fourth of the points plus the last one
-		int divisor = 4;
-		std::vector<ImVec2> points;
-		points.reserve(1 + WAVE_LEN/divisor);
-		for (int i = 0; i < WAVE_LEN; i += divisor) {
-			float value = currentBank.waves[j].postSamples[i];
-			float margin = 3.0;
-			ImVec2 pos = ImVec2(rescalef(i, 0, WAVE_LEN - 1, cellBox.Min.x, cellBox.Max.x), rescalef(value, 1.0, -1.0, cellBox.Min.y + margin, cellBox.Max.y - margin));
-			points.emplace_back(pos);
-		}
-		
-		// Last point
-		float value = currentBank.waves[j].postSamples[WAVE_LEN - 1];
+		// About one vertex per pixel of the cell, however long the waves are
+		static std::vector<ImVec2> points;
+		decimate(points, currentBank.waves[j]->getPreviewSamples(), WAVE_LEN, (int) cellBox.GetWidth());
 		float margin = 3.0;
-		ImVec2 pos = ImVec2(rescalef(WAVE_LEN - 1, 0, WAVE_LEN - 1, cellBox.Min.x, cellBox.Max.x), rescalef(value, 1.0, -1.0, cellBox.Min.y + margin, cellBox.Max.y - margin));
-		points.emplace_back(pos);
-		window->DrawList->AddPolyline(points.data(), 1 + WAVE_LEN/divisor, ImGui::GetColorU32(ImGuiCol_PlotLines), false, 1.0);		
+		for (ImVec2 &point : points) {
+			point = ImVec2(rescalef(point.x, 0, WAVE_LEN - 1, cellBox.Min.x, cellBox.Max.x), rescalef(point.y, 1.0, -1.0, cellBox.Min.y + margin, cellBox.Max.y - margin));
+		}
+		window->DrawList->AddPolyline(points.data(), points.size(), ImGui::GetColorU32(ImGuiCol_PlotLines), false, 1.0);
 
 		// Draw cell label
 		char label[64];
@@ -451,6 +502,8 @@ void renderBankGrid(const char *name, float height, int gridWidth, float *gridX,
 		window->DrawList->AddText(labelPos, ImGui::GetColorU32(ImGuiCol_PlotLines), label);
 		ImGui::PopClipRect();
 	}
+	if (pending)
+		currentBank.validateLater();
 
 	// Behavior
 	bool hovered = ImGui::ItemHoverable(box, id);
@@ -486,7 +539,7 @@ void renderBankGrid(const char *name, float height, int gridWidth, float *gridX,
 
 		// Ctrl-click dragging buffers
 		static Bank dragBank;
-		static Wave dragWaves[BANK_LEN];
+		static CowPtr<Wave> dragWaves[BANK_LEN];
 		static int dragId, dragStart, dragEnd;
 		if (g.IO.KeyCtrl && !g.IO.MouseReleased[0]) {
 			if (g.IO.MouseClicked[0]) {
@@ -613,35 +666,38 @@ void renderWaterfall(const char *name, float height, float amplitude, float angl
 
 	ImVec2 waveOffset = ImVec2(5, -5);
 
-	// Pre-effect plots
-	for (int b = 0; b < BANK_LEN; b++) {
-		ImVec2 points[WAVE_LEN];
-		for (int i = 0; i < WAVE_LEN; i++) {
-			float value = currentBank.waves[b].samples[i];
-			ImVec2 a = ImVec2(rescalef(i, 0, WAVE_LEN-1, -1.0, 1.0), rescalef(b, 0, BANK_LEN-1, -1.0, 1.0));
+	// Every wave is the same rotated line, about one vertex per pixel of its length
+	ImVec2 span = ImRotate(ImVec2(2.0, 0.0), cosf(theta), sinf(theta)) / M_SQRT2;
+	int maxVertices = (int) hypotf(span.x * box.GetWidth() / 2.0, span.y * box.GetHeight() / 2.0);
+	static std::vector<ImVec2> points;
+	auto plot = [&](int b, const float *values) {
+		decimate(points, values, WAVE_LEN, maxVertices);
+		for (ImVec2 &point : points) {
+			ImVec2 a = ImVec2(rescalef(point.x, 0, WAVE_LEN-1, -1.0, 1.0), rescalef(b, 0, BANK_LEN-1, -1.0, 1.0));
 			a = ImRotate(a, cosf(theta), sinf(theta)) / M_SQRT2;
-			a.y += -amplitude * 0.3 * value;
-			ImVec2 point = ImVec2(rescalef(a.x, -1.0, 1.0, box.Min.x, box.Max.x), rescalef(a.y, 1.0, -1.0, box.Min.y, box.Max.y));
-			points[i] = point;
+			a.y += -amplitude * 0.3 * point.y;
+			point = ImVec2(rescalef(a.x, -1.0, 1.0, box.Min.x, box.Max.x), rescalef(a.y, 1.0, -1.0, box.Min.y, box.Max.y));
 		}
+	};
+
+	// Pre-effect plots
+	for (int b = 0; b < BANK_LEN; b++) {
+		plot(b, currentBank.waves[b]->samples);
 		float thickness = 1.0;
-		window->DrawList->AddPolyline(points, WAVE_LEN, ImGui::GetColorU32(ImGuiCol_FrameBg), false, thickness);
+		window->DrawList->AddPolyline(points.data(), points.size(), ImGui::GetColorU32(ImGuiCol_FrameBg), false, thickness);
 	}
 
 	// Post-effect plots
+	bool pending = false;
 	for (int b = 0; b < BANK_LEN; b++) {
-		ImVec2 points[WAVE_LEN];
-		for (int i = 0; i < WAVE_LEN; i++) {
-			float value = currentBank.waves[b].postSamples[i];
-			ImVec2 a = ImVec2(rescalef(i, 0, WAVE_LEN-1, -1.0, 1.0), rescalef(b, 0, BANK_LEN-1, -1.0, 1.0));
-			a = ImRotate(a, cosf(theta), sinf(theta)) / M_SQRT2;
-			a.y += -amplitude * 0.3 * value;
-			ImVec2 point = ImVec2(rescalef(a.x, -1.0, 1.0, box.Min.x, box.Max.x), rescalef(a.y, 1.0, -1.0, box.Min.y, box.Max.y));
-			points[i] = point;
-		}
+		if (!currentBank.waves[b]->isValid(WAVE_POST))
+			pending = true;
+		plot(b, currentBank.waves[b]->getPreviewSamples());
 		float thickness = 1.0 + 4.0 * fmaxf(1.0 - fabsf(b - *activeZ), 0.0);
-		window->DrawList->AddPolyline(points, WAVE_LEN, ImGui::GetColorU32(ImGuiCol_PlotHistogram), false, thickness);
+		window->DrawList->AddPolyline(points.data(), points.size(), ImGui::GetColorU32(ImGuiCol_PlotHistogram), false, thickness);
 	}
+	if (pending)
+		currentBank.validateLater();
 
 	ImGui::PopClipRect();
 
@@ -693,13 +749,7 @@ float renderBankWave(const char *name, float height, const float *lines, int lin
 
 	// Draw lines
 	if (lines) {
-		ImVec2 lastPos;
-		for (int i = 0; i < linesLen; i++) {
-			ImVec2 pos = ImVec2(rescalef(i, 0, linesLen, inner.Min.x, inner.Max.x), rescalef(lines[i], 1.0, -1.0, inner.Min.y, inner.Max.y));
-			if (i > 0)
-				window->DrawList->AddLine(lastPos, pos, ImGui::GetColorU32(ImGuiCol_PlotLines));
-			lastPos = pos;
-		}
+		drawLines(inner, lines, linesLen, -1.0, 1.0, ImGui::GetColorU32(ImGuiCol_PlotLines));
 	}
 
 	// Draw grid
@@ -716,3 +766,5 @@ float renderBankWave(const char *name, float height, const float *lines, int lin
 	}
 	return delta;
 }
+
+} // namespace WAVETABLE_NAMESPACE